@@ -0,0 +1,734 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Userspace benchmark of the classification engines.
+ *
+ * The engines (linear.c, tss.c, ...) and the matchers of match.h only use
+ * a small part of the kernel API, which shim/ provides on top of libc, so
+ * they build here unchanged. chains.c is the kernel glue around them (RCU,
+ * skbs, namespaces, the flow cache) and is left out; a packet is classified
+ * here the way simplepf_traverse_chain() does on a flow cache miss, by
+ * calling the engine's classify() on the parsed packet.
+ *
+ * For every ruleset size, a synthetic ruleset and a packet trace are
+ * generated: the rules are a mix of source blocklist entries, services
+ * (protocol and destination port or range), ICMP types and rules on all
+ * fields, drawn from 10.0.0.0/8 so that they overlap; a given share of the
+ * packets are made to match a random rule, the others are random.
+ * Every engine is then timed on the trace, and its time to compile the
+ * rules, and time, instructions and cache misses per packet are printed.
+ * The last two come from the hardware counters, if perf_event_open() is
+ * allowed ("-" otherwise).
+ *
+ * With --check, every engine must also give the same verdict as the
+ * reference matcher, simplepf_match_rule(), on the first packets of the
+ * trace; a difference, or an engine that fails to compile a ruleset, is
+ * reported and makes the exit status 1.
+ */
+
+#include "../engine.h"
+#include "../match.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static const struct simplepf_engine *engines[] = {
+	&simplepf_linear_engine,
+	&simplepf_tss_engine,
+	&simplepf_lpm_engine,
+	&simplepf_ports_engine,
+	&simplepf_dtree_engine,
+	&simplepf_bitvec_engine,
+};
+
+#define NR_ENGINES ARRAY_SIZE(engines)
+
+/* Packets classified between two looks at the clock. */
+#define BENCH_BATCH 64
+
+/* Mismatches printed per engine and ruleset. */
+#define BENCH_MAX_REPORTS 5
+
+struct bench_opts {
+	unsigned long *sizes;
+	unsigned int nr_sizes;
+	bool use_engine[NR_ENGINES];
+	unsigned int packets;
+	unsigned int hit_pct;
+	unsigned long min_time_ns;
+	unsigned long seed;
+	bool check;
+	unsigned int check_packets;
+};
+
+/*
+ * xorshift64*, so that a seed gives the same rulesets and traces
+ * everywhere.
+ */
+static u64 rng_state;
+
+static u32 rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static void rng_seed(u64 seed)
+{
+	rng_state = seed * 0x9e3779b97f4a7c15ULL + 1;
+}
+
+/* Uniform enough in [0, n). */
+static u32 rnd(u32 n)
+{
+	return (u64)rng() * n >> 32;
+}
+
+static u32 rnd_addr(void)
+{
+	return 0x0a000000U | (rng() & 0x00ffffffU);
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void gen_prefix(__be32 *addr, u8 *prefixlen, unsigned int len)
+{
+	*prefixlen = len;
+	*addr = htonl(rnd_addr()) & simplepf_prefix_mask(len);
+}
+
+static void gen_ports(__be16 *first, __be16 *last)
+{
+	static const u16 common[] = {
+		22, 25, 53, 80, 123, 443, 993, 3306, 5432, 6379, 8080, 8443,
+	};
+	u16 lo;
+	u16 hi;
+
+	if (rnd(10) < 6) {
+		lo = hi = common[rnd(ARRAY_SIZE(common))];
+	} else {
+		lo = rnd(65536);
+		hi = min(lo + rnd(1024), 65535U);
+	}
+	*first = htons(lo);
+	*last = htons(hi);
+}
+
+/*
+ * A random rule, in the canonical form the chain code would store it in.
+ */
+static void gen_rule(struct simplepf_rule *rule)
+{
+	static const u8 blocklist_lens[] = { 16, 20, 24, 28, 32, 32, 32, 32 };
+	unsigned int kind = rnd(100);
+
+	memset(rule, 0, sizeof *rule);
+
+	if (kind < 40) {
+		/* Source blocklist entry. */
+		rule->filter_saddr = true;
+		gen_prefix(&rule->ip_saddr, &rule->ip_saddr_prefixlen,
+				blocklist_lens[rnd(ARRAY_SIZE(blocklist_lens))]);
+	} else if (kind < 80) {
+		/* Service, maybe of a single subnet. */
+		rule->filter_proto = true;
+		rule->ip_protocol = rnd(2) ? IPPROTO_TCP : IPPROTO_UDP;
+		rule->filter_dport = true;
+		gen_ports(&rule->transport_dport, &rule->transport_dport_max);
+		if (rnd(2)) {
+			rule->filter_daddr = true;
+			gen_prefix(&rule->ip_daddr, &rule->ip_daddr_prefixlen,
+					24 + rnd(9));
+		}
+	} else if (kind < 90) {
+		/* ICMP type, maybe from a single subnet. */
+		rule->filter_proto = true;
+		rule->ip_protocol = IPPROTO_ICMP;
+		rule->filter_icmp_type = true;
+		rule->icmp_type = rnd(20);
+		if (rnd(2)) {
+			rule->filter_saddr = true;
+			gen_prefix(&rule->ip_saddr, &rule->ip_saddr_prefixlen,
+					8 + rnd(25));
+		}
+	} else {
+		/* All the fields. */
+		rule->filter_saddr = true;
+		gen_prefix(&rule->ip_saddr, &rule->ip_saddr_prefixlen,
+				8 + rnd(25));
+		rule->filter_daddr = true;
+		gen_prefix(&rule->ip_daddr, &rule->ip_daddr_prefixlen,
+				8 + rnd(25));
+		rule->filter_proto = true;
+		rule->ip_protocol = rnd(2) ? IPPROTO_TCP : IPPROTO_UDP;
+		rule->filter_sport = true;
+		gen_ports(&rule->transport_sport, &rule->transport_sport_max);
+		rule->filter_dport = true;
+		gen_ports(&rule->transport_dport, &rule->transport_dport_max);
+	}
+
+	rule->action = rnd(10) ? SIMPLEPF_ACTION_DROP : SIMPLEPF_ACTION_ACCEPT;
+}
+
+static __be32 addr_in_prefix(bool filter, __be32 addr, u8 prefixlen)
+{
+	__be32 mask;
+
+	if (!filter) {
+		return htonl(rnd_addr());
+	}
+	mask = simplepf_prefix_mask(prefixlen);
+	return addr | (htonl(rnd_addr()) & ~mask);
+}
+
+static __be16 port_in_range(bool filter, __be16 first, __be16 last)
+{
+	if (!filter) {
+		return htons(rnd(65536));
+	}
+	return htons(ntohs(first) + rnd(ntohs(last) - ntohs(first) + 1));
+}
+
+/*
+ * A packet matching the rule, unless an earlier rule matches it first.
+ */
+static void gen_hit(const struct simplepf_rule *rule,
+		struct simplepf_packet *pkt)
+{
+	if (rule->filter_proto) {
+		pkt->protocol = rule->ip_protocol;
+	} else if (rule->filter_icmp_type) {
+		pkt->protocol = IPPROTO_ICMP;
+	} else if (rule->filter_sport || rule->filter_dport || rnd(10)) {
+		pkt->protocol = rnd(2) ? IPPROTO_TCP : IPPROTO_UDP;
+	} else {
+		pkt->protocol = IPPROTO_ICMP;
+	}
+	pkt->class = simplepf_proto_class(pkt->protocol);
+
+	pkt->saddr = addr_in_prefix(rule->filter_saddr, rule->ip_saddr,
+			rule->ip_saddr_prefixlen);
+	pkt->daddr = addr_in_prefix(rule->filter_daddr, rule->ip_daddr,
+			rule->ip_daddr_prefixlen);
+	if (pkt->class == SIMPLEPF_CLASS_ICMP) {
+		pkt->icmp_type = rule->filter_icmp_type ?
+			rule->icmp_type : rnd(20);
+	} else {
+		pkt->sport = port_in_range(rule->filter_sport,
+				rule->transport_sport, rule->transport_sport_max);
+		pkt->dport = port_in_range(rule->filter_dport,
+				rule->transport_dport, rule->transport_dport_max);
+	}
+}
+
+static void gen_packet(const struct chain_rule *rules, unsigned int count,
+		unsigned int hit_pct, struct simplepf_packet *pkt)
+{
+	memset(pkt, 0, sizeof *pkt);
+
+	if (count && rnd(100) < hit_pct) {
+		gen_hit(&rules[rnd(count)].rule, pkt);
+		return;
+	}
+
+	pkt->protocol = rnd(10) ? (rnd(2) ? IPPROTO_TCP : IPPROTO_UDP) :
+		IPPROTO_ICMP;
+	pkt->class = simplepf_proto_class(pkt->protocol);
+	pkt->saddr = htonl(rnd_addr());
+	pkt->daddr = htonl(rnd_addr());
+	if (pkt->class == SIMPLEPF_CLASS_ICMP) {
+		pkt->icmp_type = rnd(20);
+	} else {
+		pkt->sport = htons(rnd(65536));
+		pkt->dport = htons(rnd(65536));
+	}
+}
+
+static unsigned int reference_classify(const struct chain_rule *rules,
+		unsigned int count, const struct simplepf_packet *pkt)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (simplepf_match_rule(&rules[i].rule, pkt) !=
+				__SIMPLEPF_ACTION_LAST) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Hardware counters of this thread in userspace; fd is -1 if the counter
+ * is not available.
+ */
+struct hw_counter {
+	int fd;
+	u64 value;
+};
+
+static void hw_counter_open(struct hw_counter *counter, u64 config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	counter->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	counter->value = 0;
+}
+
+static void hw_counter_start(struct hw_counter *counter)
+{
+	if (counter->fd >= 0) {
+		ioctl(counter->fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter->fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static void hw_counter_stop(struct hw_counter *counter)
+{
+	if (counter->fd >= 0) {
+		ioctl(counter->fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counter->fd, &counter->value, sizeof counter->value) !=
+				sizeof counter->value) {
+			counter->value = 0;
+		}
+	}
+}
+
+static void print_per_packet(const struct hw_counter *counter,
+		unsigned long packets)
+{
+	if (counter->fd < 0) {
+		printf(" %12s", "-");
+	} else {
+		printf(" %12.2f", (double)counter->value / packets);
+	}
+}
+
+static struct hw_counter insns = { .fd = -1 };
+static struct hw_counter misses = { .fd = -1 };
+
+/* Keeps the compiler from dropping the classifications. */
+static volatile unsigned int sink;
+
+/*
+ * Classify the trace over and over for at least opts->min_time_ns, and
+ * print the results per packet.
+ */
+static void time_engine(const struct bench_opts *opts,
+		const struct simplepf_engine *engine, const void *priv,
+		const struct chain_rule *rules, unsigned int count,
+		const struct simplepf_packet *trace)
+{
+	unsigned long done = 0;
+	unsigned int next = 0;
+	unsigned int sum = 0;
+	u64 start;
+	u64 elapsed;
+
+	hw_counter_start(&insns);
+	hw_counter_start(&misses);
+	start = now_ns();
+	do {
+		unsigned int i;
+
+		for (i = 0; i < BENCH_BATCH; i++) {
+			unsigned int scanned;
+
+			sum += engine->classify(priv, rules, count,
+					&trace[next], &scanned);
+			if (++next == opts->packets) {
+				next = 0;
+			}
+		}
+		done += BENCH_BATCH;
+		elapsed = now_ns() - start;
+	} while (elapsed < opts->min_time_ns);
+	hw_counter_stop(&misses);
+	hw_counter_stop(&insns);
+	sink = sum;
+
+	printf(" %12.1f", (double)elapsed / done);
+	print_per_packet(&insns, done);
+	print_per_packet(&misses, done);
+}
+
+/*
+ * Compare the verdicts of the engine with the reference ones, @expected.
+ * Returns the number of packets they differ on.
+ */
+static unsigned int check_engine(const struct bench_opts *opts,
+		const struct simplepf_engine *engine, const void *priv,
+		const struct chain_rule *rules, unsigned int count,
+		const struct simplepf_packet *trace,
+		const unsigned int *expected)
+{
+	unsigned int bad = 0;
+	unsigned int i;
+
+	for (i = 0; i < opts->check_packets; i++) {
+		const struct simplepf_packet *pkt = &trace[i];
+		unsigned int scanned;
+		unsigned int got = engine->classify(priv, rules, count, pkt,
+				&scanned);
+
+		if (got == expected[i]) {
+			continue;
+		}
+		if (bad++ < BENCH_MAX_REPORTS) {
+			fprintf(stderr, "%s: %u rules: packet %u (proto %u %08x -> %08x ports %u -> %u icmp type %u) matches rule %u, expected %u\n",
+					engine->name, count, i, pkt->protocol,
+					ntohl(pkt->saddr), ntohl(pkt->daddr),
+					ntohs(pkt->sport), ntohs(pkt->dport),
+					pkt->icmp_type, got, expected[i]);
+		}
+	}
+
+	return bad;
+}
+
+/*
+ * Run every engine on a ruleset of @count rules.
+ * Returns the number of mismatches found by the check, plus one for every
+ * engine that failed to compile the rules.
+ */
+static unsigned long bench_size(const struct bench_opts *opts,
+		unsigned int count)
+{
+	struct seq_file m = { .stream = stdout };
+	struct chain_rule *rules;
+	struct simplepf_packet *trace;
+	unsigned int *expected = NULL;
+	unsigned long bad = 0;
+	unsigned int i;
+
+	rules = calloc(count ? count : 1, sizeof *rules);
+	trace = calloc(opts->packets, sizeof *trace);
+	if (!rules || !trace) {
+		fprintf(stderr, "Out of memory for %u rules\n", count);
+		exit(1);
+	}
+
+	rng_seed(opts->seed ^ count);
+	for (i = 0; i < count; i++) {
+		gen_rule(&rules[i].rule);
+	}
+	for (i = 0; i < opts->packets; i++) {
+		gen_packet(rules, count, opts->hit_pct, &trace[i]);
+	}
+
+	if (opts->check) {
+		expected = calloc(opts->check_packets, sizeof *expected);
+		if (!expected) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		for (i = 0; i < opts->check_packets; i++) {
+			expected[i] = reference_classify(rules, count, &trace[i]);
+		}
+	}
+
+	printf("\n%u rules, %u packets, %u%% made to hit\n", count,
+			opts->packets, opts->hit_pct);
+	printf("%-8s %10s %12s %12s %12s%s\n", "engine", "build_ms",
+			"ns/pkt", "insns/pkt", "misses/pkt",
+			opts->check ? " check" : "");
+
+	for (i = 0; i < NR_ENGINES; i++) {
+		const struct simplepf_engine *engine = engines[i];
+		void *priv = NULL;
+		u64 start;
+
+		if (!opts->use_engine[i]) {
+			continue;
+		}
+
+		printf("%-8s", engine->name);
+		fflush(stdout);
+
+		start = now_ns();
+		if (engine->build) {
+			priv = engine->build(rules, count);
+		}
+		if (IS_ERR(priv)) {
+			printf(" build failed: %s\n", strerror(-PTR_ERR(priv)));
+			bad += opts->check;
+			continue;
+		}
+		printf(" %10.2f", (now_ns() - start) / 1e6);
+
+		time_engine(opts, engine, priv, rules, count, trace);
+
+		if (opts->check) {
+			unsigned int n = check_engine(opts, engine, priv, rules,
+					count, trace, expected);
+
+			printf(n ? " FAIL(%u)" : " ok", n);
+			bad += n;
+		}
+		if (engine->show && priv) {
+			engine->show(priv, &m);
+		}
+		putchar('\n');
+
+		if (priv) {
+			engine->destroy(priv);
+		}
+	}
+
+	free(expected);
+	free(trace);
+	free(rules);
+	return bad;
+}
+
+static void usage(FILE *stream, const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stream,
+		"Usage: %s [options]\n"
+		"  -r, --rules N,N,...     ruleset sizes (default 10,100,1000,10000,100000,1000000)\n"
+		"  -e, --engines NAME,...  engines to run (default all:",
+		prog);
+	for (i = 0; i < NR_ENGINES; i++) {
+		fprintf(stream, " %s", engines[i]->name);
+	}
+	fprintf(stream, ")\n"
+		"  -p, --packets N         packets in the trace (default 10000)\n"
+		"  -H, --hit-ratio PCT     percentage of packets made to match a rule (default 50)\n"
+		"  -t, --min-time MS       time every engine for at least MS milliseconds (default 200)\n"
+		"  -s, --seed N            seed of the rulesets and traces (default 1)\n"
+		"  -c, --check             compare the verdicts with the reference matcher\n"
+		"  -C, --check-packets N   packets to compare (default 1000, at most the trace)\n"
+		"  -h, --help              print this help\n");
+}
+
+/*
+ * Parse a comma separated list of numbers.
+ * Returns false if it is not one.
+ */
+static bool parse_sizes(const char *arg, struct bench_opts *opts)
+{
+	const char *p = arg;
+
+	opts->nr_sizes = 0;
+	while (*p) {
+		unsigned long *sizes;
+		unsigned long n;
+		char *end;
+
+		errno = 0;
+		n = strtoul(p, &end, 10);
+		if (errno || end == p || n > SIMPLEPF_MAX_RULES ||
+				(*end && *end != ',')) {
+			return false;
+		}
+		sizes = realloc(opts->sizes,
+				(opts->nr_sizes + 1) * sizeof *sizes);
+		if (!sizes) {
+			return false;
+		}
+		sizes[opts->nr_sizes++] = n;
+		opts->sizes = sizes;
+		p = *end ? end + 1 : end;
+	}
+
+	return opts->nr_sizes > 0;
+}
+
+static bool parse_engines(const char *arg, struct bench_opts *opts)
+{
+	const char *p = arg;
+	unsigned int i;
+
+	memset(opts->use_engine, 0, sizeof opts->use_engine);
+	while (*p) {
+		size_t len = strcspn(p, ",");
+
+		for (i = 0; i < NR_ENGINES; i++) {
+			if (strlen(engines[i]->name) == len &&
+					!strncmp(engines[i]->name, p, len)) {
+				opts->use_engine[i] = true;
+				break;
+			}
+		}
+		if (i == NR_ENGINES) {
+			return false;
+		}
+		p += len;
+		if (*p) {
+			p++;
+		}
+	}
+
+	return true;
+}
+
+static bool parse_uint(const char *arg, unsigned long max,
+		unsigned int *value)
+{
+	unsigned long n;
+	char *end;
+
+	errno = 0;
+	n = strtoul(arg, &end, 10);
+	if (errno || end == arg || *end || n > max) {
+		return false;
+	}
+	*value = n;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_opts[] = {
+		{ "rules", required_argument, NULL, 'r' },
+		{ "engines", required_argument, NULL, 'e' },
+		{ "packets", required_argument, NULL, 'p' },
+		{ "hit-ratio", required_argument, NULL, 'H' },
+		{ "min-time", required_argument, NULL, 't' },
+		{ "seed", required_argument, NULL, 's' },
+		{ "check", no_argument, NULL, 'c' },
+		{ "check-packets", required_argument, NULL, 'C' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct bench_opts opts = {
+		.packets = 10000,
+		.hit_pct = 50,
+		.min_time_ns = 200 * 1000000UL,
+		.seed = 1,
+		.check_packets = 1000,
+	};
+	unsigned long bad = 0;
+	unsigned int value;
+	unsigned int i;
+	int c;
+
+	for (i = 0; i < NR_ENGINES; i++) {
+		opts.use_engine[i] = true;
+	}
+	parse_sizes("10,100,1000,10000,100000,1000000", &opts);
+
+	while ((c = getopt_long(argc, argv, "r:e:p:H:t:s:cC:h", long_opts,
+					NULL)) != -1) {
+		bool ok = true;
+
+		switch (c) {
+		case 'r':
+			ok = parse_sizes(optarg, &opts);
+		break;
+
+		case 'e':
+			ok = parse_engines(optarg, &opts);
+		break;
+
+		case 'p':
+			ok = parse_uint(optarg, 100000000, &opts.packets) &&
+				opts.packets > 0;
+		break;
+
+		case 'H':
+			ok = parse_uint(optarg, 100, &opts.hit_pct);
+		break;
+
+		case 't':
+			ok = parse_uint(optarg, 3600000, &value);
+			opts.min_time_ns = value * 1000000UL;
+		break;
+
+		case 's':
+			ok = parse_uint(optarg, ~0U, &value);
+			opts.seed = value;
+		break;
+
+		case 'c':
+			opts.check = true;
+		break;
+
+		case 'C':
+			ok = parse_uint(optarg, ~0U, &opts.check_packets);
+		break;
+
+		case 'h':
+			usage(stdout, argv[0]);
+			return 0;
+
+		default:
+			ok = false;
+		break;
+		}
+
+		if (!ok) {
+			if (c != '?') {
+				fprintf(stderr, "Invalid argument to -%c: %s\n",
+						c, optarg);
+			}
+			usage(stderr, argv[0]);
+			return 2;
+		}
+	}
+	if (optind < argc) {
+		usage(stderr, argv[0]);
+		return 2;
+	}
+	opts.check_packets = min(opts.check_packets, opts.packets);
+
+	hw_counter_open(&insns, PERF_COUNT_HW_INSTRUCTIONS);
+	hw_counter_open(&misses, PERF_COUNT_HW_CACHE_MISSES);
+
+	for (i = 0; i < opts.nr_sizes; i++) {
+		bad += bench_size(&opts, opts.sizes[i]);
+	}
+
+	if (opts.check) {
+		printf("\n%s\n", bad ?
+				"Engines disagree with the reference matcher or fail to build" :
+				"All engines agree with the reference matcher");
+	}
+
+	free(opts.sizes);
+	return bad ? 1 : 0;
+}
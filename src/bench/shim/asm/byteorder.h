@@ -0,0 +1,30 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMPLEPF_BENCH_ASM_BYTEORDER_H
+#define _SIMPLEPF_BENCH_ASM_BYTEORDER_H
+
+/* The uapi conversions, plus the kernel's short names for them. */
+#include_next <asm/byteorder.h>
+
+#define ntohl(x) __be32_to_cpu(x)
+#define ntohs(x) __be16_to_cpu(x)
+#define htonl(x) __cpu_to_be32(x)
+#define htons(x) __cpu_to_be16(x)
+
+#endif	/* _SIMPLEPF_BENCH_ASM_BYTEORDER_H */
@@ -0,0 +1,265 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMPLEPF_BENCH_KSHIM_H
+#define _SIMPLEPF_BENCH_KSHIM_H
+
+/*
+ * The kernel API the engines use, on top of libc, so that they build
+ * unchanged in userspace. Every header of the kernel they include is
+ * a header of this directory that includes this file.
+ * Only what the engines need is here, and only as far as they need it:
+ * allocations can't sleep or fail differently than malloc(), sort() is
+ * qsort(), and so on.
+ */
+
+#include <linux/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+/* compiler */
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((__always_inline__))
+#endif
+#define __percpu
+#define __read_mostly
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+/* kernel.h */
+
+#define U8_MAX ((u8)~0U)
+#define U16_MAX ((u16)~0U)
+#define U32_MAX ((u32)~0U)
+#define U64_MAX ((u64)~0ULL)
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define min(a, b) ({ \
+	__typeof__(a) _a = (a); \
+	__typeof__(b) _b = (b); \
+	_a < _b ? _a : _b; })
+#define max(a, b) ({ \
+	__typeof__(a) _a = (a); \
+	__typeof__(b) _b = (b); \
+	_a > _b ? _a : _b; })
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+#define swap(a, b) do { \
+	__typeof__(a) _t = (a); \
+	(a) = (b); \
+	(b) = _t; } while (0)
+
+/* err.h */
+
+#define MAX_ERRNO 4095
+
+static inline void *ERR_PTR(long error)
+{
+	return (void *)error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+	return (long)ptr;
+}
+
+static inline bool IS_ERR(const void *ptr)
+{
+	return (unsigned long)ptr >= (unsigned long)-MAX_ERRNO;
+}
+
+static inline bool IS_ERR_OR_NULL(const void *ptr)
+{
+	return !ptr || IS_ERR(ptr);
+}
+
+/* slab.h, mm.h, overflow.h */
+
+typedef unsigned int gfp_t;
+#define GFP_KERNEL 0U
+
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+	return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+	return calloc(1, size);
+}
+
+static inline void kfree(const void *ptr)
+{
+	free((void *)ptr);
+}
+
+#define kvmalloc kmalloc
+#define kvzalloc kzalloc
+#define kvfree kfree
+
+static inline void *kvmalloc_array(size_t n, size_t size, gfp_t flags)
+{
+	size_t bytes;
+
+	if (__builtin_mul_overflow(n, size, &bytes)) {
+		return NULL;
+	}
+	return malloc(bytes);
+}
+
+static inline void *kvcalloc(size_t n, size_t size, gfp_t flags)
+{
+	return calloc(n, size);
+}
+
+#define struct_size(p, member, n) \
+	(sizeof(*(p)) + (size_t)(n) * sizeof(*(p)->member))
+
+/* log2.h, bitops.h */
+
+#define BITS_PER_LONG (8 * (int)sizeof(long))
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline unsigned long __ffs(unsigned long word)
+{
+	return __builtin_ctzl(word);
+}
+
+static inline void __set_bit(unsigned long nr, unsigned long *addr)
+{
+	addr[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+	return n <= 1 ? 1 : 1UL << (BITS_PER_LONG - __builtin_clzl(n - 1));
+}
+
+static inline int ilog2(unsigned long n)
+{
+	return BITS_PER_LONG - 1 - __builtin_clzl(n);
+}
+
+/* sort.h */
+
+static inline void sort(void *base, size_t num, size_t size,
+		int (*cmp)(const void *, const void *),
+		void (*swap_func)(void *, void *, int))
+{
+	qsort(base, num, size, cmp);
+}
+
+/* random.h */
+
+static inline u32 get_random_u32(void)
+{
+	return (u32)random() ^ ((u32)random() << 16);
+}
+
+/* jhash.h, the same function as the kernel's (lookup3). */
+
+#define __jhash_rol32(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+
+#define __jhash_mix(a, b, c) do { \
+	a -= c; a ^= __jhash_rol32(c, 4); c += b; \
+	b -= a; b ^= __jhash_rol32(a, 6); a += c; \
+	c -= b; c ^= __jhash_rol32(b, 8); b += a; \
+	a -= c; a ^= __jhash_rol32(c, 16); c += b; \
+	b -= a; b ^= __jhash_rol32(a, 19); a += c; \
+	c -= b; c ^= __jhash_rol32(b, 4); b += a; } while (0)
+
+#define __jhash_final(a, b, c) do { \
+	c ^= b; c -= __jhash_rol32(b, 14); \
+	a ^= c; a -= __jhash_rol32(c, 11); \
+	b ^= a; b -= __jhash_rol32(a, 25); \
+	c ^= b; c -= __jhash_rol32(b, 16); \
+	a ^= c; a -= __jhash_rol32(c, 4); \
+	b ^= a; b -= __jhash_rol32(a, 14); \
+	c ^= b; c -= __jhash_rol32(b, 24); } while (0)
+
+#define JHASH_INITVAL 0xdeadbeef
+
+static inline u32 jhash2(const u32 *k, u32 length, u32 initval)
+{
+	u32 a, b, c;
+
+	a = b = c = JHASH_INITVAL + (length << 2) + initval;
+
+	while (length > 3) {
+		a += k[0];
+		b += k[1];
+		c += k[2];
+		__jhash_mix(a, b, c);
+		length -= 3;
+		k += 3;
+	}
+
+	switch (length) {
+	case 3:
+		c += k[2];
+		/* fall through */
+	case 2:
+		b += k[1];
+		/* fall through */
+	case 1:
+		a += k[0];
+		__jhash_final(a, b, c);
+	break;
+
+	default:
+	break;
+	}
+
+	return c;
+}
+
+/* seq_file.h, printing straight to a stdio stream. */
+
+struct seq_file {
+	FILE *stream;
+};
+
+static inline void seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(m->stream, fmt, args);
+	va_end(args);
+}
+
+static inline void seq_puts(struct seq_file *m, const char *s)
+{
+	fputs(s, m->stream);
+}
+
+static inline void seq_putc(struct seq_file *m, char c)
+{
+	fputc(c, m->stream);
+}
+
+#endif	/* _SIMPLEPF_BENCH_KSHIM_H */
@@ -0,0 +1,346 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Bit vector classifier (Lakshman and Stiliadis).
+ *
+ * Every dimension (see match.h) is cut at the ends of the rules' ranges into
+ * elementary intervals, such that every value in an interval is in exactly
+ * the same ranges. Every interval has a bitmap of the rules whose range
+ * contains it, bit i standing for rule i. A lookup finds the interval of the
+ * packet in every dimension with a binary search, ANDs the bitmaps a word at
+ * a time and takes the first set bit: the rules that match in every
+ * dimension are exactly the rules that match, and the lowest one is the
+ * first match. No rule is looked at.
+ *
+ * Dimensions that no rule filters on are left out. A lookup costs a binary
+ * search per dimension plus one pass over count / BITS_PER_LONG words, but
+ * the bitmaps take O(count^2) memory per dimension. The total size is capped;
+ * a ruleset that doesn't fit fails to compile with -E2BIG.
+ *
+ * Which fields apply depends on the packet class, so every class gets its
+ * own dimensions.
+ */
+
+#include "engine.h"
+#include "match.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/sort.h>
+#include <linux/bitops.h>
+#include <linux/seq_file.h>
+
+/* Cap on the size of all the bitmaps of a chain. */
+#define BITVEC_MAX_BYTES (128UL << 20)
+
+struct bitvec_dim {
+	/* The first value of every elementary interval, ascending. */
+	u32 *starts;
+	u32 nr_intervals;
+	/* nr_intervals bitmaps of bitvec::words words each. */
+	unsigned long *bitmaps;
+};
+
+struct bitvec_class {
+	/*
+	 * The dimensions that some rule of the class filters on, the one with
+	 * the most intervals first, so the AND tends to clear early.
+	 */
+	unsigned int nr_dims;
+	u8 order[SIMPLEPF_DIMS];
+	struct bitvec_dim dims[SIMPLEPF_DIMS];
+	/* The first rule of the class, for when it filters on nothing. */
+	u32 first;
+};
+
+struct bitvec {
+	unsigned int words;
+	u64 bytes;
+	struct bitvec_class classes[__SIMPLEPF_CLASS_LAST];
+};
+
+static void bitvec_destroy(void *priv)
+{
+	struct bitvec *bv = priv;
+	enum simplepf_pkt_class class;
+	unsigned int d;
+
+	for (class = 0; class < __SIMPLEPF_CLASS_LAST; class++) {
+		for (d = 0; d < SIMPLEPF_DIMS; d++) {
+			kvfree(bv->classes[class].dims[d].starts);
+			kvfree(bv->classes[class].dims[d].bitmaps);
+		}
+	}
+	kfree(bv);
+}
+
+static int bitvec_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a;
+	u32 y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * The index of the elementary interval that contains the value.
+ */
+static inline u32 bitvec_interval(const struct bitvec_dim *dim, u32 value)
+{
+	u32 lo = 0;
+	u32 hi = dim->nr_intervals;
+
+	/* starts[lo] <= value < starts[hi], taking starts[nr_intervals] as inf */
+	while (hi - lo > 1) {
+		u32 mid = lo + (hi - lo) / 2;
+
+		if (dim->starts[mid] <= value) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/*
+ * Build dimension @d of the class from the ranges of the @n rules listed in
+ * @list.
+ */
+static int bitvec_build_dim(struct bitvec *bv, struct bitvec_dim *dim,
+		unsigned int d, unsigned int bits,
+		const struct simplepf_range (*ranges)[SIMPLEPF_DIMS],
+		const u32 *list, u32 n)
+{
+	u64 size;
+	u32 nr = 1;
+	u32 i;
+	u32 j;
+
+	dim->starts = kvmalloc_array(2 * (size_t)n + 1, sizeof *dim->starts,
+			GFP_KERNEL);
+	if (!dim->starts) {
+		return -ENOMEM;
+	}
+
+	dim->starts[0] = 0;
+	for (i = 0; i < n; i++) {
+		const struct simplepf_range *r = &ranges[list[i]][d];
+
+		dim->starts[nr++] = r->lo;
+		/* The end of a range that ends at the last value cuts nothing. */
+		if ((u64)r->hi + 1 < (1ULL << bits)) {
+			dim->starts[nr++] = r->hi + 1;
+		}
+	}
+
+	sort(dim->starts, nr, sizeof *dim->starts, bitvec_cmp, NULL);
+	for (i = 1, j = 1; i < nr; i++) {
+		if (dim->starts[i] != dim->starts[j - 1]) {
+			dim->starts[j++] = dim->starts[i];
+		}
+	}
+	dim->nr_intervals = j;
+
+	size = (u64)dim->nr_intervals * bv->words * sizeof(unsigned long);
+	if (bv->bytes + size > BITVEC_MAX_BYTES) {
+		return -E2BIG;
+	}
+	bv->bytes += size;
+
+	dim->bitmaps = kvzalloc(size, GFP_KERNEL);
+	if (!dim->bitmaps) {
+		return -ENOMEM;
+	}
+
+	/*
+	 * The ends of every range are interval boundaries, so a range
+	 * contains exactly the intervals from the one of its first value to
+	 * the one of its last.
+	 */
+	for (i = 0; i < n; i++) {
+		const struct simplepf_range *r = &ranges[list[i]][d];
+		u32 last = bitvec_interval(dim, r->hi);
+
+		for (j = bitvec_interval(dim, r->lo); j <= last; j++) {
+			__set_bit(list[i], dim->bitmaps + (size_t)j * bv->words);
+		}
+	}
+
+	return 0;
+}
+
+static int bitvec_build_class(struct bitvec *bv, enum simplepf_pkt_class class,
+		const struct chain_rule *rules, unsigned int count)
+{
+	struct bitvec_class *cls = &bv->classes[class];
+	struct simplepf_range (*ranges)[SIMPLEPF_DIMS];
+	unsigned int filtered[SIMPLEPF_DIMS] = { 0 };
+	u32 *list;
+	u32 n = 0;
+	unsigned int d;
+	unsigned int i;
+	int err = 0;
+
+	ranges = kvmalloc_array(max(count, 1U), sizeof *ranges, GFP_KERNEL);
+	list = kvmalloc_array(max(count, 1U), sizeof *list, GFP_KERNEL);
+	if (!ranges || !list) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!simplepf_rule_in_class(&rules[i].rule, class)) {
+			continue;
+		}
+		simplepf_rule_ranges(&rules[i].rule, class, ranges[i]);
+		list[n++] = i;
+
+		for (d = 0; d < SIMPLEPF_DIMS; d++) {
+			unsigned int bits = simplepf_dim_bits(class, d);
+
+			if (ranges[i][d].lo ||
+					ranges[i][d].hi != (u32)((1ULL << bits) - 1)) {
+				filtered[d]++;
+			}
+		}
+	}
+	cls->first = n ? list[0] : count;
+
+	for (d = 0; d < SIMPLEPF_DIMS; d++) {
+		if (!filtered[d]) {
+			continue;
+		}
+		err = bitvec_build_dim(bv, &cls->dims[d], d,
+				simplepf_dim_bits(class, d),
+				(const struct simplepf_range (*)[SIMPLEPF_DIMS])ranges,
+				list, n);
+		if (err) {
+			goto out;
+		}
+
+		/* Insert into the order by number of intervals, descending. */
+		for (i = cls->nr_dims; i > 0 &&
+				cls->dims[cls->order[i - 1]].nr_intervals <
+				cls->dims[d].nr_intervals; i--) {
+			cls->order[i] = cls->order[i - 1];
+		}
+		cls->order[i] = d;
+		cls->nr_dims++;
+	}
+
+out:
+	kvfree(list);
+	kvfree(ranges);
+	return err;
+}
+
+static void *bitvec_build(const struct chain_rule *rules, unsigned int count)
+{
+	struct bitvec *bv;
+	enum simplepf_pkt_class class;
+
+	bv = kzalloc(sizeof *bv, GFP_KERNEL);
+	if (!bv) {
+		return ERR_PTR(-ENOMEM);
+	}
+	bv->words = BITS_TO_LONGS(count);
+
+	for (class = 0; class < __SIMPLEPF_CLASS_LAST; class++) {
+		int err = bitvec_build_class(bv, class, rules, count);
+		if (err) {
+			bitvec_destroy(bv);
+			return ERR_PTR(err);
+		}
+	}
+
+	return bv;
+}
+
+static unsigned int bitvec_classify(const void *priv,
+		const struct chain_rule *rules, unsigned int count,
+		const struct simplepf_packet *pkt, unsigned int *scanned)
+{
+	const struct bitvec *bv = priv;
+	const struct bitvec_class *cls;
+	const unsigned long *bitmaps[SIMPLEPF_DIMS];
+	u32 values[SIMPLEPF_DIMS];
+	unsigned int i;
+	unsigned int w;
+
+	*scanned = 0;
+	if (pkt->class >= __SIMPLEPF_CLASS_LAST) {
+		return count;
+	}
+
+	cls = &bv->classes[pkt->class];
+	if (!cls->nr_dims) {
+		return cls->first;
+	}
+
+	simplepf_packet_values(pkt, values);
+	for (i = 0; i < cls->nr_dims; i++) {
+		const struct bitvec_dim *dim = &cls->dims[cls->order[i]];
+
+		bitmaps[i] = dim->bitmaps + (size_t)bv->words *
+			bitvec_interval(dim, values[cls->order[i]]);
+	}
+
+	for (w = 0; w < bv->words; w++) {
+		unsigned long word = bitmaps[0][w];
+
+		for (i = 1; word && i < cls->nr_dims; i++) {
+			word &= bitmaps[i][w];
+		}
+		if (word) {
+			*scanned = w + 1;
+			return w * BITS_PER_LONG + __ffs(word);
+		}
+	}
+
+	*scanned = bv->words;
+	return count;
+}
+
+static void bitvec_show(const void *priv, struct seq_file *m)
+{
+	const struct bitvec *bv = priv;
+	u32 intervals = 0;
+	enum simplepf_pkt_class class;
+	unsigned int d;
+
+	for (class = 0; class < __SIMPLEPF_CLASS_LAST; class++) {
+		for (d = 0; d < SIMPLEPF_DIMS; d++) {
+			intervals += bv->classes[class].dims[d].nr_intervals;
+		}
+	}
+
+	seq_printf(m, " intervals %u bytes %llu", intervals, bv->bytes);
+}
+
+const struct simplepf_engine simplepf_bitvec_engine = {
+	.name = "bitvec",
+	.build = bitvec_build,
+	.classify = bitvec_classify,
+	.destroy = bitvec_destroy,
+	.show = bitvec_show,
+};
@@ -15,52 +15,115 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-
 #include "chains.h"
+#include "engine.h"
+#include "match.h"
+#include "flowcache.h"
+#include "hist.h"
+#include "log.h"
 #include "uapi/simplepf.h"
 
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/ip.h>
 #include <linux/icmp.h>
-#include <linux/tcp.h>
-#include <linux/udp.h>
+#include <linux/ipv6.h>
 #include <linux/inet.h>
 #include <linux/skbuff.h>
 #include <linux/netfilter.h>
-#include <linux/list.h>
-#include <linux/rculist.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/overflow.h>
+#include <linux/workqueue.h>
 #include <linux/mutex.h>
 #include <linux/nospec.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+#include <linux/sort.h>
+#include <linux/netdevice.h>
+#include <linux/moduleparam.h>
+#include <linux/bsearch.h>
+#include <linux/jiffies.h>
+#include <linux/sched.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/net_namespace.h>
+#include <linux/sched/clock.h>
+#include <net/netns/generic.h>
 
-struct chain_node {
-	struct list_head list;
-	struct simplepf_rule rule;
-};
+#define CREATE_TRACE_POINTS
+#include "trace.h"
 
 /*
- * Chains are RCU-protected linked lists.
- * Read mostly in chain traversals by netfilter hooks,
- * written rarely for update requests by userspace.
+ * The rules of a table that a packet is classified against, compiled with
+ * the chain's engine.
+ * A packet is only classified against the rules for all interfaces and the
+ * rules for its own interface, so a table with interface rules has a view
+ * of those for every interface it has rules for, and a global view of the
+ * rules for all interfaces for the other interfaces. A table without
+ * interface rules only has its global view, of all its rules.
+ * @rules are copies of the rules of the table, in order, sharing their
+ * counters, and @ids their indices in the table; or the rules of the table
+ * itself if the view has all of them, and no @ids.
  */
-static LIST_HEAD(input_chain);
-static LIST_HEAD(output_chain);
+struct chain_view {
+	/* 0 for the global view. */
+	int ifindex;
+	/*
+	 * Unique among the views of all tables of all chains of all
+	 * namespaces (up to wraparound), so the flow cache, which they all
+	 * share, can tell whether an entry was computed from this view.
+	 * Never 0.
+	 */
+	u32 gen;
+	void *engine_priv;
+	unsigned int count;
+	struct chain_rule *rules;
+	u32 *ids;
+};
 
-static struct list_head *chains[__SIMPLEPF_CHAIN_LAST] = {
-	[SIMPLEPF_CHAIN_INPUT] = &input_chain,
-	[SIMPLEPF_CHAIN_OUTPUT] = &output_chain
+/*
+ * A read-only snapshot of a chain.
+ * The rules are packed in a single allocation, so traversal is a linear
+ * scan over sequential memory instead of a pointer chase per rule.
+ * Tables are never modified once published; every update builds a new table,
+ * compiles it with the chain's engine, publishes it with rcu_assign_pointer()
+ * and frees the old one after a grace period.
+ * @counters lists the arrays the counters of the rules are in, and
+ * @free_counters tells whether they go with the table, or whether they live
+ * on in a newer table.
+ */
+struct chain_table {
+	struct rcu_work free_work;
+	bool free_counters;
+	struct counter_arrays *counters;
+	const struct simplepf_engine *engine;
+	/* How long compiling the table took. */
+	u64 build_ns;
+	struct chain_view global;
+	/* The views of the interfaces with rules, by ascending ifindex. */
+	unsigned int nr_views;
+	struct chain_view *views;
+	unsigned int count;
+	struct chain_rule rules[];
 };
 
 /*
- * Mutexes to protect the chains.
+ * The counters of the rules are allocated in percpu arrays of up to
+ * COUNTER_ARRAY_SIZE counters, for the rules of an update at once rather
+ * than one by one; a percpu allocation can't exceed PCPU_MIN_UNIT_SIZE
+ * anyway. A table lists all the arrays its rules' counters are in, so it
+ * can free them, and a newer table that keeps the rules lists them too.
  */
-static DEFINE_MUTEX(input_chain_mutex);
-static DEFINE_MUTEX(output_chain_mutex);
+#define COUNTER_ARRAY_SIZE 1024
 
-static struct mutex *chain_mutexes[__SIMPLEPF_CHAIN_LAST] = {
-	[SIMPLEPF_CHAIN_INPUT] = &input_chain_mutex,
-	[SIMPLEPF_CHAIN_OUTPUT] = &output_chain_mutex,
+struct counter_arrays {
+	unsigned int count;
+	struct simplepf_counter __percpu *arrays[];
 };
 
 /*
@@ -69,173 +132,1849 @@ static struct mutex *chain_mutexes[__SIMPLEPF_CHAIN_LAST] = {
 static enum simplepf_action default_actions[__SIMPLEPF_CHAIN_LAST] = {
 	[SIMPLEPF_CHAIN_INPUT] = SIMPLEPF_ACTION_ACCEPT,
 	[SIMPLEPF_CHAIN_OUTPUT] = SIMPLEPF_ACTION_ACCEPT,
+	[SIMPLEPF_CHAIN_PREROUTING] = SIMPLEPF_ACTION_ACCEPT,
+	[SIMPLEPF_CHAIN_FORWARD] = SIMPLEPF_ACTION_ACCEPT,
+	[SIMPLEPF_CHAIN_INGRESS] = SIMPLEPF_ACTION_ACCEPT,
+	[SIMPLEPF_CHAIN_INPUT6] = SIMPLEPF_ACTION_ACCEPT,
+	[SIMPLEPF_CHAIN_OUTPUT6] = SIMPLEPF_ACTION_ACCEPT,
+	[SIMPLEPF_CHAIN_PREROUTING6] = SIMPLEPF_ACTION_ACCEPT,
+	[SIMPLEPF_CHAIN_FORWARD6] = SIMPLEPF_ACTION_ACCEPT,
 };
 
 /*
- * Tries to match the given rule with sk_buff.
- * Will always be given non-null parameters.
- * If match is successful, returns the action specified in the rule.
- * Else, returns __SIMPLEPF_ACTION_LAST.
- * XXX: Do we need the hook state?
+ * The packet counts of the rules of a chain at the last reordering pass, by
+ * the address of their counters, to tell how many packets each rule
+ * matched since.
  */
-static enum simplepf_action match_rule(const struct simplepf_rule *rule,
-		const struct sk_buff *skb,
-		const struct nf_hook_state *state)
+struct reorder_sample {
+	const struct simplepf_counter __percpu *counters;
+	u64 packets;
+};
+
+struct reorder_samples {
+	unsigned int count;
+	struct reorder_sample *samples;
+};
+
+/*
+ * The chains of a network namespace, in its net_generic() area.
+ * Created empty with the namespace and flushed when it goes away.
+ */
+struct chains_net {
+	/*
+	 * Chains are RCU-protected pointers to tables. NULL means an empty
+	 * chain. Read mostly in chain traversals by netfilter hooks,
+	 * written rarely for update requests by userspace.
+	 */
+	struct chain_table __rcu *chains[__SIMPLEPF_CHAIN_LAST];
+	/*
+	 * Mutexes to protect the chains.
+	 */
+	struct mutex mutexes[__SIMPLEPF_CHAIN_LAST];
+	/*
+	 * The engine each chain is compiled with. Protected by the chain
+	 * mutexes. Linear by default.
+	 */
+	enum simplepf_engine_id engine_ids[__SIMPLEPF_CHAIN_LAST];
+	/*
+	 * Counters of the default policies, i.e. of the packets that did not
+	 * match any rule in the chain; __SIMPLEPF_CHAIN_LAST of them, by
+	 * chain id.
+	 */
+	struct simplepf_counter __percpu *default_counters;
+	/*
+	 * Rule reordering, see reorder_work(). The samples of each chain are
+	 * protected by its mutex.
+	 */
+	struct delayed_work reorder_work;
+	struct reorder_samples samples[__SIMPLEPF_CHAIN_LAST];
+	unsigned long reorders[__SIMPLEPF_CHAIN_LAST];
+};
+
+static unsigned int chains_net_id __read_mostly;
+
+/*
+ * Runs the freeing of retired tables and the reordering of the chains, so
+ * that unloading only has to wait for the work of this module.
+ */
+static struct workqueue_struct *chains_wq;
+
+static unsigned int reorder_interval_ms;
+module_param(reorder_interval_ms, uint, 0444);
+MODULE_PARM_DESC(reorder_interval_ms,
+		"Move the rules that matched the most packets ahead, where that can't change a verdict, every that many milliseconds; 0 disables it (default 0)");
+
+/*
+ * Upper bound on the rule moves of one reordering pass of a chain, which
+ * runs with the chain mutex held.
+ */
+#define REORDER_MAX_MOVES (1U << 22)
+
+static inline struct chains_net *chains_net(const struct net *net)
 {
-	struct iphdr *ip_header = ip_hdr(skb);
+	return net_generic(net, chains_net_id);
+}
 
-	if (rule->filter_saddr && rule->ip_saddr != ip_header->saddr) {
-		return __SIMPLEPF_ACTION_LAST;
-	}
+static const struct simplepf_engine *engines[__SIMPLEPF_ENGINE_LAST] = {
+	[SIMPLEPF_ENGINE_LINEAR] = &simplepf_linear_engine,
+	[SIMPLEPF_ENGINE_TSS] = &simplepf_tss_engine,
+	[SIMPLEPF_ENGINE_LPM] = &simplepf_lpm_engine,
+	[SIMPLEPF_ENGINE_PORTS] = &simplepf_ports_engine,
+	[SIMPLEPF_ENGINE_DTREE] = &simplepf_dtree_engine,
+	[SIMPLEPF_ENGINE_BITVEC] = &simplepf_bitvec_engine,
+};
 
-	if (rule->filter_daddr && rule->ip_daddr != ip_header->daddr) {
-		return __SIMPLEPF_ACTION_LAST;
+/*
+ * The engine that compiles the chain as engine @engine_id: the IPv6 chains
+ * only use the linear engine, in its IPv6 form.
+ */
+static const struct simplepf_engine *chain_engine(
+		enum simplepf_chain_id chain_id,
+		enum simplepf_engine_id engine_id)
+{
+	if (SIMPLEPF_CHAIN_IS_IPV6(chain_id)) {
+		return &simplepf_linear6_engine;
 	}
 
-	if (rule->filter_proto && rule->ip_protocol != ip_header->protocol) {
-		return __SIMPLEPF_ACTION_LAST;
+	return engines[engine_id];
+}
+
+static const char *chain_names[__SIMPLEPF_CHAIN_LAST] = {
+	[SIMPLEPF_CHAIN_INPUT] = "input",
+	[SIMPLEPF_CHAIN_OUTPUT] = "output",
+	[SIMPLEPF_CHAIN_PREROUTING] = "prerouting",
+	[SIMPLEPF_CHAIN_FORWARD] = "forward",
+	[SIMPLEPF_CHAIN_INGRESS] = "ingress",
+	[SIMPLEPF_CHAIN_INPUT6] = "input6",
+	[SIMPLEPF_CHAIN_OUTPUT6] = "output6",
+	[SIMPLEPF_CHAIN_PREROUTING6] = "prerouting6",
+	[SIMPLEPF_CHAIN_FORWARD6] = "forward6",
+};
+
+static const char *action_names[__SIMPLEPF_ACTION_LAST] = {
+	[SIMPLEPF_ACTION_ACCEPT] = "accept",
+	[SIMPLEPF_ACTION_DROP] = "drop",
+};
+
+/*
+ * Account a packet to the given per-CPU counter.
+ * this_cpu ops are safe against preemption and interrupts,
+ * so no locking is needed in any hook context.
+ */
+static inline void count_packet(struct simplepf_counter __percpu *counter,
+		const struct sk_buff *skb)
+{
+	this_cpu_inc(counter->packets);
+	this_cpu_add(counter->bytes, skb->len);
+}
+
+/*
+ * Sum the per-CPU values of @counter into @sum.
+ * Readers may race with the hot path; we only need a recent value, not
+ * an exact snapshot.
+ */
+static void sum_counter(const struct simplepf_counter __percpu *counter,
+		struct simplepf_counter *sum)
+{
+	int cpu;
+
+	sum->packets = 0;
+	sum->bytes = 0;
+	for_each_possible_cpu(cpu) {
+		const struct simplepf_counter *c = per_cpu_ptr(counter, cpu);
+		sum->packets += READ_ONCE(c->packets);
+		sum->bytes += READ_ONCE(c->bytes);
 	}
+}
+
+/*
+ * Read the ICMP type or the ports of a packet of the given class from its
+ * transport header at @offset, for both families; the type is the first
+ * field of the ICMP and the ICMPv6 header alike, and the two are the same
+ * size. The fields that don't apply to the class are zeroed.
+ * Returns the class, or that of an unsupported protocol if the header is
+ * truncated.
+ */
+static enum simplepf_pkt_class parse_transport(const struct sk_buff *skb,
+		int offset, enum simplepf_pkt_class class, u8 *icmp_type,
+		__be16 *sport, __be16 *dport)
+{
+	*icmp_type = 0;
+	*sport = 0;
+	*dport = 0;
 
-	switch (ip_header->protocol) {
-	case IPPROTO_ICMP:
+	switch (class) {
+	case SIMPLEPF_CLASS_ICMP:
 	{
-		struct icmphdr *icmp_header = icmp_hdr(skb);
-		if (rule->filter_icmp_type &&
-				rule->icmp_type != icmp_header->type) {
-			return __SIMPLEPF_ACTION_LAST;
+		struct icmphdr _icmp_header;
+		const struct icmphdr *icmp_header;
+
+		icmp_header = skb_header_pointer(skb, offset,
+				sizeof _icmp_header, &_icmp_header);
+		if (!icmp_header) {
+			return __SIMPLEPF_CLASS_LAST;
 		}
+		*icmp_type = icmp_header->type;
 	}
 	break;
 
-	case IPPROTO_TCP:
+	case SIMPLEPF_CLASS_L4:
 	{
-		struct tcphdr *tcp_header = tcp_hdr(skb);
-		if (rule->filter_sport &&
-				rule->transport_sport != tcp_header->source) {
-			return __SIMPLEPF_ACTION_LAST;
-		}
-		if (rule->filter_dport &&
-				rule->transport_dport != tcp_header->dest) {
-			return __SIMPLEPF_ACTION_LAST;
+		/*
+		 * Source and destination ports are the first two fields
+		 * of both the TCP and the UDP header.
+		 */
+		__be16 _ports[2];
+		const __be16 *ports;
+
+		ports = skb_header_pointer(skb, offset, sizeof _ports, _ports);
+		if (!ports) {
+			return __SIMPLEPF_CLASS_LAST;
 		}
+		*sport = ports[0];
+		*dport = ports[1];
 	}
 	break;
 
-	case IPPROTO_UDP:
-	{
-		struct udphdr *udp_header = udp_hdr(skb);
-		if (rule->filter_sport &&
-				rule->transport_sport != udp_header->source) {
-			return __SIMPLEPF_ACTION_LAST;
-		}
-		if (rule->filter_dport &&
-				rule->transport_dport != udp_header->dest) {
-			return __SIMPLEPF_ACTION_LAST;
+	default:
+	break;
+	}
+
+	return class;
+}
+
+/*
+ * Extract the fields rules match on from the packet, once per traversal.
+ * The transport header is read with skb_header_pointer(), so a truncated
+ * packet can't make us read past its end; such a packet gets the class of
+ * an unsupported protocol and matches no rule.
+ * The transport header is located from the IP header rather than taken
+ * from the skb, because it isn't set yet at the netdev ingress hook.
+ * Chains before reassembly (prerouting, forward, ingress) also see
+ * fragments; fragments other than the first have no transport header, so
+ * they are treated like an unsupported protocol as well.
+ */
+static void parse_packet(const struct sk_buff *skb,
+		struct simplepf_packet *pkt)
+{
+	const struct iphdr *ip_header = ip_hdr(skb);
+	int transport_offset = skb_network_offset(skb) + ip_header->ihl * 4;
+
+	pkt->saddr = ip_header->saddr;
+	pkt->daddr = ip_header->daddr;
+	pkt->protocol = ip_header->protocol;
+	pkt->class = simplepf_proto_class(ip_header->protocol);
+	if (ip_header->frag_off & htons(IP_OFFSET)) {
+		pkt->class = __SIMPLEPF_CLASS_LAST;
+	}
+
+	pkt->class = parse_transport(skb, transport_offset, pkt->class,
+			&pkt->icmp_type, &pkt->sport, &pkt->dport);
+}
+
+/*
+ * The extension headers parse_packet6() skips; the others, ESP above all,
+ * end the walk.
+ */
+static inline bool exthdr_skippable(u8 nexthdr)
+{
+	return nexthdr == NEXTHDR_HOP || nexthdr == NEXTHDR_ROUTING ||
+		nexthdr == NEXTHDR_DEST || nexthdr == NEXTHDR_AUTH ||
+		nexthdr == NEXTHDR_FRAGMENT;
+}
+
+/*
+ * The same for the IPv6 chains. The extension headers are skipped to find
+ * the upper-layer protocol, at most SIMPLEPF_IPV6_MAX_EXTHDRS of them, so
+ * a packet can't make us walk a long chain of headers; a packet with more,
+ * or with an ESP header, or a fragment other than the first, gets the
+ * class of an unsupported protocol.
+ */
+static void parse_packet6(const struct sk_buff *skb,
+		struct simplepf_packet6 *pkt)
+{
+	const struct ipv6hdr *ip6_header = ipv6_hdr(skb);
+	int offset = skb_network_offset(skb) + sizeof *ip6_header;
+	u8 nexthdr = ip6_header->nexthdr;
+	unsigned int i;
+
+	memcpy(pkt->saddr, &ip6_header->saddr, sizeof pkt->saddr);
+	memcpy(pkt->daddr, &ip6_header->daddr, sizeof pkt->daddr);
+
+	for (i = 0; i < SIMPLEPF_IPV6_MAX_EXTHDRS &&
+			exthdr_skippable(nexthdr); i++) {
+		struct ipv6_opt_hdr _hdr;
+		const struct ipv6_opt_hdr *hdr;
+
+		hdr = skb_header_pointer(skb, offset, sizeof _hdr, &_hdr);
+		if (!hdr) {
+			nexthdr = NEXTHDR_NONE;
+			break;
 		}
+		if (nexthdr == NEXTHDR_FRAGMENT) {
+			struct frag_hdr _frag;
+			const struct frag_hdr *frag;
 
+			frag = skb_header_pointer(skb, offset, sizeof _frag,
+					&_frag);
+			if (!frag || (frag->frag_off & htons(IP6_OFFSET))) {
+				nexthdr = NEXTHDR_NONE;
+				break;
+			}
+			offset += sizeof *frag;
+		} else if (nexthdr == NEXTHDR_AUTH) {
+			offset += ipv6_authlen(hdr);
+		} else {
+			offset += ipv6_optlen(hdr);
+		}
+		nexthdr = hdr->nexthdr;
 	}
-	break;
 
 	/*
-	 * Not matched any of the protocols we support.
-	 * Let the packet pass.
+	 * Past the limit, this is still an extension header, which is of
+	 * no supported class.
 	 */
-	default:
-	return __SIMPLEPF_ACTION_LAST;
+	pkt->protocol = nexthdr;
+	pkt->class = simplepf_proto_class6(nexthdr);
+	pkt->class = parse_transport(skb, offset, pkt->class,
+			&pkt->icmp_type, &pkt->sport, &pkt->dport);
+}
+
+/*
+ * Check a filtered address of a rule and mask it with its prefix; of an
+ * IPv4 rule, also clear the words only IPv6 addresses use.
+ */
+static int prepare_addr(__u32 addr[4], __u8 *prefixlen, bool ipv6)
+{
+	unsigned int bits = ipv6 ? 128 : 32;
+	unsigned int i;
 
+	if (*prefixlen > bits) {
+		return -EINVAL;
+	}
+	if (!*prefixlen) {
+		*prefixlen = bits;
 	}
 
-	/*
-	 * If we've come to this point, every filter that has its filter_*
-	 * set to true has matched the packet. Note that this may also mean
-	 * that no filter_* was set to true, i.e. this rule matches all packets.
-	 */
-	return rule->action;
+	if (!ipv6) {
+		addr[0] &= simplepf_prefix_mask(*prefixlen);
+		addr[1] = addr[2] = addr[3] = 0;
+		return 0;
+	}
+	for (i = 0; i < 4; i++) {
+		addr[i] &= htonl(simplepf_prefix6_word_mask(*prefixlen, i));
+	}
+	return 0;
 }
 
-int simplepf_add_rule(enum simplepf_chain_id chain_id,
-		const struct simplepf_rule *rule)
+/*
+ * Check a rule given by userspace for a chain of the given family and bring
+ * it to the canonical form that the matchers expect: a filtered address
+ * has a prefix length in 1-32 (1-128 for IPv6) and no bits set beyond it,
+ * a filtered port has its range maximum set.
+ * Returns 0 on success, -EINVAL if the rule is not valid.
+ */
+static int prepare_rule(struct simplepf_rule *rule, bool ipv6)
 {
-	struct list_head *chain;
-	struct chain_node *new;
+	if (rule->filter_saddr && prepare_addr(rule->ip6_saddr,
+			&rule->ip_saddr_prefixlen, ipv6)) {
+		return -EINVAL;
+	}
 
-	if (chain_id >= __SIMPLEPF_CHAIN_LAST) {
+	if (rule->filter_daddr && prepare_addr(rule->ip6_daddr,
+			&rule->ip_daddr_prefixlen, ipv6)) {
 		return -EINVAL;
 	}
 
-	new = kmalloc(sizeof *new, GFP_KERNEL);
-	if (!new) {
-		return -ENOMEM;
+	if (rule->filter_sport) {
+		if (!rule->transport_sport_max) {
+			rule->transport_sport_max = rule->transport_sport;
+		}
+		if (ntohs(rule->transport_sport_max) <
+				ntohs(rule->transport_sport)) {
+			return -EINVAL;
+		}
 	}
-	new->rule = *rule;
 
-	chain_id = array_index_nospec(chain_id, __SIMPLEPF_CHAIN_LAST);
-	chain = chains[chain_id];
+	if (rule->filter_dport) {
+		if (!rule->transport_dport_max) {
+			rule->transport_dport_max = rule->transport_dport;
+		}
+		if (ntohs(rule->transport_dport_max) <
+				ntohs(rule->transport_dport)) {
+			return -EINVAL;
+		}
+	}
+
+	if (rule->filter_ifindex && (int)rule->ifindex <= 0) {
+		return -EINVAL;
+	}
 
-	mutex_lock(chain_mutexes[chain_id]);
-	list_add_tail_rcu(&new->list, chain);
-	mutex_unlock(chain_mutexes[chain_id]);
+	rule->log = !!rule->log;
 
 	return 0;
 }
 
-int simplepf_flush_chain(enum simplepf_chain_id chain_id)
+/*
+ * Allocate a table for @count rules. Rules are left uninitialized.
+ */
+static struct chain_table *alloc_table(unsigned int count)
 {
-	struct list_head *chain;
-	struct chain_node *node;
-	struct chain_node *n;
+	struct chain_table *table;
 
-	if (chain_id >= __SIMPLEPF_CHAIN_LAST) {
-		return -EINVAL;
+	table = kvmalloc(struct_size(table, rules, count), GFP_KERNEL);
+	if (!table) {
+		return NULL;
 	}
+	table->count = count;
+	table->counters = NULL;
+	table->engine = NULL;
+	table->build_ns = 0;
+	table->global.ifindex = 0;
+	table->global.gen = 0;
+	table->global.engine_priv = NULL;
+	table->global.count = count;
+	table->global.rules = table->rules;
+	table->global.ids = NULL;
+	table->nr_views = 0;
+	table->views = NULL;
 
-	chain_id = array_index_nospec(chain_id, __SIMPLEPF_CHAIN_LAST);
-	chain = chains[chain_id];
+	return table;
+}
+
+/*
+ * Free the list, and the arrays in it if @with_arrays.
+ */
+static void free_counters(struct counter_arrays *counters, bool with_arrays)
+{
+	unsigned int i;
+
+	for (i = 0; counters && with_arrays && i < counters->count; i++) {
+		free_percpu(counters->arrays[i]);
+	}
+	kvfree(counters);
+}
+
+/*
+ * Allocate zeroed counters for @count rules and point the rules at them.
+ * Returns the list of their arrays, or NULL.
+ */
+static struct counter_arrays *alloc_counters(struct chain_rule *rules,
+		unsigned int count)
+{
+	struct counter_arrays *counters;
+	unsigned int i;
+
+	counters = kvmalloc(struct_size(counters, arrays,
+				DIV_ROUND_UP(count, COUNTER_ARRAY_SIZE)),
+			GFP_KERNEL);
+	if (!counters) {
+		return NULL;
+	}
+
+	counters->count = 0;
+	for (i = 0; i < count; i += COUNTER_ARRAY_SIZE) {
+		unsigned int n = min(count - i, (unsigned int)COUNTER_ARRAY_SIZE);
+		struct simplepf_counter __percpu *array;
+		unsigned int j;
+
+		array = __alloc_percpu(n * sizeof(struct simplepf_counter),
+				__alignof__(struct simplepf_counter));
+		if (!array) {
+			free_counters(counters, true);
+			return NULL;
+		}
+		counters->arrays[counters->count++] = array;
+		for (j = 0; j < n; j++) {
+			rules[i + j].counters = &array[j];
+		}
+	}
+
+	return counters;
+}
+
+/*
+ * Return a list of the arrays of @a followed by those of @b, which may be
+ * NULL. The arrays are shared, not copied.
+ */
+static struct counter_arrays *join_counters(const struct counter_arrays *a,
+		const struct counter_arrays *b)
+{
+	unsigned int nr_b = b ? b->count : 0;
+	struct counter_arrays *counters;
+
+	counters = kvmalloc(struct_size(counters, arrays, a->count + nr_b),
+			GFP_KERNEL);
+	if (!counters) {
+		return NULL;
+	}
+	counters->count = a->count + nr_b;
+	memcpy(counters->arrays, a->arrays, a->count * sizeof *a->arrays);
+	if (nr_b) {
+		memcpy(&counters->arrays[a->count], b->arrays,
+				nr_b * sizeof *b->arrays);
+	}
+
+	return counters;
+}
+
+static void destroy_view(struct chain_table *table,
+		struct chain_view *view)
+{
+	if (view->engine_priv) {
+		table->engine->destroy(view->engine_priv);
+	}
+	if (view->rules != table->rules) {
+		kvfree(view->rules);
+	}
+	kvfree(view->ids);
+	view->ids = NULL;
+	view->engine_priv = NULL;
+	view->count = table->count;
+	view->rules = table->rules;
+}
+
+/*
+ * Free the views of the table and their lookup structures, leaving it as
+ * alloc_table() made it.
+ */
+static void destroy_views(struct chain_table *table)
+{
+	unsigned int i;
+
+	for (i = 0; i < table->nr_views; i++) {
+		destroy_view(table, &table->views[i]);
+	}
+	kvfree(table->views);
+	table->views = NULL;
+	table->nr_views = 0;
+	destroy_view(table, &table->global);
+}
+
+/*
+ * Free a table that is not, or no longer, visible to readers.
+ */
+static void free_table(struct chain_table *table, bool with_counters)
+{
+	destroy_views(table);
+	free_counters(table->counters, with_counters);
+	kvfree(table);
+}
+
+/*
+ * Work item that frees a table replaced by a newer one.
+ * Queued with queue_rcu_work(), so it runs in process context after a grace
+ * period; a table may hold up to SIMPLEPF_MAX_RULES rules.
+ */
+static void free_table_work(struct work_struct *work)
+{
+	struct chain_table *table = container_of(to_rcu_work(work),
+			struct chain_table, free_work);
+
+	free_table(table, table->free_counters);
+}
+
+/*
+ * Free a table that was replaced by a newer one once no reader can be
+ * using it anymore. A single grace period for the whole table, no matter
+ * how many rules it has. We don't wait for it either.
+ */
+static void retire_table(struct chain_table *table, bool with_counters)
+{
+	table->free_counters = with_counters;
+	INIT_RCU_WORK(&table->free_work, free_table_work);
+	queue_rcu_work(chains_wq, &table->free_work);
+}
+
+static int ifindex_cmp(const void *a, const void *b)
+{
+	int x = *(const int *)a;
+	int y = *(const int *)b;
+
+	return x < y ? -1 : x > y;
+}
 
-	mutex_lock(chain_mutexes[chain_id]);
-	list_for_each_entry_safe(node, n, chain, list) {
-		list_del_rcu(&node->list);
-		synchronize_rcu();
-		kfree(node);
+/*
+ * Make @view the view of the table for interface @ifindex, or the global
+ * view if it is 0, with copies of the rules for all interfaces and of the
+ * rules for the interface.
+ */
+static int fill_view(const struct chain_table *table, struct chain_view *view,
+		int ifindex)
+{
+	unsigned int n = 0;
+	unsigned int i;
+
+	for (i = 0; i < table->count; i++) {
+		const struct simplepf_rule *rule = &table->rules[i].rule;
+
+		if (!rule->filter_ifindex || rule->ifindex == ifindex) {
+			n++;
+		}
+	}
+
+	view->ifindex = ifindex;
+	view->rules = kvmalloc_array(max(n, 1U), sizeof *view->rules,
+			GFP_KERNEL);
+	if (!view->rules) {
+		return -ENOMEM;
+	}
+	view->ids = kvmalloc_array(max(n, 1U), sizeof *view->ids, GFP_KERNEL);
+	if (!view->ids) {
+		return -ENOMEM;
+	}
+
+	view->count = 0;
+	for (i = 0; i < table->count; i++) {
+		const struct simplepf_rule *rule = &table->rules[i].rule;
+
+		if (!rule->filter_ifindex || rule->ifindex == ifindex) {
+			view->ids[view->count] = i;
+			view->rules[view->count++] = table->rules[i];
+		}
 	}
-	mutex_unlock(chain_mutexes[chain_id]);
 
 	return 0;
 }
 
-enum simplepf_action simplepf_traverse_chain(enum simplepf_chain_id chain_id,
-		const struct sk_buff *skb,
-		const struct nf_hook_state *state)
+/*
+ * Split the table into the views of the interfaces it has rules for, if it
+ * has interface rules at all.
+ */
+static int build_views(struct chain_table *table)
 {
-	struct list_head *chain;
-	struct chain_node *node;
+	int *ifindexes;
+	unsigned int nr = 0;
+	unsigned int i;
+	unsigned int j;
+	int err = 0;
 
-	if (chain_id >= __SIMPLEPF_CHAIN_LAST) {
-		/*
-		 * This should not be possible. We (the module) provide a
-		 * hardcoded chain id, so the chain id is not an arbitrary input.
-		 * This may indicate a programming error.
-		 */
-		printk(KERN_DEBUG "simplepf: Chain id (=%d) out of range. "
-				"Accepting packet. "
-				"This may be a bug.\n", chain_id);
-		return SIMPLEPF_ACTION_ACCEPT;
+	for (i = 0; i < table->count; i++) {
+		if (table->rules[i].rule.filter_ifindex) {
+			nr++;
+		}
+	}
+	if (!nr) {
+		return 0;
 	}
 
-	/*
-	 * No Spectre stuff because chain_id is not user input.
-	 */
-	chain = chains[chain_id];
+	ifindexes = kvmalloc_array(nr, sizeof *ifindexes, GFP_KERNEL);
+	if (!ifindexes) {
+		return -ENOMEM;
+	}
+	for (i = 0, j = 0; i < table->count; i++) {
+		if (table->rules[i].rule.filter_ifindex) {
+			ifindexes[j++] = table->rules[i].rule.ifindex;
+		}
+	}
+	sort(ifindexes, nr, sizeof *ifindexes, ifindex_cmp, NULL);
+	for (i = 1, j = 1; i < nr; i++) {
+		if (ifindexes[i] != ifindexes[j - 1]) {
+			ifindexes[j++] = ifindexes[i];
+		}
+	}
+	nr = j;
 
-	rcu_read_lock();
-	list_for_each_entry_rcu(node, chain, list) {
-		enum simplepf_action action;
-		action = match_rule(&node->rule, skb, state);
-		if (action != __SIMPLEPF_ACTION_LAST) {
-			rcu_read_unlock();
-			return action;
+	err = fill_view(table, &table->global, 0);
+	if (err) {
+		goto out;
+	}
+
+	table->views = kvcalloc(nr, sizeof *table->views, GFP_KERNEL);
+	if (!table->views) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < nr; i++) {
+		/* Nothing to free in the views that are not filled yet. */
+		table->views[i].rules = table->rules;
+	}
+	table->nr_views = nr;
+
+	for (i = 0; i < nr; i++) {
+		err = fill_view(table, &table->views[i], ifindexes[i]);
+		if (err) {
+			goto out;
 		}
 	}
-	rcu_read_unlock();
-	return default_actions[chain_id];
+
+out:
+	kvfree(ifindexes);
+	return err;
+}
+
+static int compile_view(const struct simplepf_engine *engine,
+		struct chain_view *view)
+{
+	void *priv = NULL;
+
+	if (engine->build) {
+		priv = engine->build(view->rules, view->count);
+		if (IS_ERR(priv)) {
+			return PTR_ERR(priv);
+		}
+	}
+	view->engine_priv = priv;
+
+	return 0;
+}
+
+/*
+ * Build the views of the table and the lookup structures of @engine for
+ * them.
+ * Returns 0 on success, or the error returned by the engine; the table is
+ * left as it was then.
+ */
+static int compile_table(struct chain_table *table,
+		const struct simplepf_engine *engine)
+{
+	u64 start = ktime_get_ns();
+	unsigned int i;
+	int err;
+
+	table->engine = engine;
+
+	err = build_views(table);
+	if (err) {
+		goto fail;
+	}
+
+	err = compile_view(engine, &table->global);
+	if (err) {
+		goto fail;
+	}
+	for (i = 0; i < table->nr_views; i++) {
+		err = compile_view(engine, &table->views[i]);
+		if (err) {
+			goto fail;
+		}
+	}
+	table->build_ns = ktime_get_ns() - start;
+
+	return 0;
+
+fail:
+	destroy_views(table);
+	return err;
+}
+
+/*
+ * Source of table generations.
+ */
+static atomic_t generation = ATOMIC_INIT(0);
+
+static u32 next_generation(void)
+{
+	u32 gen;
+
+	do {
+		gen = atomic_inc_return(&generation);
+	} while (!gen);
+
+	return gen;
+}
+
+/*
+ * Publish @new as the table of the chain and return the table it replaced.
+ * Must be called with the chain mutex held.
+ * Giving the views of the new table fresh generations invalidates every
+ * flow cache entry of the old one.
+ */
+static struct chain_table *publish_table(struct chains_net *cn,
+		enum simplepf_chain_id chain_id, struct chain_table *new)
+{
+	struct chain_table *old;
+	unsigned int i;
+
+	old = rcu_dereference_protected(cn->chains[chain_id],
+			lockdep_is_held(&cn->mutexes[chain_id]));
+	if (new) {
+		new->global.gen = next_generation();
+		for (i = 0; i < new->nr_views; i++) {
+			new->views[i].gen = next_generation();
+		}
+	}
+	rcu_assign_pointer(cn->chains[chain_id], new);
+
+	return old;
+}
+
+int simplepf_check_rule(enum simplepf_chain_id chain_id,
+		const struct simplepf_rule *rule)
+{
+	struct simplepf_rule prepared = *rule;
+
+	return prepare_rule(&prepared, SIMPLEPF_CHAIN_IS_IPV6(chain_id));
+}
+
+int simplepf_add_rules(struct net *net, enum simplepf_chain_id chain_id,
+		const struct simplepf_rule *rules, unsigned int nr_rules)
+{
+	struct chains_net *cn = chains_net(net);
+	struct chain_table *old;
+	struct chain_table *new;
+	struct chain_rule *added;
+	struct counter_arrays *counters;
+	unsigned int count;
+	unsigned int i;
+	int err;
+
+	if (chain_id >= __SIMPLEPF_CHAIN_LAST) {
+		return -EINVAL;
+	}
+
+	if (nr_rules > SIMPLEPF_MAX_RULES) {
+		return -ENOSPC;
+	}
+
+	/*
+	 * Check the rules and allocate their counters before taking the
+	 * mutex.
+	 */
+	added = kvmalloc_array(max(nr_rules, 1U), sizeof *added, GFP_KERNEL);
+	if (!added) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < nr_rules; i++) {
+		added[i].rule = rules[i];
+		err = prepare_rule(&added[i].rule,
+				SIMPLEPF_CHAIN_IS_IPV6(chain_id));
+		if (err) {
+			goto free_added;
+		}
+	}
+	counters = alloc_counters(added, nr_rules);
+	if (!counters) {
+		err = -ENOMEM;
+		goto free_added;
+	}
+
+	chain_id = array_index_nospec(chain_id, __SIMPLEPF_CHAIN_LAST);
+
+	mutex_lock(&cn->mutexes[chain_id]);
+	old = rcu_dereference_protected(cn->chains[chain_id],
+			lockdep_is_held(&cn->mutexes[chain_id]));
+	count = old ? old->count : 0;
+
+	if (count + nr_rules > SIMPLEPF_MAX_RULES) {
+		err = -ENOSPC;
+		goto fail;
+	}
+
+	new = alloc_table(count + nr_rules);
+	if (!new) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	if (old) {
+		memcpy(new->rules, old->rules, count * sizeof *new->rules);
+		new->counters = join_counters(old->counters, counters);
+	} else {
+		new->counters = join_counters(counters, NULL);
+	}
+	if (!new->counters) {
+		kvfree(new);
+		err = -ENOMEM;
+		goto fail;
+	}
+	memcpy(&new->rules[count], added, nr_rules * sizeof *added);
+
+	err = compile_table(new,
+			chain_engine(chain_id, cn->engine_ids[chain_id]));
+	if (err) {
+		free_table(new, false);
+		goto fail;
+	}
+
+	publish_table(cn, chain_id, new);
+	mutex_unlock(&cn->mutexes[chain_id]);
+
+	if (old) {
+		retire_table(old, false);
+	}
+
+	/* The arrays are the new table's now. */
+	free_counters(counters, false);
+	kvfree(added);
+	return 0;
+
+fail:
+	mutex_unlock(&cn->mutexes[chain_id]);
+	free_counters(counters, true);
+free_added:
+	kvfree(added);
+	return err;
+}
+
+int simplepf_add_rule(struct net *net, enum simplepf_chain_id chain_id,
+		const struct simplepf_rule *rule)
+{
+	return simplepf_add_rules(net, chain_id, rule, 1);
+}
+
+int simplepf_replace_chain(struct net *net, enum simplepf_chain_id chain_id,
+		const struct simplepf_rule *rules, unsigned int count)
+{
+	struct chains_net *cn = chains_net(net);
+	struct chain_table *old;
+	struct chain_table *new = NULL;
+	unsigned int i;
+
+	if (chain_id >= __SIMPLEPF_CHAIN_LAST) {
+		return -EINVAL;
+	}
+
+	if (count > SIMPLEPF_MAX_RULES) {
+		return -E2BIG;
+	}
+
+	/*
+	 * Build the whole new table before taking the mutex; only compiling
+	 * it with the chain's engine and the pointer swap need to be
+	 * serialized against other writers.
+	 */
+	if (count) {
+		new = alloc_table(count);
+		if (!new) {
+			return -ENOMEM;
+		}
+
+		for (i = 0; i < count; i++) {
+			new->rules[i].rule = rules[i];
+			if (prepare_rule(&new->rules[i].rule,
+					SIMPLEPF_CHAIN_IS_IPV6(chain_id))) {
+				kvfree(new);
+				return -EINVAL;
+			}
+		}
+		new->counters = alloc_counters(new->rules, count);
+		if (!new->counters) {
+			kvfree(new);
+			return -ENOMEM;
+		}
+	}
+
+	chain_id = array_index_nospec(chain_id, __SIMPLEPF_CHAIN_LAST);
+
+	mutex_lock(&cn->mutexes[chain_id]);
+	if (new) {
+		int err = compile_table(new,
+				chain_engine(chain_id, cn->engine_ids[chain_id]));
+		if (err) {
+			mutex_unlock(&cn->mutexes[chain_id]);
+			free_table(new, true);
+			return err;
+		}
+	}
+	old = publish_table(cn, chain_id, new);
+	mutex_unlock(&cn->mutexes[chain_id]);
+
+	if (old) {
+		retire_table(old, true);
+	}
+
+	return 0;
+}
+
+int simplepf_flush_chain(struct net *net, enum simplepf_chain_id chain_id)
+{
+	return simplepf_replace_chain(net, chain_id, NULL, 0);
+}
+
+/*
+ * Compile the rules of the chain again with @engine and publish the result,
+ * keeping the rules and their counters. An empty chain has nothing to
+ * compile. Called with the chain mutex held.
+ * Returns 0 on success, or an error from the engine; the chain is left
+ * untouched then.
+ */
+static int recompile_chain(struct chains_net *cn,
+		enum simplepf_chain_id chain_id,
+		const struct simplepf_engine *engine)
+{
+	struct chain_table *old;
+	struct chain_table *new;
+	int err;
+
+	old = rcu_dereference_protected(cn->chains[chain_id],
+			lockdep_is_held(&cn->mutexes[chain_id]));
+	if (!old) {
+		return 0;
+	}
+
+	new = alloc_table(old->count);
+	if (!new) {
+		return -ENOMEM;
+	}
+	memcpy(new->rules, old->rules, old->count * sizeof *new->rules);
+	new->counters = join_counters(old->counters, NULL);
+	if (!new->counters) {
+		kvfree(new);
+		return -ENOMEM;
+	}
+
+	err = compile_table(new, engine);
+	if (err) {
+		free_table(new, false);
+		return err;
+	}
+
+	publish_table(cn, chain_id, new);
+	retire_table(old, false);
+	return 0;
+}
+
+int simplepf_set_engine(struct net *net, enum simplepf_chain_id chain_id,
+		enum simplepf_engine_id engine_id)
+{
+	struct chains_net *cn = chains_net(net);
+	int err;
+
+	if (chain_id >= __SIMPLEPF_CHAIN_LAST ||
+			engine_id >= __SIMPLEPF_ENGINE_LAST) {
+		return -EINVAL;
+	}
+
+	/* See SIMPLEPF_CHAIN_IS_IPV6(). */
+	if (SIMPLEPF_CHAIN_IS_IPV6(chain_id) &&
+			engine_id != SIMPLEPF_ENGINE_LINEAR) {
+		return -EOPNOTSUPP;
+	}
+
+	chain_id = array_index_nospec(chain_id, __SIMPLEPF_CHAIN_LAST);
+	engine_id = array_index_nospec(engine_id, __SIMPLEPF_ENGINE_LAST);
+
+	/*
+	 * An empty chain uses the engine from the next update on.
+	 */
+	mutex_lock(&cn->mutexes[chain_id]);
+	err = recompile_chain(cn, chain_id, chain_engine(chain_id, engine_id));
+	if (!err) {
+		cn->engine_ids[chain_id] = engine_id;
+	}
+	mutex_unlock(&cn->mutexes[chain_id]);
+
+	return err;
+}
+
+int simplepf_republish_chain(struct net *net, enum simplepf_chain_id chain_id)
+{
+	struct chains_net *cn = chains_net(net);
+	int err;
+
+	if (chain_id >= __SIMPLEPF_CHAIN_LAST) {
+		return -EINVAL;
+	}
+
+	chain_id = array_index_nospec(chain_id, __SIMPLEPF_CHAIN_LAST);
+
+	mutex_lock(&cn->mutexes[chain_id]);
+	err = recompile_chain(cn, chain_id,
+			chain_engine(chain_id, cn->engine_ids[chain_id]));
+	mutex_unlock(&cn->mutexes[chain_id]);
+
+	return err;
+}
+
+/*
+ * Adaptive rule reordering.
+ * With reorder_interval_ms set, a worker of every namespace periodically
+ * counts the packets each rule of each chain matched since its last pass,
+ * and moves the rules that matched more ahead of the ones before them that
+ * matched fewer. A rule only moves past rules it can't share a packet with
+ * (rules_disjoint()), so every packet is still matched by the same rule
+ * first and gets the same verdict, and counts to the same counters; only
+ * the number of rules scanned to find it changes. The reordered chain is
+ * compiled and published like after any update, keeping the counters, and
+ * only if a rule moved.
+ * The indices of rules in the stats, the dump and the log follow the
+ * current order.
+ */
+
+/*
+ * Whether the prefixes, in network byte order, share no address: they
+ * differ in the bits of the shorter one. For both families; IPv4 addresses
+ * are in the first word, with the others zero.
+ */
+static bool prefixes_disjoint(const __be32 *a, unsigned int a_len,
+		const __be32 *b, unsigned int b_len)
+{
+	unsigned int len = min(a_len, b_len);
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		if (ntohl(a[i] ^ b[i]) & simplepf_prefix6_word_mask(len, i)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool ranges_disjoint(__be16 a_min, __be16 a_max, __be16 b_min,
+		__be16 b_max)
+{
+	return ntohs(a_max) < ntohs(b_min) || ntohs(b_max) < ntohs(a_min);
+}
+
+static bool rule_in_class(const struct simplepf_rule *rule, bool ipv6,
+		enum simplepf_pkt_class class)
+{
+	if (!rule->filter_proto) {
+		return true;
+	}
+	return (ipv6 ? simplepf_proto_class6(rule->ip_protocol) :
+			simplepf_proto_class(rule->ip_protocol)) == class;
+}
+
+/*
+ * Whether no packet can match both rules, which are in the canonical form
+ * of prepare_rule(). Conservative: false unless some field rules it out.
+ */
+static bool rules_disjoint(const struct simplepf_rule *a,
+		const struct simplepf_rule *b, bool ipv6)
+{
+	bool icmp;
+	bool l4;
+
+	if (a->filter_ifindex && b->filter_ifindex &&
+			a->ifindex != b->ifindex) {
+		return true;
+	}
+	if (a->filter_saddr && b->filter_saddr &&
+			prefixes_disjoint(a->ip6_saddr, a->ip_saddr_prefixlen,
+				b->ip6_saddr, b->ip_saddr_prefixlen)) {
+		return true;
+	}
+	if (a->filter_daddr && b->filter_daddr &&
+			prefixes_disjoint(a->ip6_daddr, a->ip_daddr_prefixlen,
+				b->ip6_daddr, b->ip_daddr_prefixlen)) {
+		return true;
+	}
+	if (a->filter_proto && b->filter_proto &&
+			a->ip_protocol != b->ip_protocol) {
+		return true;
+	}
+
+	/* They may share ICMP packets, or TCP and UDP ones. */
+	icmp = rule_in_class(a, ipv6, SIMPLEPF_CLASS_ICMP) &&
+		rule_in_class(b, ipv6, SIMPLEPF_CLASS_ICMP) &&
+		!(a->filter_icmp_type && b->filter_icmp_type &&
+			a->icmp_type != b->icmp_type);
+	l4 = rule_in_class(a, ipv6, SIMPLEPF_CLASS_L4) &&
+		rule_in_class(b, ipv6, SIMPLEPF_CLASS_L4) &&
+		!(a->filter_sport && b->filter_sport &&
+			ranges_disjoint(a->transport_sport,
+				a->transport_sport_max, b->transport_sport,
+				b->transport_sport_max)) &&
+		!(a->filter_dport && b->filter_dport &&
+			ranges_disjoint(a->transport_dport,
+				a->transport_dport_max, b->transport_dport,
+				b->transport_dport_max));
+
+	return !icmp && !l4;
+}
+
+static int sample_cmp(const void *a, const void *b)
+{
+	const struct reorder_sample *x = a;
+	const struct reorder_sample *y = b;
+
+	return x->counters < y->counters ? -1 : x->counters > y->counters;
+}
+
+/*
+ * Take the packet counts of the rules of the table as the samples of the
+ * chain, and return how many packets each rule matched since the last ones
+ * in @rates; all of its packets for a rule that is new since. A count
+ * lower than the sample, from a rule whose counters were freed and
+ * reallocated at the same address, also counts as new: the rates only
+ * steer the order, they never change a verdict.
+ * Returns 0, or -ENOMEM, in which case the samples are left as they were.
+ */
+static int sample_rates(struct reorder_samples *samples,
+		const struct chain_table *table, u64 *rates)
+{
+	struct reorder_sample *new;
+	unsigned int i;
+
+	new = kvmalloc_array(table->count, sizeof *new, GFP_KERNEL);
+	if (!new) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < table->count; i++) {
+		const struct reorder_sample *old;
+		struct simplepf_counter sum;
+
+		sum_counter(table->rules[i].counters, &sum);
+		new[i].counters = table->rules[i].counters;
+		new[i].packets = sum.packets;
+
+		rates[i] = sum.packets;
+		old = samples->samples ? bsearch(&new[i], samples->samples,
+				samples->count, sizeof *old, sample_cmp) : NULL;
+		if (old && old->packets <= sum.packets) {
+			rates[i] -= old->packets;
+		}
+		cond_resched();
+	}
+
+	sort(new, table->count, sizeof *new, sample_cmp, NULL);
+	kvfree(samples->samples);
+	samples->samples = new;
+	samples->count = table->count;
+
+	return 0;
+}
+
+/*
+ * Reorder the rules of the chain by rate and publish them. Called with the
+ * chain mutex held.
+ * An insertion sort that only swaps disjoint rules: a rule moves up while
+ * the rule before it matched fewer packets and can't match the same ones.
+ * Returns 0, or -ENOMEM or an error from the engine, in which case the
+ * chain is left untouched.
+ */
+static int reorder_chain(struct chains_net *cn,
+		enum simplepf_chain_id chain_id)
+{
+	bool ipv6 = SIMPLEPF_CHAIN_IS_IPV6(chain_id);
+	struct chain_table *old;
+	struct chain_table *new;
+	unsigned int moves = 0;
+	unsigned int i;
+	u64 *rates;
+	int err;
+
+	old = rcu_dereference_protected(cn->chains[chain_id],
+			lockdep_is_held(&cn->mutexes[chain_id]));
+	if (!old) {
+		kvfree(cn->samples[chain_id].samples);
+		cn->samples[chain_id].samples = NULL;
+		cn->samples[chain_id].count = 0;
+		return 0;
+	}
+
+	rates = kvmalloc_array(old->count, sizeof *rates, GFP_KERNEL);
+	if (!rates) {
+		return -ENOMEM;
+	}
+	err = sample_rates(&cn->samples[chain_id], old, rates);
+	if (err) {
+		goto out;
+	}
+
+	new = alloc_table(old->count);
+	if (!new) {
+		err = -ENOMEM;
+		goto out;
+	}
+	memcpy(new->rules, old->rules, old->count * sizeof *new->rules);
+
+	for (i = 1; i < new->count && moves < REORDER_MAX_MOVES; i++) {
+		unsigned int j = i;
+
+		while (j > 0 && rates[j - 1] < rates[j] &&
+				moves < REORDER_MAX_MOVES &&
+				rules_disjoint(&new->rules[j - 1].rule,
+					&new->rules[j].rule, ipv6)) {
+			swap(new->rules[j - 1], new->rules[j]);
+			swap(rates[j - 1], rates[j]);
+			j--;
+			moves++;
+		}
+		cond_resched();
+	}
+	if (!moves) {
+		kvfree(new);
+		goto out;
+	}
+	new->counters = join_counters(old->counters, NULL);
+	if (!new->counters) {
+		kvfree(new);
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = compile_table(new, old->engine);
+	if (err) {
+		free_table(new, false);
+		goto out;
+	}
+
+	publish_table(cn, chain_id, new);
+	retire_table(old, false);
+	cn->reorders[chain_id]++;
+
+out:
+	kvfree(rates);
+	return err;
+}
+
+static void reorder_work(struct work_struct *work)
+{
+	struct chains_net *cn = container_of(to_delayed_work(work),
+			struct chains_net, reorder_work);
+	enum simplepf_chain_id chain_id;
+
+	for (chain_id = 0; chain_id < __SIMPLEPF_CHAIN_LAST; chain_id++) {
+		mutex_lock(&cn->mutexes[chain_id]);
+		reorder_chain(cn, chain_id);
+		mutex_unlock(&cn->mutexes[chain_id]);
+	}
+
+	queue_delayed_work(chains_wq, &cn->reorder_work,
+			msecs_to_jiffies(reorder_interval_ms));
+}
+
+/*
+ * The interface the rules of the chain are scoped by: the output interface
+ * for the output chains, the input interface for the others.
+ */
+static inline const struct net_device *chain_dev(
+		enum simplepf_chain_id chain_id,
+		const struct nf_hook_state *state)
+{
+	return chain_id == SIMPLEPF_CHAIN_OUTPUT ||
+		chain_id == SIMPLEPF_CHAIN_OUTPUT6 ? state->out : state->in;
+}
+
+/*
+ * The view of the table for the interface of the packet: the one it came
+ * in on, or for the output chains the one it goes out on.
+ */
+
+static const struct chain_view *find_view(const struct chain_table *table,
+		enum simplepf_chain_id chain_id,
+		const struct nf_hook_state *state)
+{
+	const struct net_device *dev;
+	unsigned int lo = 0;
+	unsigned int hi = table->nr_views;
+
+	if (!table->nr_views) {
+		return &table->global;
+	}
+
+	dev = chain_dev(chain_id, state);
+	if (!dev) {
+		return &table->global;
+	}
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (table->views[mid].ifindex < dev->ifindex) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo < table->nr_views && table->views[lo].ifindex == dev->ifindex) {
+		return &table->views[lo];
+	}
+
+	return &table->global;
+}
+
+enum simplepf_action simplepf_traverse_chain(enum simplepf_chain_id chain_id,
+		const struct sk_buff *skb,
+		const struct nf_hook_state *state)
+{
+	struct chains_net *cn;
+	struct chain_table *table;
+	const struct chain_view *view = NULL;
+	enum simplepf_action action;
+	unsigned int scanned = 0;
+	bool cached = false;
+	int index = -1;
+	u64 start;
+	u64 ns;
+
+	if (chain_id >= __SIMPLEPF_CHAIN_LAST) {
+		/*
+		 * This should not be possible. We (the module) provide a
+		 * hardcoded chain id, so the chain id is not an arbitrary input.
+		 * This may indicate a programming error.
+		 */
+		printk(KERN_DEBUG "simplepf: Chain id (=%d) out of range. "
+				"Accepting packet. "
+				"This may be a bug.\n", chain_id);
+		return SIMPLEPF_ACTION_ACCEPT;
+	}
+
+	/*
+	 * No Spectre stuff because chain_id is not user input.
+	 * The hooks of a namespace are called with it in @state, so a packet
+	 * only ever sees the chains of its own namespace.
+	 */
+	start = local_clock();
+	cn = chains_net(state->net);
+	rcu_read_lock();
+	table = rcu_dereference(cn->chains[chain_id]);
+	if (table) {
+		union {
+			struct simplepf_packet v4;
+			struct simplepf_packet6 v6;
+		} pkt;
+		struct simplepf_flow flow;
+		bool ipv6 = SIMPLEPF_CHAIN_IS_IPV6(chain_id);
+		unsigned int i;
+
+		view = find_view(table, chain_id, state);
+		i = view->count;
+		if (ipv6) {
+			/* Always the linear engine, and not cached. */
+			parse_packet6(skb, &pkt.v6);
+			i = simplepf_linear_classify6(view->engine_priv,
+					view->rules, view->count, &pkt.v6,
+					&scanned);
+		} else {
+			parse_packet(skb, &pkt.v4);
+		}
+		/*
+		 * No rule matches a packet of an unsupported protocol, so
+		 * there is nothing to look up or cache.
+		 */
+		if (!ipv6 && pkt.v4.class < __SIMPLEPF_CLASS_LAST) {
+			simplepf_flow_init(&flow, &pkt.v4);
+			cached = simplepf_flow_cache_lookup(&flow, view->gen,
+					&i);
+			if (!cached) {
+				i = table->engine->classify(view->engine_priv,
+						view->rules, view->count,
+						&pkt.v4, &scanned);
+				simplepf_flow_cache_insert(&flow, view->gen, i);
+			}
+		}
+		if (i < view->count) {
+			const struct chain_rule *cr = &view->rules[i];
+
+			action = cr->rule.action;
+			count_packet(cr->counters, skb);
+			index = view->ids ? view->ids[i] : i;
+			if (unlikely(cr->rule.log)) {
+				const struct net_device *dev =
+					chain_dev(chain_id, state);
+				int ifindex = dev ? dev->ifindex : 0;
+
+				if (ipv6) {
+					simplepf_log_packet6(chain_id, index,
+							action, ifindex,
+							&pkt.v6);
+				} else {
+					simplepf_log_packet(chain_id, index,
+							action, ifindex,
+							&pkt.v4);
+				}
+			}
+			goto out;
+		}
+	}
+	action = default_actions[chain_id];
+	count_packet(&cn->default_counters[chain_id], skb);
+
+out:
+	/*
+	 * The histograms are always on; the tracepoint costs nothing unless
+	 * it is enabled. The view is only read for it, so still under RCU.
+	 */
+	ns = local_clock() - start;
+	simplepf_hist_record(chain_id, ns, scanned);
+	trace_simplepf_traverse(chain_id, view ? view->ifindex : 0, action,
+			index, scanned, cached, ns);
+	rcu_read_unlock();
+	return action;
+}
+
+const char *simplepf_chain_name(enum simplepf_chain_id chain_id)
+{
+	if (chain_id >= __SIMPLEPF_CHAIN_LAST) {
+		return "unknown";
+	}
+	return chain_names[chain_id];
+}
+
+/*
+ * Dump iterators of the rules and stats files. The position of a record is
+ * its index in the concatenation of the records of all chains, so seeking
+ * to a position is a walk over the chains, not over the rules. The table of
+ * the current chain is kept from start() to stop(), under rcu_read_lock();
+ * seq_read() calls stop() before copying to userspace, so neither RCU nor
+ * any mutex is held across user copies, and the packet path and updates are
+ * never blocked.
+ */
+/*
+ * Point the iterator at the record at @pos, or at the first record after
+ * it if the chain it was in is gone or shorter now. @records returns the
+ * number of records of a chain. Returns false at the end.
+ */
+static bool chains_iter_seek(struct simplepf_chains_iter *iter,
+		const struct chains_net *cn, enum simplepf_chain_id chain_id,
+		loff_t pos,
+		unsigned int (*records)(const struct chain_table *table))
+{
+	for (; chain_id < __SIMPLEPF_CHAIN_LAST; chain_id++) {
+		const struct chain_table *table =
+			rcu_dereference(cn->chains[chain_id]);
+		unsigned int count = records(table);
+
+		if (pos < count) {
+			iter->chain_id = chain_id;
+			iter->index = pos;
+			iter->table = table;
+			return true;
+		}
+		pos -= count;
+	}
+
+	return false;
+}
+
+/* A line per rule. */
+static unsigned int rules_records(const struct chain_table *table)
+{
+	return table ? table->count : 0;
+}
+
+static void *rules_seq_start(struct seq_file *m, loff_t *pos)
+	__acquires(RCU)
+{
+	struct simplepf_chains_iter *iter = m->private;
+
+	rcu_read_lock();
+	if (!chains_iter_seek(iter, chains_net(seq_file_net(m)), 0, *pos,
+				rules_records)) {
+		return NULL;
+	}
+
+	return iter;
+}
+
+static void *rules_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct simplepf_chains_iter *iter = v;
+
+	++*pos;
+	if (++iter->index < iter->table->count) {
+		return iter;
+	}
+	if (!chains_iter_seek(iter, chains_net(seq_file_net(m)),
+				iter->chain_id + 1, 0, rules_records)) {
+		return NULL;
+	}
+
+	return iter;
+}
+
+static void chains_seq_stop(struct seq_file *m, void *v)
+	__releases(RCU)
+{
+	rcu_read_unlock();
+}
+
+static void show_port_range(struct seq_file *m, const char *name,
+		__be16 first, __be16 last)
+{
+	if (first == last) {
+		seq_printf(m, " %s %u", name, ntohs(first));
+	} else {
+		seq_printf(m, " %s %u-%u", name, ntohs(first), ntohs(last));
+	}
+}
+
+static int rules_seq_show(struct seq_file *m, void *v)
+{
+	const struct simplepf_chains_iter *iter = v;
+	const struct simplepf_rule *rule = &iter->table->rules[iter->index].rule;
+
+	seq_puts(m, chain_names[iter->chain_id]);
+	if (SIMPLEPF_CHAIN_IS_IPV6(iter->chain_id)) {
+		if (rule->filter_saddr) {
+			seq_printf(m, " src %pI6c/%u", rule->ip6_saddr,
+					rule->ip_saddr_prefixlen);
+		}
+		if (rule->filter_daddr) {
+			seq_printf(m, " dst %pI6c/%u", rule->ip6_daddr,
+					rule->ip_daddr_prefixlen);
+		}
+	} else {
+		if (rule->filter_saddr) {
+			seq_printf(m, " src %pI4/%u", &rule->ip_saddr,
+					rule->ip_saddr_prefixlen);
+		}
+		if (rule->filter_daddr) {
+			seq_printf(m, " dst %pI4/%u", &rule->ip_daddr,
+					rule->ip_daddr_prefixlen);
+		}
+	}
+	if (rule->filter_proto) {
+		switch (rule->ip_protocol) {
+		case IPPROTO_ICMP:
+			seq_puts(m, " proto icmp");
+		break;
+
+		case IPPROTO_ICMPV6:
+			seq_puts(m, " proto icmpv6");
+		break;
+
+		case IPPROTO_TCP:
+			seq_puts(m, " proto tcp");
+		break;
+
+		case IPPROTO_UDP:
+			seq_puts(m, " proto udp");
+		break;
+
+		default:
+			seq_printf(m, " proto %u", rule->ip_protocol);
+		break;
+		}
+	}
+	if (rule->filter_sport) {
+		show_port_range(m, "sport", rule->transport_sport,
+				rule->transport_sport_max);
+	}
+	if (rule->filter_dport) {
+		show_port_range(m, "dport", rule->transport_dport,
+				rule->transport_dport_max);
+	}
+	if (rule->filter_icmp_type) {
+		seq_printf(m, " icmp-type %u", rule->icmp_type);
+	}
+	if (rule->filter_ifindex) {
+		const struct net_device *dev;
+
+		/* The interface by name, or by index if it is gone. */
+		dev = dev_get_by_index_rcu(seq_file_net(m), rule->ifindex);
+		if (dev) {
+			seq_printf(m, " iface %s", dev->name);
+		} else {
+			seq_printf(m, " iface %u", rule->ifindex);
+		}
+	}
+	if (rule->log) {
+		seq_puts(m, " log");
+	}
+	seq_printf(m, " %s\n", rule->action < __SIMPLEPF_ACTION_LAST ?
+			action_names[rule->action] : "unknown");
+
+	return 0;
+}
+
+const struct seq_operations simplepf_rules_seq_ops = {
+	.start = rules_seq_start,
+	.next = rules_seq_next,
+	.stop = chains_seq_stop,
+	.show = rules_seq_show,
+};
+
+/*
+ * The stats of a chain are its engine line, a line per view, a line per rule
+ * and its policy line. The flow cache and log lines come first, at the
+ * start token.
+ */
+static unsigned int stats_records(const struct chain_table *table)
+{
+	return table ? table->nr_views + table->count + 2 : 2;
+}
+
+static void *stats_seq_start(struct seq_file *m, loff_t *pos)
+	__acquires(RCU)
+{
+	struct simplepf_chains_iter *iter = m->private;
+
+	rcu_read_lock();
+	if (*pos == 0) {
+		return SEQ_START_TOKEN;
+	}
+	if (!chains_iter_seek(iter, chains_net(seq_file_net(m)), 0, *pos - 1,
+				stats_records)) {
+		return NULL;
+	}
+
+	return iter;
+}
+
+static void *stats_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct simplepf_chains_iter *iter = m->private;
+	enum simplepf_chain_id chain_id = 0;
+
+	++*pos;
+	if (v != SEQ_START_TOKEN) {
+		if (++iter->index < stats_records(iter->table)) {
+			return iter;
+		}
+		chain_id = iter->chain_id + 1;
+	}
+	if (!chains_iter_seek(iter, chains_net(seq_file_net(m)), chain_id, 0,
+				stats_records)) {
+		return NULL;
+	}
+
+	return iter;
+}
+
+static int stats_seq_show(struct seq_file *m, void *v)
+{
+	const struct simplepf_chains_iter *iter = v;
+	const struct chain_table *table;
+	enum simplepf_chain_id chain_id;
+	struct chains_net *cn;
+	struct simplepf_counter sum;
+	unsigned int i;
+
+	if (v == SEQ_START_TOKEN) {
+		simplepf_flow_cache_show(m);
+		simplepf_log_show(m);
+		return 0;
+	}
+
+	cn = chains_net(seq_file_net(m));
+	table = iter->table;
+	chain_id = iter->chain_id;
+	i = iter->index;
+	if (i == 0) {
+		seq_printf(m, "%s engine %s", chain_names[chain_id],
+				table ? table->engine->name :
+				engines[READ_ONCE(cn->engine_ids[chain_id])]->name);
+		if (reorder_interval_ms) {
+			seq_printf(m, " reorders %lu",
+					READ_ONCE(cn->reorders[chain_id]));
+		}
+		if (table) {
+			seq_printf(m, " build_us %llu",
+					div_u64(table->build_ns, NSEC_PER_USEC));
+			if (table->engine->show && table->global.engine_priv) {
+				table->engine->show(table->global.engine_priv,
+						m);
+			}
+		}
+		seq_putc(m, '\n');
+		return 0;
+	}
+
+	i--;
+	if (table && i < table->nr_views) {
+		const struct chain_view *view = &table->views[i];
+
+		seq_printf(m, "%s view %d rules %u", chain_names[chain_id],
+				view->ifindex, view->count);
+		if (table->engine->show && view->engine_priv) {
+			table->engine->show(view->engine_priv, m);
+		}
+		seq_putc(m, '\n');
+		return 0;
+	}
+
+	i -= table ? table->nr_views : 0;
+	if (table && i < table->count) {
+		sum_counter(table->rules[i].counters, &sum);
+		seq_printf(m, "%s rule %u packets %llu bytes %llu\n",
+				chain_names[chain_id], i, sum.packets, sum.bytes);
+		return 0;
+	}
+
+	sum_counter(&cn->default_counters[chain_id], &sum);
+	seq_printf(m, "%s policy %s packets %llu bytes %llu\n",
+			chain_names[chain_id],
+			action_names[default_actions[chain_id]],
+			sum.packets, sum.bytes);
+
+	return 0;
+}
+
+const struct seq_operations simplepf_stats_seq_ops = {
+	.start = stats_seq_start,
+	.next = stats_seq_next,
+	.stop = chains_seq_stop,
+	.show = stats_seq_show,
+};
+
+static int __net_init chains_net_init(struct net *net)
+{
+	struct chains_net *cn = chains_net(net);
+	enum simplepf_chain_id chain_id;
+
+	cn->default_counters = __alloc_percpu(__SIMPLEPF_CHAIN_LAST *
+			sizeof(struct simplepf_counter),
+			__alignof__(struct simplepf_counter));
+	if (!cn->default_counters) {
+		return -ENOMEM;
+	}
+
+	for (chain_id = 0; chain_id < __SIMPLEPF_CHAIN_LAST; chain_id++) {
+		RCU_INIT_POINTER(cn->chains[chain_id], NULL);
+		mutex_init(&cn->mutexes[chain_id]);
+		cn->engine_ids[chain_id] = SIMPLEPF_ENGINE_LINEAR;
+		cn->samples[chain_id].count = 0;
+		cn->samples[chain_id].samples = NULL;
+		cn->reorders[chain_id] = 0;
+	}
+
+	INIT_DELAYED_WORK(&cn->reorder_work, reorder_work);
+	if (reorder_interval_ms) {
+		queue_delayed_work(chains_wq, &cn->reorder_work,
+				msecs_to_jiffies(reorder_interval_ms));
+	}
+
+	return 0;
+}
+
+/*
+ * The hooks of the namespace were unregistered in its .pre_exit, a grace
+ * period ago (see main.c), so nothing traverses its chains anymore. The
+ * tables are freed after a grace period like on any update.
+ */
+static void __net_exit chains_net_exit(struct net *net)
+{
+	struct chains_net *cn = chains_net(net);
+	enum simplepf_chain_id chain_id;
+
+	/* The work requeues itself; this stops it for good. */
+	cancel_delayed_work_sync(&cn->reorder_work);
+	for (chain_id = 0; chain_id < __SIMPLEPF_CHAIN_LAST; chain_id++) {
+		simplepf_flush_chain(net, chain_id);
+		kvfree(cn->samples[chain_id].samples);
+	}
+	free_percpu(cn->default_counters);
+}
+
+static struct pernet_operations chains_net_ops = {
+	.init = chains_net_init,
+	.exit = chains_net_exit,
+	.id = &chains_net_id,
+	.size = sizeof(struct chains_net),
+};
+
+int __init simplepf_chains_init(void)
+{
+	int err;
+
+	chains_wq = alloc_workqueue("simplepf", 0, 0);
+	if (!chains_wq) {
+		printk(KERN_INFO "simplepf: Failed to set up the chains\n");
+		return -ENOMEM;
+	}
+
+	err = register_pernet_subsys(&chains_net_ops);
+	if (err) {
+		printk(KERN_INFO "simplepf: Failed to set up the chains\n");
+		destroy_workqueue(chains_wq);
+	}
+
+	return err;
+}
+
+void simplepf_chains_cleanup(void)
+{
+	unregister_pernet_subsys(&chains_net_ops);
+
+	/*
+	 * Retired tables are freed by work queued from RCU callbacks: wait
+	 * for the callbacks, then destroying the workqueue runs the work.
+	 */
+	rcu_barrier();
+	destroy_workqueue(chains_wq);
 }
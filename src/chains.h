@@ -23,17 +23,87 @@
 
 #include <linux/skbuff.h>
 #include <linux/netfilter.h>
+#include <linux/seq_file.h>
+#include <linux/seq_file_net.h>
+#include <net/net_namespace.h>
+
+/*
+ * Packet and byte counters of a rule or of a chain's default policy.
+ * They are kept per CPU and only summed when read, so that the hot path never
+ * writes to a cache line shared with other CPUs.
+ */
+struct simplepf_counter {
+	u64 packets;
+	u64 bytes;
+};
+
+/*
+ * Every network namespace has its own chains, with their own engines and
+ * counters; the functions below work on the chains of @net. They are
+ * created empty with the namespace and flushed when it goes away.
+ */
+
+/*
+ * Set up the chains of every namespace, existing and future.
+ * Returns 0 on success, or a negative error code.
+ */
+int __init simplepf_chains_init(void);
+
+/*
+ * Flush the chains of every namespace and stop setting up new ones.
+ * The hooks must be gone already. Returns once all the tables are freed.
+ */
+void simplepf_chains_cleanup(void);
 
 /*
  * Flush the chain with the given id. Frees allocated resources as well.
  * Returns 0 on success.
  * Returns -EINVAL if chain_id does not specify a valid chain.
  */
-int simplepf_flush_chain(enum simplepf_chain_id chain_id);
+int simplepf_flush_chain(struct net *net, enum simplepf_chain_id chain_id);
+
+/*
+ * Atomically replace the contents of the chain with the given id with
+ * @count rules from @rules. The new chain is built off to the side and
+ * published in one step; the old one is freed after a grace period.
+ * Returns 0 on success.
+ * Returns -EINVAL if chain_id does not specify a valid chain or any of the
+ * rules is not valid.
+ * Returns -E2BIG if count exceeds SIMPLEPF_MAX_RULES.
+ * Returns -ENOMEM on memory allocation failure, in which case the chain
+ * is left untouched.
+ * Returns another error from the chain's engine (e.g. -E2BIG from dtree)
+ * if the rules can't be compiled with it; the chain is left untouched too.
+ * Safe to call concurrently.
+ */
+int simplepf_replace_chain(struct net *net, enum simplepf_chain_id chain_id,
+		const struct simplepf_rule *rules, unsigned int count);
+
+/*
+ * Select the classification engine of the chain with the given id.
+ * A non-empty chain is recompiled and republished right away.
+ * Returns 0 on success.
+ * Returns -EINVAL if chain_id or engine_id is not valid.
+ * Returns -EOPNOTSUPP for an IPv6 chain and any engine but the linear one.
+ * Returns -ENOMEM, or another error from the engine, if the chain can't be
+ * compiled with it, in which case the chain keeps its current engine.
+ */
+int simplepf_set_engine(struct net *net, enum simplepf_chain_id chain_id,
+		enum simplepf_engine_id engine_id);
+
+/*
+ * Compile the chain with the given id again and publish it, with the same
+ * rules, engine and counters, as if it had been updated. Packets get the
+ * same verdicts as before; used to exercise updates under traffic.
+ * Returns 0 on success, -EINVAL if chain_id is not valid, or -ENOMEM or
+ * another error from the engine, in which case the chain is left untouched.
+ */
+int simplepf_republish_chain(struct net *net, enum simplepf_chain_id chain_id);
 
 /*
  * Traverses a chain, returns the action determined by the chain.
- * @skb and @state are the pointers that are passed by netfilter to our hook.
+ * @skb and @state are the pointers that are passed by netfilter to our hook;
+ * the chain is the one of the namespace in @state.
  * Validity of skb (!= NULL) is checked by the hook; so this function assumes
  * that it is non-null.
  * @chain_id is the id of the chain to be traversed.
@@ -47,14 +117,75 @@ enum simplepf_action simplepf_traverse_chain(enum simplepf_chain_id chain_id,
 /*
  * Add (append) the given rule to the chain with the given ID.
  * Returns 0 on success.
- * Returns -EINVAL if chain_id does not specify a valid chain.
+ * Returns -EINVAL if chain_id does not specify a valid chain or the rule
+ * is not valid.
  * Returns -ENOMEM on memory allocation failure.
+ * Returns -ENOSPC if the chain already has SIMPLEPF_MAX_RULES rules.
+ * Returns another error from the chain's engine if the chain can't be
+ * compiled with it.
  * Handles the synchronization among concurrent readers/writers;
  * safe to call concurrently.
  */
-int simplepf_add_rule(enum simplepf_chain_id chain_id,
+int simplepf_add_rule(struct net *net, enum simplepf_chain_id chain_id,
 		const struct simplepf_rule *rule);
 
+/*
+ * Append @nr_rules rules from @rules to the chain with the given ID, in one
+ * update: the chain is rebuilt and published once, and readers see either
+ * none or all of the rules.
+ * Returns the same errors as simplepf_add_rule(); -ENOSPC if the rules don't
+ * fit in the chain. On error, the chain is left untouched.
+ */
+int simplepf_add_rules(struct net *net, enum simplepf_chain_id chain_id,
+		const struct simplepf_rule *rules, unsigned int nr_rules);
+
+/*
+ * Returns 0 if the rule would be accepted by the functions above for the
+ * chain, -EINVAL if it is not valid.
+ */
+int simplepf_check_rule(enum simplepf_chain_id chain_id,
+		const struct simplepf_rule *rule);
+
+/*
+ * seq_file operations that dump the rules of all chains of the namespace of
+ * the file, one per line:
+ *  <chain> [src <addr>/<len>] [dst <addr>/<len>] [proto <name>]
+ *          [sport <port>[-<port>]] [dport <port>[-<port>]]
+ *          [icmp-type <type>] [iface <name or index>] [log] <action>
+ * Open with seq_open_net() and a struct simplepf_chains_iter.
+ * Reads take the live tables under RCU only, and resume from the position
+ * of the last read in O(number of chains). A dump that runs concurrently
+ * with updates may mix rules from the tables before and after them.
+ */
+extern const struct seq_operations simplepf_rules_seq_ops;
+
+/*
+ * seq_file operations that print the lines of the flow cache and the log,
+ * then for every chain of the namespace of the file its engine and views,
+ * the counters of every rule and of its default policy, summed across CPUs.
+ * Used by /proc/net/simplepf/stats. Open like simplepf_rules_seq_ops; the
+ * same holds for concurrent updates.
+ */
+extern const struct seq_operations simplepf_stats_seq_ops;
+
+struct chain_table;
+
+/*
+ * Dump cursor of both. Private to chains.c; declared here for its size.
+ */
+struct simplepf_chains_iter {
+	/* For seq_open_net(), must come first. */
+	struct seq_net_private p;
+	enum simplepf_chain_id chain_id;
+	unsigned int index;
+	const struct chain_table *table;
+};
+
+/*
+ * Returns the user visible name of the chain, e.g. "input".
+ */
+const char *simplepf_chain_name(enum simplepf_chain_id chain_id);
+
 /*
  * Convert a simplepf return value to a netfilter value.
  * SIMPLEPF_ACTION_ACCEPT -> NF_ACCEPT
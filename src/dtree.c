@@ -0,0 +1,680 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Decision tree classifier, after HiCuts.
+ *
+ * Every rule is a box in the space of the header fields: a range of values
+ * in each dimension (addresses, protocol, ports). The tree recursively cuts
+ * the space into equal-sized slices along one dimension at a time, and
+ * every slice keeps the rules that overlap it, until a slice has at most
+ * DTREE_BINTH rules. A lookup follows the slices that contain the packet
+ * from the root down to a leaf, and checks the few rules of the leaf with
+ * the reference matcher.
+ *
+ * Slice counts and sizes are powers of two, so picking the child is a shift.
+ * At each node the dimension with the most distinct rule ranges is cut, into
+ * as many slices as possible while the rules copied into the slices stay
+ * under DTREE_SPFAC times the rules of the node. Rules after one that covers
+ * a whole slice can never be the first match there and are left out of it,
+ * and adjacent slices with the same rules share one leaf. (Not a subtree:
+ * its cuts and the rules left out of it depend on the slice it was built for.)
+ *
+ * Rules are copied into every slice they overlap, so the tree can blow up
+ * on rulesets with many overlapping ranges. Above all, a rule that is
+ * (nearly) a wildcard in the dimension being cut lands in every slice: cut
+ * a blocklist of sources and every service rule is copied into every
+ * slice, cut the services by port and every blocklist entry is. So, after
+ * EffiCuts, the rules are first split by the set of dimensions they are
+ * large in (cover at least half of), and every group gets a tree of its
+ * own, which only has to cut the dimensions its rules are small in. A
+ * lookup walks the trees of all groups and keeps the first matching rule;
+ * it skips the rest of a leaf once its rules come after the best match so
+ * far. The total size is capped; a ruleset that doesn't fit fails to
+ * compile with -E2BIG.
+ *
+ * Which fields apply, and how wide they are, depends on the packet class
+ * (see match.h), so every class gets its own trees.
+ */
+
+#include "engine.h"
+#include "match.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/seq_file.h>
+
+/* Maximum number of rules in a leaf. */
+#define DTREE_BINTH 8
+/* Maximum growth of the rule copies at a node, see above. */
+#define DTREE_SPFAC 4
+#define DTREE_MAX_CUTS 256
+#define DTREE_MAX_DEPTH 24
+/*
+ * Cap on the references (child pointers and leaf rules) of a tree:
+ * DTREE_MAX_REFS_PER_RULE per rule, plus some room for small rulesets.
+ */
+#define DTREE_MAX_REFS_PER_RULE 64
+#define DTREE_MIN_MAX_REFS (1U << 20)
+
+#define DTREE_LEAF 0xff
+
+/* One tree per set of large dimensions. */
+#define DTREE_MAX_ROOTS (1U << SIMPLEPF_DIMS)
+
+/*
+ * An internal node cuts [lo, lo + (nr << shift)) of dimension @dim into @nr
+ * slices of 2^shift values; their children are refs[first] to
+ * refs[first + nr - 1].
+ * A leaf (dim == DTREE_LEAF) has the @nr rules refs[first] and on, in
+ * ascending order.
+ */
+struct dtree_node {
+	u8 dim;
+	u8 shift;
+	u32 lo;
+	u32 first;
+	u32 nr;
+};
+
+/*
+ * The trees of a class share their nodes and refs; @roots are the indices
+ * of their root nodes, in no particular order.
+ */
+struct dtree_tree {
+	u32 roots[DTREE_MAX_ROOTS];
+	unsigned int nr_roots;
+	struct dtree_node *nodes;
+	u32 nr_nodes;
+	u32 max_nodes;
+	u32 *refs;
+	u32 nr_refs;
+	u32 max_refs;
+	u32 nr_leaves;
+	unsigned int depth;
+};
+
+struct dtree {
+	struct dtree_tree trees[__SIMPLEPF_CLASS_LAST];
+};
+
+/*
+ * A slice of the search space: 2^bits[d] values from lo[d] in dimension d.
+ */
+struct dtree_box {
+	u32 lo[SIMPLEPF_DIMS];
+	u8 bits[SIMPLEPF_DIMS];
+};
+
+/*
+ * State kept while building the tree of a class.
+ * @ranges holds the ranges of every rule of the chain in every dimension.
+ */
+struct dtree_builder {
+	struct dtree_tree *tree;
+	const struct simplepf_range (*ranges)[SIMPLEPF_DIMS];
+	u32 refs_cap;
+};
+
+static void dtree_destroy(void *priv)
+{
+	struct dtree *dtree = priv;
+	enum simplepf_pkt_class class;
+
+	for (class = 0; class < __SIMPLEPF_CLASS_LAST; class++) {
+		kvfree(dtree->trees[class].nodes);
+		kvfree(dtree->trees[class].refs);
+	}
+	kfree(dtree);
+}
+
+static inline u32 dtree_box_hi(const struct dtree_box *box, unsigned int dim)
+{
+	return box->lo[dim] + (u32)((1ULL << box->bits[dim]) - 1);
+}
+
+static bool dtree_covers(const struct simplepf_range ranges[SIMPLEPF_DIMS],
+		const struct dtree_box *box)
+{
+	unsigned int d;
+
+	for (d = 0; d < SIMPLEPF_DIMS; d++) {
+		if (ranges[d].lo > box->lo[d] ||
+				ranges[d].hi < dtree_box_hi(box, d)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Make room for @nr more elements of @size bytes in a growable array.
+ */
+static int dtree_reserve(void **array, u32 *max, u32 used, u32 nr,
+		size_t size)
+{
+	u32 new_max = *max;
+	void *new;
+
+	if (used + nr <= *max) {
+		return 0;
+	}
+	while (new_max < used + nr) {
+		new_max = max(2 * new_max, 64U);
+	}
+
+	new = kvmalloc_array(new_max, size, GFP_KERNEL);
+	if (!new) {
+		return -ENOMEM;
+	}
+	if (*array) {
+		memcpy(new, *array, used * size);
+		kvfree(*array);
+	}
+	*array = new;
+	*max = new_max;
+
+	return 0;
+}
+
+/*
+ * Append a node with @nr refs. Returns its index, or a negative error code.
+ */
+static int dtree_new_node(struct dtree_builder *b, u8 dim, u32 nr)
+{
+	struct dtree_tree *tree = b->tree;
+	struct dtree_node *node;
+	int err;
+
+	if (tree->nr_refs + nr > b->refs_cap) {
+		return -E2BIG;
+	}
+
+	err = dtree_reserve((void **)&tree->nodes, &tree->max_nodes,
+			tree->nr_nodes, 1, sizeof *tree->nodes);
+	if (err) {
+		return err;
+	}
+	err = dtree_reserve((void **)&tree->refs, &tree->max_refs,
+			tree->nr_refs, nr, sizeof *tree->refs);
+	if (err) {
+		return err;
+	}
+
+	node = &tree->nodes[tree->nr_nodes];
+	node->dim = dim;
+	node->shift = 0;
+	node->lo = 0;
+	node->first = tree->nr_refs;
+	node->nr = nr;
+	tree->nr_refs += nr;
+
+	return tree->nr_nodes++;
+}
+
+static int dtree_new_leaf(struct dtree_builder *b, const u32 *list, u32 n)
+{
+	int id = dtree_new_node(b, DTREE_LEAF, n);
+
+	if (id < 0) {
+		return id;
+	}
+	if (n) {
+		memcpy(&b->tree->refs[b->tree->nodes[id].first], list,
+				n * sizeof *list);
+	}
+	b->tree->nr_leaves++;
+
+	return id;
+}
+
+static int dtree_cmp_range(const void *a, const void *b)
+{
+	const struct simplepf_range *x = a;
+	const struct simplepf_range *y = b;
+
+	if (x->lo != y->lo) {
+		return x->lo < y->lo ? -1 : 1;
+	}
+	return x->hi < y->hi ? -1 : x->hi > y->hi;
+}
+
+/*
+ * Pick the dimension to cut: the one where the rules, clipped to the box,
+ * have the most distinct ranges. Returns SIMPLEPF_DIMS if no cut can tell any
+ * two rules apart. @tmp has room for @n ranges.
+ */
+static unsigned int dtree_pick_dim(const struct dtree_builder *b,
+		const struct dtree_box *box, const u32 *list, u32 n,
+		struct simplepf_range *tmp)
+{
+	unsigned int best_dim = SIMPLEPF_DIMS;
+	u32 best = 1;
+	unsigned int d;
+	u32 i;
+
+	for (d = 0; d < SIMPLEPF_DIMS; d++) {
+		u32 distinct = 1;
+
+		if (!box->bits[d]) {
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			const struct simplepf_range *r = &b->ranges[list[i]][d];
+
+			tmp[i].lo = max(r->lo, box->lo[d]);
+			tmp[i].hi = min(r->hi, dtree_box_hi(box, d));
+		}
+		sort(tmp, n, sizeof *tmp, dtree_cmp_range, NULL);
+		for (i = 1; i < n; i++) {
+			if (dtree_cmp_range(&tmp[i - 1], &tmp[i])) {
+				distinct++;
+			}
+		}
+
+		if (distinct > best) {
+			best = distinct;
+			best_dim = d;
+		}
+	}
+
+	return best_dim;
+}
+
+/*
+ * The number of slices of 2^shift values from @lo that the range overlaps.
+ */
+static inline u32 dtree_span(const struct simplepf_range *r,
+		const struct dtree_box *box, unsigned int dim, unsigned int shift)
+{
+	u32 lo = max(r->lo, box->lo[dim]) - box->lo[dim];
+	u32 hi = min(r->hi, dtree_box_hi(box, dim)) - box->lo[dim];
+
+	return (hi >> shift) - (lo >> shift) + 1;
+}
+
+/*
+ * Pick the number of cuts (as log2) for the dimension: double it while the
+ * rule copies stay within DTREE_SPFAC times the rules of the node.
+ */
+static unsigned int dtree_pick_cuts(const struct dtree_builder *b,
+		const struct dtree_box *box, unsigned int dim,
+		const u32 *list, u32 n)
+{
+	unsigned int cut_bits = 1;
+
+	while (cut_bits < box->bits[dim] &&
+			(1U << (cut_bits + 1)) <= DTREE_MAX_CUTS) {
+		unsigned int shift = box->bits[dim] - (cut_bits + 1);
+		u64 copies = 1U << (cut_bits + 1);
+		u32 i;
+
+		for (i = 0; i < n; i++) {
+			copies += dtree_span(&b->ranges[list[i]][dim], box, dim,
+					shift);
+		}
+		if (copies > (u64)DTREE_SPFAC * n) {
+			break;
+		}
+		cut_bits++;
+	}
+
+	return cut_bits;
+}
+
+/*
+ * Build the subtree for the rules in @list (ascending, all overlapping
+ * @box). Returns the index of its root node, or a negative error code.
+ */
+static int dtree_build_node(struct dtree_builder *b,
+		const struct dtree_box *box, const u32 *list, u32 n,
+		unsigned int depth)
+{
+	struct simplepf_range *tmp;
+	struct dtree_box child;
+	unsigned int dim;
+	unsigned int cut_bits;
+	unsigned int shift;
+	u32 nr_cuts;
+	u32 *starts;
+	u32 *ends;
+	u32 *lists;
+	u32 copies;
+	int prev_id = -1;
+	int id;
+	u32 c;
+	u32 i;
+
+	if (depth > b->tree->depth) {
+		b->tree->depth = depth;
+	}
+
+	if (n <= DTREE_BINTH || depth == DTREE_MAX_DEPTH) {
+		return dtree_new_leaf(b, list, n);
+	}
+
+	tmp = kvmalloc_array(n, sizeof *tmp, GFP_KERNEL);
+	if (!tmp) {
+		return -ENOMEM;
+	}
+	dim = dtree_pick_dim(b, box, list, n, tmp);
+	kvfree(tmp);
+	if (dim == SIMPLEPF_DIMS) {
+		return dtree_new_leaf(b, list, n);
+	}
+
+	cut_bits = dtree_pick_cuts(b, box, dim, list, n);
+	shift = box->bits[dim] - cut_bits;
+	nr_cuts = 1U << cut_bits;
+
+	id = dtree_new_node(b, dim, nr_cuts);
+	if (id < 0) {
+		return id;
+	}
+	b->tree->nodes[id].shift = shift;
+	b->tree->nodes[id].lo = box->lo[dim];
+
+	/*
+	 * Deal the rules out to the slices they overlap in one pass, rather
+	 * than a pass over the rules per slice: count the rules of every
+	 * slice, then fill the lists of all slices back to back. A slice
+	 * takes no more rules after one that covers it; @ends marks it
+	 * closed by setting its count past the end while counting.
+	 */
+	starts = kvcalloc(2 * (size_t)nr_cuts + 1, sizeof *starts, GFP_KERNEL);
+	if (!starts) {
+		return -ENOMEM;
+	}
+	ends = starts + nr_cuts + 1;
+
+	child = *box;
+	child.bits[dim] = shift;
+	for (i = 0; i < n; i++) {
+		const struct simplepf_range *r = b->ranges[list[i]];
+		u32 first = (max(r[dim].lo, box->lo[dim]) - box->lo[dim]) >> shift;
+		u32 last = (min(r[dim].hi, dtree_box_hi(box, dim)) -
+				box->lo[dim]) >> shift;
+
+		for (c = first; c <= last; c++) {
+			if (ends[c]) {
+				continue;
+			}
+			starts[c + 1]++;
+			child.lo[dim] = box->lo[dim] + (c << shift);
+			if (dtree_covers(r, &child)) {
+				ends[c] = 1;
+			}
+		}
+	}
+	for (c = 0; c < nr_cuts; c++) {
+		starts[c + 1] += starts[c];
+		ends[c] = starts[c];
+	}
+	copies = starts[nr_cuts];
+
+	lists = kvmalloc_array(max(copies, 1U), sizeof *lists, GFP_KERNEL);
+	if (!lists) {
+		kvfree(starts);
+		return -ENOMEM;
+	}
+	for (i = 0; i < n; i++) {
+		const struct simplepf_range *r = b->ranges[list[i]];
+		u32 first = (max(r[dim].lo, box->lo[dim]) - box->lo[dim]) >> shift;
+		u32 last = (min(r[dim].hi, dtree_box_hi(box, dim)) -
+				box->lo[dim]) >> shift;
+
+		for (c = first; c <= last; c++) {
+			if (ends[c] < starts[c + 1]) {
+				lists[ends[c]++] = list[i];
+			}
+		}
+	}
+
+	for (c = 0; c < nr_cuts; c++) {
+		const u32 *cur = &lists[starts[c]];
+		u32 nr_cur = starts[c + 1] - starts[c];
+		int child_id;
+
+		if (prev_id >= 0 &&
+				b->tree->nodes[prev_id].dim == DTREE_LEAF &&
+				nr_cur == starts[c] - starts[c - 1] &&
+				!memcmp(cur, &lists[starts[c - 1]],
+					nr_cur * sizeof *cur)) {
+			child_id = prev_id;
+		} else {
+			child.lo[dim] = box->lo[dim] + (c << shift);
+			child_id = dtree_build_node(b, &child, cur, nr_cur,
+					depth + 1);
+			if (child_id < 0) {
+				kvfree(lists);
+				kvfree(starts);
+				return child_id;
+			}
+			prev_id = child_id;
+		}
+		b->tree->refs[b->tree->nodes[id].first + c] = child_id;
+	}
+
+	kvfree(lists);
+	kvfree(starts);
+	return id;
+}
+
+/*
+ * The set of dimensions in which the ranges cover at least half of the
+ * values of the class, as a bit mask. Dimensions without values don't
+ * count.
+ */
+static u32 dtree_large_dims(enum simplepf_pkt_class class,
+		const struct simplepf_range ranges[SIMPLEPF_DIMS])
+{
+	u32 mask = 0;
+	unsigned int d;
+
+	for (d = 0; d < SIMPLEPF_DIMS; d++) {
+		unsigned int bits = simplepf_dim_bits(class, d);
+
+		if (bits && ranges[d].hi - ranges[d].lo >= (1U << (bits - 1)) - 1) {
+			mask |= 1U << d;
+		}
+	}
+
+	return mask;
+}
+
+static int dtree_build_class(struct dtree *dtree,
+		enum simplepf_pkt_class class,
+		const struct chain_rule *rules, unsigned int count)
+{
+	struct dtree_builder b = {
+		.tree = &dtree->trees[class],
+		.refs_cap = max_t(u32, DTREE_MIN_MAX_REFS,
+				min_t(u64, U32_MAX,
+					(u64)DTREE_MAX_REFS_PER_RULE * count)),
+	};
+	struct simplepf_range (*ranges)[SIMPLEPF_DIMS];
+	struct dtree_box root;
+	u32 *masks;
+	u32 *list;
+	u32 *group;
+	u32 n = 0;
+	u32 mask;
+	unsigned int i;
+	int err = 0;
+
+	ranges = kvmalloc_array(max(count, 1U), sizeof *ranges, GFP_KERNEL);
+	masks = kvmalloc_array(max(count, 1U), sizeof *masks, GFP_KERNEL);
+	list = kvmalloc_array(2 * (size_t)max(count, 1U), sizeof *list,
+			GFP_KERNEL);
+	if (!ranges || !masks || !list) {
+		err = -ENOMEM;
+		goto out;
+	}
+	b.ranges = (const struct simplepf_range (*)[SIMPLEPF_DIMS])ranges;
+	group = list + max(count, 1U);
+
+	for (i = 0; i < SIMPLEPF_DIMS; i++) {
+		root.lo[i] = 0;
+		root.bits[i] = simplepf_dim_bits(class, i);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!simplepf_rule_in_class(&rules[i].rule, class)) {
+			continue;
+		}
+		simplepf_rule_ranges(&rules[i].rule, class, ranges[i]);
+		masks[i] = dtree_large_dims(class, ranges[i]);
+		list[n++] = i;
+		if (dtree_covers(ranges[i], &root)) {
+			break;
+		}
+	}
+
+	/* A class without rules has no trees. */
+	for (mask = 0; mask < DTREE_MAX_ROOTS; mask++) {
+		u32 nr = 0;
+		int id;
+
+		for (i = 0; i < n; i++) {
+			if (masks[list[i]] == mask) {
+				group[nr++] = list[i];
+			}
+		}
+		if (!nr) {
+			continue;
+		}
+
+		id = dtree_build_node(&b, &root, group, nr, 0);
+		if (id < 0) {
+			err = id;
+			goto out;
+		}
+		b.tree->roots[b.tree->nr_roots++] = id;
+	}
+
+out:
+	kvfree(list);
+	kvfree(masks);
+	kvfree(ranges);
+	return err;
+}
+
+static void *dtree_build(const struct chain_rule *rules, unsigned int count)
+{
+	struct dtree *dtree;
+	enum simplepf_pkt_class class;
+
+	dtree = kzalloc(sizeof *dtree, GFP_KERNEL);
+	if (!dtree) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	for (class = 0; class < __SIMPLEPF_CLASS_LAST; class++) {
+		int err = dtree_build_class(dtree, class, rules, count);
+		if (err) {
+			dtree_destroy(dtree);
+			return ERR_PTR(err);
+		}
+	}
+
+	return dtree;
+}
+
+static unsigned int dtree_classify(const void *priv,
+		const struct chain_rule *rules, unsigned int count,
+		const struct simplepf_packet *pkt, unsigned int *scanned)
+{
+	const struct dtree *dtree = priv;
+	const struct dtree_tree *tree;
+	u32 val[SIMPLEPF_DIMS];
+	unsigned int best = count;
+	unsigned int r;
+	u32 i;
+
+	*scanned = 0;
+	if (pkt->class >= __SIMPLEPF_CLASS_LAST) {
+		return count;
+	}
+
+	simplepf_packet_values(pkt, val);
+
+	tree = &dtree->trees[pkt->class];
+	for (r = 0; r < tree->nr_roots; r++) {
+		const struct dtree_node *node = &tree->nodes[tree->roots[r]];
+
+		while (node->dim != DTREE_LEAF) {
+			u32 c = (val[node->dim] - node->lo) >> node->shift;
+
+			node = &tree->nodes[tree->refs[node->first + c]];
+		}
+
+		for (i = 0; i < node->nr; i++) {
+			u32 index = tree->refs[node->first + i];
+
+			if (index >= best) {
+				break;
+			}
+			++*scanned;
+			if (simplepf_match_rule(&rules[index].rule, pkt) !=
+					__SIMPLEPF_ACTION_LAST) {
+				best = index;
+				break;
+			}
+		}
+	}
+
+	return best;
+}
+
+static void dtree_show(const void *priv, struct seq_file *m)
+{
+	const struct dtree *dtree = priv;
+	u32 nodes = 0;
+	u32 leaves = 0;
+	unsigned int trees = 0;
+	u64 bytes = sizeof *dtree;
+	unsigned int depth = 0;
+	enum simplepf_pkt_class class;
+
+	for (class = 0; class < __SIMPLEPF_CLASS_LAST; class++) {
+		const struct dtree_tree *tree = &dtree->trees[class];
+
+		trees += tree->nr_roots;
+		nodes += tree->nr_nodes;
+		leaves += tree->nr_leaves;
+		depth = max(depth, tree->depth);
+		bytes += (u64)tree->max_nodes * sizeof *tree->nodes +
+			(u64)tree->max_refs * sizeof *tree->refs;
+	}
+
+	seq_printf(m, " trees %u nodes %u leaves %u depth %u bytes %llu",
+			trees, nodes, leaves, depth, bytes);
+}
+
+const struct simplepf_engine simplepf_dtree_engine = {
+	.name = "dtree",
+	.build = dtree_build,
+	.classify = dtree_classify,
+	.destroy = dtree_destroy,
+	.show = dtree_show,
+};
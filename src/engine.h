@@ -0,0 +1,102 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMPLEPF_ENGINE_H
+#define _SIMPLEPF_ENGINE_H
+
+#include "uapi/simplepf.h"
+#include "match.h"
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+
+struct simplepf_counter;
+struct seq_file;
+
+/*
+ * A rule as stored in a chain.
+ * The counters are allocated once per rule, in an array with those of the
+ * other rules of the same update, and the pointer is carried over to every
+ * new table the rule is copied into, so republishing a chain does not
+ * reset or lose any counts.
+ */
+struct chain_rule {
+	struct simplepf_rule rule;
+	struct simplepf_counter __percpu *counters;
+};
+
+/*
+ * A classification engine finds the first rule of a chain that matches
+ * a packet. The linear engine just tries every rule in order; the others
+ * compile the rules into a lookup structure when a chain is published.
+ * Every engine must return the same rule as the linear one.
+ */
+struct simplepf_engine {
+	const char *name;
+
+	/*
+	 * Compile @count rules into the engine's lookup structure.
+	 * Returns the structure, which is passed as @priv to the other
+	 * operations, or an ERR_PTR() on failure. NULL is a valid result.
+	 * Called in process context; may sleep.
+	 */
+	void *(*build)(const struct chain_rule *rules, unsigned int count);
+
+	/*
+	 * Returns the index of the first of the @count rules that matches
+	 * @pkt, or @count if none does, and sets *@scanned to the number of
+	 * rules it compared @pkt with; an engine that does not compare rules
+	 * one at a time counts the steps that take their place (a hash probe,
+	 * a bitmap word). Only for statistics, so keep it cheap.
+	 * Called under rcu_read_lock() in the packet path; must not sleep.
+	 */
+	unsigned int (*classify)(const void *priv,
+			const struct chain_rule *rules, unsigned int count,
+			const struct simplepf_packet *pkt, unsigned int *scanned);
+
+	/*
+	 * Free the result of build().
+	 */
+	void (*destroy)(void *priv);
+
+	/*
+	 * Optional. Print statistics about the result of build() to @m, as
+	 * " key value" pairs on the current line of /proc/simplepf/stats.
+	 */
+	void (*show)(const void *priv, struct seq_file *m);
+};
+
+extern const struct simplepf_engine simplepf_linear_engine;
+extern const struct simplepf_engine simplepf_tss_engine;
+extern const struct simplepf_engine simplepf_lpm_engine;
+extern const struct simplepf_engine simplepf_ports_engine;
+extern const struct simplepf_engine simplepf_dtree_engine;
+extern const struct simplepf_engine simplepf_bitvec_engine;
+
+/*
+ * The linear engine for the IPv6 chains, the only one they use. It has no
+ * classify(): the hooks call simplepf_linear_classify6() instead, with
+ * the result of its build() as @priv.
+ */
+extern const struct simplepf_engine simplepf_linear6_engine;
+
+unsigned int simplepf_linear_classify6(const void *priv,
+		const struct chain_rule *rules, unsigned int count,
+		const struct simplepf_packet6 *pkt, unsigned int *scanned);
+
+#endif	/* _SIMPLEPF_ENGINE_H */
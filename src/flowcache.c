@@ -0,0 +1,229 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Flow verdict cache.
+ *
+ * Every CPU has its own hash table of buckets, each bucket a single cache
+ * line of FLOW_CACHE_WAYS entries, so a lookup is one hash and one cache
+ * line no matter how many rules there are, and needs no locking.
+ * A new entry takes the place of a stale one in its bucket if there is one,
+ * or else pushes the others down and evicts the last.
+ */
+
+#include "flowcache.h"
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/mm.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/log2.h>
+#include <linux/bottom_half.h>
+#include <linux/cache.h>
+#include <linux/string.h>
+
+/*
+ * Off by default: the cache only pays off when packets come in flows that
+ * repeat. Under a flood of random flows it misses on every packet, and the
+ * hash and the insert come on top of the classification.
+ */
+static unsigned int flow_cache_buckets;
+module_param(flow_cache_buckets, uint, 0444);
+MODULE_PARM_DESC(flow_cache_buckets,
+		"Buckets of the per-CPU flow cache, rounded up to a power of two; 0 disables it (default 0)");
+
+#define FLOW_CACHE_WAYS 2
+
+/*
+ * The part of struct simplepf_flow that is compared; an entry with
+ * generation 0 is empty.
+ */
+#define FLOW_KEY_SIZE offsetof(struct simplepf_flow, hash)
+
+struct flow_entry {
+	struct simplepf_flow key;
+	u32 gen;
+	u32 index;
+};
+
+struct flow_bucket {
+	struct flow_entry ways[FLOW_CACHE_WAYS];
+} ____cacheline_aligned;
+
+struct flow_cache_stats {
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+};
+
+static DEFINE_PER_CPU(struct flow_bucket *, flow_cache);
+static DEFINE_PER_CPU(struct flow_cache_stats, flow_cache_stats);
+static u32 flow_cache_mask;
+static u32 flow_cache_seed __read_mostly;
+
+void simplepf_flow_init(struct simplepf_flow *flow,
+		const struct simplepf_packet *pkt)
+{
+	flow->saddr = pkt->saddr;
+	flow->daddr = pkt->daddr;
+	flow->sport = pkt->sport;
+	flow->dport = pkt->dport;
+	flow->protocol = pkt->protocol;
+	flow->icmp_type = pkt->icmp_type;
+	flow->pad = 0;
+}
+
+static inline struct flow_bucket *flow_bucket(const struct simplepf_flow *flow)
+{
+	return &this_cpu_read(flow_cache)[flow->hash & flow_cache_mask];
+}
+
+static inline bool flow_entry_matches(const struct flow_entry *e,
+		const struct simplepf_flow *flow, u32 gen)
+{
+	return e->gen == gen && !memcmp(&e->key, flow, FLOW_KEY_SIZE);
+}
+
+bool simplepf_flow_cache_lookup(struct simplepf_flow *flow, u32 gen,
+		unsigned int *index)
+{
+	const struct flow_bucket *b;
+	bool hit = false;
+	unsigned int i;
+
+	if (!flow_cache_buckets) {
+		return false;
+	}
+
+	flow->hash = jhash2((const u32 *)flow, FLOW_KEY_SIZE / sizeof(u32),
+			flow_cache_seed);
+
+	/*
+	 * The output hook may run in process context, so keep softirqs
+	 * (and preemption) off this CPU's table while we use it.
+	 */
+	local_bh_disable();
+	b = flow_bucket(flow);
+	for (i = 0; i < FLOW_CACHE_WAYS; i++) {
+		if (flow_entry_matches(&b->ways[i], flow, gen)) {
+			*index = b->ways[i].index;
+			hit = true;
+			break;
+		}
+	}
+	if (hit) {
+		this_cpu_inc(flow_cache_stats.hits);
+	} else {
+		this_cpu_inc(flow_cache_stats.misses);
+	}
+	local_bh_enable();
+
+	return hit;
+}
+
+void simplepf_flow_cache_insert(const struct simplepf_flow *flow, u32 gen,
+		unsigned int index)
+{
+	struct flow_bucket *b;
+	unsigned int i;
+
+	if (!flow_cache_buckets) {
+		return;
+	}
+
+	local_bh_disable();
+	b = flow_bucket(flow);
+	for (i = 0; i < FLOW_CACHE_WAYS; i++) {
+		if (b->ways[i].gen != gen) {
+			break;
+		}
+	}
+	if (i == FLOW_CACHE_WAYS) {
+		this_cpu_inc(flow_cache_stats.evictions);
+		i = FLOW_CACHE_WAYS - 1;
+	}
+	memmove(&b->ways[1], &b->ways[0], i * sizeof b->ways[0]);
+	b->ways[0].key = *flow;
+	b->ways[0].gen = gen;
+	b->ways[0].index = index;
+	local_bh_enable();
+}
+
+void simplepf_flow_cache_show(struct seq_file *m)
+{
+	struct flow_cache_stats sum = { 0 };
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		const struct flow_cache_stats *s =
+			per_cpu_ptr(&flow_cache_stats, cpu);
+
+		sum.hits += s->hits;
+		sum.misses += s->misses;
+		sum.evictions += s->evictions;
+	}
+
+	seq_printf(m, "flowcache buckets %u ways %u hits %llu misses %llu evictions %llu\n",
+			flow_cache_buckets, FLOW_CACHE_WAYS,
+			sum.hits, sum.misses, sum.evictions);
+}
+
+int __init simplepf_flow_cache_init(void)
+{
+	int cpu;
+
+	if (!flow_cache_buckets) {
+		return 0;
+	}
+	if (flow_cache_buckets > (1U << 24)) {
+		flow_cache_buckets = 1U << 24;
+	}
+	flow_cache_buckets = roundup_pow_of_two(flow_cache_buckets);
+	flow_cache_mask = flow_cache_buckets - 1;
+	flow_cache_seed = get_random_u32();
+
+	for_each_possible_cpu(cpu) {
+		struct flow_bucket *table;
+
+		table = kvzalloc_node(flow_cache_buckets * sizeof *table,
+				GFP_KERNEL, cpu_to_node(cpu));
+		if (!table) {
+			printk(KERN_INFO "simplepf: Failed to allocate the flow cache\n");
+			simplepf_flow_cache_cleanup();
+			return -ENOMEM;
+		}
+		per_cpu(flow_cache, cpu) = table;
+	}
+
+	return 0;
+}
+
+void simplepf_flow_cache_cleanup(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kvfree(per_cpu(flow_cache, cpu));
+		per_cpu(flow_cache, cpu) = NULL;
+	}
+}
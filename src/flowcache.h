@@ -0,0 +1,82 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMPLEPF_FLOWCACHE_H
+#define _SIMPLEPF_FLOWCACHE_H
+
+#include "match.h"
+
+#include <linux/types.h>
+#include <linux/seq_file.h>
+
+/*
+ * Per-CPU cache of classification results, keyed on the header fields the
+ * rules match on. An entry is only valid for the table it was computed
+ * from, identified by its generation (see chains.c), so publishing a new
+ * table invalidates every entry of the old one at no cost.
+ */
+
+/*
+ * The header fields of a packet, as a cache key, and its hash.
+ * Fields that don't apply to the packet class are zero.
+ */
+struct simplepf_flow {
+	__be32 saddr;
+	__be32 daddr;
+	__be16 sport;
+	__be16 dport;
+	__u8 protocol;
+	__u8 icmp_type;
+	__u16 pad;
+	u32 hash;
+};
+
+/*
+ * Fill in the key of the packet. It is hashed on lookup, and only if the
+ * cache is enabled.
+ */
+void simplepf_flow_init(struct simplepf_flow *flow,
+		const struct simplepf_packet *pkt);
+
+/*
+ * Hash the flow and look it up in the cache of this CPU.
+ * Returns true and sets @index to the cached result of classifying the
+ * flow with the table of generation @gen, if there is one.
+ * Always returns false if the cache is disabled.
+ */
+bool simplepf_flow_cache_lookup(struct simplepf_flow *flow, u32 gen,
+		unsigned int *index);
+
+/*
+ * Cache @index as the result of classifying the flow with the table of
+ * generation @gen, on this CPU. The flow must have been looked up first.
+ */
+void simplepf_flow_cache_insert(const struct simplepf_flow *flow, u32 gen,
+		unsigned int index);
+
+/*
+ * Print the size and the hit, miss and eviction counters of the cache to
+ * @m, summed across CPUs.
+ */
+void simplepf_flow_cache_show(struct seq_file *m);
+
+int __init simplepf_flow_cache_init(void);
+
+void simplepf_flow_cache_cleanup(void);
+
+#endif	/* _SIMPLEPF_FLOWCACHE_H */
@@ -0,0 +1,116 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * <debugfs>/simplepf/histograms prints the histograms of hist.h summed over
+ * the CPUs, one line per non-empty bucket:
+ *
+ *	<chain> ns|scanned <low>-<high> <count>
+ *
+ * The bounds are inclusive; the high bound of the last bucket is empty.
+ * The histograms only ever grow, so take the difference of two reads to
+ * see an interval.
+ */
+
+#include "uapi/simplepf.h"
+#include "chains.h"
+#include "hist.h"
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+
+DEFINE_PER_CPU(struct simplepf_hist, simplepf_hist);
+
+static void hist_show_one(struct seq_file *m, enum simplepf_chain_id chain_id,
+		const char *what, const u64 *hist, unsigned int nr_buckets)
+{
+	unsigned int b;
+
+	for (b = 0; b < nr_buckets; b++) {
+		u64 low = b ? 1ULL << (b - 1) : 0;
+
+		if (!hist[b]) {
+			continue;
+		}
+		seq_printf(m, "%s %s %llu-", simplepf_chain_name(chain_id),
+				what, low);
+		if (b < nr_buckets - 1) {
+			seq_printf(m, "%llu", (1ULL << b) - 1);
+		}
+		seq_printf(m, " %llu\n", hist[b]);
+	}
+}
+
+static int hist_show(struct seq_file *m, void *v)
+{
+	enum simplepf_chain_id chain_id;
+	struct simplepf_hist *sum;
+	unsigned int b;
+	int cpu;
+
+	/* Too big for the stack. */
+	sum = kzalloc(sizeof *sum, GFP_KERNEL);
+	if (!sum) {
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		const struct simplepf_hist *h = per_cpu_ptr(&simplepf_hist, cpu);
+
+		for (chain_id = 0; chain_id < __SIMPLEPF_CHAIN_LAST; chain_id++) {
+			for (b = 0; b < SIMPLEPF_HIST_NS_BUCKETS; b++) {
+				sum->ns[chain_id][b] += h->ns[chain_id][b];
+			}
+			for (b = 0; b < SIMPLEPF_HIST_SCANNED_BUCKETS; b++) {
+				sum->scanned[chain_id][b] +=
+					h->scanned[chain_id][b];
+			}
+		}
+	}
+
+	for (chain_id = 0; chain_id < __SIMPLEPF_CHAIN_LAST; chain_id++) {
+		hist_show_one(m, chain_id, "ns", sum->ns[chain_id],
+				SIMPLEPF_HIST_NS_BUCKETS);
+		hist_show_one(m, chain_id, "scanned", sum->scanned[chain_id],
+				SIMPLEPF_HIST_SCANNED_BUCKETS);
+	}
+
+	kfree(sum);
+	return 0;
+}
+
+static int hist_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, hist_show, NULL);
+}
+
+static const struct file_operations hist_fops = {
+	.owner = THIS_MODULE,
+	.open = hist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void __init simplepf_hist_init(struct dentry *dir)
+{
+	debugfs_create_file("histograms", 0444, dir, NULL, &hist_fops);
+}
@@ -0,0 +1,73 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMPLEPF_HIST_H
+#define _SIMPLEPF_HIST_H
+
+#include "uapi/simplepf.h"
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/dcache.h>
+
+/*
+ * Per-CPU histograms of the traversals of every chain, over all namespaces:
+ * how long they took and how many rules they compared the packet with.
+ * Bucket 0 counts zeros and bucket b > 0 the values in [2^(b-1), 2^b);
+ * the last bucket also counts everything above.
+ */
+#define SIMPLEPF_HIST_NS_BUCKETS 32
+#define SIMPLEPF_HIST_SCANNED_BUCKETS 24
+
+struct simplepf_hist {
+	u64 ns[__SIMPLEPF_CHAIN_LAST][SIMPLEPF_HIST_NS_BUCKETS];
+	u64 scanned[__SIMPLEPF_CHAIN_LAST][SIMPLEPF_HIST_SCANNED_BUCKETS];
+};
+
+DECLARE_PER_CPU(struct simplepf_hist, simplepf_hist);
+
+static inline unsigned int simplepf_hist_bucket(u64 value,
+		unsigned int nr_buckets)
+{
+	unsigned int b = value ? ilog2(value) + 1 : 0;
+
+	return min(b, nr_buckets - 1);
+}
+
+/*
+ * Count a traversal of the chain. Two per-CPU increments, safe in any
+ * context.
+ */
+static inline void simplepf_hist_record(enum simplepf_chain_id chain_id,
+		u64 ns, unsigned int scanned)
+{
+	this_cpu_inc(simplepf_hist.ns[chain_id]
+			[simplepf_hist_bucket(ns, SIMPLEPF_HIST_NS_BUCKETS)]);
+	this_cpu_inc(simplepf_hist.scanned[chain_id]
+			[simplepf_hist_bucket(scanned,
+				SIMPLEPF_HIST_SCANNED_BUCKETS)]);
+}
+
+/*
+ * Create the histograms file in the debugfs directory @dir.
+ */
+void __init simplepf_hist_init(struct dentry *dir);
+
+#endif	/* _SIMPLEPF_HIST_H */
@@ -0,0 +1,243 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Netdev ingress hooks of the ingress chain.
+ *
+ * Netdev hooks belong to a device, so they have to follow the devices:
+ * a netdevice notifier attaches the chain to a listed device when it is
+ * registered (register_netdevice_notifier() replays the devices that
+ * already exist) and detaches it when the device is unregistered, so
+ * a hooked device can still be deleted at any time. A renamed device is
+ * detached and attached again if its new name is listed.
+ * The notifier runs under RTNL, which protects the list of hooks.
+ *
+ * Devices are matched by name in every network namespace, and the hook of
+ * a device traverses the ingress chain of the device's namespace. A device
+ * moved to another namespace is unregistered from the old one and
+ * registered in the new one, so its hook follows it.
+ */
+
+#include "uapi/simplepf.h"
+#include "chains.h"
+#include "ingress.h"
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/netdevice.h>
+#include <linux/rtnetlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter_netdev.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <net/net_namespace.h>
+
+static char *ingress_devices;
+module_param(ingress_devices, charp, 0444);
+MODULE_PARM_DESC(ingress_devices,
+		"Comma separated names of the devices to attach the ingress chain to");
+
+static int ingress_priority;
+
+struct ingress_hook {
+	struct list_head list;
+	struct nf_hook_ops ops;
+};
+
+static LIST_HEAD(ingress_hooks);
+
+/*
+ * Nothing has looked at the packet yet at this point, so make sure it is
+ * IPv4 and its header is in the linear area before the chain reads it.
+ * Anything else is accepted.
+ */
+static unsigned int hook_ingress(void *priv,
+		struct sk_buff *skb,
+		const struct nf_hook_state *state)
+{
+	const struct iphdr *ip_header;
+	enum simplepf_action action;
+
+	if (!skb || skb->protocol != htons(ETH_P_IP) ||
+			!pskb_may_pull(skb, sizeof(struct iphdr))) {
+		return NF_ACCEPT;
+	}
+
+	ip_header = ip_hdr(skb);
+	if (ip_header->version != 4 || ip_header->ihl < 5) {
+		return NF_ACCEPT;
+	}
+
+	action = simplepf_traverse_chain(SIMPLEPF_CHAIN_INGRESS, skb, state);
+
+	return simplepf_to_nf(action);
+}
+
+/*
+ * Whether the name is in the ingress_devices list.
+ */
+static bool ingress_listed(const char *name)
+{
+	const char *p = ingress_devices;
+	size_t len = strlen(name);
+
+	while (*p) {
+		size_t n = strcspn(p, ",");
+
+		if (n == len && !strncmp(p, name, len)) {
+			return true;
+		}
+		p += n;
+		if (*p) {
+			p++;
+		}
+	}
+
+	return false;
+}
+
+static void ingress_attach(struct net_device *dev)
+{
+	struct ingress_hook *hook;
+	int err;
+
+	hook = kzalloc(sizeof *hook, GFP_KERNEL);
+	if (!hook) {
+		printk(KERN_INFO "simplepf: Failed to attach the ingress chain to %s\n",
+				dev->name);
+		return;
+	}
+
+	hook->ops.hook = hook_ingress;
+	hook->ops.pf = NFPROTO_NETDEV;
+	hook->ops.hooknum = NF_NETDEV_INGRESS;
+	hook->ops.priority = ingress_priority;
+	hook->ops.dev = dev;
+
+	err = nf_register_net_hook(dev_net(dev), &hook->ops);
+	if (err) {
+		printk(KERN_INFO "simplepf: Failed to attach the ingress chain to %s (%d)\n",
+				dev->name, err);
+		kfree(hook);
+		return;
+	}
+
+	list_add(&hook->list, &ingress_hooks);
+	printk(KERN_INFO "simplepf: Attached the ingress chain to %s\n",
+			dev->name);
+}
+
+static void ingress_free(struct ingress_hook *hook)
+{
+	nf_unregister_net_hook(dev_net(hook->ops.dev), &hook->ops);
+	list_del(&hook->list);
+	kfree(hook);
+}
+
+static void ingress_detach(struct net_device *dev)
+{
+	struct ingress_hook *hook;
+
+	list_for_each_entry(hook, &ingress_hooks, list) {
+		if (hook->ops.dev == dev) {
+			ingress_free(hook);
+			return;
+		}
+	}
+}
+
+static int ingress_netdev_event(struct notifier_block *nb,
+		unsigned long event, void *ptr)
+{
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+
+	switch (event) {
+	case NETDEV_REGISTER:
+		if (ingress_listed(dev->name)) {
+			ingress_attach(dev);
+		}
+	break;
+
+	case NETDEV_UNREGISTER:
+		ingress_detach(dev);
+	break;
+
+	case NETDEV_CHANGENAME:
+		ingress_detach(dev);
+		if (ingress_listed(dev->name)) {
+			ingress_attach(dev);
+		}
+	break;
+
+	default:
+	break;
+	}
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block ingress_notifier = {
+	.notifier_call = ingress_netdev_event,
+};
+
+int __init simplepf_ingress_init(int priority)
+{
+	int err;
+
+	if (!ingress_devices || !*ingress_devices) {
+		return 0;
+	}
+
+	ingress_priority = priority;
+	err = register_netdevice_notifier(&ingress_notifier);
+	if (err) {
+		printk(KERN_INFO "simplepf: Failed to register the netdevice notifier\n");
+	}
+
+	return err;
+}
+
+void simplepf_ingress_net_exit(struct net *net)
+{
+	struct ingress_hook *hook, *tmp;
+
+	rtnl_lock();
+	list_for_each_entry_safe(hook, tmp, &ingress_hooks, list) {
+		if (net_eq(dev_net(hook->ops.dev), net)) {
+			ingress_free(hook);
+		}
+	}
+	rtnl_unlock();
+}
+
+void simplepf_ingress_cleanup(void)
+{
+	if (!ingress_devices || !*ingress_devices) {
+		return;
+	}
+
+	/*
+	 * Unregistering the notifier replays NETDEV_UNREGISTER for every
+	 * device, which detaches all the hooks.
+	 */
+	unregister_netdevice_notifier(&ingress_notifier);
+}
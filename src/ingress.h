@@ -0,0 +1,44 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMPLEPF_INGRESS_H
+#define _SIMPLEPF_INGRESS_H
+
+#include <net/net_namespace.h>
+
+/*
+ * Attach the ingress chain to the devices of the ingress_devices module
+ * parameter, now and whenever one of them is registered, with hooks of the
+ * given priority.
+ * Returns 0 on success, or a negative error code.
+ */
+int __init simplepf_ingress_init(int priority);
+
+/*
+ * Detach the ingress chain from the devices of a namespace that is going
+ * away, before its devices are unregistered.
+ */
+void simplepf_ingress_net_exit(struct net *net);
+
+/*
+ * Detach the ingress chain from all devices. Does nothing if
+ * simplepf_ingress_init() attached nothing.
+ */
+void simplepf_ingress_cleanup(void);
+
+#endif	/* _SIMPLEPF_INGRESS_H */
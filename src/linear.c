@@ -0,0 +1,282 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Linear classifier, the reference engine: try every rule in order.
+ *
+ * Rather than testing every filter_* flag of every rule, the rules of the
+ * IPv4 chains are packed when the chain is compiled into a key and a mask
+ * over the fields of the packet (see struct simplepf_packed_rule). The
+ * packet is laid out the same way once, and every rule then costs a masked
+ * compare and a single branch, whatever fields it filters on. The packed
+ * rules take 32 bytes each, so a scan reads two rules per cache line
+ * instead of one struct chain_rule and a bit.
+ *
+ * The IPv6 chains are classified by this engine only, in its own instance
+ * (simplepf_linear6_engine, see simplepf_linear_classify6()). Their rules
+ * are cut into runs of consecutive rules that filter on the same fields,
+ * and every run is scanned with a matcher specialized for its fields,
+ * which only compares those (see simplepf_match_fields6()). The fields
+ * that don't apply to the class of the packet are left out too, so a run
+ * costs one dispatch per packet and every rule in it a single branch.
+ */
+
+#include "engine.h"
+#include "match.h"
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/overflow.h>
+#include <linux/seq_file.h>
+
+struct linear_run {
+	/* One past the last rule of the run. */
+	u32 end;
+	/* simplepf_rule_fields() of the rules of the run. */
+	u32 fields;
+};
+
+struct linear6 {
+	unsigned int nr_runs;
+	struct linear_run runs[];
+};
+
+/*
+ * The rules of an IPv4 chain, packed, in order.
+ */
+static void *linear_build(const struct chain_rule *rules, unsigned int count)
+{
+	struct simplepf_packed_rule *packed;
+	unsigned int i;
+
+	if (!count) {
+		return NULL;
+	}
+
+	packed = kvmalloc_array(count, sizeof *packed, GFP_KERNEL);
+	if (!packed) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	for (i = 0; i < count; i++) {
+		simplepf_pack_rule(&rules[i].rule, &packed[i]);
+	}
+
+	return packed;
+}
+
+/*
+ * The runs of the rules of an IPv6 chain.
+ */
+static void *linear6_build(const struct chain_rule *rules, unsigned int count)
+{
+	struct linear6 *linear;
+	unsigned int nr_runs = 0;
+	unsigned int i;
+
+	if (!count) {
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!i || simplepf_rule_fields(&rules[i].rule) !=
+				simplepf_rule_fields(&rules[i - 1].rule)) {
+			nr_runs++;
+		}
+	}
+
+	linear = kvmalloc(struct_size(linear, runs, nr_runs), GFP_KERNEL);
+	if (!linear) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	linear->nr_runs = 0;
+	for (i = 0; i < count; i++) {
+		unsigned int fields = simplepf_rule_fields(&rules[i].rule);
+
+		if (!i || fields != linear->runs[linear->nr_runs - 1].fields) {
+			linear->runs[linear->nr_runs].fields = fields;
+			linear->nr_runs++;
+		}
+		linear->runs[linear->nr_runs - 1].end = i + 1;
+	}
+
+	return linear;
+}
+
+static void linear_destroy(void *priv)
+{
+	kvfree(priv);
+}
+
+/*
+ * Scan the rules first to end - 1 with the matcher for @fields.
+ * Returns the index of the first that matches, or @end.
+ */
+static __always_inline unsigned int linear_scan_fields6(
+		const struct chain_rule *rules, unsigned int first,
+		unsigned int end, const struct simplepf_packet6 *pkt,
+		unsigned int fields)
+{
+	unsigned int i;
+
+	for (i = first; i < end; i++) {
+		if (simplepf_match_fields6(&rules[i].rule, pkt, fields)) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+#define LINEAR_CASE(scan, fields) \
+	case (fields): \
+		return scan(rules, first, end, pkt, (fields));
+
+/* @extra with every combination of the fields all classes have. */
+#define LINEAR_CASES(scan, extra) \
+	LINEAR_CASE(scan, extra) \
+	LINEAR_CASE(scan, (extra) | SIMPLEPF_FIELD_SADDR) \
+	LINEAR_CASE(scan, (extra) | SIMPLEPF_FIELD_DADDR) \
+	LINEAR_CASE(scan, (extra) | SIMPLEPF_FIELD_SADDR | \
+			SIMPLEPF_FIELD_DADDR) \
+	LINEAR_CASE(scan, (extra) | SIMPLEPF_FIELD_PROTO) \
+	LINEAR_CASE(scan, (extra) | SIMPLEPF_FIELD_SADDR | \
+			SIMPLEPF_FIELD_PROTO) \
+	LINEAR_CASE(scan, (extra) | SIMPLEPF_FIELD_DADDR | \
+			SIMPLEPF_FIELD_PROTO) \
+	LINEAR_CASE(scan, (extra) | SIMPLEPF_FIELDS_COMMON)
+
+/* Every combination of fields a class can have. */
+#define LINEAR_ALL_CASES(scan) \
+	LINEAR_CASES(scan, 0) \
+	LINEAR_CASES(scan, SIMPLEPF_FIELD_ICMP_TYPE) \
+	LINEAR_CASES(scan, SIMPLEPF_FIELD_SPORT) \
+	LINEAR_CASES(scan, SIMPLEPF_FIELD_DPORT) \
+	LINEAR_CASES(scan, SIMPLEPF_FIELD_SPORT | SIMPLEPF_FIELD_DPORT)
+
+/*
+ * Scan the rules first to end - 1, which filter on @fields among the ones
+ * that apply to the packet, with the matcher specialized for them.
+ * Returns the index of the first that matches, or @end.
+ */
+static unsigned int linear_scan6(const struct chain_rule *rules,
+		unsigned int first, unsigned int end,
+		const struct simplepf_packet6 *pkt, unsigned int fields)
+{
+	unsigned int i;
+
+	switch (fields) {
+	LINEAR_ALL_CASES(linear_scan_fields6)
+
+	/*
+	 * No class has both the ICMP type and the ports, so this is not
+	 * possible; fall back to the reference matcher anyway.
+	 */
+	default:
+	break;
+	}
+
+	for (i = first; i < end; i++) {
+		if (simplepf_match_rule6(&rules[i].rule, pkt) !=
+				__SIMPLEPF_ACTION_LAST) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+static unsigned int linear_classify(const void *priv,
+		const struct chain_rule *rules, unsigned int count,
+		const struct simplepf_packet *pkt, unsigned int *scanned)
+{
+	const struct simplepf_packed_rule *packed = priv;
+	struct simplepf_packed_key key;
+	unsigned int i;
+
+	/* Packets of an unsupported protocol match no rule. */
+	if (!packed || pkt->class >= __SIMPLEPF_CLASS_LAST) {
+		*scanned = 0;
+		return count;
+	}
+
+	simplepf_packet_key(pkt, &key);
+	for (i = 0; i < count; i++) {
+		if (simplepf_match_packed(&packed[i], &key)) {
+			*scanned = i + 1;
+			return i;
+		}
+	}
+
+	*scanned = count;
+	return count;
+}
+
+unsigned int simplepf_linear_classify6(const void *priv,
+		const struct chain_rule *rules, unsigned int count,
+		const struct simplepf_packet6 *pkt, unsigned int *scanned)
+{
+	const struct linear6 *linear = priv;
+	unsigned int class_fields = simplepf_class_fields(pkt->class);
+	unsigned int first = 0;
+	unsigned int r;
+
+	if (!linear || !class_fields) {
+		*scanned = 0;
+		return count;
+	}
+
+	for (r = 0; r < linear->nr_runs; r++) {
+		const struct linear_run *run = &linear->runs[r];
+		unsigned int i;
+
+		i = linear_scan6(rules, first, run->end, pkt,
+				run->fields & class_fields);
+		if (i < run->end) {
+			*scanned = i + 1;
+			return i;
+		}
+		first = run->end;
+	}
+
+	*scanned = count;
+	return count;
+}
+
+static void linear6_show(const void *priv, struct seq_file *m)
+{
+	const struct linear6 *linear = priv;
+
+	seq_printf(m, " runs %u", linear->nr_runs);
+}
+
+const struct simplepf_engine simplepf_linear_engine = {
+	.name = "linear",
+	.build = linear_build,
+	.classify = linear_classify,
+	.destroy = linear_destroy,
+};
+
+const struct simplepf_engine simplepf_linear6_engine = {
+	.name = "linear",
+	.build = linear6_build,
+	.destroy = linear_destroy,
+	.show = linear6_show,
+};
@@ -0,0 +1,211 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Packet log, see struct simplepf_log_record.
+ *
+ * The buffers are a relay channel in no-overwrite mode: a record is
+ * reserved in the sub-buffer of the current CPU with interrupts off, which
+ * is all the synchronization the writers need, and when all the sub-buffers
+ * of the CPU are full until userspace consumes them, relay_reserve() fails
+ * and the record is dropped. So logging costs a packet a few stores, however
+ * fast they come and whether or not anyone reads them.
+ */
+
+#include "log.h"
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/relay.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/irqflags.h>
+#include <linux/timekeeping.h>
+#include <linux/err.h>
+#include <linux/stringify.h>
+#include <linux/string.h>
+
+/*
+ * Userspace consumes the buffer a sub-buffer at a time, so a few of them let
+ * it read one while the packet path fills the next.
+ */
+#define LOG_SUBBUFS 8
+
+static unsigned int log_buffer_kb = 256;
+module_param(log_buffer_kb, uint, 0444);
+MODULE_PARM_DESC(log_buffer_kb,
+		"Size of the per-CPU packet log buffers in KiB, in " __stringify(LOG_SUBBUFS) " sub-buffers; 0 disables logging (default 256)");
+
+struct log_stats {
+	u64 records;
+	u64 dropped;
+};
+
+static struct rchan *log_chan;
+static DEFINE_PER_CPU(struct log_stats, log_stats);
+
+/*
+ * Called by relay when a record does not fit in the current sub-buffer.
+ * Returns whether it may switch to the next, i.e. whether that one was
+ * consumed.
+ */
+static int log_subbuf_start(struct rchan_buf *buf, void *subbuf,
+		void *prev_subbuf, size_t prev_padding)
+{
+	return !relay_buf_full(buf);
+}
+
+static struct dentry *log_create_buf_file(const char *filename,
+		struct dentry *parent, umode_t mode, struct rchan_buf *buf,
+		int *is_global)
+{
+	struct dentry *dentry;
+
+	dentry = debugfs_create_file(filename, 0400, parent, buf,
+			&relay_file_operations);
+
+	/* relay takes NULL for failure. */
+	return IS_ERR(dentry) ? NULL : dentry;
+}
+
+static int log_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static struct rchan_callbacks log_callbacks = {
+	.subbuf_start = log_subbuf_start,
+	.create_buf_file = log_create_buf_file,
+	.remove_buf_file = log_remove_buf_file,
+};
+
+/*
+ * Copy a record to the buffer of this CPU, or count it as dropped if the
+ * buffer is full.
+ */
+static void log_write(const struct simplepf_log_record *rec)
+{
+	void *slot;
+	unsigned long flags;
+
+	/*
+	 * The output hook runs in process context, so keep the softirqs of
+	 * this CPU out of its buffer; relay_write() does the same.
+	 */
+	local_irq_save(flags);
+	slot = relay_reserve(log_chan, sizeof *rec);
+	if (slot) {
+		memcpy(slot, rec, sizeof *rec);
+		__this_cpu_inc(log_stats.records);
+	} else {
+		__this_cpu_inc(log_stats.dropped);
+	}
+	local_irq_restore(flags);
+}
+
+void simplepf_log_packet(enum simplepf_chain_id chain_id, u32 rule,
+		enum simplepf_action action, int ifindex,
+		const struct simplepf_packet *pkt)
+{
+	struct simplepf_log_record rec = {
+		.timestamp = ktime_get_ns(),
+		.saddr = pkt->saddr,
+		.daddr = pkt->daddr,
+		.sport = pkt->sport,
+		.dport = pkt->dport,
+		.protocol = pkt->protocol,
+		.icmp_type = pkt->icmp_type,
+		.chain_id = chain_id,
+		.action = action,
+		.ifindex = ifindex,
+		.rule = rule,
+	};
+
+	if (log_chan) {
+		log_write(&rec);
+	}
+}
+
+void simplepf_log_packet6(enum simplepf_chain_id chain_id, u32 rule,
+		enum simplepf_action action, int ifindex,
+		const struct simplepf_packet6 *pkt)
+{
+	struct simplepf_log_record rec = {
+		.timestamp = ktime_get_ns(),
+		.sport = pkt->sport,
+		.dport = pkt->dport,
+		.protocol = pkt->protocol,
+		.icmp_type = pkt->icmp_type,
+		.chain_id = chain_id,
+		.action = action,
+		.ifindex = ifindex,
+		.rule = rule,
+	};
+
+	if (log_chan) {
+		memcpy(rec.saddr6, pkt->saddr, sizeof rec.saddr6);
+		memcpy(rec.daddr6, pkt->daddr, sizeof rec.daddr6);
+		log_write(&rec);
+	}
+}
+
+void simplepf_log_show(struct seq_file *m)
+{
+	struct log_stats sum = { 0 };
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		const struct log_stats *s = per_cpu_ptr(&log_stats, cpu);
+
+		sum.records += s->records;
+		sum.dropped += s->dropped;
+	}
+
+	seq_printf(m, "log records %llu dropped %llu\n",
+			sum.records, sum.dropped);
+}
+
+void __init simplepf_log_init(struct dentry *dir)
+{
+	size_t subbuf_size = (size_t)log_buffer_kb * 1024 / LOG_SUBBUFS;
+
+	if (!log_buffer_kb || IS_ERR_OR_NULL(dir)) {
+		return;
+	}
+
+	/* A whole number of records, so there is no padding to skip. */
+	subbuf_size = max(rounddown(subbuf_size,
+				sizeof(struct simplepf_log_record)),
+			sizeof(struct simplepf_log_record));
+
+	log_chan = relay_open("log", dir, subbuf_size, LOG_SUBBUFS,
+			&log_callbacks, NULL);
+	if (!log_chan) {
+		printk(KERN_INFO "simplepf: Failed to create the packet log, packets will not be logged\n");
+	}
+}
+
+void simplepf_log_cleanup(void)
+{
+	if (log_chan) {
+		relay_close(log_chan);
+		log_chan = NULL;
+	}
+}
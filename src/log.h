@@ -0,0 +1,59 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMPLEPF_LOG_H
+#define _SIMPLEPF_LOG_H
+
+#include "uapi/simplepf.h"
+#include "match.h"
+
+#include <linux/types.h>
+#include <linux/dcache.h>
+#include <linux/seq_file.h>
+
+/*
+ * Create the log buffers, as files in the debugfs directory @dir, see
+ * struct simplepf_log_record. If that fails, or the log_buffer_kb module
+ * parameter is 0, nothing is logged; the rest of the module works the same.
+ */
+void __init simplepf_log_init(struct dentry *dir);
+
+/*
+ * Free the log buffers. The packet path must not use them anymore.
+ */
+void simplepf_log_cleanup(void);
+
+/*
+ * Log a packet that matched rule @rule of the chain. Safe in any context
+ * the hooks run in; never blocks.
+ */
+void simplepf_log_packet(enum simplepf_chain_id chain_id, u32 rule,
+		enum simplepf_action action, int ifindex,
+		const struct simplepf_packet *pkt);
+
+/* The same for a packet of an IPv6 chain. */
+void simplepf_log_packet6(enum simplepf_chain_id chain_id, u32 rule,
+		enum simplepf_action action, int ifindex,
+		const struct simplepf_packet6 *pkt);
+
+/*
+ * Print the line of the log to /proc/simplepf/stats.
+ */
+void simplepf_log_show(struct seq_file *m);
+
+#endif	/* _SIMPLEPF_LOG_H */
@@ -0,0 +1,297 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Prefix trie classifier.
+ *
+ * Rules are indexed by the prefix of one of the addresses (source or
+ * destination, whichever more rules filter on) in a multibit trie with
+ * a stride of 8 bits, so a lookup visits at most 4 nodes.
+ * A prefix whose length is not a multiple of the stride is expanded to all
+ * the slots it covers in its node (controlled prefix expansion).
+ *
+ * Since first-match needs every matching rule and not only the longest
+ * prefix, a lookup looks at every slot on the path. A rule that filters on
+ * nothing but the address matches every packet that reaches a slot its
+ * prefix covers, so a slot only keeps the first of those. The others are
+ * kept in a list per slot, in rule order, without the ones after the first
+ * rule of that kind of the slot or of the slots above it; they can never
+ * be the first match. The lists are checked with the reference matcher,
+ * each only until it can't beat the best match found so far, so the rest
+ * of the fields of a rule behave exactly as in the linear engine.
+ *
+ * The rules that don't filter on the address of the trie are compiled with
+ * the tss engine.
+ */
+
+#include "engine.h"
+#include "match.h"
+#include "rulelist.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/string.h>
+#include <asm/byteorder.h>
+
+#define LPM_STRIDE 8
+#define LPM_SLOTS (1 << LPM_STRIDE)
+#define LPM_LEVELS (32 / LPM_STRIDE)
+
+#define LPM_NONE U32_MAX
+
+struct lpm_node;
+
+struct lpm_slot {
+	struct lpm_node *child;
+	/* The first rule on the address alone that covers the slot. */
+	u32 first;
+	/* The other rules that cover it, before @first. */
+	struct rule_list rules;
+};
+
+struct lpm_node {
+	struct lpm_slot slots[LPM_SLOTS];
+};
+
+struct lpm {
+	/* Whether the trie is on the destination address. */
+	bool daddr;
+	struct lpm_node *root;
+	/* Rules that don't filter on the address of the trie. */
+	struct rule_subset wildcard;
+};
+
+static struct lpm_node *lpm_alloc_node(void)
+{
+	struct lpm_node *node = kvzalloc(sizeof *node, GFP_KERNEL);
+	unsigned int i;
+
+	if (!node) {
+		return NULL;
+	}
+	for (i = 0; i < LPM_SLOTS; i++) {
+		node->slots[i].first = LPM_NONE;
+	}
+	return node;
+}
+
+static void lpm_free_node(struct lpm_node *node)
+{
+	unsigned int i;
+
+	for (i = 0; i < LPM_SLOTS; i++) {
+		if (node->slots[i].child) {
+			lpm_free_node(node->slots[i].child);
+		}
+		rule_list_free(&node->slots[i].rules);
+	}
+	kvfree(node);
+}
+
+static void lpm_destroy(void *priv)
+{
+	struct lpm *lpm = priv;
+
+	if (lpm->root) {
+		lpm_free_node(lpm->root);
+	}
+	rule_subset_free(&lpm->wildcard);
+	kfree(lpm);
+}
+
+static inline unsigned int lpm_chunk(u32 addr, unsigned int level)
+{
+	return (addr >> (32 - LPM_STRIDE * (level + 1))) & (LPM_SLOTS - 1);
+}
+
+/*
+ * Insert a rule with the prefix @addr/@prefixlen (host byte order,
+ * prefixlen in 1-32). @alone tells that the rule filters on nothing else.
+ * Rules must be inserted in rule order.
+ */
+static int lpm_insert(struct lpm *lpm, u32 addr, unsigned int prefixlen,
+		bool alone, u32 index)
+{
+	struct lpm_node *node = lpm->root;
+	unsigned int level = (prefixlen - 1) / LPM_STRIDE;
+	unsigned int bits = prefixlen - level * LPM_STRIDE;
+	unsigned int first;
+	unsigned int i;
+
+	for (i = 0; i < level; i++) {
+		struct lpm_slot *slot = &node->slots[lpm_chunk(addr, i)];
+
+		if (slot->first != LPM_NONE) {
+			/* Shadowed by a shorter prefix. */
+			return 0;
+		}
+		if (!slot->child) {
+			slot->child = lpm_alloc_node();
+			if (!slot->child) {
+				return -ENOMEM;
+			}
+		}
+		node = slot->child;
+	}
+
+	/*
+	 * The prefix covers 2^(LPM_STRIDE - bits) consecutive slots of the
+	 * node at its level.
+	 */
+	first = lpm_chunk(addr, level) & ~((1U << (LPM_STRIDE - bits)) - 1);
+	for (i = first; i < first + (1U << (LPM_STRIDE - bits)); i++) {
+		struct lpm_slot *slot = &node->slots[i];
+		int err;
+
+		if (slot->first != LPM_NONE) {
+			continue;
+		}
+		if (alone) {
+			slot->first = index;
+			continue;
+		}
+		err = rule_list_append(&slot->rules, index);
+		if (err) {
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Whether the rule filters on a single address; then it matches every
+ * packet with an address in its prefix.
+ */
+static bool lpm_address_only(const struct simplepf_rule *rule)
+{
+	return rule->filter_saddr + rule->filter_daddr == 1 &&
+		!rule->filter_proto && !rule->filter_icmp_type &&
+		!rule->filter_sport && !rule->filter_dport;
+}
+
+static void *lpm_build(const struct chain_rule *rules, unsigned int count)
+{
+	struct lpm *lpm;
+	unsigned int nr_saddr = 0;
+	unsigned int nr_daddr = 0;
+	unsigned int i;
+	int err = 0;
+
+	lpm = kzalloc(sizeof *lpm, GFP_KERNEL);
+	if (!lpm) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	lpm->root = lpm_alloc_node();
+	if (!lpm->root) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	/*
+	 * Rules that don't filter on the address of the trie are tried for
+	 * every packet, so index the address that fewer rules leave out.
+	 */
+	for (i = 0; i < count; i++) {
+		nr_saddr += rules[i].rule.filter_saddr;
+		nr_daddr += rules[i].rule.filter_daddr;
+	}
+	lpm->daddr = nr_daddr > nr_saddr;
+
+	for (i = 0; i < count; i++) {
+		const struct simplepf_rule *rule = &rules[i].rule;
+
+		/*
+		 * Leave out the rules that can't match any packet.
+		 */
+		if (!simplepf_rule_in_class(rule, SIMPLEPF_CLASS_ICMP) &&
+				!simplepf_rule_in_class(rule, SIMPLEPF_CLASS_L4)) {
+			continue;
+		}
+
+		if (lpm->daddr && rule->filter_daddr) {
+			err = lpm_insert(lpm, ntohl(rule->ip_daddr),
+					rule->ip_daddr_prefixlen,
+					lpm_address_only(rule), i);
+		} else if (!lpm->daddr && rule->filter_saddr) {
+			err = lpm_insert(lpm, ntohl(rule->ip_saddr),
+					rule->ip_saddr_prefixlen,
+					lpm_address_only(rule), i);
+		} else {
+			err = rule_list_append(&lpm->wildcard.index, i);
+		}
+		if (err) {
+			goto fail;
+		}
+	}
+
+	err = rule_subset_build(&lpm->wildcard, &simplepf_tss_engine, rules);
+	if (err) {
+		goto fail;
+	}
+
+	return lpm;
+
+fail:
+	lpm_destroy(lpm);
+	return ERR_PTR(err);
+}
+
+static unsigned int lpm_classify(const void *priv,
+		const struct chain_rule *rules, unsigned int count,
+		const struct simplepf_packet *pkt, unsigned int *scanned)
+{
+	const struct lpm *lpm = priv;
+	const struct lpm_node *node = lpm->root;
+	u32 addr = ntohl(lpm->daddr ? pkt->daddr : pkt->saddr);
+	const struct lpm_slot *path[LPM_LEVELS];
+	u32 best = count;
+	unsigned int depth;
+	unsigned int i;
+
+	*scanned = 0;
+	if (pkt->class >= __SIMPLEPF_CLASS_LAST) {
+		return count;
+	}
+
+	/*
+	 * Take the first rules on the address alone before the lists, so
+	 * the lists are only scanned up to them.
+	 */
+	for (depth = 0; node && depth < LPM_LEVELS; depth++) {
+		path[depth] = &node->slots[lpm_chunk(addr, depth)];
+		best = min(best, path[depth]->first);
+		node = path[depth]->child;
+	}
+	for (i = 0; i < depth; i++) {
+		best = rule_list_match(&path[i]->rules, rules, pkt, best,
+				scanned);
+	}
+
+	return rule_subset_match(&lpm->wildcard, pkt, best, scanned);
+}
+
+const struct simplepf_engine simplepf_lpm_engine = {
+	.name = "lpm",
+	.build = lpm_build,
+	.classify = lpm_classify,
+	.destroy = lpm_destroy,
+};
@@ -19,84 +19,185 @@
 #include "uapi/simplepf.h"
 #include "chains.h"
 #include "proc.h"
+#include "netlink.h"
+#include "flowcache.h"
+#include "ingress.h"
+#include "selftest.h"
+#include "hist.h"
+#include "log.h"
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6.h>
+#include <linux/netdevice.h>
 #include <linux/skbuff.h>
 #include <linux/socket.h>
+#include <linux/debugfs.h>
+#include <net/net_namespace.h>
+
+static int hook_priority = NF_IP_PRI_FIRST;
+module_param(hook_priority, int, 0444);
+MODULE_PARM_DESC(hook_priority,
+		"Priority of the hooks of all chains (default NF_IP_PRI_FIRST)");
 
 /*
- * Following hooks check the validity of skb and if valid, passes them to
- * simplepf_traverse_chain. They translate the simplepf action they get from the
- * chain traversal to a NF action.
- * If skb is not valid, chain traversal is not invoked and a NF_ACCEPT is returned
- * immediately.
+ * Following hook checks the validity of skb and if valid, passes it to
+ * simplepf_traverse_chain with the chain of the hook, given in @priv.
+ * It translates the simplepf action it gets from the chain traversal to a
+ * NF action.
+ * If skb is not valid, chain traversal is not invoked and a NF_ACCEPT is
+ * returned immediately.
  */
 
-static unsigned int hook_local_in(void *priv,
+static unsigned int hook_chain(void *priv,
 		struct sk_buff *skb,
 		const struct nf_hook_state *state)
 {
+	enum simplepf_chain_id chain_id = (unsigned long)priv;
 	enum simplepf_action action;
 
 	if (!skb) {
 		return NF_ACCEPT;
 	}
 
-	action = simplepf_traverse_chain(SIMPLEPF_CHAIN_INPUT, skb, state);
+	action = simplepf_traverse_chain(chain_id, skb, state);
 
 	return simplepf_to_nf(action);
 }
 
-static unsigned int hook_local_out(void *priv,
-		struct sk_buff *skb,
-		const struct nf_hook_state *state)
+/*
+ * The hooks of the IPv4 chains, and of the IPv6 ones if the kernel has
+ * IPv6. The ingress chain is attached per device, see ingress.c.
+ * Their priority is set from hook_priority on init.
+ * They are registered in every network namespace, and traverse the chains
+ * of the namespace they are called in.
+ */
+static struct nf_hook_ops hook_ops[] = {
+	{
+		.hook = hook_chain,
+		.priv = (void *)SIMPLEPF_CHAIN_INPUT,
+		.pf = PF_INET,
+		.hooknum = NF_INET_LOCAL_IN,
+	},
+	{
+		.hook = hook_chain,
+		.priv = (void *)SIMPLEPF_CHAIN_OUTPUT,
+		.pf = PF_INET,
+		.hooknum = NF_INET_LOCAL_OUT,
+	},
+	{
+		.hook = hook_chain,
+		.priv = (void *)SIMPLEPF_CHAIN_PREROUTING,
+		.pf = PF_INET,
+		.hooknum = NF_INET_PRE_ROUTING,
+	},
+	{
+		.hook = hook_chain,
+		.priv = (void *)SIMPLEPF_CHAIN_FORWARD,
+		.pf = PF_INET,
+		.hooknum = NF_INET_FORWARD,
+	},
+#if IS_ENABLED(CONFIG_IPV6)
+	{
+		.hook = hook_chain,
+		.priv = (void *)SIMPLEPF_CHAIN_INPUT6,
+		.pf = PF_INET6,
+		.hooknum = NF_INET_LOCAL_IN,
+	},
+	{
+		.hook = hook_chain,
+		.priv = (void *)SIMPLEPF_CHAIN_OUTPUT6,
+		.pf = PF_INET6,
+		.hooknum = NF_INET_LOCAL_OUT,
+	},
+	{
+		.hook = hook_chain,
+		.priv = (void *)SIMPLEPF_CHAIN_PREROUTING6,
+		.pf = PF_INET6,
+		.hooknum = NF_INET_PRE_ROUTING,
+	},
+	{
+		.hook = hook_chain,
+		.priv = (void *)SIMPLEPF_CHAIN_FORWARD6,
+		.pf = PF_INET6,
+		.hooknum = NF_INET_FORWARD,
+	},
+#endif
+};
+
+static int __net_init hooks_net_init(struct net *net)
 {
-	enum simplepf_action action;
+	int err;
 
-	if (!skb) {
-		return NF_ACCEPT;
+	err = nf_register_net_hooks(net, hook_ops, ARRAY_SIZE(hook_ops));
+	if (err) {
+		printk(KERN_INFO "simplepf: Failed to register hooks\n");
 	}
 
-	action = simplepf_traverse_chain(SIMPLEPF_CHAIN_OUTPUT, skb, state);
+	return err;
+}
 
-	return simplepf_to_nf(action);
+/*
+ * Unregistering a hook doesn't wait for the calls in flight, so the hooks
+ * of a namespace going away, the ingress ones included, are dropped before
+ * the grace period that the namespace teardown waits for between the
+ * .pre_exit and the .exit methods. By the time the chains and counters of
+ * the namespace are freed, no hook uses them anymore.
+ */
+static void __net_exit hooks_net_pre_exit(struct net *net)
+{
+	simplepf_ingress_net_exit(net);
+	nf_unregister_net_hooks(net, hook_ops, ARRAY_SIZE(hook_ops));
 }
 
-static struct nf_hook_ops ops_local_in = {
-	.hook = hook_local_in,
-	/* struct net_device *dev, TODO: for what? */
-	/* void *priv, unused */
-	.pf = PF_INET,
-	.hooknum = NF_INET_LOCAL_IN,
-	.priority = NF_IP_PRI_FIRST
+static struct pernet_operations hooks_net_ops = {
+	.init = hooks_net_init,
+	.pre_exit = hooks_net_pre_exit,
 };
 
-static struct nf_hook_ops ops_local_out = {
-	.hook = hook_local_out,
-	/* struct net_device *dev, TODO: for what? */
-	/* void *priv, unused */
-	.pf = PF_INET,
-	.hooknum = NF_INET_LOCAL_OUT,
-	.priority = NF_IP_PRI_FIRST
-};
+static struct dentry *debugfs_dir;
 
 static int __init simplepf_init(void)
 {
+	unsigned int i;
 	int err;
 
-	err = nf_register_net_hook(&init_net, &ops_local_in);
+	/*
+	 * The hooks use the flow cache, so it must be set up before them.
+	 */
+	err = simplepf_flow_cache_init();
+	if (err) {
+		goto flow_cache_fail;
+	}
+
+	/*
+	 * The debugfs files are for debugging and benchmarking only; the
+	 * module works the same without them. The log lives there too, and
+	 * is used by the hooks.
+	 */
+	debugfs_dir = debugfs_create_dir("simplepf", NULL);
+	simplepf_log_init(debugfs_dir);
+
+	err = simplepf_chains_init();
+	if (err) {
+		goto chains_fail;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(hook_ops); i++) {
+		hook_ops[i].priority = hook_priority;
+	}
+
+	err = register_pernet_subsys(&hooks_net_ops);
 	if (err) {
-		printk(KERN_INFO "simplepf: Failed to register input hook\n");
-		goto register_in_fail;
+		goto register_fail;
 	}
 
-	err = nf_register_net_hook(&init_net, &ops_local_out);
+	err = simplepf_ingress_init(hook_priority);
 	if (err) {
-		printk(KERN_INFO "simplepf: Failed to register output hook\n");
-		goto register_out_fail;
+		goto ingress_fail;
 	}
 
 	err = simplepf_proc_init();
@@ -107,46 +208,64 @@ static int __init simplepf_init(void)
 		goto proc_fail;
 	}
 
+	err = simplepf_netlink_init();
+	if (err) {
+		goto netlink_fail;
+	}
+
+	simplepf_hist_init(debugfs_dir);
+	simplepf_selftest_init(debugfs_dir);
+
 	return 0;
 
+netlink_fail:
+	simplepf_proc_cleanup();
 proc_fail:
-	nf_unregister_net_hook(&init_net, &ops_local_out);
-register_out_fail:
-	nf_unregister_net_hook(&init_net, &ops_local_in);
-register_in_fail:
+	simplepf_ingress_cleanup();
+ingress_fail:
+	unregister_pernet_subsys(&hooks_net_ops);
+register_fail:
+	simplepf_chains_cleanup();
+chains_fail:
+	simplepf_log_cleanup();
+	debugfs_remove_recursive(debugfs_dir);
+	simplepf_flow_cache_cleanup();
+flow_cache_fail:
 	return err;
 }
 
 static void __exit simplepf_exit(void)
 {
-	nf_unregister_net_hook(&init_net, &ops_local_in);
-	nf_unregister_net_hook(&init_net, &ops_local_out);
+	simplepf_ingress_cleanup();
+	unregister_pernet_subsys(&hooks_net_ops);
+
+	/*
+	 * Unregistering a hook doesn't wait for the calls already in it,
+	 * which may still log. Wait for them before closing the log.
+	 */
+	synchronize_net();
+	simplepf_log_cleanup();
+	debugfs_remove_recursive(debugfs_dir);
+	simplepf_selftest_cleanup();
 
+	simplepf_netlink_cleanup();
 	simplepf_proc_cleanup();
 
 	/*
 	 * At this point, we would (hopefully) have stopped new hook calls
 	 * and also any new updates (by disabling whatever communication
 	 * mechanism we use to communicate with the userspace).
-	 *
-	 * We don't need to check the return value of the following calls.
-	 * The only error they can return is EINVAL if the given chain id is
-	 * invalid. We are providing hardcoded id's that we know are valid.
-	 * The check is only required for cases where the id may be arbitrary
-	 * input from userspace.
+	 * Flush the chains of every namespace.
 	 */
-	simplepf_flush_chain(SIMPLEPF_CHAIN_INPUT);
-	simplepf_flush_chain(SIMPLEPF_CHAIN_OUTPUT);
+	simplepf_chains_cleanup();
 
 	/*
-	 * Chains are RCU-protected. Make sure all RCU callbacks are fired
-	 * before unloading the module.
-	 *
-	 * Even though we're not using RCU callbacks, in which case this may be
-	 * unnecessary, still do this just to be safe. We may need it in the
-	 * future, who knows?
+	 * No hook has run since synchronize_net() above, and the RCU
+	 * callbacks and work of the chains are done since the rcu_barrier()
+	 * of simplepf_chains_cleanup(), so nothing uses the flow cache
+	 * anymore.
 	 */
-	rcu_barrier();
+	simplepf_flow_cache_cleanup();
 }
 
 module_init(simplepf_init);
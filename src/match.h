@@ -0,0 +1,623 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMPLEPF_MATCH_H
+#define _SIMPLEPF_MATCH_H
+
+#include "uapi/simplepf.h"
+
+#include <linux/types.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <asm/byteorder.h>
+
+/*
+ * Packets are divided into classes by the protocol, because the protocol
+ * decides which fields of a rule apply at all:
+ * ICMP packets ignore the port filters, TCP/UDP packets ignore the ICMP type
+ * filter, and packets of any other protocol match no rule.
+ */
+enum simplepf_pkt_class {
+	SIMPLEPF_CLASS_ICMP,
+	SIMPLEPF_CLASS_L4,
+	/* Protocols we don't support. No rule matches them. */
+	__SIMPLEPF_CLASS_LAST
+};
+
+/*
+ * The header fields that rules match on, extracted from the packet once
+ * before the chain is traversed. Fields in network byte order.
+ * Fields that do not apply to the packet class are zero.
+ */
+struct simplepf_packet {
+	__be32 saddr;
+	__be32 daddr;
+	__be16 sport;
+	__be16 dport;
+	__u8 protocol;
+	__u8 icmp_type;
+	enum simplepf_pkt_class class;
+};
+
+/*
+ * The same for the IPv6 chains. The protocol is the upper-layer one, found
+ * after the extension headers.
+ */
+struct simplepf_packet6 {
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be16 sport;
+	__be16 dport;
+	__u8 protocol;
+	__u8 icmp_type;
+	enum simplepf_pkt_class class;
+};
+
+/*
+ * Bits for the fields of a rule, used by the classifiers to describe
+ * which fields a rule (or a group of rules) filters on.
+ */
+enum {
+	SIMPLEPF_FIELD_SADDR = 1 << 0,
+	SIMPLEPF_FIELD_DADDR = 1 << 1,
+	SIMPLEPF_FIELD_PROTO = 1 << 2,
+	SIMPLEPF_FIELD_ICMP_TYPE = 1 << 3,
+	SIMPLEPF_FIELD_SPORT = 1 << 4,
+	SIMPLEPF_FIELD_DPORT = 1 << 5,
+};
+
+#define SIMPLEPF_FIELDS_COMMON \
+	(SIMPLEPF_FIELD_SADDR | SIMPLEPF_FIELD_DADDR | SIMPLEPF_FIELD_PROTO)
+
+static inline enum simplepf_pkt_class simplepf_proto_class(__u8 protocol)
+{
+	switch (protocol) {
+	case IPPROTO_ICMP:
+		return SIMPLEPF_CLASS_ICMP;
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		return SIMPLEPF_CLASS_L4;
+	default:
+		return __SIMPLEPF_CLASS_LAST;
+	}
+}
+
+static inline enum simplepf_pkt_class simplepf_proto_class6(__u8 protocol)
+{
+	switch (protocol) {
+	case IPPROTO_ICMPV6:
+		return SIMPLEPF_CLASS_ICMP;
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		return SIMPLEPF_CLASS_L4;
+	default:
+		return __SIMPLEPF_CLASS_LAST;
+	}
+}
+
+/*
+ * The fields that apply to packets of the given class.
+ */
+static inline unsigned int simplepf_class_fields(enum simplepf_pkt_class class)
+{
+	switch (class) {
+	case SIMPLEPF_CLASS_ICMP:
+		return SIMPLEPF_FIELDS_COMMON | SIMPLEPF_FIELD_ICMP_TYPE;
+	case SIMPLEPF_CLASS_L4:
+		return SIMPLEPF_FIELDS_COMMON | SIMPLEPF_FIELD_SPORT |
+			SIMPLEPF_FIELD_DPORT;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * The fields the rule filters on, i.e. the ones with filter_* set.
+ */
+static inline unsigned int simplepf_rule_fields(const struct simplepf_rule *rule)
+{
+	return (rule->filter_saddr ? SIMPLEPF_FIELD_SADDR : 0) |
+		(rule->filter_daddr ? SIMPLEPF_FIELD_DADDR : 0) |
+		(rule->filter_proto ? SIMPLEPF_FIELD_PROTO : 0) |
+		(rule->filter_icmp_type ? SIMPLEPF_FIELD_ICMP_TYPE : 0) |
+		(rule->filter_sport ? SIMPLEPF_FIELD_SPORT : 0) |
+		(rule->filter_dport ? SIMPLEPF_FIELD_DPORT : 0);
+}
+
+/*
+ * Returns false if the rule can't match any packet of the given class,
+ * e.g. a rule filtering on TCP can't match an ICMP packet.
+ * Lets the classifiers leave such rules out of a class altogether.
+ */
+static inline bool simplepf_rule_in_class(const struct simplepf_rule *rule,
+		enum simplepf_pkt_class class)
+{
+	if (class >= __SIMPLEPF_CLASS_LAST) {
+		return false;
+	}
+	return !rule->filter_proto ||
+		simplepf_proto_class(rule->ip_protocol) == class;
+}
+
+/*
+ * Network byte order mask for an IPv4 prefix of the given length (0-32).
+ */
+static inline __be32 simplepf_prefix_mask(unsigned int prefixlen)
+{
+	return prefixlen ? htonl(~0U << (32 - prefixlen)) : 0;
+}
+
+/*
+ * Host byte order mask for word @word (0-3) of an IPv6 prefix of the given
+ * length (0-128): the bits of the prefix that fall in that word.
+ */
+static __always_inline __u32 simplepf_prefix6_word_mask(unsigned int prefixlen,
+		unsigned int word)
+{
+	int shift = 32 * (int)(word + 1) - (int)prefixlen;
+
+	shift = shift < 0 ? 0 : shift;
+	shift = shift > 32 ? 32 : shift;
+	return (__u32)(~0ULL << shift);
+}
+
+/*
+ * Whether the IPv6 addresses, in network byte order, share a prefix of the
+ * given length (0-128).
+ */
+static __always_inline bool simplepf_addr6_match(const __be32 *a,
+		const __be32 *b, unsigned int prefixlen)
+{
+	__u32 miss = 0;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		miss |= ntohl(a[i] ^ b[i]) &
+			simplepf_prefix6_word_mask(prefixlen, i);
+	}
+	return !miss;
+}
+
+/*
+ * Nonzero if the IPv6 addresses, in network byte order, differ in a prefix
+ * of the given length (1-128). Compares them as two 64-bit halves in host
+ * byte order, each masked by its part of the prefix.
+ */
+static __always_inline __u64 simplepf_addr6_miss(const __be32 *a,
+		const __be32 *b, unsigned int prefixlen)
+{
+	__u64 hi = (__u64)ntohl(a[0] ^ b[0]) << 32 | ntohl(a[1] ^ b[1]);
+	__u64 lo = (__u64)ntohl(a[2] ^ b[2]) << 32 | ntohl(a[3] ^ b[3]);
+
+	/* Shifting by 64 is undefined, so the low half is masked apart. */
+	return (hi & ~0ULL << (prefixlen < 64 ? 64 - prefixlen : 0)) |
+		(lo & (prefixlen > 64 ? ~0ULL << (128 - prefixlen) : 0));
+}
+
+/*
+ * Whether the port is in the range first-last, inclusive.
+ * All in network byte order; the comparison is done in host order.
+ */
+static inline bool simplepf_port_in_range(__be16 port, __be16 first,
+		__be16 last)
+{
+	__u16 p = ntohs(port);
+
+	return p >= ntohs(first) && p <= ntohs(last);
+}
+
+/*
+ * Whether the rule compares every field it filters on for equality
+ * (addresses by prefix), i.e. it has no port ranges.
+ */
+static inline bool simplepf_rule_is_exact(const struct simplepf_rule *rule)
+{
+	return (!rule->filter_sport ||
+			rule->transport_sport == rule->transport_sport_max) &&
+		(!rule->filter_dport ||
+			rule->transport_dport == rule->transport_dport_max);
+}
+
+/*
+ * The fields of a packet as the dimensions of a search space, for the
+ * classifiers that see a rule as a range of values in every dimension.
+ * For ICMP packets, SIMPLEPF_DIM_SPORT holds the ICMP type and
+ * SIMPLEPF_DIM_DPORT is unused (always 0).
+ */
+enum simplepf_dim {
+	SIMPLEPF_DIM_SADDR,
+	SIMPLEPF_DIM_DADDR,
+	SIMPLEPF_DIM_PROTO,
+	SIMPLEPF_DIM_SPORT,
+	SIMPLEPF_DIM_DPORT,
+	SIMPLEPF_DIMS
+};
+
+/*
+ * An inclusive range of values in a dimension, in host byte order.
+ */
+struct simplepf_range {
+	__u32 lo;
+	__u32 hi;
+};
+
+/*
+ * Width of the dimension for packets of the class, in bits.
+ */
+static inline unsigned int simplepf_dim_bits(enum simplepf_pkt_class class,
+		enum simplepf_dim dim)
+{
+	switch (dim) {
+	case SIMPLEPF_DIM_SADDR:
+	case SIMPLEPF_DIM_DADDR:
+		return 32;
+	case SIMPLEPF_DIM_PROTO:
+		return 8;
+	case SIMPLEPF_DIM_SPORT:
+		return class == SIMPLEPF_CLASS_ICMP ? 8 : 16;
+	case SIMPLEPF_DIM_DPORT:
+		return class == SIMPLEPF_CLASS_ICMP ? 0 : 16;
+	default:
+		return 0;
+	}
+}
+
+static inline struct simplepf_range simplepf_dim_range(bool filter,
+		__u32 lo, __u32 hi, unsigned int bits)
+{
+	struct simplepf_range r = { 0, (__u32)((1ULL << bits) - 1) };
+
+	if (filter) {
+		r.lo = lo;
+		r.hi = hi;
+	}
+	return r;
+}
+
+/*
+ * The ranges of values the rule matches in every dimension, for packets
+ * of the given class. Expects a rule in the class and in canonical form
+ * (see simplepf_match_rule()); it then matches exactly the packets whose
+ * values are in all the ranges.
+ */
+static inline void simplepf_rule_ranges(const struct simplepf_rule *rule,
+		enum simplepf_pkt_class class,
+		struct simplepf_range ranges[SIMPLEPF_DIMS])
+{
+	__u32 saddr = ntohl(rule->ip_saddr);
+	__u32 daddr = ntohl(rule->ip_daddr);
+
+	ranges[SIMPLEPF_DIM_SADDR] = simplepf_dim_range(rule->filter_saddr,
+			saddr, saddr | ~ntohl(simplepf_prefix_mask(
+					rule->ip_saddr_prefixlen)), 32);
+	ranges[SIMPLEPF_DIM_DADDR] = simplepf_dim_range(rule->filter_daddr,
+			daddr, daddr | ~ntohl(simplepf_prefix_mask(
+					rule->ip_daddr_prefixlen)), 32);
+	ranges[SIMPLEPF_DIM_PROTO] = simplepf_dim_range(rule->filter_proto,
+			rule->ip_protocol, rule->ip_protocol, 8);
+
+	if (class == SIMPLEPF_CLASS_ICMP) {
+		ranges[SIMPLEPF_DIM_SPORT] = simplepf_dim_range(
+				rule->filter_icmp_type,
+				rule->icmp_type, rule->icmp_type, 8);
+		ranges[SIMPLEPF_DIM_DPORT] = simplepf_dim_range(false, 0, 0, 0);
+	} else {
+		ranges[SIMPLEPF_DIM_SPORT] = simplepf_dim_range(
+				rule->filter_sport,
+				ntohs(rule->transport_sport),
+				ntohs(rule->transport_sport_max), 16);
+		ranges[SIMPLEPF_DIM_DPORT] = simplepf_dim_range(
+				rule->filter_dport,
+				ntohs(rule->transport_dport),
+				ntohs(rule->transport_dport_max), 16);
+	}
+}
+
+/*
+ * The values of the packet in every dimension; see enum simplepf_dim.
+ */
+static inline void simplepf_packet_values(const struct simplepf_packet *pkt,
+		__u32 values[SIMPLEPF_DIMS])
+{
+	values[SIMPLEPF_DIM_SADDR] = ntohl(pkt->saddr);
+	values[SIMPLEPF_DIM_DADDR] = ntohl(pkt->daddr);
+	values[SIMPLEPF_DIM_PROTO] = pkt->protocol;
+	if (pkt->class == SIMPLEPF_CLASS_ICMP) {
+		values[SIMPLEPF_DIM_SPORT] = pkt->icmp_type;
+		values[SIMPLEPF_DIM_DPORT] = 0;
+	} else {
+		values[SIMPLEPF_DIM_SPORT] = ntohs(pkt->sport);
+		values[SIMPLEPF_DIM_DPORT] = ntohs(pkt->dport);
+	}
+}
+
+/*
+ * The part of simplepf_match_rule() after the addresses, which is the same
+ * for both families: the protocol, and the ICMP type or the ports by the
+ * class of the packet.
+ */
+static inline enum simplepf_action simplepf_match_upper(
+		const struct simplepf_rule *rule, enum simplepf_pkt_class class,
+		__u8 protocol, __u8 icmp_type, __be16 sport, __be16 dport)
+{
+	if (rule->filter_proto && rule->ip_protocol != protocol) {
+		return __SIMPLEPF_ACTION_LAST;
+	}
+
+	switch (class) {
+	case SIMPLEPF_CLASS_ICMP:
+		if (rule->filter_icmp_type && rule->icmp_type != icmp_type) {
+			return __SIMPLEPF_ACTION_LAST;
+		}
+	break;
+
+	case SIMPLEPF_CLASS_L4:
+		if (rule->filter_sport &&
+				!simplepf_port_in_range(sport,
+					rule->transport_sport,
+					rule->transport_sport_max)) {
+			return __SIMPLEPF_ACTION_LAST;
+		}
+		if (rule->filter_dport &&
+				!simplepf_port_in_range(dport,
+					rule->transport_dport,
+					rule->transport_dport_max)) {
+			return __SIMPLEPF_ACTION_LAST;
+		}
+	break;
+
+	/*
+	 * Not matched any of the protocols we support.
+	 * Let the packet pass.
+	 */
+	default:
+	return __SIMPLEPF_ACTION_LAST;
+
+	}
+
+	/*
+	 * If we've come to this point, every filter that has its filter_*
+	 * set to true has matched the packet. Note that this may also mean
+	 * that no filter_* was set to true, i.e. this rule matches all packets.
+	 */
+	return rule->action;
+}
+
+/*
+ * Tries to match the given rule with the packet.
+ * Will always be given non-null parameters.
+ * If match is successful, returns the action specified in the rule.
+ * Else, returns __SIMPLEPF_ACTION_LAST.
+ * This is the reference matcher; every classifier must agree with it.
+ * Expects a rule that went through the checks of the chain code, i.e. with
+ * address prefix lengths in 1-32 for the filtered addresses and valid
+ * port ranges for the filtered ports.
+ * The interface of the rule is not matched here: the chain code only
+ * classifies a packet against the rules of its interface (see
+ * filter_ifindex).
+ */
+static inline enum simplepf_action simplepf_match_rule(
+		const struct simplepf_rule *rule,
+		const struct simplepf_packet *pkt)
+{
+	if (rule->filter_saddr && ((rule->ip_saddr ^ pkt->saddr) &
+			simplepf_prefix_mask(rule->ip_saddr_prefixlen))) {
+		return __SIMPLEPF_ACTION_LAST;
+	}
+
+	if (rule->filter_daddr && ((rule->ip_daddr ^ pkt->daddr) &
+			simplepf_prefix_mask(rule->ip_daddr_prefixlen))) {
+		return __SIMPLEPF_ACTION_LAST;
+	}
+
+	return simplepf_match_upper(rule, pkt->class, pkt->protocol,
+			pkt->icmp_type, pkt->sport, pkt->dport);
+}
+
+/*
+ * The reference matcher of the IPv6 chains, as simplepf_match_rule(),
+ * for a rule with address prefix lengths in 1-128.
+ */
+static inline enum simplepf_action simplepf_match_rule6(
+		const struct simplepf_rule *rule,
+		const struct simplepf_packet6 *pkt)
+{
+	if (rule->filter_saddr && !simplepf_addr6_match(rule->ip6_saddr,
+			pkt->saddr, rule->ip_saddr_prefixlen)) {
+		return __SIMPLEPF_ACTION_LAST;
+	}
+
+	if (rule->filter_daddr && !simplepf_addr6_match(rule->ip6_daddr,
+			pkt->daddr, rule->ip_daddr_prefixlen)) {
+		return __SIMPLEPF_ACTION_LAST;
+	}
+
+	return simplepf_match_upper(rule, pkt->class, pkt->protocol,
+			pkt->icmp_type, pkt->sport, pkt->dport);
+}
+
+/*
+ * Nonzero if the rule misses the upper-layer fields of a packet among
+ * @fields; the part of simplepf_match_fields6() after the addresses.
+ */
+static __always_inline __u32 simplepf_miss_upper(
+		const struct simplepf_rule *rule, __u8 protocol, __u8 icmp_type,
+		__be16 sport, __be16 dport, unsigned int fields)
+{
+	__u32 miss = 0;
+
+	if (fields & SIMPLEPF_FIELD_PROTO) {
+		miss |= rule->ip_protocol ^ protocol;
+	}
+	if (fields & SIMPLEPF_FIELD_ICMP_TYPE) {
+		miss |= rule->icmp_type ^ icmp_type;
+	}
+	/* p is in first-last if and only if p - first <= last - first. */
+	if (fields & SIMPLEPF_FIELD_SPORT) {
+		miss |= (__u16)(ntohs(sport) - ntohs(rule->transport_sport)) >
+			(__u16)(ntohs(rule->transport_sport_max) -
+				ntohs(rule->transport_sport));
+	}
+	if (fields & SIMPLEPF_FIELD_DPORT) {
+		miss |= (__u16)(ntohs(dport) - ntohs(rule->transport_dport)) >
+			(__u16)(ntohs(rule->transport_dport_max) -
+				ntohs(rule->transport_dport));
+	}
+
+	return miss;
+}
+
+/*
+ * Whether the rule matches the packet of an IPv6 chain in the given fields,
+ * ignoring all the others. With @fields the fields of the rule that apply
+ * to the class of the packet (simplepf_rule_fields() &
+ * simplepf_class_fields()), this agrees with simplepf_match_rule6() for
+ * packets of a supported class.
+ * Meant to be called with a constant @fields, for which the compiler leaves
+ * only the comparisons of those fields; their results are or'ed together,
+ * so a rule costs a single branch however many fields it filters on. The
+ * addresses are compared by simplepf_addr6_miss(), so a 128-bit prefix
+ * costs no more branches than a 32-bit one.
+ * Expects a rule in canonical form, as simplepf_match_rule6().
+ */
+static __always_inline bool simplepf_match_fields6(
+		const struct simplepf_rule *rule,
+		const struct simplepf_packet6 *pkt, unsigned int fields)
+{
+	__u64 miss = 0;
+
+	if (fields & SIMPLEPF_FIELD_SADDR) {
+		miss |= simplepf_addr6_miss(rule->ip6_saddr, pkt->saddr,
+				rule->ip_saddr_prefixlen);
+	}
+	if (fields & SIMPLEPF_FIELD_DADDR) {
+		miss |= simplepf_addr6_miss(rule->ip6_daddr, pkt->daddr,
+				rule->ip_daddr_prefixlen);
+	}
+
+	return !(miss | simplepf_miss_upper(rule, pkt->protocol,
+			pkt->icmp_type, pkt->sport, pkt->dport, fields));
+}
+
+/*
+ * Packed form of an IPv4 rule, for scanning many of them: a key and a mask
+ * over the fields of the packet, so a rule matches a packet if the two
+ * agree in the bits of the mask, plus the port ranges, which no mask can
+ * express. Made from a rule in canonical form (see simplepf_match_rule())
+ * by simplepf_pack_rule(); 32 bytes, against the 72 of struct simplepf_rule,
+ * and matched against a struct simplepf_packed_key with no branch but the
+ * verdict by simplepf_match_packed(). In host byte order.
+ * Unfiltered fields have a mask of 0, or the whole range of ports.
+ */
+struct simplepf_packed_rule {
+	/* The source address in the high half, the destination in the low. */
+	__u64 addrs;
+	__u64 addrs_mask;
+	/* The protocol in bits 8-15, the ICMP type in bits 0-7. */
+	__u32 upper;
+	__u32 upper_mask;
+	/* The first port of each range, and its length minus one. */
+	__u16 sport_first;
+	__u16 sport_span;
+	__u16 dport_first;
+	__u16 dport_span;
+};
+
+/*
+ * The fields of a packet of a supported class laid out like those of
+ * struct simplepf_packed_rule, extracted once per packet by
+ * simplepf_packet_key(). @upper_mask leaves out the ICMP type of TCP and UDP
+ * packets, and @l4 the ports of ICMP ones, as simplepf_match_rule() does.
+ */
+struct simplepf_packed_key {
+	__u64 addrs;
+	__u32 upper;
+	__u32 upper_mask;
+	__u16 sport;
+	__u16 dport;
+	__u32 l4;
+};
+
+static inline void simplepf_pack_rule(const struct simplepf_rule *rule,
+		struct simplepf_packed_rule *packed)
+{
+	/*
+	 * Defined for the prefix lengths of IPv6 rules too, as a mask of
+	 * their first word; the linear engine packs them all the same.
+	 */
+	__u64 saddr_mask = rule->filter_saddr ?
+		simplepf_prefix6_word_mask(rule->ip_saddr_prefixlen, 0) : 0;
+	__u64 daddr_mask = rule->filter_daddr ?
+		simplepf_prefix6_word_mask(rule->ip_daddr_prefixlen, 0) : 0;
+
+	packed->addrs_mask = saddr_mask << 32 | daddr_mask;
+	packed->addrs = ((__u64)ntohl(rule->ip_saddr) << 32 |
+			ntohl(rule->ip_daddr)) & packed->addrs_mask;
+	packed->upper_mask = (rule->filter_proto ? 0xff00 : 0) |
+		(rule->filter_icmp_type ? 0xff : 0);
+	packed->upper = ((__u32)rule->ip_protocol << 8 | rule->icmp_type) &
+		packed->upper_mask;
+
+	packed->sport_first = 0;
+	packed->sport_span = 0xffff;
+	if (rule->filter_sport) {
+		packed->sport_first = ntohs(rule->transport_sport);
+		packed->sport_span = ntohs(rule->transport_sport_max) -
+			packed->sport_first;
+	}
+	packed->dport_first = 0;
+	packed->dport_span = 0xffff;
+	if (rule->filter_dport) {
+		packed->dport_first = ntohs(rule->transport_dport);
+		packed->dport_span = ntohs(rule->transport_dport_max) -
+			packed->dport_first;
+	}
+}
+
+static inline void simplepf_packet_key(const struct simplepf_packet *pkt,
+		struct simplepf_packed_key *key)
+{
+	key->addrs = (__u64)ntohl(pkt->saddr) << 32 | ntohl(pkt->daddr);
+	key->upper = (__u32)pkt->protocol << 8 | pkt->icmp_type;
+	key->upper_mask = pkt->class == SIMPLEPF_CLASS_ICMP ? 0xffff : 0xff00;
+	key->sport = ntohs(pkt->sport);
+	key->dport = ntohs(pkt->dport);
+	key->l4 = pkt->class == SIMPLEPF_CLASS_L4;
+}
+
+/*
+ * Whether the packed rule matches the packet; agrees with
+ * simplepf_match_rule() for packets of a supported class.
+ */
+static __always_inline bool simplepf_match_packed(
+		const struct simplepf_packed_rule *rule,
+		const struct simplepf_packed_key *key)
+{
+	__u64 miss = (key->addrs ^ rule->addrs) & rule->addrs_mask;
+
+	miss |= (key->upper ^ rule->upper) & rule->upper_mask &
+		key->upper_mask;
+	/* p is in first-last if and only if p - first <= last - first. */
+	miss |= key->l4 &
+		(((__u16)(key->sport - rule->sport_first) > rule->sport_span) |
+		 ((__u16)(key->dport - rule->dport_first) > rule->dport_span));
+
+	return !miss;
+}
+
+#endif	/* _SIMPLEPF_MATCH_H */
@@ -0,0 +1,291 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Generic netlink control interface. See uapi/simplepf.h for the protocol.
+ *
+ * The netlink core already does the batching: every message of a sendmsg()
+ * is handed to us in turn, and acked or answered with its error. So each
+ * operation here is one message, and a message may carry any number of
+ * rules, which go to the chain in a single update.
+ *
+ * The family is available in every network namespace, and a message
+ * updates the chains of the namespace of the socket it was sent on.
+ * An administrator of that namespace (CAP_NET_ADMIN in its user namespace)
+ * may update them.
+ */
+
+#include "uapi/simplepf.h"
+#include "chains.h"
+#include "netlink.h"
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <net/netlink.h>
+#include <net/genetlink.h>
+
+static const struct nla_policy simplepf_genl_policy[SIMPLEPF_ATTR_MAX + 1] = {
+	[SIMPLEPF_ATTR_CHAIN] = { .type = NLA_U32 },
+	[SIMPLEPF_ATTR_RULE] = NLA_POLICY_EXACT_LEN(sizeof(struct simplepf_rule)),
+	[SIMPLEPF_ATTR_ENGINE] = { .type = NLA_U32 },
+};
+
+/*
+ * Get the chain id of the message.
+ * Returns 0 on success, -EINVAL if it's missing or not valid.
+ */
+static int genl_get_chain(struct genl_info *info,
+		enum simplepf_chain_id *chain_id)
+{
+	struct nlattr *attr = info->attrs[SIMPLEPF_ATTR_CHAIN];
+
+	if (!attr) {
+		NL_SET_ERR_MSG(info->extack, "Missing chain");
+		return -EINVAL;
+	}
+
+	*chain_id = nla_get_u32(attr);
+	if (*chain_id >= __SIMPLEPF_CHAIN_LAST) {
+		NL_SET_ERR_MSG_ATTR(info->extack, attr, "Invalid chain");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy the SIMPLEPF_ATTR_RULE attributes of the message, in order, into
+ * an array allocated with kvmalloc(). Every rule is checked, so an invalid
+ * one can be reported with the attribute that holds it.
+ * Returns 0 on success, or a negative error code.
+ */
+static int genl_get_rules(struct genl_info *info,
+		enum simplepf_chain_id chain_id,
+		struct simplepf_rule **rulesp, unsigned int *countp)
+{
+	const struct nlattr *attr;
+	struct simplepf_rule *rules;
+	unsigned int count = 0;
+	unsigned int i = 0;
+	int rem;
+
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(attr) == SIMPLEPF_ATTR_RULE) {
+			count++;
+		}
+	}
+
+	if (count > SIMPLEPF_MAX_RULES) {
+		NL_SET_ERR_MSG(info->extack, "Too many rules");
+		return -E2BIG;
+	}
+
+	rules = kvmalloc_array(max(count, 1U), sizeof *rules, GFP_KERNEL);
+	if (!rules) {
+		return -ENOMEM;
+	}
+
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(attr) != SIMPLEPF_ATTR_RULE) {
+			continue;
+		}
+		memcpy(&rules[i], nla_data(attr), sizeof *rules);
+		if (simplepf_check_rule(chain_id, &rules[i])) {
+			NL_SET_ERR_MSG_ATTR(info->extack, attr, "Invalid rule");
+			kvfree(rules);
+			return -EINVAL;
+		}
+		i++;
+	}
+
+	*rulesp = rules;
+	*countp = count;
+	return 0;
+}
+
+/*
+ * Explain the errors of a chain update that are not about a single rule.
+ */
+static void genl_set_update_err(struct genl_info *info, int err)
+{
+	switch (err) {
+	case -ENOSPC:
+		NL_SET_ERR_MSG(info->extack, "Chain is full");
+	break;
+
+	case -E2BIG:
+		NL_SET_ERR_MSG(info->extack,
+				"Chain is too large for its engine");
+	break;
+
+	case -EOPNOTSUPP:
+		NL_SET_ERR_MSG(info->extack,
+				"IPv6 chains only have the linear engine");
+	break;
+
+	default:
+	break;
+	}
+}
+
+static int genl_add(struct sk_buff *skb, struct genl_info *info)
+{
+	enum simplepf_chain_id chain_id;
+	struct simplepf_rule *rules;
+	unsigned int count;
+	int err;
+
+	err = genl_get_chain(info, &chain_id);
+	if (err) {
+		return err;
+	}
+
+	err = genl_get_rules(info, chain_id, &rules, &count);
+	if (err) {
+		return err;
+	}
+
+	if (!count) {
+		NL_SET_ERR_MSG(info->extack, "No rules to add");
+		err = -EINVAL;
+	} else {
+		err = simplepf_add_rules(genl_info_net(info), chain_id,
+				rules, count);
+		genl_set_update_err(info, err);
+	}
+
+	kvfree(rules);
+	return err;
+}
+
+static int genl_flush(struct sk_buff *skb, struct genl_info *info)
+{
+	enum simplepf_chain_id chain_id;
+	int err;
+
+	err = genl_get_chain(info, &chain_id);
+	if (err) {
+		return err;
+	}
+
+	return simplepf_flush_chain(genl_info_net(info), chain_id);
+}
+
+static int genl_replace(struct sk_buff *skb, struct genl_info *info)
+{
+	enum simplepf_chain_id chain_id;
+	struct simplepf_rule *rules;
+	unsigned int count;
+	int err;
+
+	err = genl_get_chain(info, &chain_id);
+	if (err) {
+		return err;
+	}
+
+	err = genl_get_rules(info, chain_id, &rules, &count);
+	if (err) {
+		return err;
+	}
+
+	err = simplepf_replace_chain(genl_info_net(info), chain_id,
+			rules, count);
+	genl_set_update_err(info, err);
+
+	kvfree(rules);
+	return err;
+}
+
+static int genl_set_engine(struct sk_buff *skb, struct genl_info *info)
+{
+	enum simplepf_chain_id chain_id;
+	struct nlattr *attr = info->attrs[SIMPLEPF_ATTR_ENGINE];
+	int err;
+
+	err = genl_get_chain(info, &chain_id);
+	if (err) {
+		return err;
+	}
+
+	if (!attr) {
+		NL_SET_ERR_MSG(info->extack, "Missing engine");
+		return -EINVAL;
+	}
+	if (nla_get_u32(attr) >= __SIMPLEPF_ENGINE_LAST) {
+		NL_SET_ERR_MSG_ATTR(info->extack, attr, "Invalid engine");
+		return -EINVAL;
+	}
+
+	err = simplepf_set_engine(genl_info_net(info), chain_id,
+			nla_get_u32(attr));
+	genl_set_update_err(info, err);
+
+	return err;
+}
+
+static const struct genl_ops simplepf_genl_ops[] = {
+	{
+		.cmd = SIMPLEPF_GENL_CMD_ADD,
+		.doit = genl_add,
+		.flags = GENL_UNS_ADMIN_PERM,
+	},
+	{
+		.cmd = SIMPLEPF_GENL_CMD_FLUSH,
+		.doit = genl_flush,
+		.flags = GENL_UNS_ADMIN_PERM,
+	},
+	{
+		.cmd = SIMPLEPF_GENL_CMD_REPLACE,
+		.doit = genl_replace,
+		.flags = GENL_UNS_ADMIN_PERM,
+	},
+	{
+		.cmd = SIMPLEPF_GENL_CMD_SET_ENGINE,
+		.doit = genl_set_engine,
+		.flags = GENL_UNS_ADMIN_PERM,
+	},
+};
+
+static struct genl_family simplepf_genl_family __ro_after_init = {
+	.name = SIMPLEPF_GENL_NAME,
+	.version = SIMPLEPF_GENL_VERSION,
+	.maxattr = SIMPLEPF_ATTR_MAX,
+	.policy = simplepf_genl_policy,
+	.netnsok = true,
+	.module = THIS_MODULE,
+	.ops = simplepf_genl_ops,
+	.n_ops = ARRAY_SIZE(simplepf_genl_ops),
+};
+
+int __init simplepf_netlink_init(void)
+{
+	int err;
+
+	err = genl_register_family(&simplepf_genl_family);
+	if (err) {
+		printk(KERN_INFO "simplepf: Failed to register the generic netlink family\n");
+	}
+
+	return err;
+}
+
+void simplepf_netlink_cleanup(void)
+{
+	genl_unregister_family(&simplepf_genl_family);
+}
@@ -0,0 +1,324 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Port interval classifier.
+ *
+ * TCP/UDP rules are indexed by their destination port range. The ends of
+ * all the ranges cut the port space into elementary intervals, such that
+ * every port in an interval is in exactly the same ranges. A segment tree
+ * over the intervals stores every range in the O(log n) nodes that
+ * exactly cover it, so the ranges containing a port are the ones stored
+ * on the path from its interval's leaf up to the root.
+ *
+ * ICMP rules are indexed by their ICMP type in a plain table.
+ *
+ * As in the prefix trie, every node keeps its rules in rule order, the lists
+ * on the path are the only candidates, and the candidates are checked with
+ * the reference matcher.
+ *
+ * The rules that don't filter on the indexed field of a class, such as
+ * address blocklists, are compiled with the lpm engine.
+ */
+
+#include "engine.h"
+#include "match.h"
+#include "rulelist.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/log2.h>
+#include <linux/sort.h>
+#include <asm/byteorder.h>
+
+#define PORTS_ICMP_TYPES 256
+
+struct ports {
+	/*
+	 * The first port of every elementary interval, ascending;
+	 * starts[0] is always 0.
+	 */
+	u32 *starts;
+	unsigned int nr_intervals;
+	/*
+	 * Segment tree in an array: node 1 is the root, the children of node i
+	 * are 2i and 2i+1 and the leaf of interval j is node leaves + j.
+	 */
+	unsigned int leaves;
+	struct rule_list *tree;
+
+	struct rule_list icmp[PORTS_ICMP_TYPES];
+
+	/*
+	 * TCP/UDP rules that don't filter on the destination port, and ICMP
+	 * rules that don't filter on the ICMP type.
+	 */
+	struct rule_subset wildcard;
+};
+
+static void ports_destroy(void *priv)
+{
+	struct ports *ports = priv;
+	unsigned int i;
+
+	if (ports->tree) {
+		for (i = 1; i < 2 * ports->leaves; i++) {
+			rule_list_free(&ports->tree[i]);
+		}
+		kvfree(ports->tree);
+	}
+	kvfree(ports->starts);
+	for (i = 0; i < PORTS_ICMP_TYPES; i++) {
+		rule_list_free(&ports->icmp[i]);
+	}
+	rule_subset_free(&ports->wildcard);
+	kvfree(ports);
+}
+
+static int ports_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a;
+	u32 y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * The index of the elementary interval that contains the port.
+ */
+static inline unsigned int ports_interval(const struct ports *ports, u32 port)
+{
+	unsigned int lo = 0;
+	unsigned int hi = ports->nr_intervals;
+
+	/* starts[lo] <= port < starts[hi], taking starts[nr_intervals] as inf */
+	while (hi - lo > 1) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (ports->starts[mid] <= port) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static bool ports_is_l4_indexed(const struct simplepf_rule *rule)
+{
+	return simplepf_rule_in_class(rule, SIMPLEPF_CLASS_L4) &&
+		rule->filter_dport;
+}
+
+/*
+ * Cut the port space at the ends of the destination port ranges.
+ */
+static int ports_build_intervals(struct ports *ports,
+		const struct chain_rule *rules, unsigned int count)
+{
+	unsigned int nr = 1;
+	unsigned int i;
+	unsigned int j;
+
+	ports->starts = kvmalloc_array(2 * count + 1, sizeof *ports->starts,
+			GFP_KERNEL);
+	if (!ports->starts) {
+		return -ENOMEM;
+	}
+
+	ports->starts[0] = 0;
+	for (i = 0; i < count; i++) {
+		const struct simplepf_rule *rule = &rules[i].rule;
+
+		if (!ports_is_l4_indexed(rule)) {
+			continue;
+		}
+		ports->starts[nr++] = ntohs(rule->transport_dport);
+		ports->starts[nr++] = ntohs(rule->transport_dport_max) + 1U;
+	}
+
+	sort(ports->starts, nr, sizeof *ports->starts, ports_cmp, NULL);
+
+	/*
+	 * Remove the duplicates, and the end of a range that ends at
+	 * the last port.
+	 */
+	for (i = 1, j = 1; i < nr; i++) {
+		if (ports->starts[i] != ports->starts[j - 1] &&
+				ports->starts[i] <= U16_MAX) {
+			ports->starts[j++] = ports->starts[i];
+		}
+	}
+	ports->nr_intervals = j;
+
+	return 0;
+}
+
+/*
+ * Store the rule in the nodes that exactly cover the intervals first-last.
+ */
+static int ports_tree_insert(struct ports *ports, unsigned int first,
+		unsigned int last, u32 index)
+{
+	unsigned int l = first + ports->leaves;
+	unsigned int r = last + ports->leaves + 1;
+	int err;
+
+	while (l < r) {
+		if (l & 1) {
+			err = rule_list_append(&ports->tree[l++], index);
+			if (err) {
+				return err;
+			}
+		}
+		if (r & 1) {
+			err = rule_list_append(&ports->tree[--r], index);
+			if (err) {
+				return err;
+			}
+		}
+		l >>= 1;
+		r >>= 1;
+	}
+
+	return 0;
+}
+
+static int ports_insert(struct ports *ports, const struct simplepf_rule *rule,
+		u32 index)
+{
+	bool wildcard = false;
+	int err;
+
+	if (simplepf_rule_in_class(rule, SIMPLEPF_CLASS_L4)) {
+		if (rule->filter_dport) {
+			err = ports_tree_insert(ports,
+				ports_interval(ports, ntohs(rule->transport_dport)),
+				ports_interval(ports,
+					ntohs(rule->transport_dport_max)),
+				index);
+			if (err) {
+				return err;
+			}
+		} else {
+			wildcard = true;
+		}
+	}
+
+	if (simplepf_rule_in_class(rule, SIMPLEPF_CLASS_ICMP)) {
+		if (rule->filter_icmp_type) {
+			err = rule_list_append(&ports->icmp[rule->icmp_type],
+					index);
+			if (err) {
+				return err;
+			}
+		} else {
+			wildcard = true;
+		}
+	}
+
+	/*
+	 * The other engine gets the whole rule, so it may also see it for
+	 * the class it is indexed for here; that only makes it a candidate
+	 * twice.
+	 */
+	return wildcard ? rule_list_append(&ports->wildcard.index, index) : 0;
+}
+
+static void *ports_build(const struct chain_rule *rules, unsigned int count)
+{
+	struct ports *ports;
+	unsigned int i;
+	int err;
+
+	ports = kvzalloc(sizeof *ports, GFP_KERNEL);
+	if (!ports) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	err = ports_build_intervals(ports, rules, count);
+	if (err) {
+		goto fail;
+	}
+
+	ports->leaves = roundup_pow_of_two(ports->nr_intervals);
+	ports->tree = kvcalloc(2 * ports->leaves, sizeof *ports->tree,
+			GFP_KERNEL);
+	if (!ports->tree) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < count; i++) {
+		err = ports_insert(ports, &rules[i].rule, i);
+		if (err) {
+			goto fail;
+		}
+	}
+
+	err = rule_subset_build(&ports->wildcard, &simplepf_lpm_engine, rules);
+	if (err) {
+		goto fail;
+	}
+
+	return ports;
+
+fail:
+	ports_destroy(ports);
+	return ERR_PTR(err);
+}
+
+static unsigned int ports_classify(const void *priv,
+		const struct chain_rule *rules, unsigned int count,
+		const struct simplepf_packet *pkt, unsigned int *scanned)
+{
+	const struct ports *ports = priv;
+	u32 best = count;
+	unsigned int node;
+
+	*scanned = 0;
+	switch (pkt->class) {
+	case SIMPLEPF_CLASS_ICMP:
+		best = rule_list_match(&ports->icmp[pkt->icmp_type], rules, pkt,
+				best, scanned);
+	break;
+
+	case SIMPLEPF_CLASS_L4:
+		node = ports->leaves + ports_interval(ports, ntohs(pkt->dport));
+		for (; node; node >>= 1) {
+			best = rule_list_match(&ports->tree[node], rules, pkt,
+					best, scanned);
+		}
+	break;
+
+	default:
+		return best;
+	}
+
+	return rule_subset_match(&ports->wildcard, pkt, best, scanned);
+}
+
+const struct simplepf_engine simplepf_ports_engine = {
+	.name = "ports",
+	.build = ports_build,
+	.classify = ports_classify,
+	.destroy = ports_destroy,
+};
@@ -23,23 +23,46 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/seq_file_net.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/capability.h>
+#include <linux/uidgid.h>
+#include <net/net_namespace.h>
+
+/*
+ * Every network namespace has its own /proc/net/simplepf directory, for its
+ * own chains. /proc/simplepf is a link to /proc/net/simplepf, so it shows
+ * the directory of the namespace of whoever looks at it.
+ */
 
 /*
  * @pos is not used in this implementation.
  *
  * Only a write of a full cmd struct (sizeof(struct simplepf_cmd)) is considered
  * valid; -EINVAL is returned on invalid writes and no action is taken.
+ * SIMPLEPF_CMD_REPLACE is the exception; it must be followed by exactly
+ * cmd.nr_rules rules in the same write.
  * -EINVAL is returned if cmd.type is invalid.
  * -EFAULT  is returned if copy_from_user() fails.
  * If the called chain operation (add, flush...) returns an error, this
  * functions propagates that error.
+ * -EPERM is returned if the opener of the file did not have CAP_NET_ADMIN
+ * in the user namespace that owns the network namespace.
  */
 static ssize_t rules_write(struct file *filp, const char __user *buf,
 		size_t nbytes, loff_t *pos)
 {
+	struct net *net = seq_file_net(filp->private_data);
 	struct simplepf_cmd cmd;
 
-	if (nbytes != sizeof cmd) {
+	if (!file_ns_capable(filp, net->user_ns, CAP_NET_ADMIN)) {
+		return -EPERM;
+	}
+
+	if (nbytes < sizeof cmd) {
 		return -EINVAL;
 	}
 
@@ -47,10 +70,14 @@ static ssize_t rules_write(struct file *filp, const char __user *buf,
 		return -EFAULT;
 	}
 
+	if (cmd.type != SIMPLEPF_CMD_REPLACE && nbytes != sizeof cmd) {
+		return -EINVAL;
+	}
+
 	switch (cmd.type) {
 	case SIMPLEPF_CMD_ADD:
 	{
-		int err = simplepf_add_rule(cmd.chain_id, &cmd.rule);
+		int err = simplepf_add_rule(net, cmd.chain_id, &cmd.rule);
 		if (err) {
 			return err;
 		}
@@ -59,7 +86,44 @@ static ssize_t rules_write(struct file *filp, const char __user *buf,
 
 	case SIMPLEPF_CMD_FLUSH:
 	{
-		int err = simplepf_flush_chain(cmd.chain_id);
+		int err = simplepf_flush_chain(net, cmd.chain_id);
+		if (err) {
+			return err;
+		}
+	}
+	break;
+
+	case SIMPLEPF_CMD_REPLACE:
+	{
+		struct simplepf_rule *rules;
+		size_t rules_size;
+		int err;
+
+		if (cmd.nr_rules > SIMPLEPF_MAX_RULES) {
+			return -E2BIG;
+		}
+
+		rules_size = (size_t)cmd.nr_rules * sizeof *rules;
+		if (nbytes != sizeof cmd + rules_size) {
+			return -EINVAL;
+		}
+
+		rules = vmemdup_user(buf + sizeof cmd, rules_size);
+		if (IS_ERR(rules)) {
+			return PTR_ERR(rules);
+		}
+
+		err = simplepf_replace_chain(net, cmd.chain_id, rules, cmd.nr_rules);
+		kvfree(rules);
+		if (err) {
+			return err;
+		}
+	}
+	break;
+
+	case SIMPLEPF_CMD_SET_ENGINE:
+	{
+		int err = simplepf_set_engine(net, cmd.chain_id, cmd.engine);
 		if (err) {
 			return err;
 		}
@@ -76,52 +140,136 @@ static ssize_t rules_write(struct file *filp, const char __user *buf,
 	return nbytes;
 }
 
+static int rules_open(struct inode *inode, struct file *filp)
+{
+	return seq_open_net(inode, filp, &simplepf_rules_seq_ops,
+			sizeof(struct simplepf_chains_iter));
+}
+
 static struct file_operations rules_fops = {
 	.owner = THIS_MODULE,
-	.write = rules_write
+	.open = rules_open,
+	.read = seq_read,
+	.write = rules_write,
+	.llseek = seq_lseek,
+	.release = seq_release_net
+};
+
+static int stats_open(struct inode *inode, struct file *filp)
+{
+	return seq_open_net(inode, filp, &simplepf_stats_seq_ops,
+			sizeof(struct simplepf_chains_iter));
+}
+
+static struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release_net
 };
 
 /*
- * /proc/simplepf/ directory.
+ * /proc/net/simplepf/rules file.
+ * User writes a simplepf_cmd struct to this file to manipulate the chains,
+ * see uapi/simplepf.h for the commands.
+ * Reading it dumps the rules of all chains, one per line, in the format
+ * described at simplepf_rules_seq_ops.
+ *
+ * /proc/net/simplepf/stats file.
+ * Read only. For every chain, a line with its engine, one line per rule and
+ * one line for the default policy, after lines for the flow cache and the
+ * packet log:
+ *  flowcache buckets <n> ways <n> hits <n> misses <n> evictions <n>
+ *  log records <n> dropped <n>
+ *  <chain> engine <name> build_us <n> [<engine statistics>]
+ *  <chain> rule <index> packets <n> bytes <n>
+ *  <chain> policy <action> packets <n> bytes <n>
+ * Counters are summed across CPUs at read time. The flow cache and the log
+ * are shared by all namespaces, so their lines are the same in all of them.
+ *
+ * The files of a namespace belong to the root user of its user namespace,
+ * if it has one, so a container can manage its own chains.
  */
-static struct proc_dir_entry *proc_dir;
+static int __net_init proc_net_init(struct net *net)
+{
+	struct proc_dir_entry *dir;
+	struct proc_dir_entry *rules;
+	struct proc_dir_entry *stats;
+	kuid_t uid = make_kuid(net->user_ns, 0);
+	kgid_t gid = make_kgid(net->user_ns, 0);
+
+	dir = proc_net_mkdir(net, "simplepf", net->proc_net);
+	if (!dir) {
+		goto proc_dir_fail;
+	}
+
+	rules = proc_create("rules", 0600, dir, &rules_fops);
+	if (!rules) {
+		goto proc_files_fail;
+	}
+
+	stats = proc_create("stats", 0444, dir, &stats_fops);
+	if (!stats) {
+		goto proc_files_fail;
+	}
+
+	if (uid_valid(uid) && gid_valid(gid)) {
+		proc_set_user(dir, uid, gid);
+		proc_set_user(rules, uid, gid);
+		proc_set_user(stats, uid, gid);
+	}
+
+	return 0;
+
+proc_files_fail:
+	remove_proc_subtree("simplepf", net->proc_net);
+proc_dir_fail:
+	printk(KERN_INFO "simplepf: Failed to create /proc/net/simplepf\n");
+	return -ENOMEM;
+}
+
+static void __net_exit proc_net_exit(struct net *net)
+{
+	remove_proc_subtree("simplepf", net->proc_net);
+}
+
+static struct pernet_operations proc_net_ops = {
+	.init = proc_net_init,
+	.exit = proc_net_exit,
+};
 
 /*
- * /proc/simplepf/rules file.
- * User writes a simplepf_cmd struct to this file to manipulate the chains.
- * TODO: Define the commands and document them.
- * TODO: What to do on read? How to present existing rules to user?
+ * /proc/simplepf link.
  */
-static struct proc_dir_entry *proc_rules;
+static struct proc_dir_entry *proc_link;
 
 int __init simplepf_proc_init(void)
 {
 	int err;
 
-	proc_dir = proc_mkdir("simplepf", NULL);
-	if (!proc_dir) {
-		err = -ENOMEM;
-		printk(KERN_INFO "simplepf: Failed to create /proc/simplepf\n");
-		goto proc_dir_fail;
+	err = register_pernet_subsys(&proc_net_ops);
+	if (err) {
+		goto proc_net_fail;
 	}
 
-	proc_rules = proc_create("rules", 0200, proc_dir, &rules_fops);
-	if (!proc_rules) {
+	proc_link = proc_symlink("simplepf", NULL, "net/simplepf");
+	if (!proc_link) {
 		err = -ENOMEM;
-		printk(KERN_INFO "simplepf: Failed to create /proc/simplepf/rules\n");
-		goto proc_rules_fail;
+		printk(KERN_INFO "simplepf: Failed to create /proc/simplepf\n");
+		goto proc_link_fail;
 	}
 
 	return 0;
 
-proc_rules_fail:
-	proc_remove(proc_dir);
-proc_dir_fail:
+proc_link_fail:
+	unregister_pernet_subsys(&proc_net_ops);
+proc_net_fail:
 	return err;
 }
 
-void __exit simplepf_proc_cleanup(void)
+void simplepf_proc_cleanup(void)
 {
-	proc_remove(proc_rules);
-	proc_remove(proc_dir);
+	proc_remove(proc_link);
+	unregister_pernet_subsys(&proc_net_ops);
 }
@@ -21,6 +21,6 @@
 
 int __init simplepf_proc_init(void);
 
-void __exit simplepf_proc_cleanup(void);
+void simplepf_proc_cleanup(void);
 
 #endif	/* _SIMPLEPF_PROC_H */
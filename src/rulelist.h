@@ -0,0 +1,173 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMPLEPF_RULELIST_H
+#define _SIMPLEPF_RULELIST_H
+
+#include "engine.h"
+#include "match.h"
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/string.h>
+
+/*
+ * A list of candidate rule indices, in ascending order, as kept by the
+ * engines that narrow the chain down to a few candidates and then check
+ * them with the reference matcher.
+ */
+struct rule_list {
+	u32 *index;
+	u32 nr;
+	u32 max;
+};
+
+/*
+ * Append a rule index; indices must be appended in ascending order.
+ * Returns 0 on success, -ENOMEM on allocation failure.
+ */
+static inline int rule_list_append(struct rule_list *list, u32 index)
+{
+	if (list->nr == list->max) {
+		u32 max = max(2 * list->max, 4U);
+		u32 *new;
+
+		new = kvmalloc_array(max, sizeof *new, GFP_KERNEL);
+		if (!new) {
+			return -ENOMEM;
+		}
+		if (list->index) {
+			memcpy(new, list->index, list->nr * sizeof *new);
+			kvfree(list->index);
+		}
+		list->index = new;
+		list->max = max;
+	}
+	list->index[list->nr++] = index;
+
+	return 0;
+}
+
+static inline void rule_list_free(struct rule_list *list)
+{
+	kvfree(list->index);
+}
+
+/*
+ * Returns the index of the first rule in @list that matches the packet,
+ * if it is below @best; @best otherwise.
+ * Adds the number of rules it tried to *@scanned.
+ */
+static inline u32 rule_list_match(const struct rule_list *list,
+		const struct chain_rule *rules,
+		const struct simplepf_packet *pkt, u32 best,
+		unsigned int *scanned)
+{
+	u32 i;
+
+	for (i = 0; i < list->nr && list->index[i] < best; i++) {
+		if (simplepf_match_rule(&rules[list->index[i]].rule, pkt) !=
+				__SIMPLEPF_ACTION_LAST) {
+			*scanned += i + 1;
+			return list->index[i];
+		}
+	}
+
+	*scanned += i;
+	return best;
+}
+
+/*
+ * The rules an engine doesn't index itself, compiled with another engine,
+ * so that they don't make a list every packet has to be checked against.
+ * Append their indices to @index in ascending order, then call
+ * rule_subset_build().
+ */
+struct rule_subset {
+	struct rule_list index;
+	struct chain_rule *rules;
+	const struct simplepf_engine *engine;
+	void *priv;
+};
+
+/*
+ * Compile the rules of @index, out of @rules, with @engine.
+ * Returns 0, or a negative error code.
+ */
+static inline int rule_subset_build(struct rule_subset *sub,
+		const struct simplepf_engine *engine,
+		const struct chain_rule *rules)
+{
+	void *priv;
+	u32 i;
+
+	if (!sub->index.nr) {
+		return 0;
+	}
+
+	sub->rules = kvmalloc_array(sub->index.nr, sizeof *sub->rules,
+			GFP_KERNEL);
+	if (!sub->rules) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < sub->index.nr; i++) {
+		sub->rules[i] = rules[sub->index.index[i]];
+	}
+
+	sub->engine = engine;
+	priv = engine->build(sub->rules, sub->index.nr);
+	if (IS_ERR(priv)) {
+		return PTR_ERR(priv);
+	}
+	sub->priv = priv;
+
+	return 0;
+}
+
+static inline void rule_subset_free(struct rule_subset *sub)
+{
+	if (sub->priv) {
+		sub->engine->destroy(sub->priv);
+	}
+	kvfree(sub->rules);
+	rule_list_free(&sub->index);
+}
+
+/*
+ * As rule_list_match(), for the rules of the subset.
+ */
+static inline u32 rule_subset_match(const struct rule_subset *sub,
+		const struct simplepf_packet *pkt, u32 best,
+		unsigned int *scanned)
+{
+	unsigned int sub_scanned;
+	u32 i;
+
+	if (!sub->index.nr || sub->index.index[0] >= best) {
+		return best;
+	}
+
+	i = sub->engine->classify(sub->priv, sub->rules, sub->index.nr, pkt,
+			&sub_scanned);
+	*scanned += sub_scanned;
+
+	return i < sub->index.nr ? min(sub->index.index[i], best) : best;
+}
+
+#endif	/* _SIMPLEPF_RULELIST_H */
@@ -0,0 +1,789 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * In-kernel benchmark and selftest of chain traversal, driven through
+ * debugfs.
+ *
+ * Writing a configuration to <debugfs>/simplepf/selftest builds a set of
+ * synthetic skbs, one per flow, after the packet mix it asks for, and runs
+ * them through simplepf_traverse_chain() on every online CPU at once, from
+ * a kthread bound to each, with bottom halves disabled as in the receive
+ * path. The chain is the one of the namespace of the writer, with whatever
+ * rules it has, so load a ruleset first. The write returns when the run is
+ * over; reading the file then gives the report: cycles and nanoseconds per
+ * packet and the distribution of the cycles of single traversals, per CPU
+ * and overall, and the verdicts.
+ *
+ * With updates=1, another kthread republishes the chain unchanged (see
+ * simplepf_republish_chain()) for as long as the readers run, which shows
+ * their jitter under updates. The verdict of every flow is taken before the
+ * run, and a traversal that gives another one is counted as an error, so
+ * the run is a selftest of the update path too; the write fails with -EIO
+ * if there were errors. Don't change the chain during a run.
+ *
+ * The packets are counted in the counters of the chain like any other.
+ *
+ * Configuration, space separated key=value pairs, all optional:
+ *  chain=<name>           IPv4 chain to traverse (input)
+ *  packets=<n>            traversals per CPU (1000000)
+ *  flows=<n>              distinct packets (4096); fewer than the flow cache
+ *                         holds measure the cache, more the engine
+ *  tcp=<n> udp=<n> icmp=<n>
+ *                         weights of the protocols in the mix (60, 30, 10)
+ *  src=<addr>/<len> dst=<addr>/<len>
+ *                         where the addresses are drawn from (10.0.0.0/8)
+ *  dport=<port>[-<port>]  where TCP/UDP destination ports are drawn from
+ *                         (1-65535); source ports are random
+ *  dev=<name>             the interface of the packets, for interface rules
+ *                         (none)
+ *  updates=<0|1>          republish the chain during the run (0)
+ *  update_us=<n>          pause between republishes, each of which
+ *                         leaves a table to free after a grace period (100)
+ */
+
+#include "uapi/simplepf.h"
+#include "chains.h"
+#include "selftest.h"
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/sched.h>
+#include <linux/nsproxy.h>
+#include <linux/cpu.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/icmp.h>
+#include <linux/inet.h>
+#include <linux/inetdevice.h>
+#include <linux/random.h>
+#include <linux/timex.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/bottom_half.h>
+#include <net/net_namespace.h>
+
+#define SELFTEST_MAX_PACKETS 100000000U
+#define SELFTEST_MAX_FLOWS (1U << 20)
+
+/* Traversals between two chances to reschedule. */
+#define SELFTEST_BATCH 1024
+
+/* Log2 buckets of the cycles of a traversal. */
+#define SELFTEST_HIST_BUCKETS 64
+
+struct selftest_config {
+	enum simplepf_chain_id chain_id;
+	unsigned int packets;
+	unsigned int flows;
+	unsigned int weights[3];
+	__be32 saddr;
+	u8 saddr_prefixlen;
+	__be32 daddr;
+	u8 daddr_prefixlen;
+	u16 dport_min;
+	u16 dport_max;
+	char dev[IFNAMSIZ];
+	bool updates;
+	unsigned int update_us;
+};
+
+/* The protocols of the mix, by index in the weights. */
+static const u8 selftest_protocols[] = { IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP };
+
+/*
+ * The results of the reader of a CPU.
+ */
+struct selftest_cpu {
+	struct selftest *st;
+	struct task_struct *task;
+	u64 cycles;
+	u64 ns;
+	u64 max;
+	u64 hist[SELFTEST_HIST_BUCKETS];
+	u64 verdicts[__SIMPLEPF_ACTION_LAST];
+	u64 errors;
+};
+
+struct selftest {
+	const struct selftest_config *cfg;
+	struct nf_hook_state state;
+	struct sk_buff **skbs;
+	/* The verdict of every flow before the run. */
+	u8 *expected;
+	struct selftest_cpu *cpus;
+	/* Readers that are ready to go, then readers that are running. */
+	atomic_t ready;
+	atomic_t running;
+	bool go;
+	struct completion done;
+	struct task_struct *updater;
+	u64 updates;
+	int update_err;
+};
+
+/*
+ * Serializes runs, and protects the report of the last one.
+ */
+static DEFINE_MUTEX(selftest_mutex);
+static char *selftest_report;
+static size_t selftest_report_len;
+
+static struct sk_buff *selftest_alloc_skb(const struct selftest_config *cfg)
+{
+	unsigned int total = 0;
+	unsigned int pick;
+	unsigned int i;
+	struct sk_buff *skb;
+	struct iphdr *ip;
+	unsigned int len;
+	u8 protocol;
+
+	for (i = 0; i < ARRAY_SIZE(cfg->weights); i++) {
+		total += cfg->weights[i];
+	}
+	pick = prandom_u32_max(total);
+	for (i = 0; pick >= cfg->weights[i]; i++) {
+		pick -= cfg->weights[i];
+	}
+	protocol = selftest_protocols[i];
+
+	switch (protocol) {
+	case IPPROTO_TCP:
+		len = sizeof(struct tcphdr);
+	break;
+
+	case IPPROTO_UDP:
+		len = sizeof(struct udphdr);
+	break;
+
+	default:
+		len = sizeof(struct icmphdr);
+	break;
+	}
+	len += sizeof(struct iphdr);
+
+	skb = alloc_skb(LL_MAX_HEADER + len, GFP_KERNEL);
+	if (!skb) {
+		return NULL;
+	}
+	skb_reserve(skb, LL_MAX_HEADER);
+	skb->protocol = htons(ETH_P_IP);
+
+	skb_reset_network_header(skb);
+	ip = skb_put_zero(skb, sizeof *ip);
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->tot_len = htons(len);
+	ip->ttl = 64;
+	ip->protocol = protocol;
+	ip->saddr = cfg->saddr | (get_random_u32() &
+			~inet_make_mask(cfg->saddr_prefixlen));
+	ip->daddr = cfg->daddr | (get_random_u32() &
+			~inet_make_mask(cfg->daddr_prefixlen));
+
+	skb_set_transport_header(skb, sizeof *ip);
+	switch (protocol) {
+	case IPPROTO_TCP:
+	{
+		struct tcphdr *th = skb_put_zero(skb, sizeof *th);
+
+		th->source = htons(1 + prandom_u32_max(65535));
+		th->dest = htons(cfg->dport_min +
+				prandom_u32_max(cfg->dport_max -
+					cfg->dport_min + 1));
+		th->doff = sizeof *th / 4;
+	}
+	break;
+
+	case IPPROTO_UDP:
+	{
+		struct udphdr *uh = skb_put_zero(skb, sizeof *uh);
+
+		uh->source = htons(1 + prandom_u32_max(65535));
+		uh->dest = htons(cfg->dport_min +
+				prandom_u32_max(cfg->dport_max -
+					cfg->dport_min + 1));
+		uh->len = htons(sizeof *uh);
+	}
+	break;
+
+	default:
+	{
+		struct icmphdr *icmph = skb_put_zero(skb, sizeof *icmph);
+
+		icmph->type = prandom_u32_max(NR_ICMP_TYPES + 1);
+	}
+	break;
+	}
+
+	return skb;
+}
+
+static int selftest_reader(void *data)
+{
+	struct selftest_cpu *sc = data;
+	struct selftest *st = sc->st;
+	const struct selftest_config *cfg = st->cfg;
+	unsigned int flow = 0;
+	unsigned int i;
+	u64 start;
+
+	atomic_inc(&st->ready);
+	/* Yield while waiting: the writer may be on this CPU. */
+	while (!READ_ONCE(st->go)) {
+		cond_resched();
+	}
+
+	start = ktime_get_ns();
+	local_bh_disable();
+	for (i = 0; i < cfg->packets; i++) {
+		enum simplepf_action action;
+		cycles_t t;
+
+		t = get_cycles();
+		action = simplepf_traverse_chain(cfg->chain_id, st->skbs[flow],
+				&st->state);
+		t = get_cycles() - t;
+
+		sc->cycles += t;
+		sc->max = max_t(u64, sc->max, t);
+		sc->hist[t ? ilog2(t) : 0]++;
+		if (action < __SIMPLEPF_ACTION_LAST) {
+			sc->verdicts[action]++;
+		}
+		if (action != st->expected[flow]) {
+			sc->errors++;
+		}
+
+		if (++flow == cfg->flows) {
+			flow = 0;
+		}
+		if (i % SELFTEST_BATCH == SELFTEST_BATCH - 1) {
+			local_bh_enable();
+			cond_resched();
+			local_bh_disable();
+		}
+	}
+	local_bh_enable();
+	sc->ns = ktime_get_ns() - start;
+
+	if (atomic_dec_and_test(&st->running)) {
+		complete(&st->done);
+	}
+
+	/* Wait to be reaped by kthread_stop(). */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static int selftest_updater(void *data)
+{
+	struct selftest *st = data;
+	const struct selftest_config *cfg = st->cfg;
+
+	while (!kthread_should_stop()) {
+		int err = simplepf_republish_chain(st->state.net,
+				cfg->chain_id);
+
+		if (err) {
+			st->update_err = err;
+			break;
+		}
+		st->updates++;
+
+		if (cfg->update_us) {
+			usleep_range(cfg->update_us, cfg->update_us + 1);
+		} else {
+			cond_resched();
+		}
+	}
+
+	/* Wait to be reaped by kthread_stop(). */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+/*
+ * The upper bound of the bucket the @permille per mille quantile of the
+ * traversals is in.
+ */
+static u64 selftest_quantile(const u64 *hist, u64 total, unsigned int permille)
+{
+	u64 target = div_u64(total * permille + 999, 1000);
+	u64 seen = 0;
+	unsigned int b;
+
+	for (b = 0; b < SELFTEST_HIST_BUCKETS - 1; b++) {
+		seen += hist[b];
+		if (seen >= target) {
+			break;
+		}
+	}
+
+	return 2ULL << b;
+}
+
+static size_t selftest_print_line(char *buf, size_t size, const char *what,
+		const struct selftest_cpu *sc, u64 packets)
+{
+	return scnprintf(buf, size,
+			"%s cycles/pkt %llu ns/pkt %llu p50 <%llu p99 <%llu p99.9 <%llu max %llu\n",
+			what, div64_u64(sc->cycles, packets),
+			div64_u64(sc->ns, packets),
+			selftest_quantile(sc->hist, packets, 500),
+			selftest_quantile(sc->hist, packets, 990),
+			selftest_quantile(sc->hist, packets, 999),
+			sc->max);
+}
+
+/*
+ * Sum up the results of the CPUs and replace the report with them.
+ * Returns -EIO if there were errors, or -ENOMEM if there is no memory for
+ * the report.
+ */
+static int selftest_make_report(const struct selftest *st)
+{
+	const struct selftest_config *cfg = st->cfg;
+	struct selftest_cpu all = { 0 };
+	unsigned int nr_cpus = 0;
+	size_t size = (num_online_cpus() + 4) * 128;
+	size_t len = 0;
+	char *buf;
+	char name[16];
+	unsigned int b;
+	int cpu;
+
+	buf = kvmalloc(size, GFP_KERNEL);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	len += scnprintf(buf + len, size - len,
+			"chain %s flows %u packets/cpu %u\n",
+			simplepf_chain_name(cfg->chain_id), cfg->flows,
+			cfg->packets);
+
+	for_each_possible_cpu(cpu) {
+		const struct selftest_cpu *sc = &st->cpus[cpu];
+
+		if (!sc->task) {
+			continue;
+		}
+		nr_cpus++;
+		snprintf(name, sizeof name, "cpu %d", cpu);
+		len += selftest_print_line(buf + len, size - len, name, sc,
+				cfg->packets);
+
+		all.cycles += sc->cycles;
+		all.ns += sc->ns;
+		all.max = max(all.max, sc->max);
+		for (b = 0; b < SELFTEST_HIST_BUCKETS; b++) {
+			all.hist[b] += sc->hist[b];
+		}
+		for (b = 0; b < __SIMPLEPF_ACTION_LAST; b++) {
+			all.verdicts[b] += sc->verdicts[b];
+		}
+		all.errors += sc->errors;
+	}
+
+	if (nr_cpus) {
+		len += selftest_print_line(buf + len, size - len, "all", &all,
+				(u64)cfg->packets * nr_cpus);
+	}
+	len += scnprintf(buf + len, size - len,
+			"cpus %u accept %llu drop %llu errors %llu updates %llu",
+			nr_cpus, all.verdicts[SIMPLEPF_ACTION_ACCEPT],
+			all.verdicts[SIMPLEPF_ACTION_DROP], all.errors,
+			st->updates);
+	if (st->update_err) {
+		len += scnprintf(buf + len, size - len, " update_error %d",
+				st->update_err);
+	}
+	len += scnprintf(buf + len, size - len, "\n");
+
+	kvfree(selftest_report);
+	selftest_report = buf;
+	selftest_report_len = len;
+
+	return all.errors ? -EIO : 0;
+}
+
+/*
+ * Run the selftest with the given configuration on the chains of @net.
+ * Called with selftest_mutex held.
+ * Returns 0 on success, -EIO if a traversal gave an unexpected verdict,
+ * or another negative error code if it could not be run.
+ */
+static int selftest_run(const struct selftest_config *cfg, struct net *net)
+{
+	struct net_device *dev = NULL;
+	struct selftest *st;
+	unsigned int i;
+	int cpu;
+	int err;
+
+	st = kzalloc(sizeof *st, GFP_KERNEL);
+	if (!st) {
+		return -ENOMEM;
+	}
+	st->cfg = cfg;
+	init_completion(&st->done);
+
+	if (cfg->dev[0]) {
+		dev = dev_get_by_name(net, cfg->dev);
+		if (!dev) {
+			err = -ENODEV;
+			goto free_st;
+		}
+	}
+	st->state.pf = NFPROTO_IPV4;
+	st->state.net = net;
+	if (cfg->chain_id == SIMPLEPF_CHAIN_OUTPUT) {
+		st->state.out = dev;
+	} else {
+		st->state.in = dev;
+	}
+
+	st->skbs = kvcalloc(cfg->flows, sizeof *st->skbs, GFP_KERNEL);
+	st->expected = kvmalloc(cfg->flows, GFP_KERNEL);
+	st->cpus = kvcalloc(nr_cpu_ids, sizeof *st->cpus, GFP_KERNEL);
+	if (!st->skbs || !st->expected || !st->cpus) {
+		err = -ENOMEM;
+		goto free_skbs;
+	}
+
+	for (i = 0; i < cfg->flows; i++) {
+		st->skbs[i] = selftest_alloc_skb(cfg);
+		if (!st->skbs[i]) {
+			err = -ENOMEM;
+			goto free_skbs;
+		}
+		local_bh_disable();
+		st->expected[i] = simplepf_traverse_chain(cfg->chain_id,
+				st->skbs[i], &st->state);
+		local_bh_enable();
+	}
+
+	cpus_read_lock();
+	for_each_online_cpu(cpu) {
+		struct selftest_cpu *sc = &st->cpus[cpu];
+		struct task_struct *task;
+
+		sc->st = st;
+		task = kthread_create_on_cpu(selftest_reader, sc, cpu,
+				"simplepf_st/%u");
+		if (IS_ERR(task)) {
+			err = PTR_ERR(task);
+			cpus_read_unlock();
+			goto stop_readers;
+		}
+		sc->task = task;
+		atomic_inc(&st->running);
+	}
+	cpus_read_unlock();
+
+	for_each_possible_cpu(cpu) {
+		if (st->cpus[cpu].task) {
+			wake_up_process(st->cpus[cpu].task);
+		}
+	}
+	while (atomic_read(&st->ready) < atomic_read(&st->running)) {
+		schedule_timeout_uninterruptible(1);
+	}
+
+	if (cfg->updates) {
+		st->updater = kthread_run(selftest_updater, st,
+				"simplepf_st_upd");
+		if (IS_ERR(st->updater)) {
+			err = PTR_ERR(st->updater);
+			st->updater = NULL;
+			goto stop_readers;
+		}
+	}
+
+	WRITE_ONCE(st->go, true);
+	wait_for_completion(&st->done);
+
+	if (st->updater) {
+		kthread_stop(st->updater);
+	}
+	err = selftest_make_report(st);
+
+stop_readers:
+	/*
+	 * On error, the readers that were created are released and run too;
+	 * wait for them like after a complete run.
+	 */
+	if (!READ_ONCE(st->go)) {
+		WRITE_ONCE(st->go, true);
+		for_each_possible_cpu(cpu) {
+			if (st->cpus[cpu].task) {
+				wake_up_process(st->cpus[cpu].task);
+			}
+		}
+		if (atomic_read(&st->running)) {
+			wait_for_completion(&st->done);
+		}
+	}
+	for_each_possible_cpu(cpu) {
+		if (st->cpus[cpu].task) {
+			kthread_stop(st->cpus[cpu].task);
+		}
+	}
+free_skbs:
+	for (i = 0; st->skbs && i < cfg->flows; i++) {
+		kfree_skb(st->skbs[i]);
+	}
+	kvfree(st->cpus);
+	kvfree(st->expected);
+	kvfree(st->skbs);
+	if (dev) {
+		dev_put(dev);
+	}
+free_st:
+	kfree(st);
+	return err;
+}
+
+static int selftest_parse_prefix(char *arg, __be32 *addr, u8 *prefixlen)
+{
+	char *len = strchr(arg, '/');
+	unsigned int n = 32;
+
+	if (len) {
+		*len++ = '\0';
+		if (kstrtouint(len, 10, &n) || n > 32) {
+			return -EINVAL;
+		}
+	}
+	if (!in4_pton(arg, -1, (u8 *)addr, -1, NULL)) {
+		return -EINVAL;
+	}
+	*prefixlen = n;
+	*addr &= inet_make_mask(n);
+
+	return 0;
+}
+
+static int selftest_parse_ports(char *arg, u16 *min, u16 *max)
+{
+	char *last = strchr(arg, '-');
+
+	if (last) {
+		*last++ = '\0';
+	}
+	if (kstrtou16(arg, 10, min) || kstrtou16(last ? last : arg, 10, max) ||
+			*min > *max) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int selftest_parse_chain(const char *arg,
+		enum simplepf_chain_id *chain_id)
+{
+	enum simplepf_chain_id id;
+
+	/* The packets are IPv4 ones. */
+	for (id = 0; id < __SIMPLEPF_CHAIN_LAST; id++) {
+		if (!SIMPLEPF_CHAIN_IS_IPV6(id) &&
+				!strcmp(arg, simplepf_chain_name(id))) {
+			*chain_id = id;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Parse the key=value pairs of @args into @cfg.
+ */
+static int selftest_parse(char *args, struct selftest_config *cfg)
+{
+	char *token;
+
+	while ((token = strsep(&args, " \t\n"))) {
+		char *value = strchr(token, '=');
+		int err;
+
+		if (!*token) {
+			continue;
+		}
+		if (!value) {
+			return -EINVAL;
+		}
+		*value++ = '\0';
+
+		if (!strcmp(token, "chain")) {
+			err = selftest_parse_chain(value, &cfg->chain_id);
+		} else if (!strcmp(token, "packets")) {
+			err = kstrtouint(value, 0, &cfg->packets);
+		} else if (!strcmp(token, "flows")) {
+			err = kstrtouint(value, 0, &cfg->flows);
+		} else if (!strcmp(token, "tcp")) {
+			err = kstrtouint(value, 0, &cfg->weights[0]);
+		} else if (!strcmp(token, "udp")) {
+			err = kstrtouint(value, 0, &cfg->weights[1]);
+		} else if (!strcmp(token, "icmp")) {
+			err = kstrtouint(value, 0, &cfg->weights[2]);
+		} else if (!strcmp(token, "src")) {
+			err = selftest_parse_prefix(value, &cfg->saddr,
+					&cfg->saddr_prefixlen);
+		} else if (!strcmp(token, "dst")) {
+			err = selftest_parse_prefix(value, &cfg->daddr,
+					&cfg->daddr_prefixlen);
+		} else if (!strcmp(token, "dport")) {
+			err = selftest_parse_ports(value, &cfg->dport_min,
+					&cfg->dport_max);
+		} else if (!strcmp(token, "dev")) {
+			err = strscpy(cfg->dev, value, sizeof cfg->dev) < 0 ?
+				-EINVAL : 0;
+		} else if (!strcmp(token, "updates")) {
+			err = kstrtobool(value, &cfg->updates);
+		} else if (!strcmp(token, "update_us")) {
+			err = kstrtouint(value, 0, &cfg->update_us);
+		} else {
+			err = -EINVAL;
+		}
+		if (err) {
+			return -EINVAL;
+		}
+	}
+
+	if (!cfg->packets || cfg->packets > SELFTEST_MAX_PACKETS ||
+			!cfg->flows || cfg->flows > SELFTEST_MAX_FLOWS ||
+			(u64)cfg->weights[0] + cfg->weights[1] +
+			cfg->weights[2] == 0 ||
+			(u64)cfg->weights[0] + cfg->weights[1] +
+			cfg->weights[2] > U32_MAX ||
+			cfg->update_us > USEC_PER_SEC) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Writing a configuration runs the selftest with it, see above.
+ * Returns -EINVAL if the configuration is not valid, -EIO if the run had
+ * errors (the report is updated then too), or another error if it could
+ * not be run.
+ */
+static ssize_t selftest_write(struct file *filp, const char __user *buf,
+		size_t nbytes, loff_t *pos)
+{
+	struct selftest_config cfg = {
+		.chain_id = SIMPLEPF_CHAIN_INPUT,
+		.packets = 1000000,
+		.flows = 4096,
+		.weights = { 60, 30, 10 },
+		.saddr = htonl(0x0a000000),
+		.saddr_prefixlen = 8,
+		.daddr = htonl(0x0a000000),
+		.daddr_prefixlen = 8,
+		.dport_min = 1,
+		.dport_max = 65535,
+		.update_us = 100,
+	};
+	char *args;
+	int err;
+
+	if (nbytes >= PAGE_SIZE) {
+		return -EINVAL;
+	}
+
+	args = memdup_user_nul(buf, nbytes);
+	if (IS_ERR(args)) {
+		return PTR_ERR(args);
+	}
+	err = selftest_parse(args, &cfg);
+	kfree(args);
+	if (err) {
+		return err;
+	}
+
+	err = mutex_lock_interruptible(&selftest_mutex);
+	if (err) {
+		return err;
+	}
+	err = selftest_run(&cfg, current->nsproxy->net_ns);
+	mutex_unlock(&selftest_mutex);
+
+	return err ? err : nbytes;
+}
+
+/*
+ * Reading gives the report of the last run.
+ */
+static ssize_t selftest_read(struct file *filp, char __user *buf,
+		size_t nbytes, loff_t *pos)
+{
+	ssize_t ret;
+
+	mutex_lock(&selftest_mutex);
+	ret = simple_read_from_buffer(buf, nbytes, pos, selftest_report,
+			selftest_report_len);
+	mutex_unlock(&selftest_mutex);
+
+	return ret;
+}
+
+static const struct file_operations selftest_fops = {
+	.owner = THIS_MODULE,
+	.read = selftest_read,
+	.write = selftest_write,
+	.llseek = default_llseek,
+};
+
+void __init simplepf_selftest_init(struct dentry *dir)
+{
+	debugfs_create_file("selftest", 0600, dir, NULL, &selftest_fops);
+}
+
+void simplepf_selftest_cleanup(void)
+{
+	kvfree(selftest_report);
+}
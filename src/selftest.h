@@ -0,0 +1,36 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMPLEPF_SELFTEST_H
+#define _SIMPLEPF_SELFTEST_H
+
+#include <linux/dcache.h>
+
+/*
+ * Create the selftest file in the debugfs directory @dir, see selftest.c.
+ * Without debugfs, there is simply no selftest.
+ */
+void __init simplepf_selftest_init(struct dentry *dir);
+
+/*
+ * Free the last report, once the file is removed. No run is in progress
+ * then: a run holds the file open, and with it a reference to the module.
+ */
+void simplepf_selftest_cleanup(void);
+
+#endif	/* _SIMPLEPF_SELFTEST_H */
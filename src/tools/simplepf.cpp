@@ -17,19 +17,36 @@
  */
 
 #include "../uapi/simplepf.h"
+#include "../xdp/simplepf_xdp.h"
 
 #include <cstring>
 #include <cerrno>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <net/if.h>
 #include <linux/types.h>
+#include <linux/bpf.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string>
+#include <vector>
+#include <array>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <random>
+#include <chrono>
 #include <stdexcept>
 #include <boost/program_options.hpp>
 
@@ -59,25 +76,2214 @@ void option_dependency(const po::variables_map& vm,
 					+ "' requires option '" + required_option + "'.");
 }
 
+/* Parse a chain name given on the command line. Returns false if the name
+   is not valid. */
+bool parse_chain_name(const std::string& name, enum simplepf_chain_id& chain_id)
+{
+	if (name == "input") {
+		chain_id = SIMPLEPF_CHAIN_INPUT;
+	} else if (name == "output") {
+		chain_id = SIMPLEPF_CHAIN_OUTPUT;
+	} else if (name == "prerouting") {
+		chain_id = SIMPLEPF_CHAIN_PREROUTING;
+	} else if (name == "forward") {
+		chain_id = SIMPLEPF_CHAIN_FORWARD;
+	} else if (name == "ingress") {
+		chain_id = SIMPLEPF_CHAIN_INGRESS;
+	} else if (name == "input6") {
+		chain_id = SIMPLEPF_CHAIN_INPUT6;
+	} else if (name == "output6") {
+		chain_id = SIMPLEPF_CHAIN_OUTPUT6;
+	} else if (name == "prerouting6") {
+		chain_id = SIMPLEPF_CHAIN_PREROUTING6;
+	} else if (name == "forward6") {
+		chain_id = SIMPLEPF_CHAIN_FORWARD6;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/* The name of a chain, as in the rule dump. */
+const char *chain_name(enum simplepf_chain_id chain_id)
+{
+	static const char *names[] = {
+		"input", "output", "prerouting", "forward", "ingress",
+		"input6", "output6", "prerouting6", "forward6"
+	};
+
+	return chain_id < __SIMPLEPF_CHAIN_LAST ? names[chain_id] : "unknown";
+}
+
+/* Split an "address[/prefixlen]" argument of a chain. prefixlen is 0 (i.e.
+   an exact match) if not given. Returns false if the prefix length is not
+   valid, i.e. not in 1-32, or 1-128 for an IPv6 chain. */
+bool split_prefix(const std::string& arg, enum simplepf_chain_id chain_id,
+		std::string& addr, std::uint8_t& prefixlen)
+{
+	unsigned long max_len = SIMPLEPF_CHAIN_IS_IPV6(chain_id) ? 128 : 32;
+
+	auto slash = arg.find('/');
+
+	prefixlen = 0;
+	addr = arg.substr(0, slash);
+	if (slash == std::string::npos) {
+		return true;
+	}
+
+	try {
+		std::size_t end;
+		auto len = std::stoul(arg.substr(slash + 1), &end);
+		if (end != arg.size() - slash - 1 || len < 1 || len > max_len) {
+			return false;
+		}
+		prefixlen = len;
+	} catch (const std::exception&) {
+		return false;
+	}
+	return true;
+}
+
+/* Parse a "port[-port]" argument into the first and last port of the
+   range, in host byte order. Returns false if it's not a valid range. */
+bool parse_port_range(const std::string& arg, std::uint16_t& first, std::uint16_t& last)
+{
+	auto dash = arg.find('-');
+
+	try {
+		std::size_t end;
+		auto lo = std::stoul(arg.substr(0, dash), &end);
+		if (end != arg.substr(0, dash).size() || lo > 65535) {
+			return false;
+		}
+		auto hi = lo;
+		if (dash != std::string::npos) {
+			hi = std::stoul(arg.substr(dash + 1), &end);
+			if (end != arg.size() - dash - 1 || hi > 65535 || hi < lo) {
+				return false;
+			}
+		}
+		first = lo;
+		last = hi;
+	} catch (const std::exception&) {
+		return false;
+	}
+	return true;
+}
+
+/* Parse a number from 0 to 255. Returns false if it's not valid. */
+bool parse_byte(const std::string& arg, std::uint8_t& value)
+{
+	try {
+		std::size_t end;
+		auto v = std::stoul(arg, &end);
+		if (end != arg.size() || v > 255) {
+			return false;
+		}
+		value = v;
+	} catch (const std::exception&) {
+		return false;
+	}
+	return true;
+}
+
+/* Look up the index of an interface given by name, or by index as the
+   rule dump shows interfaces that are gone. Returns false if there is no
+   such interface. */
+bool parse_iface(const std::string& arg, std::uint32_t& ifindex)
+{
+	ifindex = if_nametoindex(arg.c_str());
+	if (ifindex) {
+		return true;
+	}
+
+	try {
+		std::size_t end;
+		auto index = std::stoul(arg, &end);
+		if (end != arg.size() || index < 1 || index > INT32_MAX) {
+			return false;
+		}
+		ifindex = index;
+	} catch (const std::exception&) {
+		return false;
+	}
+	return true;
+}
+
+/* Parse an "address[/prefixlen]" of a chain into a rule's fields: an IPv4
+   address into the first word of addr, an IPv6 one into all four.
+   Returns false if it's not valid. */
+bool parse_prefix(const std::string& arg, enum simplepf_chain_id chain_id,
+		std::uint32_t addr[4], std::uint8_t& prefixlen)
+{
+	std::string addr_str;
+
+	return split_prefix(arg, chain_id, addr_str, prefixlen)
+		&& inet_pton(SIMPLEPF_CHAIN_IS_IPV6(chain_id) ? AF_INET6 : AF_INET,
+				addr_str.c_str(), addr) == 1;
+}
+
+/* Parse a line of the rule dump of /proc/simplepf/rules, e.g.
+   "input src 10.0.0.0/8 proto tcp dport 80-90 drop". The rule comes out
+   in the canonical form the module dumps it in. Returns false if the line
+   is not valid. */
+bool parse_rule_line(const std::string& line, enum simplepf_chain_id& chain_id,
+		struct simplepf_rule& rule)
+{
+	std::istringstream words(line);
+	std::string word;
+	std::string arg;
+
+	std::memset(&rule, 0, sizeof rule);
+	if (!(words >> word) || !parse_chain_name(word, chain_id)) {
+		return false;
+	}
+
+	while (words >> word) {
+		if (word == "accept" || word == "drop") {
+			rule.action = word == "accept" ?
+				SIMPLEPF_ACTION_ACCEPT : SIMPLEPF_ACTION_DROP;
+			return !(words >> word);
+		}
+		if (word == "log") {
+			rule.log = true;
+			continue;
+		}
+		if (!(words >> arg)) {
+			return false;
+		}
+
+		if (word == "src") {
+			rule.filter_saddr = true;
+			if (!parse_prefix(arg, chain_id, rule.ip6_saddr, rule.ip_saddr_prefixlen)) {
+				return false;
+			}
+		} else if (word == "dst") {
+			rule.filter_daddr = true;
+			if (!parse_prefix(arg, chain_id, rule.ip6_daddr, rule.ip_daddr_prefixlen)) {
+				return false;
+			}
+		} else if (word == "proto") {
+			rule.filter_proto = true;
+			if (arg == "icmp") {
+				rule.ip_protocol = IPPROTO_ICMP;
+			} else if (arg == "icmpv6") {
+				rule.ip_protocol = IPPROTO_ICMPV6;
+			} else if (arg == "tcp") {
+				rule.ip_protocol = IPPROTO_TCP;
+			} else if (arg == "udp") {
+				rule.ip_protocol = IPPROTO_UDP;
+			} else if (!parse_byte(arg, rule.ip_protocol)) {
+				return false;
+			}
+		} else if (word == "sport" || word == "dport") {
+			std::uint16_t first, last;
+			if (!parse_port_range(arg, first, last)) {
+				return false;
+			}
+			if (word == "sport") {
+				rule.filter_sport = true;
+				rule.transport_sport = htons(first);
+				rule.transport_sport_max = htons(last);
+			} else {
+				rule.filter_dport = true;
+				rule.transport_dport = htons(first);
+				rule.transport_dport_max = htons(last);
+			}
+		} else if (word == "icmp-type") {
+			rule.filter_icmp_type = true;
+			if (!parse_byte(arg, rule.icmp_type)) {
+				return false;
+			}
+		} else if (word == "iface") {
+			rule.filter_ifindex = true;
+			if (!parse_iface(arg, rule.ifindex)) {
+				return false;
+			}
+		} else {
+			return false;
+		}
+	}
+
+	/* No action. */
+	return false;
+}
+
+/* Read the rules of the chain from the rule dump. Returns false if the
+   dump can't be read. */
+bool read_chain_rules(enum simplepf_chain_id chain_id, std::vector<struct simplepf_rule>& rules)
+{
+	std::ifstream dump("/proc/simplepf/rules");
+	std::string line;
+
+	if (!dump) {
+		std::cerr << "Unable to open simplepf proc file\n";
+		return false;
+	}
+
+	while (std::getline(dump, line)) {
+		enum simplepf_chain_id line_chain;
+		struct simplepf_rule rule;
+
+		if (!parse_rule_line(line, line_chain, rule)) {
+			std::cerr << "Unexpected line in the rule dump: " << line << '\n';
+			return false;
+		}
+		if (line_chain == chain_id) {
+			rules.push_back(rule);
+		}
+	}
+	return true;
+}
+
+/* Thin wrappers of the bpf() system call, for the maps of the XDP
+   program. They return -1 and set errno on failure. */
+int bpf_obj_get(const std::string& path)
+{
+	union bpf_attr attr;
+
+	std::memset(&attr, 0, sizeof attr);
+	attr.pathname = reinterpret_cast<std::uintptr_t>(path.c_str());
+	return syscall(__NR_bpf, BPF_OBJ_GET, &attr, sizeof attr);
+}
+
+int bpf_map_lookup(int fd, std::uint32_t key, void *value)
+{
+	union bpf_attr attr;
+
+	std::memset(&attr, 0, sizeof attr);
+	attr.map_fd = fd;
+	attr.key = reinterpret_cast<std::uintptr_t>(&key);
+	attr.value = reinterpret_cast<std::uintptr_t>(value);
+	return syscall(__NR_bpf, BPF_MAP_LOOKUP_ELEM, &attr, sizeof attr);
+}
+
+int bpf_map_update(int fd, std::uint32_t key, const void *value)
+{
+	union bpf_attr attr;
+
+	std::memset(&attr, 0, sizeof attr);
+	attr.map_fd = fd;
+	attr.key = reinterpret_cast<std::uintptr_t>(&key);
+	attr.value = reinterpret_cast<std::uintptr_t>(value);
+	attr.flags = BPF_ANY;
+	return syscall(__NR_bpf, BPF_MAP_UPDATE_ELEM, &attr, sizeof attr);
+}
+
+/* Open a pinned map of the XDP program. Prints the error and returns -1
+   on failure. */
+int open_xdp_map(const std::string& dir, const char *name)
+{
+	int fd = bpf_obj_get(dir + "/" + name);
+
+	if (fd == -1) {
+		perror(("bpf(BPF_OBJ_GET, " + dir + "/" + name + ")").c_str());
+	}
+	return fd;
+}
+
+/* Whether the maps of the XDP program are pinned in the directory, i.e.
+   whether it is loaded. */
+bool xdp_maps_pinned(const std::string& dir)
+{
+	return access((dir + "/" + SIMPLEPF_XDP_META_MAP).c_str(), F_OK) == 0;
+}
+
+/* Copy the input chain to the maps of the XDP program: its rules to the
+   half of the rules map that is not in use, then switch to it. See
+   xdp/simplepf_xdp.h. Returns the exit code. */
+int xdp_sync(const std::string& dir)
+{
+	std::vector<struct simplepf_rule> rules;
+
+	if (!read_chain_rules(SIMPLEPF_CHAIN_INPUT, rules)) {
+		return 1;
+	}
+	/* Packets dropped by XDP never reach the hook that logs them. */
+	for (std::size_t i = 0; i < rules.size(); i++) {
+		if (rules[i].log) {
+			std::cerr << "Rule " << i << " of the input chain logs;"
+				<< " it and the rules after it are applied by the netfilter hook.\n";
+			rules.resize(i);
+			break;
+		}
+	}
+	if (rules.size() > SIMPLEPF_XDP_MAX_RULES) {
+		std::cerr << "The input chain has " << rules.size()
+			<< " rules; only the first " << SIMPLEPF_XDP_MAX_RULES
+			<< " are applied by XDP, the rest by the netfilter hook.\n";
+		rules.resize(SIMPLEPF_XDP_MAX_RULES);
+	}
+
+	int rules_fd = open_xdp_map(dir, SIMPLEPF_XDP_RULES_MAP);
+	int meta_fd = open_xdp_map(dir, SIMPLEPF_XDP_META_MAP);
+	if (rules_fd == -1 || meta_fd == -1) {
+		return 1;
+	}
+
+	std::uint32_t meta;
+	if (bpf_map_lookup(meta_fd, 0, &meta) == -1) {
+		perror("bpf(BPF_MAP_LOOKUP_ELEM)");
+		return 1;
+	}
+
+	std::uint32_t half = !SIMPLEPF_XDP_META_HALF(meta);
+	for (std::uint32_t i = 0; i < rules.size(); i++) {
+		if (bpf_map_update(rules_fd, half * SIMPLEPF_XDP_MAX_RULES + i, &rules[i]) == -1) {
+			perror("bpf(BPF_MAP_UPDATE_ELEM)");
+			return 1;
+		}
+	}
+
+	meta = SIMPLEPF_XDP_META(static_cast<std::uint32_t>(rules.size()), half);
+	if (bpf_map_update(meta_fd, 0, &meta) == -1) {
+		perror("bpf(BPF_MAP_UPDATE_ELEM)");
+		return 1;
+	}
+
+	close(rules_fd);
+	close(meta_fd);
+	return 0;
+}
+
+/* Number of possible CPUs, i.e. of values of a per-CPU map element. */
+unsigned int possible_cpus()
+{
+	std::ifstream possible("/sys/devices/system/cpu/possible");
+	std::string line;
+	std::string range;
+	unsigned int count = 0;
+
+	/* A list of ranges like "0-3,8-11". */
+	std::getline(possible, line);
+	std::istringstream ranges(line);
+	while (std::getline(ranges, range, ',')) {
+		std::uint16_t first, last;
+		if (parse_port_range(range, first, last)) {
+			count += last - first + 1;
+		}
+	}
+	return count;
+}
+
+/* Print the packet counts of the XDP program. Returns the exit code. */
+int xdp_stats(const std::string& dir)
+{
+	static const char *names[] = { "pass", "drop", "skip" };
+
+	int fd = open_xdp_map(dir, SIMPLEPF_XDP_STATS_MAP);
+	if (fd == -1) {
+		return 1;
+	}
+
+	std::vector<struct simplepf_xdp_counter> counters(possible_cpus());
+	for (std::uint32_t stat = 0; stat < __SIMPLEPF_XDP_STAT_LAST; stat++) {
+		struct simplepf_xdp_counter sum = { 0, 0 };
+
+		if (bpf_map_lookup(fd, stat, counters.data()) == -1) {
+			perror("bpf(BPF_MAP_LOOKUP_ELEM)");
+			return 1;
+		}
+		for (const auto& counter : counters) {
+			sum.packets += counter.packets;
+			sum.bytes += counter.bytes;
+		}
+		std::cout << "xdp " << names[stat] << " packets " << sum.packets
+			<< " bytes " << sum.bytes << '\n';
+	}
+
+	close(fd);
+	return 0;
+}
+
+/* Print the records of the packet log as they come, until interrupted.
+   Every CPU has its own buffer, <dir>/log<cpu>; each read() consumes a
+   batch of records from one. Returns the exit code. */
+int read_log(const std::string& dir)
+{
+	std::vector<struct pollfd> fds;
+	std::vector<struct simplepf_log_record> records(4096);
+
+	for (unsigned int cpu = 0; cpu < possible_cpus(); cpu++) {
+		int fd = open((dir + "/log" + std::to_string(cpu)).c_str(), O_RDONLY);
+
+		/* Not every possible CPU is online. */
+		if (fd != -1) {
+			fds.push_back({ fd, POLLIN, 0 });
+		}
+	}
+	if (fds.empty()) {
+		std::cerr << "No packet log in " << dir
+			<< " (is debugfs mounted and the module loaded?)\n";
+		return 1;
+	}
+
+	for (;;) {
+		/*
+		 * Readers are only woken up when a sub-buffer fills up, so
+		 * look at the others every second too.
+		 */
+		if (poll(fds.data(), fds.size(), 1000) == -1 && errno != EINTR) {
+			perror("poll()");
+			return 1;
+		}
+
+		for (const auto& pfd : fds) {
+			ssize_t len = read(pfd.fd, records.data(),
+					records.size() * sizeof records[0]);
+
+			if (len == -1) {
+				perror("read()");
+				return 1;
+			}
+			for (ssize_t i = 0; i < len / static_cast<ssize_t>(sizeof records[0]); i++) {
+				const auto& rec = records[i];
+				int family = SIMPLEPF_CHAIN_IS_IPV6(rec.chain_id) ?
+					AF_INET6 : AF_INET;
+				char saddr[INET6_ADDRSTRLEN];
+				char daddr[INET6_ADDRSTRLEN];
+				char ifname[IF_NAMESIZE];
+
+				inet_ntop(family, rec.saddr6, saddr, sizeof saddr);
+				inet_ntop(family, rec.daddr6, daddr, sizeof daddr);
+				std::cout << rec.timestamp << ' '
+					<< chain_name(static_cast<enum simplepf_chain_id>(rec.chain_id))
+					<< " rule " << rec.rule;
+				if (rec.ifindex) {
+					std::cout << " iface " << (if_indextoname(rec.ifindex, ifname) ?
+						ifname : std::to_string(rec.ifindex));
+				}
+				std::cout << " proto " << unsigned(rec.protocol)
+					<< " src " << saddr << " dst " << daddr;
+				if (rec.protocol == IPPROTO_TCP || rec.protocol == IPPROTO_UDP) {
+					std::cout << " sport " << ntohs(rec.sport)
+						<< " dport " << ntohs(rec.dport);
+				} else if (rec.protocol == IPPROTO_ICMP
+						|| rec.protocol == IPPROTO_ICMPV6) {
+					std::cout << " icmp-type " << unsigned(rec.icmp_type);
+				}
+				std::cout << (rec.action == SIMPLEPF_ACTION_ACCEPT ?
+						" accept\n" : " drop\n");
+			}
+		}
+		std::cout.flush();
+	}
+}
+
+/* Keep the XDP program, if it is loaded, in sync with the input chain
+   after a change to the chain. Returns the exit code. */
+int xdp_update(const std::string& dir, enum simplepf_chain_id chain_id)
+{
+	if (chain_id != SIMPLEPF_CHAIN_INPUT || !xdp_maps_pinned(dir)) {
+		return 0;
+	}
+	return xdp_sync(dir);
+}
+
+/* Ruleset optimizer. It rewrites the rules of a chain into fewer rules, in
+   an order that finds the common packets sooner, that give every packet
+   the same verdict: the action and log flag of the first rule that
+   matches, or the policy of the chain (accept) if none does.
+
+   Rules are seen as boxes, one per packet class, since the class decides
+   which fields of a rule apply (see match.h): an address prefix for each
+   address, a set of protocols, and a range of ICMP types or source ports
+   and a range of destination ports. Then, in order:
+   - a rule that can't match any packet, e.g. one for an unsupported
+     protocol, is dropped;
+   - a rule with the same match fields as an earlier one (a duplicate), or
+     covered by earlier ones in every class (shadowed), never matches and
+     is dropped;
+   - a rule whose packets would all get the same verdict without it
+     (redundant: a later rule with the same verdict covers it and no rule
+     in between with another verdict overlaps it, or nothing after it with
+     another verdict overlaps it and it accepts like the policy) is dropped;
+   - two rules with the same verdict that differ in one field only, in
+     sibling prefixes or touching port ranges, are merged, if the later one
+     can be moved up to the earlier one;
+   - with the counters of the rules, rules are moved ahead of the earlier
+     rules that matched fewer packets, as long as they don't overlap them
+     or have the same verdict.
+   Every step keeps the verdicts the same; as a check, both rulesets are
+   run on a set of test packets made from the boundaries of the rules. */
+
+enum opt_class {
+	OPT_CLASS_ICMP,
+	OPT_CLASS_L4,
+	OPT_CLASSES
+};
+
+/* An address prefix, in host byte order; len 0 for any address. */
+struct opt_prefix {
+	std::array<std::uint32_t, 4> addr;
+	unsigned int len;
+};
+
+/* The packets of a class a rule matches. For ICMP, range1 is the ICMP type
+   and range2 is [0, 0]; for TCP and UDP, they are the ports. protos is a
+   bit per protocol of the class: TCP and UDP, or the ICMP of the family. */
+struct opt_box {
+	opt_prefix src;
+	opt_prefix dst;
+	unsigned int protos;
+	std::uint32_t lo1, hi1;
+	std::uint32_t lo2, hi2;
+	std::uint32_t iface;
+};
+
+struct opt_rule {
+	struct simplepf_rule rule;
+	std::uint64_t hits;
+	bool in_class[OPT_CLASSES];
+	opt_box boxes[OPT_CLASSES];
+};
+
+struct opt_stats {
+	std::size_t unmatchable = 0;
+	std::size_t duplicates = 0;
+	std::size_t shadowed = 0;
+	std::size_t redundant = 0;
+	std::size_t merged = 0;
+	std::size_t moved = 0;
+};
+
+/* The verdict of a rule, comparable with the one of the policy. */
+int rule_verdict(const struct simplepf_rule& rule)
+{
+	return rule.action * 2 + (rule.log ? 1 : 0);
+}
+
+const int policy_verdict = SIMPLEPF_ACTION_ACCEPT * 2;
+
+/* Host byte order mask of the part of a prefix of length len in word w. */
+std::uint32_t prefix_word_mask(unsigned int len, unsigned int w)
+{
+	if (len >= 32 * (w + 1)) {
+		return ~0U;
+	}
+	if (len <= 32 * w) {
+		return 0;
+	}
+	return ~0U << (32 * (w + 1) - len);
+}
+
+/* Bring a rule to the canonical form the module keeps it in, so it can be
+   compared with others: addresses masked by their prefix, a prefix length
+   of 0 taken as the whole address, port range maximums set. */
+void canonicalize_rule(struct simplepf_rule& rule, bool ipv6)
+{
+	unsigned int words = ipv6 ? 4 : 1;
+
+	if (rule.filter_saddr) {
+		if (!rule.ip_saddr_prefixlen) {
+			rule.ip_saddr_prefixlen = ipv6 ? 128 : 32;
+		}
+		for (unsigned int w = 0; w < 4; w++) {
+			rule.ip6_saddr[w] = w < words ? rule.ip6_saddr[w]
+				& htonl(prefix_word_mask(rule.ip_saddr_prefixlen, w)) : 0;
+		}
+	}
+	if (rule.filter_daddr) {
+		if (!rule.ip_daddr_prefixlen) {
+			rule.ip_daddr_prefixlen = ipv6 ? 128 : 32;
+		}
+		for (unsigned int w = 0; w < 4; w++) {
+			rule.ip6_daddr[w] = w < words ? rule.ip6_daddr[w]
+				& htonl(prefix_word_mask(rule.ip_daddr_prefixlen, w)) : 0;
+		}
+	}
+	if (rule.filter_sport && !rule.transport_sport_max) {
+		rule.transport_sport_max = rule.transport_sport;
+	}
+	if (rule.filter_dport && !rule.transport_dport_max) {
+		rule.transport_dport_max = rule.transport_dport;
+	}
+	rule.log = !!rule.log;
+}
+
+/* The fields a rule matches with, and nothing else: two rules with the same
+   match fields match the same packets. */
+struct simplepf_rule match_fields(const struct simplepf_rule& rule)
+{
+	struct simplepf_rule fields;
+
+	std::memset(&fields, 0, sizeof fields);
+	if (rule.filter_saddr) {
+		fields.filter_saddr = true;
+		std::memcpy(fields.ip6_saddr, rule.ip6_saddr, sizeof fields.ip6_saddr);
+		fields.ip_saddr_prefixlen = rule.ip_saddr_prefixlen;
+	}
+	if (rule.filter_daddr) {
+		fields.filter_daddr = true;
+		std::memcpy(fields.ip6_daddr, rule.ip6_daddr, sizeof fields.ip6_daddr);
+		fields.ip_daddr_prefixlen = rule.ip_daddr_prefixlen;
+	}
+	if (rule.filter_proto) {
+		fields.filter_proto = true;
+		fields.ip_protocol = rule.ip_protocol;
+	}
+	if (rule.filter_icmp_type) {
+		fields.filter_icmp_type = true;
+		fields.icmp_type = rule.icmp_type;
+	}
+	if (rule.filter_sport) {
+		fields.filter_sport = true;
+		fields.transport_sport = rule.transport_sport;
+		fields.transport_sport_max = rule.transport_sport_max;
+	}
+	if (rule.filter_dport) {
+		fields.filter_dport = true;
+		fields.transport_dport = rule.transport_dport;
+		fields.transport_dport_max = rule.transport_dport_max;
+	}
+	if (rule.filter_ifindex) {
+		fields.filter_ifindex = true;
+		fields.ifindex = rule.ifindex;
+	}
+	return fields;
+}
+
+bool same_match_fields(const struct simplepf_rule& a, const struct simplepf_rule& b)
+{
+	struct simplepf_rule fa = match_fields(a);
+	struct simplepf_rule fb = match_fields(b);
+
+	return std::memcmp(&fa, &fb, sizeof fa) == 0;
+}
+
+std::uint8_t icmp_protocol(bool ipv6)
+{
+	return ipv6 ? std::uint8_t(IPPROTO_ICMPV6) : std::uint8_t(IPPROTO_ICMP);
+}
+
+bool protocol_class(std::uint8_t protocol, bool ipv6, enum opt_class& cls)
+{
+	if (protocol == icmp_protocol(ipv6)) {
+		cls = OPT_CLASS_ICMP;
+	} else if (protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) {
+		cls = OPT_CLASS_L4;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+opt_prefix rule_prefix(bool filter, const std::uint32_t addr[4], unsigned int len)
+{
+	opt_prefix prefix = {};
+
+	if (filter) {
+		for (unsigned int w = 0; w < 4; w++) {
+			prefix.addr[w] = ntohl(addr[w]);
+		}
+		prefix.len = len;
+	}
+	return prefix;
+}
+
+/* The box of the rule in the class. Returns false if the rule can't match
+   packets of the class. */
+bool rule_box(const struct simplepf_rule& rule, bool ipv6, enum opt_class cls, opt_box& box)
+{
+	enum opt_class rule_cls;
+
+	if (rule.filter_proto && (!protocol_class(rule.ip_protocol, ipv6, rule_cls)
+				|| rule_cls != cls)) {
+		return false;
+	}
+
+	box.src = rule_prefix(rule.filter_saddr, rule.ip6_saddr, rule.ip_saddr_prefixlen);
+	box.dst = rule_prefix(rule.filter_daddr, rule.ip6_daddr, rule.ip_daddr_prefixlen);
+	box.iface = rule.filter_ifindex ? rule.ifindex : 0;
+	if (cls == OPT_CLASS_ICMP) {
+		box.protos = 1;
+		box.lo1 = rule.filter_icmp_type ? rule.icmp_type : 0;
+		box.hi1 = rule.filter_icmp_type ? rule.icmp_type : 255;
+		box.lo2 = 0;
+		box.hi2 = 0;
+	} else {
+		box.protos = !rule.filter_proto ? 3 : rule.ip_protocol == IPPROTO_TCP ? 1 : 2;
+		box.lo1 = rule.filter_sport ? ntohs(rule.transport_sport) : 0;
+		box.hi1 = rule.filter_sport ? ntohs(rule.transport_sport_max) : 65535;
+		box.lo2 = rule.filter_dport ? ntohs(rule.transport_dport) : 0;
+		box.hi2 = rule.filter_dport ? ntohs(rule.transport_dport_max) : 65535;
+	}
+	return true;
+}
+
+opt_rule make_opt_rule(const struct simplepf_rule& rule, std::uint64_t hits, bool ipv6)
+{
+	opt_rule r;
+
+	r.rule = rule;
+	r.hits = hits;
+	for (unsigned int c = 0; c < OPT_CLASSES; c++) {
+		r.in_class[c] = rule_box(rule, ipv6, static_cast<enum opt_class>(c), r.boxes[c]);
+	}
+	return r;
+}
+
+bool prefix_contains(const opt_prefix& a, const opt_prefix& b)
+{
+	if (a.len > b.len) {
+		return false;
+	}
+	for (unsigned int w = 0; w < 4; w++) {
+		if ((a.addr[w] ^ b.addr[w]) & prefix_word_mask(a.len, w)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool box_contains(const opt_box& a, const opt_box& b)
+{
+	return prefix_contains(a.src, b.src) && prefix_contains(a.dst, b.dst)
+		&& !(b.protos & ~a.protos)
+		&& a.lo1 <= b.lo1 && b.hi1 <= a.hi1
+		&& a.lo2 <= b.lo2 && b.hi2 <= a.hi2
+		&& (!a.iface || a.iface == b.iface);
+}
+
+bool box_disjoint(const opt_box& a, const opt_box& b)
+{
+	return (!prefix_contains(a.src, b.src) && !prefix_contains(b.src, a.src))
+		|| (!prefix_contains(a.dst, b.dst) && !prefix_contains(b.dst, a.dst))
+		|| !(a.protos & b.protos)
+		|| a.hi1 < b.lo1 || b.hi1 < a.lo1
+		|| a.hi2 < b.lo2 || b.hi2 < a.lo2
+		|| (a.iface && b.iface && a.iface != b.iface);
+}
+
+bool rules_disjoint(const opt_rule& a, const opt_rule& b)
+{
+	for (unsigned int c = 0; c < OPT_CLASSES; c++) {
+		if (a.in_class[c] && b.in_class[c] && !box_disjoint(a.boxes[c], b.boxes[c])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Whether two rules next to each other can trade places without changing
+   any verdict. */
+bool can_swap(const opt_rule& a, const opt_rule& b)
+{
+	return rule_verdict(a.rule) == rule_verdict(b.rule) || rules_disjoint(a, b);
+}
+
+/* Rules by class and by address prefix, so the rules that can overlap a
+   rule are found without comparing it with all the others. The rules that
+   filter on the address more of them filter on are kept by that prefix,
+   the others by their other address, in a second set of maps. Two prefixes
+   overlap if one contains the other: the prefixes that contain one are
+   looked up at every length in use, and the ones it contains are a range
+   of the map. Rules are kept by position in the ruleset, in ascending order
+   per prefix. */
+typedef std::map<std::pair<std::array<std::uint32_t, 4>, unsigned int>,
+	std::vector<std::size_t>> opt_prefix_map;
+
+struct opt_index {
+	bool dst;
+	opt_prefix_map prefixes[2][OPT_CLASSES];
+	/* The number of rules at every length in use. */
+	std::map<unsigned int, std::size_t> lens[2][OPT_CLASSES];
+};
+
+/* The prefixes of a rule, or the addresses of a packet, the one the index
+   is mostly by first. */
+typedef std::array<opt_prefix, 2> opt_key;
+
+opt_index make_opt_index(const std::vector<opt_rule>& rules)
+{
+	opt_index index;
+	std::size_t nr_saddr = 0;
+	std::size_t nr_daddr = 0;
+
+	for (const auto& r : rules) {
+		nr_saddr += r.rule.filter_saddr;
+		nr_daddr += r.rule.filter_daddr;
+	}
+	index.dst = nr_daddr > nr_saddr;
+	return index;
+}
+
+opt_key index_key(const opt_index& index, const struct simplepf_rule& rule)
+{
+	opt_prefix saddr = rule_prefix(rule.filter_saddr, rule.ip6_saddr,
+			rule.ip_saddr_prefixlen);
+	opt_prefix daddr = rule_prefix(rule.filter_daddr, rule.ip6_daddr,
+			rule.ip_daddr_prefixlen);
+
+	return index.dst ? opt_key{daddr, saddr} : opt_key{saddr, daddr};
+}
+
+std::array<std::uint32_t, 4> mask_prefix(const std::array<std::uint32_t, 4>& addr,
+		unsigned int len)
+{
+	std::array<std::uint32_t, 4> masked;
+
+	for (unsigned int w = 0; w < 4; w++) {
+		masked[w] = addr[w] & prefix_word_mask(len, w);
+	}
+	return masked;
+}
+
+void index_add(opt_index& index, const opt_rule& r, std::size_t pos)
+{
+	opt_key key = index_key(index, r.rule);
+	unsigned int set = !key[0].len;
+	const opt_prefix& prefix = key[set];
+
+	for (unsigned int c = 0; c < OPT_CLASSES; c++) {
+		if (r.in_class[c]) {
+			auto& positions = index.prefixes[set][c][{mask_prefix(prefix.addr,
+				prefix.len), prefix.len}];
+
+			positions.insert(std::lower_bound(positions.begin(), positions.end(), pos), pos);
+			index.lens[set][c][prefix.len]++;
+		}
+	}
+}
+
+void index_remove(opt_index& index, const opt_rule& r, std::size_t pos)
+{
+	opt_key key = index_key(index, r.rule);
+	unsigned int set = !key[0].len;
+	const opt_prefix& prefix = key[set];
+
+	for (unsigned int c = 0; c < OPT_CLASSES; c++) {
+		if (!r.in_class[c]) {
+			continue;
+		}
+		auto it = index.prefixes[set][c].find({mask_prefix(prefix.addr, prefix.len),
+				prefix.len});
+		auto& positions = it->second;
+
+		positions.erase(std::lower_bound(positions.begin(), positions.end(), pos));
+		if (positions.empty()) {
+			index.prefixes[set][c].erase(it);
+		}
+		if (!--index.lens[set][c][prefix.len]) {
+			index.lens[set][c].erase(prefix.len);
+		}
+	}
+}
+
+void index_overlapping(const opt_prefix_map& prefixes,
+		const std::map<unsigned int, std::size_t>& lens, const opt_prefix& prefix,
+		std::vector<const std::vector<std::size_t> *>& found)
+{
+	auto addr = mask_prefix(prefix.addr, prefix.len);
+
+	for (const auto& len : lens) {
+		if (len.first >= prefix.len) {
+			break;
+		}
+		auto it = prefixes.find({mask_prefix(addr, len.first), len.first});
+		if (it != prefixes.end()) {
+			found.push_back(&it->second);
+		}
+	}
+	for (auto it = prefixes.lower_bound({addr, prefix.len}); it != prefixes.end()
+			&& mask_prefix(it->first.first, prefix.len) == addr; ++it) {
+		found.push_back(&it->second);
+	}
+}
+
+/* The positions of the rules of the class whose prefixes overlap the given
+   ones, as a list per prefix. The other fields are left to the caller. */
+std::vector<const std::vector<std::size_t> *> index_overlapping(const opt_index& index,
+		unsigned int c, const opt_key& key)
+{
+	std::vector<const std::vector<std::size_t> *> found;
+
+	for (unsigned int set = 0; set < 2; set++) {
+		index_overlapping(index.prefixes[set][c], index.lens[set][c], key[set], found);
+	}
+	return found;
+}
+
+/* Drop the rules that never match: those of no class, the duplicates and
+   the shadowed ones. Returns whether any was dropped. */
+bool drop_shadowed(std::vector<opt_rule>& rules, opt_stats& stats)
+{
+	std::vector<opt_rule> kept;
+	std::set<std::string> fields;
+	opt_index index = make_opt_index(rules);
+
+	for (const auto& r : rules) {
+		struct simplepf_rule match = match_fields(r.rule);
+		std::string key(reinterpret_cast<const char *>(&match), sizeof match);
+		bool duplicate = fields.count(key);
+		bool dead = true;
+
+		for (unsigned int c = 0; c < OPT_CLASSES && dead && !duplicate; c++) {
+			if (!r.in_class[c]) {
+				continue;
+			}
+			dead = false;
+			for (const auto *positions : index_overlapping(index, c,
+						index_key(index, r.rule))) {
+				dead = std::any_of(positions->begin(), positions->end(),
+						[&](std::size_t k) {
+					return box_contains(kept[k].boxes[c], r.boxes[c]);
+				});
+				if (dead) {
+					break;
+				}
+			}
+		}
+
+		if (duplicate) {
+			stats.duplicates++;
+		} else if (!r.in_class[OPT_CLASS_ICMP] && !r.in_class[OPT_CLASS_L4]) {
+			stats.unmatchable++;
+		} else if (dead) {
+			stats.shadowed++;
+		} else {
+			fields.insert(key);
+			index_add(index, r, kept.size());
+			kept.push_back(r);
+		}
+	}
+
+	bool dropped = kept.size() != rules.size();
+	rules.swap(kept);
+	return dropped;
+}
+
+/* Drop the redundant rules, from the last one up. Their counts go to the
+   rule that takes their packets. Returns whether any was dropped. */
+bool drop_redundant(std::vector<opt_rule>& rules, opt_stats& stats)
+{
+	std::vector<bool> gone(rules.size(), false);
+	opt_index index = make_opt_index(rules);
+	bool dropped = false;
+
+	/* The index holds the rules after the current one that are kept;
+	   the others can't overlap it, so they don't matter. */
+	for (std::size_t i = rules.size(); i-- > 0; ) {
+		const opt_rule& r = rules[i];
+		std::size_t cover = rules.size();
+		bool redundant = true;
+
+		for (unsigned int c = 0; c < OPT_CLASSES && redundant; c++) {
+			bool conflict = false;
+			std::size_t j = rules.size();
+
+			if (!r.in_class[c]) {
+				continue;
+			}
+			/* The first later rule that covers it or conflicts with it. */
+			for (const auto *positions : index_overlapping(index, c,
+						index_key(index, r.rule))) {
+				for (std::size_t k : *positions) {
+					const opt_rule& x = rules[k];
+
+					if (k >= j) {
+						break;
+					}
+					if (rule_verdict(x.rule) == rule_verdict(r.rule)) {
+						if (box_contains(x.boxes[c], r.boxes[c])) {
+							j = k;
+							conflict = false;
+							break;
+						}
+					} else if (!box_disjoint(x.boxes[c], r.boxes[c])) {
+						j = k;
+						conflict = true;
+						break;
+					}
+				}
+			}
+			if (conflict || (j == rules.size() && rule_verdict(r.rule) != policy_verdict)) {
+				redundant = false;
+			} else if (cover == rules.size()) {
+				cover = j;
+			}
+		}
+
+		if (redundant) {
+			if (cover < rules.size()) {
+				rules[cover].hits += r.hits;
+			}
+			gone[i] = true;
+			stats.redundant++;
+			dropped = true;
+		} else {
+			index_add(index, r, i);
+		}
+	}
+
+	std::vector<opt_rule> kept;
+	for (std::size_t i = 0; i < rules.size(); i++) {
+		if (!gone[i]) {
+			kept.push_back(rules[i]);
+		}
+	}
+	rules.swap(kept);
+	return dropped;
+}
+
+enum opt_field {
+	OPT_FIELD_SADDR,
+	OPT_FIELD_DADDR,
+	OPT_FIELD_SPORT,
+	OPT_FIELD_DPORT,
+	OPT_FIELDS
+};
+
+/* The key of the rules that can be merged in the field: their verdict and
+   all their other match fields. */
+std::string merge_key(const struct simplepf_rule& rule, enum opt_field field)
+{
+	struct simplepf_rule fields = match_fields(rule);
+
+	switch (field) {
+	case OPT_FIELD_SADDR:
+		std::memset(fields.ip6_saddr, 0, sizeof fields.ip6_saddr);
+		fields.ip_saddr_prefixlen = 0;
+		break;
+	case OPT_FIELD_DADDR:
+		std::memset(fields.ip6_daddr, 0, sizeof fields.ip6_daddr);
+		fields.ip_daddr_prefixlen = 0;
+		break;
+	case OPT_FIELD_SPORT:
+		fields.transport_sport = 0;
+		fields.transport_sport_max = 0;
+		break;
+	default:
+		fields.transport_dport = 0;
+		fields.transport_dport_max = 0;
+		break;
+	}
+	fields.action = rule.action;
+	fields.log = rule.log;
+	return std::string(reinterpret_cast<const char *>(&fields), sizeof fields)
+		+ static_cast<char>(field);
+}
+
+/* Merge two prefixes of the same length that differ in their last bit only
+   into their parent. Returns false if they are not such siblings. */
+bool merge_prefixes(bool& filter, std::uint32_t a[4], std::uint8_t& len,
+		const std::uint32_t b[4], std::uint8_t b_len)
+{
+	unsigned int diff_bits = 0;
+	unsigned int diff_word = 0;
+
+	if (!filter || len != b_len) {
+		return false;
+	}
+	for (unsigned int w = 0; w < 4; w++) {
+		if (a[w] != b[w]) {
+			diff_bits += __builtin_popcount(a[w] ^ b[w]);
+			diff_word = w;
+		}
+	}
+	if (diff_bits != 1 || !(ntohl(a[diff_word] ^ b[diff_word])
+				& ~prefix_word_mask(len - 1, diff_word))) {
+		return false;
+	}
+
+	len--;
+	if (!len) {
+		filter = false;
+		std::memset(a, 0, 4 * sizeof a[0]);
+		return true;
+	}
+	a[diff_word] &= htonl(prefix_word_mask(len, diff_word));
+	return true;
+}
+
+/* Merge two port ranges that overlap or touch. Returns false if they are
+   apart. */
+bool merge_ranges(__u16& lo, __u16& hi, __u16 b_lo, __u16 b_hi)
+{
+	unsigned int l = ntohs(lo), h = ntohs(hi);
+	unsigned int bl = ntohs(b_lo), bh = ntohs(b_hi);
+
+	if (std::max(l, bl) > std::min(h, bh) + 1) {
+		return false;
+	}
+	lo = htons(std::min(l, bl));
+	hi = htons(std::max(h, bh));
+	return true;
+}
+
+/* Merge rule b into rule a, which has the same key in the field. Returns
+   false if the merged values can't be written as a prefix or a range. */
+bool merge_rule(struct simplepf_rule& a, const struct simplepf_rule& b, enum opt_field field)
+{
+	switch (field) {
+	case OPT_FIELD_SADDR:
+		return merge_prefixes(a.filter_saddr, a.ip6_saddr, a.ip_saddr_prefixlen,
+				b.ip6_saddr, b.ip_saddr_prefixlen);
+	case OPT_FIELD_DADDR:
+		return merge_prefixes(a.filter_daddr, a.ip6_daddr, a.ip_daddr_prefixlen,
+				b.ip6_daddr, b.ip_daddr_prefixlen);
+	case OPT_FIELD_SPORT:
+		return a.filter_sport && merge_ranges(a.transport_sport, a.transport_sport_max,
+				b.transport_sport, b.transport_sport_max);
+	default:
+		return a.filter_dport && merge_ranges(a.transport_dport, a.transport_dport_max,
+				b.transport_dport, b.transport_dport_max);
+	}
+}
+
+/* The value of the field of a rule: its prefix, or its port range as
+   {first}, last. */
+typedef std::pair<std::array<std::uint32_t, 4>, unsigned int> merge_value;
+
+merge_value field_value(const struct simplepf_rule& rule, enum opt_field field)
+{
+	opt_prefix prefix;
+
+	switch (field) {
+	case OPT_FIELD_SADDR:
+		prefix = rule_prefix(rule.filter_saddr, rule.ip6_saddr, rule.ip_saddr_prefixlen);
+		return {prefix.addr, prefix.len};
+	case OPT_FIELD_DADDR:
+		prefix = rule_prefix(rule.filter_daddr, rule.ip6_daddr, rule.ip_daddr_prefixlen);
+		return {prefix.addr, prefix.len};
+	case OPT_FIELD_SPORT:
+		return {{ntohs(rule.transport_sport), 0, 0, 0}, ntohs(rule.transport_sport_max)};
+	default:
+		return {{ntohs(rule.transport_dport), 0, 0, 0}, ntohs(rule.transport_dport_max)};
+	}
+}
+
+/* The rules after rule i of a group that rule i may merge with, given the
+   rules of the group by the value of the field: those with the sibling
+   prefix, or with a range that overlaps or touches its one. width is the
+   widest range of the group. */
+std::vector<std::size_t> merge_partners(const std::map<merge_value, std::set<std::size_t>>& values,
+		const struct simplepf_rule& rule, enum opt_field field, unsigned int width,
+		std::size_t i)
+{
+	merge_value value = field_value(rule, field);
+	std::vector<std::size_t> found;
+	auto add = [&](const std::set<std::size_t>& positions) {
+		found.insert(found.end(), positions.upper_bound(i), positions.end());
+	};
+
+	if (field == OPT_FIELD_SADDR || field == OPT_FIELD_DADDR) {
+		unsigned int bit = value.second - 1;
+
+		if (!value.second) {
+			return found;
+		}
+		value.first[bit / 32] ^= 1U << (31 - bit % 32);
+		auto it = values.find(value);
+		if (it != values.end()) {
+			add(it->second);
+		}
+	} else if (field == OPT_FIELD_SPORT ? rule.filter_sport : rule.filter_dport) {
+		unsigned int lo = value.first[0];
+		unsigned int hi = value.second;
+		unsigned int start = lo > width + 1 ? lo - width - 1 : 0;
+
+		for (auto it = values.lower_bound({{start, 0, 0, 0}, 0});
+				it != values.end() && it->first.first[0] <= hi + 1; ++it) {
+			if (it->first.second + 1 >= lo) {
+				add(it->second);
+			}
+		}
+	}
+	std::sort(found.begin(), found.end());
+	return found;
+}
+
+/* Whether rule j can move up to the place of rule i, past the rules of the
+   index between them. */
+bool can_move_up(const opt_index& index, const std::vector<opt_rule>& rules,
+		std::size_t i, std::size_t j)
+{
+	const opt_rule& r = rules[j];
+
+	for (unsigned int c = 0; c < OPT_CLASSES; c++) {
+		if (!r.in_class[c]) {
+			continue;
+		}
+		for (const auto *positions : index_overlapping(index, c,
+					index_key(index, r.rule))) {
+			for (auto k = std::upper_bound(positions->begin(), positions->end(), i);
+					k != positions->end() && *k < j; ++k) {
+				if (rule_verdict(rules[*k].rule) != rule_verdict(r.rule)
+						&& !box_disjoint(rules[*k].boxes[c], r.boxes[c])) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+/* Merge the pairs of rules that can be merged, a round over each field.
+   Returns whether any was merged. */
+bool merge_rules(std::vector<opt_rule>& rules, bool ipv6, opt_stats& stats)
+{
+	bool any = false;
+
+	for (unsigned int f = 0; f < OPT_FIELDS; f++) {
+		auto field = static_cast<enum opt_field>(f);
+		bool range = field == OPT_FIELD_SPORT || field == OPT_FIELD_DPORT;
+		std::map<std::string, std::vector<std::size_t>> groups;
+		std::vector<bool> gone(rules.size(), false);
+		opt_index index = make_opt_index(rules);
+
+		for (std::size_t i = 0; i < rules.size(); i++) {
+			groups[merge_key(rules[i].rule, field)].push_back(i);
+			index_add(index, rules[i], i);
+		}
+
+		for (const auto& group : groups) {
+			std::map<merge_value, std::set<std::size_t>> values;
+			unsigned int width = 0;
+
+			if (group.second.size() < 2) {
+				continue;
+			}
+			for (std::size_t i : group.second) {
+				merge_value value = field_value(rules[i].rule, field);
+
+				values[value].insert(i);
+				if (range) {
+					width = std::max(width, value.second - value.first[0]);
+				}
+			}
+
+			for (std::size_t i : group.second) {
+				bool merged_any = true;
+
+				while (!gone[i] && merged_any) {
+					merged_any = false;
+					for (std::size_t j : merge_partners(values, rules[i].rule, field,
+								width, i)) {
+						struct simplepf_rule merged = rules[i].rule;
+
+						/* Rule j takes the place of rule i, so it must
+						   be able to move up to it. */
+						if (!merge_rule(merged, rules[j].rule, field)
+								|| !can_move_up(index, rules, i, j)) {
+							continue;
+						}
+
+						for (std::size_t k : {i, j}) {
+							auto it = values.find(field_value(rules[k].rule, field));
+
+							it->second.erase(k);
+							if (it->second.empty()) {
+								values.erase(it);
+							}
+							index_remove(index, rules[k], k);
+						}
+						rules[i] = make_opt_rule(merged, rules[i].hits + rules[j].hits, ipv6);
+						gone[j] = true;
+						index_add(index, rules[i], i);
+
+						merge_value value = field_value(merged, field);
+						values[value].insert(i);
+						if (range) {
+							width = std::max(width, value.second - value.first[0]);
+						}
+						stats.merged++;
+						any = true;
+						/* The merged rule may merge with others. */
+						merged_any = true;
+						break;
+					}
+				}
+			}
+		}
+
+		std::vector<opt_rule> kept;
+		for (std::size_t i = 0; i < rules.size(); i++) {
+			if (!gone[i]) {
+				kept.push_back(rules[i]);
+			}
+		}
+		rules.swap(kept);
+	}
+	return any;
+}
+
+/* Move the rules ahead of the earlier rules that matched fewer packets,
+   as far as they can go. */
+void reorder_rules(std::vector<opt_rule>& rules, opt_stats& stats)
+{
+	for (std::size_t i = 1; i < rules.size(); i++) {
+		std::size_t j = i;
+
+		while (j > 0 && rules[j - 1].hits < rules[j].hits && can_swap(rules[j - 1], rules[j])) {
+			std::swap(rules[j - 1], rules[j]);
+			j--;
+		}
+		if (j != i) {
+			stats.moved++;
+		}
+	}
+}
+
+/* A packet to test rulesets with. Host byte order. */
+struct test_packet {
+	std::array<std::uint32_t, 4> saddr;
+	std::array<std::uint32_t, 4> daddr;
+	std::uint8_t protocol;
+	std::uint8_t icmp_type;
+	std::uint16_t sport;
+	std::uint16_t dport;
+	std::uint32_t ifindex;
+};
+
+bool addr_in_prefix(const std::array<std::uint32_t, 4>& addr, const std::uint32_t prefix[4],
+		unsigned int len)
+{
+	for (unsigned int w = 0; w * 32 < len; w++) {
+		if ((addr[w] ^ ntohl(prefix[w])) & prefix_word_mask(len, w)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Whether the rule matches the packet, the way simplepf_match_rule() and
+   the interface views of the module decide it, straight from the fields
+   of the rule rather than from its boxes. */
+bool rule_matches(const struct simplepf_rule& rule, bool ipv6, const test_packet& pkt)
+{
+	bool icmp = pkt.protocol == icmp_protocol(ipv6);
+	bool l4 = pkt.protocol == IPPROTO_TCP || pkt.protocol == IPPROTO_UDP;
+
+	if (!icmp && !l4) {
+		return false;
+	}
+	if (rule.filter_ifindex && rule.ifindex != pkt.ifindex) {
+		return false;
+	}
+	if (rule.filter_saddr && !addr_in_prefix(pkt.saddr, rule.ip6_saddr, rule.ip_saddr_prefixlen)) {
+		return false;
+	}
+	if (rule.filter_daddr && !addr_in_prefix(pkt.daddr, rule.ip6_daddr, rule.ip_daddr_prefixlen)) {
+		return false;
+	}
+	if (rule.filter_proto && rule.ip_protocol != pkt.protocol) {
+		return false;
+	}
+	if (icmp && rule.filter_icmp_type && rule.icmp_type != pkt.icmp_type) {
+		return false;
+	}
+	if (l4 && rule.filter_sport && (pkt.sport < ntohs(rule.transport_sport)
+				|| pkt.sport > ntohs(rule.transport_sport_max))) {
+		return false;
+	}
+	if (l4 && rule.filter_dport && (pkt.dport < ntohs(rule.transport_dport)
+				|| pkt.dport > ntohs(rule.transport_dport_max))) {
+		return false;
+	}
+	return true;
+}
+
+/* The verdict of the rules for the packet. The index only narrows them
+   down to those whose prefixes hold the addresses of the packet; whether
+   they match is up to rule_matches(). */
+int chain_verdict(const std::vector<opt_rule>& rules, const opt_index& index, bool ipv6,
+		const test_packet& pkt)
+{
+	opt_prefix saddr = {pkt.saddr, ipv6 ? 128U : 32U};
+	opt_prefix daddr = {pkt.daddr, ipv6 ? 128U : 32U};
+	std::size_t first = rules.size();
+	enum opt_class cls;
+
+	if (!protocol_class(pkt.protocol, ipv6, cls)) {
+		return policy_verdict;
+	}
+	for (const auto *positions : index_overlapping(index, cls,
+				index.dst ? opt_key{daddr, saddr} : opt_key{saddr, daddr})) {
+		for (std::size_t k : *positions) {
+			if (k >= first) {
+				break;
+			}
+			if (rule_matches(rules[k].rule, ipv6, pkt)) {
+				first = k;
+				break;
+			}
+		}
+	}
+	return first < rules.size() ? rule_verdict(rules[first].rule) : policy_verdict;
+}
+
+/* Add one to, or take one from, an address of the family. */
+std::array<std::uint32_t, 4> addr_step(std::array<std::uint32_t, 4> addr, bool ipv6, bool up)
+{
+	for (int w = ipv6 ? 3 : 0; w >= 0; w--) {
+		std::uint32_t old = addr[w];
+
+		addr[w] += up ? 1 : -1;
+		if (up ? addr[w] > old : addr[w] < old) {
+			break;
+		}
+	}
+	return addr;
+}
+
+/* The first and last address of a prefix, and the ones just outside. */
+std::vector<std::array<std::uint32_t, 4>> prefix_edges(const opt_prefix& prefix, bool ipv6)
+{
+	std::array<std::uint32_t, 4> last = prefix.addr;
+
+	for (unsigned int w = 0; w < (ipv6 ? 4U : 1U); w++) {
+		last[w] |= ~prefix_word_mask(prefix.len, w);
+	}
+	return { prefix.addr, last, addr_step(prefix.addr, ipv6, false), addr_step(last, ipv6, true) };
+}
+
+/* Test packets for the rules: for every rule and class, a packet at a
+   corner of its box, and the packets that differ from it in one field,
+   at the edges of the box and just past them. Then random packets on the
+   same values. */
+std::vector<test_packet> test_packets(const std::vector<opt_rule>& rules, bool ipv6,
+		std::size_t max_packets)
+{
+	const std::uint8_t icmp = icmp_protocol(ipv6);
+	const std::uint8_t protocols[] = { icmp, IPPROTO_TCP, IPPROTO_UDP, IPPROTO_GRE };
+	std::mt19937 rng(1);
+	std::vector<test_packet> packets;
+	std::vector<std::array<std::uint32_t, 4>> addrs;
+	std::vector<std::uint32_t> ifaces = { 0 };
+	std::uint32_t max_iface = 0;
+
+	for (const auto& r : rules) {
+		max_iface = std::max(max_iface, r.rule.filter_ifindex ? r.rule.ifindex : 0);
+	}
+	ifaces.push_back(max_iface + 1);
+
+	for (const auto& r : rules) {
+		for (unsigned int c = 0; c < OPT_CLASSES; c++) {
+			const opt_box& box = r.boxes[c];
+			test_packet base;
+
+			if (!r.in_class[c]) {
+				continue;
+			}
+			base.saddr = box.src.addr;
+			base.daddr = box.dst.addr;
+			if (c == OPT_CLASS_ICMP) {
+				base.protocol = icmp;
+			} else {
+				base.protocol = box.protos & 1 ? IPPROTO_TCP : IPPROTO_UDP;
+			}
+			base.icmp_type = c == OPT_CLASS_ICMP ? box.lo1 : 0;
+			base.sport = c == OPT_CLASS_L4 ? box.lo1 : 0;
+			base.dport = box.lo2;
+			base.ifindex = box.iface;
+			packets.push_back(base);
+			if (box.iface) {
+				ifaces.push_back(box.iface);
+			}
+
+			for (const auto& addr : prefix_edges(box.src, ipv6)) {
+				test_packet p = base;
+				p.saddr = addr;
+				packets.push_back(p);
+				addrs.push_back(addr);
+			}
+			for (const auto& addr : prefix_edges(box.dst, ipv6)) {
+				test_packet p = base;
+				p.daddr = addr;
+				packets.push_back(p);
+				addrs.push_back(addr);
+			}
+			for (std::uint32_t v : { box.lo1, box.hi1, box.lo1 - 1, box.hi1 + 1 }) {
+				test_packet p = base;
+				if (c == OPT_CLASS_ICMP) {
+					p.icmp_type = v;
+				} else {
+					p.sport = v;
+				}
+				packets.push_back(p);
+			}
+			for (std::uint32_t v : { box.lo2, box.hi2, box.lo2 - 1, box.hi2 + 1 }) {
+				test_packet p = base;
+				p.dport = v;
+				packets.push_back(p);
+			}
+			for (std::uint8_t protocol : protocols) {
+				test_packet p = base;
+				p.protocol = protocol;
+				packets.push_back(p);
+			}
+			for (std::uint32_t iface : { 0U, max_iface + 1 }) {
+				test_packet p = base;
+				p.ifindex = iface;
+				packets.push_back(p);
+			}
+		}
+	}
+
+	if (packets.size() > max_packets) {
+		std::shuffle(packets.begin(), packets.end(), rng);
+		packets.resize(max_packets);
+	}
+	if (addrs.empty()) {
+		addrs.push_back({ 0, 0, 0, 0 });
+	}
+
+	for (std::size_t i = 0; i < max_packets / 4; i++) {
+		test_packet p;
+
+		p.saddr = addrs[rng() % addrs.size()];
+		p.daddr = addrs[rng() % addrs.size()];
+		p.protocol = protocols[rng() % 3];
+		p.icmp_type = p.protocol == icmp ? rng() : 0;
+		p.sport = p.protocol != icmp ? rng() : 0;
+		p.dport = p.protocol != icmp ? rng() : 0;
+		p.ifindex = ifaces[rng() % ifaces.size()];
+		packets.push_back(p);
+	}
+	return packets;
+}
+
+/* Print a rule in the format of the rule dump. */
+std::string format_rule(enum simplepf_chain_id chain_id, const struct simplepf_rule& rule)
+{
+	int family = SIMPLEPF_CHAIN_IS_IPV6(chain_id) ? AF_INET6 : AF_INET;
+	std::ostringstream out;
+	char addr[INET6_ADDRSTRLEN];
+	char ifname[IF_NAMESIZE];
+
+	out << chain_name(chain_id);
+	if (rule.filter_saddr) {
+		inet_ntop(family, rule.ip6_saddr, addr, sizeof addr);
+		out << " src " << addr << '/' << unsigned(rule.ip_saddr_prefixlen);
+	}
+	if (rule.filter_daddr) {
+		inet_ntop(family, rule.ip6_daddr, addr, sizeof addr);
+		out << " dst " << addr << '/' << unsigned(rule.ip_daddr_prefixlen);
+	}
+	if (rule.filter_proto) {
+		switch (rule.ip_protocol) {
+		case IPPROTO_ICMP:
+			out << " proto icmp";
+			break;
+		case IPPROTO_ICMPV6:
+			out << " proto icmpv6";
+			break;
+		case IPPROTO_TCP:
+			out << " proto tcp";
+			break;
+		case IPPROTO_UDP:
+			out << " proto udp";
+			break;
+		default:
+			out << " proto " << unsigned(rule.ip_protocol);
+			break;
+		}
+	}
+	if (rule.filter_sport) {
+		out << " sport " << ntohs(rule.transport_sport);
+		if (rule.transport_sport_max != rule.transport_sport) {
+			out << '-' << ntohs(rule.transport_sport_max);
+		}
+	}
+	if (rule.filter_dport) {
+		out << " dport " << ntohs(rule.transport_dport);
+		if (rule.transport_dport_max != rule.transport_dport) {
+			out << '-' << ntohs(rule.transport_dport_max);
+		}
+	}
+	if (rule.filter_icmp_type) {
+		out << " icmp-type " << unsigned(rule.icmp_type);
+	}
+	if (rule.filter_ifindex) {
+		out << " iface " << (if_indextoname(rule.ifindex, ifname) ?
+				ifname : std::to_string(rule.ifindex));
+	}
+	if (rule.log) {
+		out << " log";
+	}
+	out << (rule.action == SIMPLEPF_ACTION_ACCEPT ? " accept" : " drop");
+	return out.str();
+}
+
+/* Read the rules of a file in the format of the rule dump, the ones of the
+   chain only. Returns false if the file can't be read or has a bad line. */
+bool read_rules_file(const std::string& path, enum simplepf_chain_id chain_id,
+		std::vector<struct simplepf_rule>& rules)
+{
+	std::ifstream file(path);
+	std::string line;
+
+	if (!file) {
+		std::cerr << "Unable to open " << path << '\n';
+		return false;
+	}
+	while (std::getline(file, line)) {
+		enum simplepf_chain_id line_chain;
+		struct simplepf_rule rule;
+
+		if (line.empty()) {
+			continue;
+		}
+		if (!parse_rule_line(line, line_chain, rule)) {
+			std::cerr << "Invalid rule in " << path << ": " << line << '\n';
+			return false;
+		}
+		if (line_chain == chain_id) {
+			rules.push_back(rule);
+		}
+	}
+	return true;
+}
+
+/* Read the packet counts of the rules of the chain from a copy of
+   /proc/simplepf/stats. Returns false if it can't be read. */
+bool read_rule_counts(const std::string& path, enum simplepf_chain_id chain_id,
+		std::vector<std::uint64_t>& counts)
+{
+	std::ifstream file(path);
+	std::string line;
+
+	if (!file) {
+		std::cerr << "Unable to open " << path << '\n';
+		return false;
+	}
+	while (std::getline(file, line)) {
+		std::istringstream words(line);
+		std::string chain, kind, packets;
+		std::size_t index;
+		std::uint64_t count;
+
+		/* <chain> rule <index> packets <n> bytes <n> */
+		if (!(words >> chain >> kind) || chain != chain_name(chain_id) || kind != "rule"
+				|| !(words >> index >> packets >> count) || packets != "packets") {
+			continue;
+		}
+		if (index < counts.size()) {
+			counts[index] = count;
+		}
+	}
+	return true;
+}
+
+/* Replace the rules of the chain in one write. Returns the exit code. */
+int replace_chain(enum simplepf_chain_id chain_id, const std::vector<struct simplepf_rule>& rules)
+{
+	struct simplepf_cmd cmd;
+	std::vector<char> buf(sizeof cmd + rules.size() * sizeof rules[0]);
+
+	std::memset(&cmd, 0, sizeof cmd);
+	cmd.type = SIMPLEPF_CMD_REPLACE;
+	cmd.chain_id = chain_id;
+	cmd.nr_rules = rules.size();
+	std::memcpy(buf.data(), &cmd, sizeof cmd);
+	if (!rules.empty()) {
+		std::memcpy(buf.data() + sizeof cmd, rules.data(), rules.size() * sizeof rules[0]);
+	}
+
+	int fd = open("/proc/simplepf/rules", O_WRONLY);
+	if (fd == -1) {
+		perror("open()");
+		return 1;
+	}
+	if (write(fd, buf.data(), buf.size()) == -1) {
+		perror("write()");
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
+
+/* Optimize the rules of the chain, read from the rule dump or from
+   rules_file, with the counts of counters_file if not empty. Prints the
+   result in the format of the rule dump, or with apply replaces the chain
+   with it. Returns the exit code. */
+int optimize_chain(enum simplepf_chain_id chain_id, const std::string& rules_file,
+		const std::string& counters_file, bool apply, const std::string& bpf_dir)
+{
+	bool ipv6 = SIMPLEPF_CHAIN_IS_IPV6(chain_id);
+	std::vector<struct simplepf_rule> before;
+
+	if (rules_file.empty() ? !read_chain_rules(chain_id, before)
+			: !read_rules_file(rules_file, chain_id, before)) {
+		return 1;
+	}
+	for (auto& rule : before) {
+		canonicalize_rule(rule, ipv6);
+	}
+
+	std::vector<std::uint64_t> counts(before.size(), 0);
+	if (!counters_file.empty() && !read_rule_counts(counters_file, chain_id, counts)) {
+		return 1;
+	}
+
+	std::vector<opt_rule> rules;
+	for (std::size_t i = 0; i < before.size(); i++) {
+		rules.push_back(make_opt_rule(before[i], counts[i], ipv6));
+	}
+	auto packets = test_packets(rules, ipv6, 40000);
+	std::vector<opt_rule> original = rules;
+
+	opt_stats stats;
+	bool changed = true;
+	while (changed) {
+		changed = drop_shadowed(rules, stats);
+		changed |= drop_redundant(rules, stats);
+		changed |= merge_rules(rules, ipv6, stats);
+	}
+	if (!counters_file.empty()) {
+		reorder_rules(rules, stats);
+	}
+
+	std::vector<struct simplepf_rule> after;
+	for (const auto& r : rules) {
+		after.push_back(r.rule);
+	}
+
+	std::cerr << chain_name(chain_id) << ": " << before.size() << " rules before, "
+		<< after.size() << " after (" << stats.unmatchable << " unmatchable, "
+		<< stats.duplicates << " duplicates, " << stats.shadowed << " shadowed, "
+		<< stats.redundant << " redundant, " << stats.merged << " merged, "
+		<< stats.moved << " moved)\n";
+
+	opt_index before_index = make_opt_index(original);
+	opt_index after_index = make_opt_index(rules);
+	for (std::size_t i = 0; i < original.size(); i++) {
+		index_add(before_index, original[i], i);
+	}
+	for (std::size_t i = 0; i < rules.size(); i++) {
+		index_add(after_index, rules[i], i);
+	}
+
+	std::size_t differ = 0;
+	for (const auto& pkt : packets) {
+		if (chain_verdict(original, before_index, ipv6, pkt)
+				!= chain_verdict(rules, after_index, ipv6, pkt)) {
+			differ++;
+		}
+	}
+	if (differ) {
+		std::cerr << "Verdicts differ for " << differ << " of " << packets.size()
+			<< " test packets; the rules are left as they are.\n";
+		return 1;
+	}
+	std::cerr << "Same verdicts for all " << packets.size() << " test packets.\n";
+
+	if (apply) {
+		int err = replace_chain(chain_id, after);
+		return err ? err : xdp_update(bpf_dir, chain_id);
+	}
+	for (const auto& rule : after) {
+		std::cout << format_rule(chain_id, rule) << '\n';
+	}
+	return 0;
+}
+
+/* Minimal generic netlink client, for the bulk interface of the module
+   (see uapi/simplepf.h). Requests are sent one at a time, each waiting for
+   its ack. */
+struct genl_sock {
+	int fd;
+	std::uint16_t family;
+	std::uint32_t seq;
+};
+
+/* Start a request of the family in buf. */
+void genl_start(std::vector<char>& buf, std::uint16_t family, std::uint8_t cmd)
+{
+	struct nlmsghdr nlh;
+	struct genlmsghdr genlh;
+
+	std::memset(&nlh, 0, sizeof nlh);
+	nlh.nlmsg_type = family;
+	nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	std::memset(&genlh, 0, sizeof genlh);
+	genlh.cmd = cmd;
+	genlh.version = family == GENL_ID_CTRL ? 1 : SIMPLEPF_GENL_VERSION;
+
+	buf.assign(NLMSG_HDRLEN + GENL_HDRLEN, 0);
+	std::memcpy(buf.data(), &nlh, sizeof nlh);
+	std::memcpy(buf.data() + NLMSG_HDRLEN, &genlh, sizeof genlh);
+}
+
+/* Append an attribute to the request in buf. */
+void genl_put(std::vector<char>& buf, std::uint16_t type, const void *data, std::size_t len)
+{
+	struct nlattr nla;
+	std::size_t offset = buf.size();
+
+	nla.nla_len = NLA_HDRLEN + len;
+	nla.nla_type = type;
+	buf.resize(offset + NLA_ALIGN(nla.nla_len), 0);
+	std::memcpy(buf.data() + offset, &nla, sizeof nla);
+	std::memcpy(buf.data() + offset + NLA_HDRLEN, data, len);
+}
+
+/* Send the request in buf and wait for its ack. A reply other than the ack
+   is copied to reply, if not null. Returns 0 on success, or the error of
+   the kernel, with its message, if any, in err_msg, and the offset in the
+   request of the attribute it points at, if any, in err_offset. Returns
+   -1 if the socket fails, with errno set. */
+int genl_request(genl_sock& sock, std::vector<char>& buf, std::vector<char> *reply,
+		std::string& err_msg, std::uint32_t& err_offset)
+{
+	struct nlmsghdr *req = reinterpret_cast<struct nlmsghdr *>(buf.data());
+	std::vector<char> rbuf(65536);
+
+	req->nlmsg_len = buf.size();
+	req->nlmsg_seq = ++sock.seq;
+	err_msg.clear();
+	err_offset = 0;
+
+	if (send(sock.fd, buf.data(), buf.size(), 0) == -1) {
+		return -errno;
+	}
+
+	for (;;) {
+		ssize_t len = recv(sock.fd, rbuf.data(), rbuf.size(), 0);
+		if (len == -1) {
+			return -errno;
+		}
+
+		for (auto nlh = reinterpret_cast<struct nlmsghdr *>(rbuf.data());
+				NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != sock.seq) {
+				continue;
+			}
+			if (nlh->nlmsg_type != NLMSG_ERROR) {
+				if (reply) {
+					auto data = reinterpret_cast<char *>(nlh);
+					reply->assign(data, data + nlh->nlmsg_len);
+				}
+				continue;
+			}
+
+			auto err = static_cast<struct nlmsgerr *>(NLMSG_DATA(nlh));
+			if (!err->error || !(nlh->nlmsg_flags & NLM_F_ACK_TLVS)) {
+				return err->error;
+			}
+
+			/* The extended ack attributes follow the header of the
+			   request, or the whole request if it is not capped. */
+			std::size_t offset = NLMSG_HDRLEN + sizeof *err;
+			offset += nlh->nlmsg_flags & NLM_F_CAPPED ? 0
+				: NLMSG_ALIGN(err->msg.nlmsg_len) - NLMSG_HDRLEN;
+			while (offset + NLA_HDRLEN <= nlh->nlmsg_len) {
+				auto nla = reinterpret_cast<struct nlattr *>(
+						reinterpret_cast<char *>(nlh) + offset);
+				auto data = reinterpret_cast<char *>(nla) + NLA_HDRLEN;
+
+				if (nla->nla_len < NLA_HDRLEN || offset + nla->nla_len > nlh->nlmsg_len) {
+					break;
+				}
+				if (nla->nla_type == NLMSGERR_ATTR_MSG) {
+					err_msg.assign(data, strnlen(data, nla->nla_len - NLA_HDRLEN));
+				} else if (nla->nla_type == NLMSGERR_ATTR_OFFS) {
+					std::memcpy(&err_offset, data, sizeof err_offset);
+				}
+				offset += NLA_ALIGN(nla->nla_len);
+			}
+			return err->error;
+		}
+	}
+}
+
+/* Open a generic netlink socket and look up the family of the module.
+   Returns false if either fails, e.g. if the module is not loaded. */
+bool genl_open(genl_sock& sock)
+{
+	struct sockaddr_nl addr;
+	std::vector<char> buf, reply;
+	std::string err_msg;
+	std::uint32_t err_offset;
+	int one = 1;
+
+	sock.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (sock.fd == -1) {
+		return false;
+	}
+	sock.seq = 0;
+	std::memset(&addr, 0, sizeof addr);
+	addr.nl_family = AF_NETLINK;
+	if (bind(sock.fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof addr) == -1) {
+		close(sock.fd);
+		return false;
+	}
+	/* Only ask for the error messages and offsets, not for copies of
+	   the (large) requests. Older kernels have neither; that's fine. */
+	setsockopt(sock.fd, SOL_NETLINK, NETLINK_EXT_ACK, &one, sizeof one);
+	setsockopt(sock.fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof one);
+
+	genl_start(buf, GENL_ID_CTRL, CTRL_CMD_GETFAMILY);
+	genl_put(buf, CTRL_ATTR_FAMILY_NAME, SIMPLEPF_GENL_NAME, sizeof SIMPLEPF_GENL_NAME);
+	if (genl_request(sock, buf, &reply, err_msg, err_offset) != 0 || reply.empty()) {
+		close(sock.fd);
+		return false;
+	}
+
+	std::size_t offset = NLMSG_HDRLEN + GENL_HDRLEN;
+	while (offset + NLA_HDRLEN <= reply.size()) {
+		auto nla = reinterpret_cast<struct nlattr *>(reply.data() + offset);
+
+		if (nla->nla_len < NLA_HDRLEN || offset + nla->nla_len > reply.size()) {
+			break;
+		}
+		if (nla->nla_type == CTRL_ATTR_FAMILY_ID) {
+			std::memcpy(&sock.family, reply.data() + offset + NLA_HDRLEN, sizeof sock.family);
+			return true;
+		}
+		offset += NLA_ALIGN(nla->nla_len);
+	}
+	close(sock.fd);
+	return false;
+}
+
+/* Rules of the file being loaded, to be added in one update: consecutive
+   rules for the same chain, with their line numbers. */
+struct load_batch {
+	enum simplepf_chain_id chain_id;
+	std::vector<struct simplepf_rule> rules;
+	std::vector<std::size_t> lines;
+};
+
+/* Rules per SIMPLEPF_GENL_CMD_ADD request; about 64 KiB of attributes. */
+const std::size_t load_batch_size = 1024;
+
+/* Add the first count rules of the batch to its chain in one request.
+   Returns 0 on success, or the error of the kernel, with its message in
+   err_msg and the index of the offending rule in err_index, if known. */
+int genl_add_rules(genl_sock& sock, const load_batch& batch, std::size_t count,
+		std::string& err_msg, std::size_t& err_index)
+{
+	std::uint32_t chain_id = batch.chain_id;
+	std::uint32_t err_offset;
+	std::vector<char> buf;
+	std::size_t first_rule;
+
+	genl_start(buf, sock.family, SIMPLEPF_GENL_CMD_ADD);
+	genl_put(buf, SIMPLEPF_ATTR_CHAIN, &chain_id, sizeof chain_id);
+	first_rule = buf.size();
+	for (std::size_t i = 0; i < count; i++) {
+		genl_put(buf, SIMPLEPF_ATTR_RULE, &batch.rules[i], sizeof batch.rules[i]);
+	}
+
+	int err = genl_request(sock, buf, nullptr, err_msg, err_offset);
+	err_index = count;
+	if (err > 0) {
+		err = -EPROTO;
+	}
+	if (err < 0 && err_offset >= first_rule) {
+		err_index = (err_offset - first_rule) / NLA_ALIGN(NLA_HDRLEN + sizeof batch.rules[0]);
+	}
+	return err;
+}
+
+/* Add the rules of the batch, over netlink if sock.fd is open, or with a
+   write each to proc_fd. On failure, the rules before the offending one
+   are still added, and the error is printed with its line.
+   Returns the number of rules added, less than the size of the batch on
+   failure. */
+std::size_t add_batch(genl_sock& sock, int proc_fd, const load_batch& batch,
+		const std::string& path)
+{
+	if (batch.rules.empty()) {
+		return 0;
+	}
+
+	if (sock.fd == -1) {
+		struct simplepf_cmd cmd;
+
+		std::memset(&cmd, 0, sizeof cmd);
+		cmd.type = SIMPLEPF_CMD_ADD;
+		cmd.chain_id = batch.chain_id;
+		for (std::size_t i = 0; i < batch.rules.size(); i++) {
+			cmd.rule = batch.rules[i];
+			if (write(proc_fd, &cmd, sizeof cmd) == -1) {
+				std::cerr << path << ':' << batch.lines[i] << ": "
+					<< std::strerror(errno) << '\n';
+				return i;
+			}
+		}
+		return batch.rules.size();
+	}
+
+	std::string err_msg;
+	std::size_t err_index;
+	int err = genl_add_rules(sock, batch, batch.rules.size(), err_msg, err_index);
+	if (!err) {
+		return batch.rules.size();
+	}
+
+	/* A request adds all of its rules or none; add the ones before the
+	   offending rule, if it is known, so the load stops right at it. */
+	std::string ignored;
+	std::size_t ignored_index;
+	if (err_index < batch.rules.size() && err_index > 0
+			&& genl_add_rules(sock, batch, err_index, ignored, ignored_index) != 0) {
+		err_index = batch.rules.size();
+	}
+	if (err_index < batch.rules.size()) {
+		std::cerr << path << ':' << batch.lines[err_index] << ": ";
+	} else {
+		std::cerr << path << ':' << batch.lines.front() << '-' << batch.lines.back()
+			<< ": none of these rules were added: ";
+	}
+	std::cerr << (err_msg.empty() ? std::strerror(-err) : err_msg) << '\n';
+	return err_index < batch.rules.size() ? err_index : 0;
+}
+
+/* Add the rules of a file in the format of the rule dump, or of standard
+   input for "-", to their chains. Empty lines and lines starting with #
+   are skipped. Consecutive rules for a chain are added in batches with a
+   request each, or with a write each if the netlink interface is not
+   available. Stops at the first line that can't be parsed or added; the
+   rules before it stay added. Prints the rate. Returns the exit code. */
+int load_rules(const std::string& path, const std::string& bpf_dir)
+{
+	std::ifstream file;
+	std::istream *in = &std::cin;
+	std::string name = path == "-" ? "<stdin>" : path;
+
+	if (path != "-") {
+		file.open(path);
+		if (!file) {
+			std::cerr << "Unable to open " << path << '\n';
+			return 1;
+		}
+		in = &file;
+	}
+
+	genl_sock sock;
+	int proc_fd = -1;
+	if (!genl_open(sock)) {
+		sock.fd = -1;
+		proc_fd = open("/proc/simplepf/rules", O_WRONLY);
+		if (proc_fd == -1) {
+			perror("open()");
+			std::cerr << "Unable to open simplepf proc file\n";
+			return 1;
+		}
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<bool> touched(__SIMPLEPF_CHAIN_LAST, false);
+	load_batch batch;
+	std::size_t loaded = 0;
+	std::size_t lineno = 0;
+	std::string line;
+	std::string invalid;
+	bool ok = true;
+
+	batch.chain_id = SIMPLEPF_CHAIN_INPUT;
+	while (ok && std::getline(*in, line)) {
+		enum simplepf_chain_id chain_id;
+		struct simplepf_rule rule;
+
+		lineno++;
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		if (!parse_rule_line(line, chain_id, rule)) {
+			invalid = line;
+			break;
+		}
+
+		if (chain_id != batch.chain_id || batch.rules.size() == load_batch_size) {
+			std::size_t added = add_batch(sock, proc_fd, batch, name);
+			loaded += added;
+			ok = added == batch.rules.size();
+			batch.rules.clear();
+			batch.lines.clear();
+			batch.chain_id = chain_id;
+		}
+		batch.rules.push_back(rule);
+		batch.lines.push_back(lineno);
+		touched[chain_id] = true;
+	}
+	/* The rules before an invalid line are added all the same. */
+	if (ok) {
+		std::size_t added = add_batch(sock, proc_fd, batch, name);
+		loaded += added;
+		ok = added == batch.rules.size();
+	}
+	if (ok && !invalid.empty()) {
+		std::cerr << name << ':' << lineno << ": invalid rule: " << invalid << '\n';
+		ok = false;
+	}
+
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	std::cerr << "Added " << loaded << " rules in " << secs.count() << " s ("
+		<< (secs.count() > 0 ? static_cast<std::uint64_t>(loaded / secs.count()) : 0)
+		<< " rules/s)" << (sock.fd == -1 ? " through the proc file" : "") << '\n';
+
+	close(sock.fd == -1 ? proc_fd : sock.fd);
+
+	/* Some rules of the input chain may have been added even on failure. */
+	int err = touched[SIMPLEPF_CHAIN_INPUT] ? xdp_update(bpf_dir, SIMPLEPF_CHAIN_INPUT) : 0;
+	return ok ? err : 1;
+}
+
 int main(int argc, char **argv)
 {
 	po::options_description options_desc("Options");
 	options_desc.add_options()
 	("help", "print this help message")
 	("add", po::value<std::string>(), "add a rule to the specified chain")
-	("src", po::value<std::string>(), "source IP address (dotted decimal)")
-	("dest", po::value<std::string>(), "destination IP address (dotted decimal)")
-	("proto", po::value<std::string>(), "protocol; one of icmp, tcp or udp")
-	("icmp_type", po::value<std::uint8_t>(), "ICMP type (for icmp)")
-	("sport", po::value<std::uint16_t>(), "source port number (for tcp or udp)")
-	("dport", po::value<std::uint16_t>(), "destination port number (for tcp or udp)")
+	("src", po::value<std::string>(), "source IP address (dotted decimal, or IPv6 for the *6 chains), optionally with a /prefix length")
+	("dest", po::value<std::string>(), "destination IP address (dotted decimal, or IPv6 for the *6 chains), optionally with a /prefix length")
+	("proto", po::value<std::string>(), "protocol; one of icmp, icmpv6, tcp or udp")
+	("icmp_type", po::value<std::uint8_t>(), "ICMP type (for icmp or icmpv6)")
+	("sport", po::value<std::string>(), "source port number or range first-last (for tcp or udp)")
+	("dport", po::value<std::string>(), "destination port number or range first-last (for tcp or udp)")
+	("iface", po::value<std::string>(), "interface the rule applies to (the output interface for the output chain)")
+	("log", "log the packets the rule matches")
 	("flush", po::value<std::string>(), "flush the specified chain")
+	("set-engine", po::value<std::string>(), "set the classification engine of the specified chain")
+	("engine", po::value<std::string>(), "engine name; one of linear, tss, lpm, ports, dtree or bitvec")
+	("xdp-sync", "copy the input chain to the maps of the XDP program (done after every change to the input chain while it is loaded)")
+	("xdp-stats", "print the packet counts of the XDP program")
+	("bpf-dir", po::value<std::string>()->default_value(SIMPLEPF_XDP_PIN_DIR), "directory the maps of the XDP program are pinned in")
+	("read-log", "print the packets logged by rules with --log as they come, until interrupted")
+	("debugfs-dir", po::value<std::string>()->default_value("/sys/kernel/debug/simplepf"), "directory of the debugfs files of the module")
+	("optimize", po::value<std::string>(), "print an equivalent, smaller ruleset for the specified chain")
+	("rules-file", po::value<std::string>(), "optimize the rules of a file in the format of the rule dump instead of the loaded ones")
+	("counters", po::value<std::string>(), "copy of /proc/simplepf/stats to order the rules by how many packets they matched")
+	("apply", "replace the chain with the optimized rules instead of printing them")
+	("load", po::value<std::string>(), "add the rules of a file in the format of the rule dump (- for standard input) in a few batches, stopping at the first bad line")
 	;
 
 	po::variables_map vm;
 	po::store(po::parse_command_line(argc, argv, options_desc), vm);
 
 	conflicting_options(vm, "flush", "add");
+	conflicting_options(vm, "set-engine", "add");
+	conflicting_options(vm, "set-engine", "flush");
+	conflicting_options(vm, "xdp-sync", "add");
+	conflicting_options(vm, "xdp-sync", "flush");
+	conflicting_options(vm, "xdp-sync", "set-engine");
+	conflicting_options(vm, "xdp-stats", "add");
+	conflicting_options(vm, "xdp-stats", "flush");
+	conflicting_options(vm, "xdp-stats", "set-engine");
+	conflicting_options(vm, "xdp-stats", "xdp-sync");
+	conflicting_options(vm, "read-log", "add");
+	conflicting_options(vm, "read-log", "flush");
+	conflicting_options(vm, "read-log", "set-engine");
+	conflicting_options(vm, "read-log", "xdp-sync");
+	conflicting_options(vm, "read-log", "xdp-stats");
+	conflicting_options(vm, "optimize", "add");
+	conflicting_options(vm, "optimize", "flush");
+	conflicting_options(vm, "optimize", "set-engine");
+	conflicting_options(vm, "optimize", "xdp-sync");
+	conflicting_options(vm, "optimize", "xdp-stats");
+	conflicting_options(vm, "optimize", "read-log");
+	conflicting_options(vm, "load", "add");
+	conflicting_options(vm, "load", "flush");
+	conflicting_options(vm, "load", "set-engine");
+	conflicting_options(vm, "load", "xdp-sync");
+	conflicting_options(vm, "load", "xdp-stats");
+	conflicting_options(vm, "load", "read-log");
+	conflicting_options(vm, "load", "optimize");
 
 	option_dependency(vm, "src", "add");
 	option_dependency(vm, "dest", "add");
@@ -85,12 +2291,52 @@ int main(int argc, char **argv)
 	option_dependency(vm, "icmp_type", "add");
 	option_dependency(vm, "sport", "add");
 	option_dependency(vm, "dport", "add");
+	option_dependency(vm, "iface", "add");
+	option_dependency(vm, "log", "add");
+	option_dependency(vm, "engine", "set-engine");
+	option_dependency(vm, "set-engine", "engine");
+	option_dependency(vm, "rules-file", "optimize");
+	option_dependency(vm, "counters", "optimize");
+	option_dependency(vm, "apply", "optimize");
 
 	if (vm.count("help")) {
 		std::cout << options_desc << '\n';
 		return 0;
 	}
 
+	auto bpf_dir = vm["bpf-dir"].as<std::string>();
+
+	if (vm.count("xdp-sync")) {
+		return xdp_sync(bpf_dir);
+	}
+
+	if (vm.count("xdp-stats")) {
+		return xdp_stats(bpf_dir);
+	}
+
+	if (vm.count("read-log")) {
+		return read_log(vm["debugfs-dir"].as<std::string>());
+	}
+
+	if (vm.count("load")) {
+		return load_rules(vm["load"].as<std::string>(), bpf_dir);
+	}
+
+	if (vm.count("optimize")) {
+		enum simplepf_chain_id chain_id;
+
+		if (!parse_chain_name(vm["optimize"].as<std::string>(), chain_id)) {
+			std::cerr << "Chain name invalid. Must be input, output, prerouting, forward, ingress,\n"
+				"input6, output6, prerouting6 or forward6.\n";
+			return 1;
+		}
+
+		return optimize_chain(chain_id,
+				vm.count("rules-file") ? vm["rules-file"].as<std::string>() : "",
+				vm.count("counters") ? vm["counters"].as<std::string>() : "",
+				vm.count("apply"), bpf_dir);
+	}
+
 	int fd;
 	fd = open("/proc/simplepf/rules", O_WRONLY);
 	if (fd == -1) {
@@ -105,13 +2351,44 @@ int main(int argc, char **argv)
 	if (vm.count("flush")) {
 		cmd.type = SIMPLEPF_CMD_FLUSH;
 
-		auto chain_name {vm["flush"].as<std::string>()};
-		if (chain_name == "input") {
-			cmd.chain_id = SIMPLEPF_CHAIN_INPUT;
-		} else if (chain_name == "output") {
-			cmd.chain_id = SIMPLEPF_CHAIN_OUTPUT;
+		if (!parse_chain_name(vm["flush"].as<std::string>(), cmd.chain_id)) {
+			std::cerr << "Chain name invalid. Must be input, output, prerouting, forward, ingress,\n"
+				"input6, output6, prerouting6 or forward6.\n";
+			return 1;
+		}
+
+		if (write(fd, &cmd, sizeof cmd) == -1) {
+			perror("write()");
+			return 1;
+		}
+
+		return xdp_update(bpf_dir, cmd.chain_id);
+	}
+
+	if (vm.count("set-engine")) {
+		cmd.type = SIMPLEPF_CMD_SET_ENGINE;
+
+		if (!parse_chain_name(vm["set-engine"].as<std::string>(), cmd.chain_id)) {
+			std::cerr << "Chain name invalid. Must be input, output, prerouting, forward, ingress,\n"
+				"input6, output6, prerouting6 or forward6.\n";
+			return 1;
+		}
+
+		auto engine = vm["engine"].as<std::string>();
+		if (engine == "linear") {
+			cmd.engine = SIMPLEPF_ENGINE_LINEAR;
+		} else if (engine == "tss") {
+			cmd.engine = SIMPLEPF_ENGINE_TSS;
+		} else if (engine == "lpm") {
+			cmd.engine = SIMPLEPF_ENGINE_LPM;
+		} else if (engine == "ports") {
+			cmd.engine = SIMPLEPF_ENGINE_PORTS;
+		} else if (engine == "dtree") {
+			cmd.engine = SIMPLEPF_ENGINE_DTREE;
+		} else if (engine == "bitvec") {
+			cmd.engine = SIMPLEPF_ENGINE_BITVEC;
 		} else {
-			std::cerr << "Chain name invalid. Must be input or output.\n";
+			std::cerr << "Invalid engine.\n";
 			return 1;
 		}
 
@@ -128,46 +2405,50 @@ int main(int argc, char **argv)
 
 		cmd.rule.action = SIMPLEPF_ACTION_DROP;
 
-		auto chain_name {vm["add"].as<std::string>()};
-		if (chain_name == "input") {
-			cmd.chain_id = SIMPLEPF_CHAIN_INPUT;
-		} else if (chain_name == "output") {
-			cmd.chain_id = SIMPLEPF_CHAIN_OUTPUT;
-		} else {
-			std::cerr << "Chain name invalid. Must be input or output.\n";
+		if (!parse_chain_name(vm["add"].as<std::string>(), cmd.chain_id)) {
+			std::cerr << "Chain name invalid. Must be input, output, prerouting, forward, ingress,\n"
+				"input6, output6, prerouting6 or forward6.\n";
 			return 1;
 		}
 
 		if (vm.count("src")) {
 			cmd.rule.filter_saddr = true;
 
-			struct in_addr inaddr;
+			std::string addr;
+			if (!split_prefix(vm["src"].as<std::string>(), cmd.chain_id, addr, cmd.rule.ip_saddr_prefixlen)) {
+				std::cerr << "Invalid prefix length.\n";
+				return 1;
+			}
+
 			/*
 			 * inet_pton() returns 1 on success.
 			 * It's a crying shame, innit?
 			 */
-			if (inet_pton(AF_INET, vm["src"].as<std::string>().c_str(), &inaddr) == 0) {
+			if (inet_pton(SIMPLEPF_CHAIN_IS_IPV6(cmd.chain_id) ? AF_INET6 : AF_INET,
+					addr.c_str(), cmd.rule.ip6_saddr) == 0) {
 				perror("inet_pton");
 				return 1;
 			}
-
-			cmd.rule.ip_saddr = inaddr.s_addr;
 		}
 
 		if (vm.count("dest")) {
 			cmd.rule.filter_daddr = true;
 
-			struct in_addr inaddr;
+			std::string addr;
+			if (!split_prefix(vm["dest"].as<std::string>(), cmd.chain_id, addr, cmd.rule.ip_daddr_prefixlen)) {
+				std::cerr << "Invalid prefix length.\n";
+				return 1;
+			}
+
 			/*
 			 * inet_pton() returns 1 on success.
 			 * It's a crying shame, innit?
 			 */
-			if (inet_pton(AF_INET, vm["dest"].as<std::string>().c_str(), &inaddr) == 0) {
+			if (inet_pton(SIMPLEPF_CHAIN_IS_IPV6(cmd.chain_id) ? AF_INET6 : AF_INET,
+					addr.c_str(), cmd.rule.ip6_daddr) == 0) {
 				perror("inet_pton");
 				return 1;
 			}
-
-			cmd.rule.ip_daddr = inaddr.s_addr;
 		}
 
 		if (vm.count("proto")) {
@@ -176,6 +2457,8 @@ int main(int argc, char **argv)
 			auto proto = vm["proto"].as<std::string>();
 			if (proto == "icmp") {
 				cmd.rule.ip_protocol = IPPROTO_ICMP;
+			} else if (proto == "icmpv6") {
+				cmd.rule.ip_protocol = IPPROTO_ICMPV6;
 			} else if (proto == "tcp") {
 				cmd.rule.ip_protocol = IPPROTO_TCP;
 			} else if (proto == "udp") {
@@ -187,15 +2470,29 @@ int main(int argc, char **argv)
 		}
 
 		if (vm.count("sport")) {
+			std::uint16_t first, last;
+
 			cmd.rule.filter_sport = true;
 
-			cmd.rule.transport_sport = htons(vm["sport"].as<std::uint16_t>());
+			if (!parse_port_range(vm["sport"].as<std::string>(), first, last)) {
+				std::cerr << "Invalid port range.\n";
+				return 1;
+			}
+			cmd.rule.transport_sport = htons(first);
+			cmd.rule.transport_sport_max = htons(last);
 		}
 
 		if (vm.count("dport")) {
+			std::uint16_t first, last;
+
 			cmd.rule.filter_dport = true;
 
-			cmd.rule.transport_dport = htons(vm["dport"].as<std::uint16_t>());
+			if (!parse_port_range(vm["dport"].as<std::string>(), first, last)) {
+				std::cerr << "Invalid port range.\n";
+				return 1;
+			}
+			cmd.rule.transport_dport = htons(first);
+			cmd.rule.transport_dport_max = htons(last);
 		}
 
 		if (vm.count("icmp_type")) {
@@ -204,6 +2501,20 @@ int main(int argc, char **argv)
 			cmd.rule.icmp_type = vm["icmp_type"].as<std::uint8_t>();
 		}
 
+		if (vm.count("iface")) {
+			cmd.rule.filter_ifindex = true;
+
+			cmd.rule.ifindex = if_nametoindex(vm["iface"].as<std::string>().c_str());
+			if (cmd.rule.ifindex == 0) {
+				perror("if_nametoindex");
+				return 1;
+			}
+		}
+
+		if (vm.count("log")) {
+			cmd.rule.log = true;
+		}
+
 		/*
 		 * Ready to fire the command.
 		 */
@@ -211,6 +2522,8 @@ int main(int argc, char **argv)
 			perror("write()");
 			return 1;
 		}
+
+		return xdp_update(bpf_dir, cmd.chain_id);
 	}
 
 	return 0;
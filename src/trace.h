@@ -0,0 +1,94 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tracepoints of simplepf, under events/simplepf in tracefs.
+ * Disabled tracepoints cost a patched-out branch in the packet path.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM simplepf
+
+#if !defined(_SIMPLEPF_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SIMPLEPF_TRACE_H
+
+#include "uapi/simplepf.h"
+
+#include <linux/tracepoint.h>
+
+/*
+ * A packet went through a chain. @index is the index in the chain of the
+ * rule that matched, or -1 if none did and the default action was taken.
+ * @ifindex is the interface whose rules applied, 0 if only the rules for
+ * all interfaces did. @scanned is the number of rules it was compared with,
+ * 0 if the verdict came from the flow cache (@cached).
+ */
+TRACE_EVENT(simplepf_traverse,
+
+	TP_PROTO(enum simplepf_chain_id chain_id, int ifindex,
+		enum simplepf_action action, int index,
+		unsigned int scanned, bool cached, u64 ns),
+
+	TP_ARGS(chain_id, ifindex, action, index, scanned, cached, ns),
+
+	TP_STRUCT__entry(
+		__field(u8, chain_id)
+		__field(u8, action)
+		__field(bool, cached)
+		__field(int, ifindex)
+		__field(int, index)
+		__field(unsigned int, scanned)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->chain_id = chain_id;
+		__entry->action = action;
+		__entry->cached = cached;
+		__entry->ifindex = ifindex;
+		__entry->index = index;
+		__entry->scanned = scanned;
+		__entry->ns = ns;
+	),
+
+	TP_printk("chain=%s ifindex=%d verdict=%s rule=%d scanned=%u cached=%d ns=%llu",
+		__print_symbolic(__entry->chain_id,
+			{ SIMPLEPF_CHAIN_INPUT, "input" },
+			{ SIMPLEPF_CHAIN_OUTPUT, "output" },
+			{ SIMPLEPF_CHAIN_PREROUTING, "prerouting" },
+			{ SIMPLEPF_CHAIN_FORWARD, "forward" },
+			{ SIMPLEPF_CHAIN_INGRESS, "ingress" },
+			{ SIMPLEPF_CHAIN_INPUT6, "input6" },
+			{ SIMPLEPF_CHAIN_OUTPUT6, "output6" },
+			{ SIMPLEPF_CHAIN_PREROUTING6, "prerouting6" },
+			{ SIMPLEPF_CHAIN_FORWARD6, "forward6" }),
+		__entry->ifindex,
+		__print_symbolic(__entry->action,
+			{ SIMPLEPF_ACTION_ACCEPT, "accept" },
+			{ SIMPLEPF_ACTION_DROP, "drop" }),
+		__entry->index, __entry->scanned, __entry->cached,
+		__entry->ns)
+);
+
+#endif	/* _SIMPLEPF_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
@@ -0,0 +1,645 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tuple space search classifier, after TupleMerge.
+ *
+ * Every rule is a range of values in each dimension of the search space
+ * (see match.h), and a tuple is a prefix length for each dimension. The
+ * rules of a tuple are hashed on their values masked to its lengths, so a
+ * packet only needs one probe per tuple, with its own values masked the
+ * same way, to find the rules of the tuple that can match it. These are
+ * kept in a short list per key, in rule order, and checked with the
+ * reference matcher. A rule has a key for every block of the tuple's
+ * lengths its ranges reach into; it can go in a tuple where that is up to
+ * TSS_KEYS, so a port range across a block boundary is in two lists.
+ *
+ * Giving every combination of prefix lengths a tuple of its own would cost
+ * a probe per combination, i.e. grow with the ruleset. Instead a rule goes
+ * into the first tuple where all its lists have room (fewer than
+ * TSS_BUCKET rules); only if there is none is a tuple made for it, with
+ * its lengths rounded down to multiples of TSS_LEN_STEP. So there are at
+ * most as many tuples as rounded combinations of lengths, however many
+ * rules there are, and usually far fewer, as a tuple of short prefixes
+ * takes the longer ones that don't crowd a list. Lists only grow beyond
+ * TSS_BUCKET in the tuple of the rules' own lengths, when many rules
+ * overlap there; a packet then usually matches one of the first few.
+ *
+ * Across tuples, first-match is kept by taking the lowest rule index found.
+ * Tuples are ordered by the index of their first rule, so the search stops
+ * at the first tuple that can't beat the best match found so far, and a
+ * list is only scanned up to it. A rule with a single key that matches
+ * every packet with that key shadows the later rules that only have that
+ * key in the tuple, which are left out.
+ *
+ * Which fields apply, and how wide they are, depends on the packet class,
+ * so every class gets its own set of tuples.
+ */
+
+#include "engine.h"
+#include "match.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+#include <linux/seq_file.h>
+
+/* Rules per key beyond which a rule looks for another tuple. */
+#define TSS_BUCKET 8
+/* Granularity of the prefix lengths of new tuples, a power of two. */
+#define TSS_LEN_STEP 4
+/* Keys a rule may have in a tuple. */
+#define TSS_KEYS 4
+
+#define TSS_EMPTY U32_MAX
+
+/*
+ * The values of a rule or packet in every dimension, masked to the lengths
+ * of a tuple.
+ */
+struct tss_key {
+	u32 val[SIMPLEPF_DIMS];
+};
+
+/*
+ * The rules with a key: refs[first] to refs[first + nr - 1] of the class.
+ * While building, @covered tells that one of them matches every packet
+ * with the key; @first is TSS_EMPTY for a free slot.
+ */
+struct tss_entry {
+	struct tss_key key;
+	u32 first;
+	u32 nr;
+	bool covered;
+};
+
+/*
+ * An open addressing hash table with linear probing.
+ * It is at most half full, so every probe sequence ends at an empty slot.
+ */
+struct tss_tuple {
+	u8 len[SIMPLEPF_DIMS];
+	u32 mask[SIMPLEPF_DIMS];
+	unsigned int first;
+	u32 nr_entries;
+	u32 hash_mask;
+	struct tss_entry *entries;
+};
+
+struct tss_class {
+	unsigned int nr_tuples;
+	unsigned int max_tuples;
+	struct tss_tuple *tuples;
+	u32 *refs;
+	u32 max_bucket;
+};
+
+struct tss {
+	u32 seed;
+	struct tss_class classes[__SIMPLEPF_CLASS_LAST];
+};
+
+static inline u32 tss_hash(const struct tss_key *key, u32 seed)
+{
+	return jhash2(key->val, SIMPLEPF_DIMS, seed);
+}
+
+static inline void tss_mask_key(const struct tss_tuple *t, const u32 *val,
+		struct tss_key *key)
+{
+	unsigned int d;
+
+	for (d = 0; d < SIMPLEPF_DIMS; d++) {
+		key->val[d] = val[d] & t->mask[d];
+	}
+}
+
+/*
+ * The slot of the key in the table: its entry, or the free slot it would
+ * go to.
+ */
+static struct tss_entry *tss_slot(const struct tss_tuple *t,
+		const struct tss_key *key, u32 seed)
+{
+	u32 i = tss_hash(key, seed) & t->hash_mask;
+
+	for (;;) {
+		struct tss_entry *e = &t->entries[i];
+
+		if (e->first == TSS_EMPTY ||
+				!memcmp(&e->key, key, sizeof *key)) {
+			return e;
+		}
+		i = (i + 1) & t->hash_mask;
+	}
+}
+
+/*
+ * Make room for one more key: double the table when it is half full.
+ */
+static int tss_grow(struct tss_tuple *t, u32 seed)
+{
+	struct tss_entry *old = t->entries;
+	u32 size = t->hash_mask + 1;
+	u32 i;
+
+	if (old && 2 * (t->nr_entries + 1) <= size) {
+		return 0;
+	}
+
+	size = old ? 2 * size : 16;
+	t->entries = kvmalloc_array(size, sizeof *t->entries, GFP_KERNEL);
+	if (!t->entries) {
+		t->entries = old;
+		return -ENOMEM;
+	}
+	for (i = 0; i < size; i++) {
+		t->entries[i].first = TSS_EMPTY;
+	}
+	t->hash_mask = size - 1;
+
+	for (i = 0; old && i < size / 2; i++) {
+		if (old[i].first != TSS_EMPTY) {
+			*tss_slot(t, &old[i].key, seed) = old[i];
+		}
+	}
+	kvfree(old);
+
+	return 0;
+}
+
+static void tss_destroy(void *priv)
+{
+	struct tss *tss = priv;
+	enum simplepf_pkt_class class;
+	unsigned int i;
+
+	for (class = 0; class < __SIMPLEPF_CLASS_LAST; class++) {
+		struct tss_class *cls = &tss->classes[class];
+		for (i = 0; i < cls->nr_tuples; i++) {
+			kvfree(cls->tuples[i].entries);
+		}
+		kvfree(cls->tuples);
+		kvfree(cls->refs);
+	}
+	kfree(tss);
+}
+
+/*
+ * The length of the shortest aligned block of a dimension of @bits bits
+ * that holds the range.
+ */
+static inline unsigned int tss_range_len(const struct simplepf_range *r,
+		unsigned int bits)
+{
+	u32 diff = r->lo ^ r->hi;
+
+	return diff ? bits - ilog2(diff) - 1 : bits;
+}
+
+/* The number of aligned blocks of length @len the range spans. */
+static inline u64 tss_range_blocks(const struct simplepf_range *r,
+		unsigned int bits, unsigned int len)
+{
+	unsigned int shift = bits - len;
+
+	return len ? (u64)(r->hi >> shift) - (r->lo >> shift) + 1 : 1;
+}
+
+/*
+ * The lengths of the tuple made for a rule with @ranges: their lengths
+ * rounded down to multiples of TSS_LEN_STEP. A range that isn't an
+ * aligned block, i.e. a port range, may lie across a boundary of large
+ * blocks; it gets the longest length at which it spans up to two.
+ */
+static void tss_rule_lens(enum simplepf_pkt_class class,
+		const struct simplepf_range *ranges, u8 *len)
+{
+	unsigned int d;
+
+	for (d = 0; d < SIMPLEPF_DIMS; d++) {
+		const struct simplepf_range *r = &ranges[d];
+		unsigned int bits = simplepf_dim_bits(class, d);
+		unsigned int exact = tss_range_len(r, bits);
+		unsigned int l = exact & ~(TSS_LEN_STEP - 1);
+
+		if (r->hi - r->lo != (u32)((1ULL << (bits - exact)) - 1)) {
+			while (l + TSS_LEN_STEP <= bits &&
+					tss_range_blocks(r, bits,
+						l + TSS_LEN_STEP) <= 2) {
+				l += TSS_LEN_STEP;
+			}
+		}
+		len[d] = l;
+	}
+}
+
+/*
+ * The number of keys of a rule with @ranges in the tuple, or any number
+ * above TSS_KEYS if there are more.
+ */
+static u32 tss_nr_keys(const struct tss_tuple *t,
+		enum simplepf_pkt_class class,
+		const struct simplepf_range *ranges)
+{
+	u32 nr = 1;
+	unsigned int d;
+
+	for (d = 0; d < SIMPLEPF_DIMS && nr <= TSS_KEYS; d++) {
+		u64 blocks = tss_range_blocks(&ranges[d],
+				simplepf_dim_bits(class, d), t->len[d]);
+
+		nr = blocks > TSS_KEYS ? TSS_KEYS + 1 : nr * blocks;
+	}
+	return nr;
+}
+
+/*
+ * The keys of a rule with @ranges in the tuple: start with the masked
+ * lower ends, and call this until it returns false.
+ */
+static bool tss_next_key(const struct tss_tuple *t,
+		const struct simplepf_range *ranges, struct tss_key *key)
+{
+	unsigned int d;
+
+	for (d = 0; d < SIMPLEPF_DIMS; d++) {
+		if (key->val[d] != (ranges[d].hi & t->mask[d])) {
+			key->val[d] += t->mask[d] & -t->mask[d];
+			return true;
+		}
+		key->val[d] = ranges[d].lo & t->mask[d];
+	}
+	return false;
+}
+
+/*
+ * Add a tuple with the lengths. Returns its index, or a negative error
+ * code.
+ */
+static int tss_add_tuple(struct tss_class *cls, enum simplepf_pkt_class class,
+		const u8 *len, unsigned int index)
+{
+	struct tss_tuple *t;
+	unsigned int d;
+
+	if (cls->nr_tuples == cls->max_tuples) {
+		unsigned int max_tuples = max(2 * cls->max_tuples, 16U);
+		struct tss_tuple *tuples;
+
+		tuples = kvcalloc(max_tuples, sizeof *tuples, GFP_KERNEL);
+		if (!tuples) {
+			return -ENOMEM;
+		}
+		if (cls->tuples) {
+			memcpy(tuples, cls->tuples,
+					cls->nr_tuples * sizeof *tuples);
+			kvfree(cls->tuples);
+		}
+		cls->tuples = tuples;
+		cls->max_tuples = max_tuples;
+	}
+
+	t = &cls->tuples[cls->nr_tuples];
+	for (d = 0; d < SIMPLEPF_DIMS; d++) {
+		unsigned int bits = simplepf_dim_bits(class, d);
+
+		t->len[d] = len[d];
+		t->mask[d] = len[d] ? (u32)(((1ULL << len[d]) - 1) <<
+				(bits - len[d])) : 0;
+	}
+	t->first = index;
+
+	return cls->nr_tuples++;
+}
+
+static bool tss_same_lens(const struct tss_tuple *t, const u8 *len)
+{
+	return !memcmp(t->len, len, sizeof t->len);
+}
+
+/*
+ * Whether the rule can go in the tuple: whether all its @nr_keys keys
+ * have room, or the tuple is the rule's own. Sets @shadowed if it has a
+ * single key, and a rule before it covers that.
+ */
+static bool tss_fits(const struct tss_tuple *t, const u8 *len,
+		const struct simplepf_range *ranges, u32 nr_keys, u32 seed,
+		bool *shadowed)
+{
+	const struct tss_entry *e;
+	struct tss_key key;
+	u32 lo[SIMPLEPF_DIMS];
+	bool room = true;
+	unsigned int d;
+
+	for (d = 0; d < SIMPLEPF_DIMS; d++) {
+		lo[d] = ranges[d].lo;
+	}
+	tss_mask_key(t, lo, &key);
+
+	do {
+		e = tss_slot(t, &key, seed);
+		if (e->first != TSS_EMPTY && e->nr >= TSS_BUCKET) {
+			room = false;
+		}
+	} while (tss_next_key(t, ranges, &key));
+
+	*shadowed = nr_keys == 1 && e->first != TSS_EMPTY && e->covered;
+	return room || tss_same_lens(t, len);
+}
+
+/*
+ * Put rule @index, with @ranges and the lengths of its own tuple @len, in
+ * a tuple; see above. Sets @tuple to the index of the tuple, or to
+ * TSS_EMPTY if a rule before it shadows it. Returns 0, or a negative
+ * error code.
+ */
+static int tss_place_rule(struct tss *tss, enum simplepf_pkt_class class,
+		const struct simplepf_range *ranges, const u8 *len,
+		unsigned int index, u32 *tuple)
+{
+	struct tss_class *cls = &tss->classes[class];
+	struct tss_tuple *t = NULL;
+	struct tss_entry *e;
+	struct tss_key key;
+	u32 lo[SIMPLEPF_DIMS];
+	u32 nr_keys = 0;
+	bool shadowed;
+	unsigned int i;
+	unsigned int d;
+	int err;
+
+	*tuple = TSS_EMPTY;
+	for (i = 0; i < cls->nr_tuples; i++) {
+		struct tss_tuple *u = &cls->tuples[i];
+
+		nr_keys = tss_nr_keys(u, class, ranges);
+		if (nr_keys > TSS_KEYS) {
+			continue;
+		}
+		if (tss_fits(u, len, ranges, nr_keys, tss->seed, &shadowed)) {
+			t = u;
+			break;
+		}
+		if (shadowed) {
+			return 0;
+		}
+	}
+	if (!t) {
+		int id = tss_add_tuple(cls, class, len, index);
+
+		if (id < 0) {
+			return id;
+		}
+		i = id;
+		t = &cls->tuples[i];
+		nr_keys = tss_nr_keys(t, class, ranges);
+	}
+
+	for (d = 0; d < SIMPLEPF_DIMS; d++) {
+		lo[d] = ranges[d].lo;
+	}
+	tss_mask_key(t, lo, &key);
+	do {
+		err = tss_grow(t, tss->seed);
+		if (err) {
+			return err;
+		}
+		e = tss_slot(t, &key, tss->seed);
+		if (e->first == TSS_EMPTY) {
+			e->key = key;
+			e->first = 0;
+			e->nr = 0;
+			e->covered = false;
+			t->nr_entries++;
+		} else if (e->covered && nr_keys == 1) {
+			/* Shadowed by a rule before it. */
+			return 0;
+		}
+		e->nr++;
+	} while (tss_next_key(t, ranges, &key));
+	*tuple = i;
+
+	if (nr_keys > 1) {
+		return 0;
+	}
+	for (d = 0; d < SIMPLEPF_DIMS; d++) {
+		unsigned int free_bits = simplepf_dim_bits(class, d) - t->len[d];
+
+		if (ranges[d].hi - ranges[d].lo !=
+				(u32)((1ULL << free_bits) - 1)) {
+			return 0;
+		}
+	}
+	e->covered = true;
+
+	return 0;
+}
+
+static int tss_build_class(struct tss *tss, enum simplepf_pkt_class class,
+		const struct chain_rule *rules, unsigned int count)
+{
+	struct tss_class *cls = &tss->classes[class];
+	struct simplepf_range ranges[SIMPLEPF_DIMS];
+	u8 len[SIMPLEPF_DIMS];
+	u32 *placed;
+	u32 nr_refs = 0;
+	unsigned int i;
+	unsigned int d;
+	u32 j;
+	int err = 0;
+
+	placed = kvmalloc_array(max(count, 1U), sizeof *placed, GFP_KERNEL);
+	if (!placed) {
+		return -ENOMEM;
+	}
+
+	/*
+	 * First pass: place the rules in the tuples, and count the rules of
+	 * every key. Tuples are made in the order of their first rules, so
+	 * they come out sorted by it.
+	 */
+	for (i = 0; i < count; i++) {
+		placed[i] = TSS_EMPTY;
+		if (!simplepf_rule_in_class(&rules[i].rule, class)) {
+			continue;
+		}
+		simplepf_rule_ranges(&rules[i].rule, class, ranges);
+		tss_rule_lens(class, ranges, len);
+		err = tss_place_rule(tss, class, ranges, len, i, &placed[i]);
+		if (err) {
+			goto out;
+		}
+	}
+
+	/* Lay the lists out back to back, then fill them in rule order. */
+	for (i = 0; i < cls->nr_tuples; i++) {
+		struct tss_tuple *t = &cls->tuples[i];
+
+		for (j = 0; j <= t->hash_mask; j++) {
+			struct tss_entry *e = &t->entries[j];
+
+			if (e->first == TSS_EMPTY) {
+				continue;
+			}
+			e->first = nr_refs;
+			nr_refs += e->nr;
+			cls->max_bucket = max(cls->max_bucket, e->nr);
+			e->nr = 0;
+		}
+	}
+
+	cls->refs = kvmalloc_array(max(nr_refs, 1U), sizeof *cls->refs,
+			GFP_KERNEL);
+	if (!cls->refs) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		const struct tss_tuple *t;
+		struct tss_entry *e;
+		struct tss_key key;
+		u32 lo[SIMPLEPF_DIMS];
+
+		if (placed[i] == TSS_EMPTY) {
+			continue;
+		}
+		t = &cls->tuples[placed[i]];
+		simplepf_rule_ranges(&rules[i].rule, class, ranges);
+		for (d = 0; d < SIMPLEPF_DIMS; d++) {
+			lo[d] = ranges[d].lo;
+		}
+		tss_mask_key(t, lo, &key);
+		do {
+			e = tss_slot(t, &key, tss->seed);
+			cls->refs[e->first + e->nr++] = i;
+		} while (tss_next_key(t, ranges, &key));
+	}
+
+out:
+	kvfree(placed);
+	return err;
+}
+
+static void *tss_build(const struct chain_rule *rules, unsigned int count)
+{
+	struct tss *tss;
+	enum simplepf_pkt_class class;
+
+	tss = kzalloc(sizeof *tss, GFP_KERNEL);
+	if (!tss) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	/*
+	 * Random seed, so that the layout of the hash tables can't be
+	 * predicted by whoever is sending the packets.
+	 */
+	tss->seed = get_random_u32();
+
+	for (class = 0; class < __SIMPLEPF_CLASS_LAST; class++) {
+		int err = tss_build_class(tss, class, rules, count);
+		if (err) {
+			tss_destroy(tss);
+			return ERR_PTR(err);
+		}
+	}
+
+	return tss;
+}
+
+static unsigned int tss_classify(const void *priv,
+		const struct chain_rule *rules, unsigned int count,
+		const struct simplepf_packet *pkt, unsigned int *scanned)
+{
+	const struct tss *tss = priv;
+	const struct tss_class *cls;
+	u32 values[SIMPLEPF_DIMS];
+	unsigned int best = count;
+	unsigned int i;
+
+	*scanned = 0;
+	if (pkt->class >= __SIMPLEPF_CLASS_LAST) {
+		return count;
+	}
+
+	cls = &tss->classes[pkt->class];
+	simplepf_packet_values(pkt, values);
+	for (i = 0; i < cls->nr_tuples; i++) {
+		const struct tss_tuple *t = &cls->tuples[i];
+		const struct tss_entry *e;
+		struct tss_key key;
+		u32 j;
+
+		if (t->first >= best) {
+			break;
+		}
+
+		tss_mask_key(t, values, &key);
+		e = tss_slot(t, &key, tss->seed);
+		(*scanned)++;
+		if (e->first == TSS_EMPTY) {
+			continue;
+		}
+		for (j = 0; j < e->nr; j++) {
+			u32 index = cls->refs[e->first + j];
+
+			if (index >= best) {
+				break;
+			}
+			(*scanned)++;
+			if (simplepf_match_rule(&rules[index].rule, pkt) !=
+					__SIMPLEPF_ACTION_LAST) {
+				best = index;
+				break;
+			}
+		}
+	}
+
+	return best;
+}
+
+static void tss_show(const void *priv, struct seq_file *m)
+{
+	const struct tss *tss = priv;
+	unsigned int tuples = 0;
+	u32 max_bucket = 0;
+	enum simplepf_pkt_class class;
+
+	for (class = 0; class < __SIMPLEPF_CLASS_LAST; class++) {
+		tuples += tss->classes[class].nr_tuples;
+		max_bucket = max(max_bucket, tss->classes[class].max_bucket);
+	}
+
+	seq_printf(m, " tuples %u max_bucket %u", tuples, max_bucket);
+}
+
+const struct simplepf_engine simplepf_tss_engine = {
+	.name = "tss",
+	.build = tss_build,
+	.classify = tss_classify,
+	.destroy = tss_destroy,
+	.show = tss_show,
+};
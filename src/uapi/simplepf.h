@@ -27,12 +27,82 @@ enum simplepf_action {
 	__SIMPLEPF_ACTION_LAST
 };
 
+/*
+ * Chains, by the hook they are attached to:
+ * SIMPLEPF_CHAIN_INPUT: NF_INET_LOCAL_IN, packets delivered to this host.
+ * SIMPLEPF_CHAIN_OUTPUT: NF_INET_LOCAL_OUT, packets sent by this host.
+ * SIMPLEPF_CHAIN_PREROUTING: NF_INET_PRE_ROUTING, every packet received,
+ *  before the routing decision.
+ * SIMPLEPF_CHAIN_FORWARD: NF_INET_FORWARD, packets routed through this host.
+ * SIMPLEPF_CHAIN_INGRESS: NF_NETDEV_INGRESS of the devices listed in the
+ *  ingress_devices module parameter, every packet as soon as it is received,
+ *  before the IP stack.
+ * SIMPLEPF_CHAIN_INPUT6, SIMPLEPF_CHAIN_OUTPUT6, SIMPLEPF_CHAIN_PREROUTING6,
+ *  SIMPLEPF_CHAIN_FORWARD6: the same hooks for IPv6, see
+ *  SIMPLEPF_CHAIN_IS_IPV6(); without IPv6 in the kernel they see no packets.
+ * The priority of the hooks is set with the hook_priority module parameter.
+ * Prerouting, forward and ingress, and all the IPv6 chains, may see packets
+ * before reassembly; fragments other than the first match no rule there.
+ */
 enum simplepf_chain_id {
 	SIMPLEPF_CHAIN_INPUT = 0,
 	SIMPLEPF_CHAIN_OUTPUT,
+	SIMPLEPF_CHAIN_PREROUTING,
+	SIMPLEPF_CHAIN_FORWARD,
+	SIMPLEPF_CHAIN_INGRESS,
+	SIMPLEPF_CHAIN_INPUT6,
+	SIMPLEPF_CHAIN_OUTPUT6,
+	SIMPLEPF_CHAIN_PREROUTING6,
+	SIMPLEPF_CHAIN_FORWARD6,
 	__SIMPLEPF_CHAIN_LAST
 };
 
+/*
+ * Whether the chain filters IPv6 packets. The rules of the IPv6 chains
+ * match addresses with ip6_saddr and ip6_daddr, by prefixes of up to 128
+ * bits, and their protocol is the upper-layer protocol found after the
+ * extension headers (at most SIMPLEPF_IPV6_MAX_EXTHDRS of them; a packet
+ * with more matches no rule), with IPPROTO_ICMPV6 for ICMP types.
+ * They always use SIMPLEPF_ENGINE_LINEAR, and not the flow cache.
+ */
+#define SIMPLEPF_CHAIN_IS_IPV6(chain_id) ((chain_id) >= SIMPLEPF_CHAIN_INPUT6)
+
+#define SIMPLEPF_IPV6_MAX_EXTHDRS 8
+
+/*
+ * Classification engines. Each chain is compiled with one of them whenever
+ * it is updated; all of them give the same verdicts, they only differ in
+ * speed and memory use.
+ * SIMPLEPF_ENGINE_LINEAR tries every rule in order. Default.
+ * SIMPLEPF_ENGINE_TSS (tuple space search) hashes rules by the set of fields
+ *  (and address prefix lengths) they filter on; lookup cost depends on the
+ *  number of distinct sets, not on the number of rules.
+ * SIMPLEPF_ENGINE_LPM indexes rules by address prefix in a multibit trie;
+ *  lookup cost depends on the address width and on the number of rules
+ *  that don't filter on that address, suited to large prefix blocklists.
+ * SIMPLEPF_ENGINE_PORTS indexes TCP/UDP rules by destination port range in
+ *  a segment tree and ICMP rules by type; suited to rulesets made of port
+ *  ranges.
+ * SIMPLEPF_ENGINE_DTREE cuts the space of all the fields into a decision tree
+ *  (HiCuts); a lookup walks a bounded number of nodes and checks a small leaf.
+ *  Suited to large rulesets mixing addresses, protocols and ports. Its size
+ *  grows with overlapping ranges and is capped; a ruleset that would exceed
+ *  the cap fails to compile with E2BIG.
+ * SIMPLEPF_ENGINE_BITVEC keeps a bitmap of the matching rules for every range
+ *  of values of every field and ANDs the bitmaps of the packet a word at a
+ *  time; lookup cost grows with the number of rules / 64, memory with its
+ *  square. Suited to a few thousand rules; fails with E2BIG above its cap.
+ */
+enum simplepf_engine_id {
+	SIMPLEPF_ENGINE_LINEAR = 0,
+	SIMPLEPF_ENGINE_TSS,
+	SIMPLEPF_ENGINE_LPM,
+	SIMPLEPF_ENGINE_PORTS,
+	SIMPLEPF_ENGINE_DTREE,
+	SIMPLEPF_ENGINE_BITVEC,
+	__SIMPLEPF_ENGINE_LAST
+};
+
 /*
  * Rule descriptor struct. This struct is what will be filled by userspace.
  * Each chain node will store one rule descriptor.
@@ -47,16 +117,49 @@ enum simplepf_chain_id {
  *  of the fields do not match, there is no match and we skip the rule.
  *  Think of it as a "logical and" operation.
  *
+ * Addresses can be matched by prefix: if filter_saddr is set, only the first
+ *  ip_saddr_prefixlen bits of the source address are compared, so a single rule
+ *  can match a whole CIDR block (e.g. 10.1.0.0/16). Same for the destination.
+ *  A prefix length of 0 is taken as 32, i.e. an exact match, so rules that
+ *  don't set it keep their meaning; to match any address, don't set the
+ *  filter_* field. Prefix lengths above 32 are rejected with EINVAL.
+ *  In the IPv6 chains, the addresses are ip6_saddr and ip6_daddr, and
+ *  prefix lengths go up to 128, with 0 taken as 128.
+ *
+ * Ports can be matched by range: if filter_sport is set, the rule matches source
+ *  ports from transport_sport to transport_sport_max, inclusive. A maximum of 0
+ *  means the single port transport_sport, so rules that don't set it keep their
+ *  meaning. A maximum below the minimum is rejected with EINVAL.
+ *  Same for the destination port.
+ *
+ * Rules can be scoped to an interface: if filter_ifindex is set, the rule only
+ *  applies to packets that came in on the interface with index ifindex (for
+ *  the output chain, that go out on it). Chains are split by interface when
+ *  they are compiled, so a packet is only classified against the rules for
+ *  all interfaces and the rules for its own; the rules of other interfaces
+ *  cost it nothing. An ifindex of 0 is rejected with EINVAL.
+ *
+ * If log is set, every packet the rule matches is logged, see
+ *  struct simplepf_log_record. It does not take part in matching.
+ *
  * Note that if none of the filter_* are set, the rule matches ALL packets.
  *  XXX: We should not let anyone set port numbers for ICMP filters or
  *  ICMP types for UDP/TCP filters.
  */
 struct simplepf_rule {
 	bool filter_saddr;
-	__u32 ip_saddr;
+	union {
+		__u32 ip_saddr;
+		__u32 ip6_saddr[4];
+	};
+	__u8 ip_saddr_prefixlen;
 
 	bool filter_daddr;
-	__u32 ip_daddr;
+	union {
+		__u32 ip_daddr;
+		__u32 ip6_daddr[4];
+	};
+	__u8 ip_daddr_prefixlen;
 
 	bool filter_proto;
 	__u8 ip_protocol;
@@ -66,17 +169,80 @@ struct simplepf_rule {
 
 	bool filter_sport;
 	__u16 transport_sport;
+	__u16 transport_sport_max;
 
 	bool filter_dport;
 	__u16 transport_dport;
+	__u16 transport_dport_max;
+
+	bool filter_ifindex;
+	__u32 ifindex;
 
 	enum simplepf_action action;
+
+	bool log;
 };
 
+/*
+ * Log of the packets matched by rules with the log flag, for all namespaces.
+ * Every CPU has its own relay buffer of records, readable (and mmap()able,
+ * with the usual relay sub-buffer layout) as <debugfs>/simplepf/log<cpu>.
+ * A packet is logged on the CPU that handles it, without locking or
+ * waiting: when the buffer of the CPU is full, the record is dropped and
+ * counted in /proc/simplepf/stats. The size of the buffers is set with the
+ * log_buffer_kb module parameter.
+ * A reader gets whole records; records never straddle sub-buffers.
+ */
+struct simplepf_log_record {
+	/* CLOCK_MONOTONIC, in ns. */
+	__u64 timestamp;
+	/*
+	 * Network byte order; saddr6 and daddr6 for the IPv6 chains, and
+	 * only saddr and daddr set for the others.
+	 */
+	union {
+		__u32 saddr;
+		__u32 saddr6[4];
+	};
+	union {
+		__u32 daddr;
+		__u32 daddr6[4];
+	};
+	/* Network byte order; 0 for other protocols than TCP and UDP. */
+	__u16 sport;
+	__u16 dport;
+	__u8 protocol;
+	/* 0 for other protocols than ICMP and ICMPv6. */
+	__u8 icmp_type;
+	/* enum simplepf_chain_id */
+	__u8 chain_id;
+	/* enum simplepf_action */
+	__u8 action;
+	/* Input interface, or output for the output chains; 0 if none. */
+	__s32 ifindex;
+	/* Index of the rule in its chain. */
+	__u32 rule;
+};
+
+/*
+ * Upper bound on the number of rules in a chain.
+ */
+#define SIMPLEPF_MAX_RULES (1 << 20)
+
 /*
  * The firewall is configured by writing a struct simplepf_cmd to /proc/simplepf/rules.
  * Only one command can be written at a time,
  * use multiple writes for multiple commands.
+ * SIMPLEPF_CMD_REPLACE is the exception to the fixed size: the command is
+ * followed by nr_rules struct simplepf_rule in the same write, and the chain
+ * is atomically replaced with these rules. Readers see either the old chain
+ * or the new one, never a partially loaded chain. A replace with
+ * nr_rules == 0 is equivalent to a flush.
+ * SIMPLEPF_CMD_SET_ENGINE selects the classification engine of the chain.
+ * Every network namespace has its own chains, and its own copy of the file
+ * as /proc/net/simplepf/rules; /proc/simplepf links to the one of the
+ * namespace of the process that opens it. Writing requires CAP_NET_ADMIN
+ * in the user namespace that owns the network namespace.
  * The following enum and struct are self explanatory.
  * There are a few things to note, though:
  * * Since currently only feasible way to use this module is with a default accept
@@ -87,13 +253,69 @@ struct simplepf_rule {
 enum simplepf_cmd_type {
 	SIMPLEPF_CMD_ADD,
 	SIMPLEPF_CMD_FLUSH,
+	SIMPLEPF_CMD_REPLACE,
+	SIMPLEPF_CMD_SET_ENGINE,
 	__SIMPLEPF_CMD_LAST
 };
 
 struct simplepf_cmd {
 	enum simplepf_cmd_type type;
 	enum simplepf_chain_id chain_id;
-	struct simplepf_rule rule;
+	union {
+		/* SIMPLEPF_CMD_ADD */
+		struct simplepf_rule rule;
+		/* SIMPLEPF_CMD_REPLACE */
+		__u32 nr_rules;
+		/* SIMPLEPF_CMD_SET_ENGINE */
+		enum simplepf_engine_id engine;
+	};
+};
+
+/*
+ * Generic netlink interface, an alternative to /proc/simplepf/rules that
+ * can carry many rules per message and many messages per sendmsg().
+ * Resolve the family id of SIMPLEPF_GENL_NAME with the generic netlink
+ * controller, then send one message per operation. Every message is
+ * processed in order, and answered with an error message (an ack, if the
+ * error is 0) when it fails or when NLM_F_ACK is set; so a batch of
+ * messages gets one reply per operation. Failures point at the offending
+ * attribute (with the extended ack attributes) where there is one.
+ * Messages update the chains of the network namespace of the socket, and
+ * require CAP_NET_ADMIN in the user namespace that owns it.
+ *
+ * SIMPLEPF_GENL_CMD_ADD: SIMPLEPF_ATTR_CHAIN, and one SIMPLEPF_ATTR_RULE per
+ *  rule to append, in order. All the rules of a message are appended in one
+ *  update; if any of them is invalid, none is.
+ * SIMPLEPF_GENL_CMD_FLUSH: SIMPLEPF_ATTR_CHAIN.
+ * SIMPLEPF_GENL_CMD_REPLACE: SIMPLEPF_ATTR_CHAIN, and one SIMPLEPF_ATTR_RULE
+ *  per rule of the new chain (none to flush), as SIMPLEPF_CMD_REPLACE.
+ * SIMPLEPF_GENL_CMD_SET_ENGINE: SIMPLEPF_ATTR_CHAIN and SIMPLEPF_ATTR_ENGINE.
+ *
+ * A message is limited by the socket send buffer; raise it with SO_SNDBUF
+ * (or SO_SNDBUFFORCE) to send large chains in one message.
+ */
+#define SIMPLEPF_GENL_NAME "simplepf"
+#define SIMPLEPF_GENL_VERSION 1
+
+enum simplepf_genl_cmd {
+	SIMPLEPF_GENL_CMD_UNSPEC,
+	SIMPLEPF_GENL_CMD_ADD,
+	SIMPLEPF_GENL_CMD_FLUSH,
+	SIMPLEPF_GENL_CMD_REPLACE,
+	SIMPLEPF_GENL_CMD_SET_ENGINE,
+	__SIMPLEPF_GENL_CMD_LAST
+};
+
+enum simplepf_genl_attr {
+	SIMPLEPF_ATTR_UNSPEC,
+	/* __u32, enum simplepf_chain_id */
+	SIMPLEPF_ATTR_CHAIN,
+	/* struct simplepf_rule; may be repeated */
+	SIMPLEPF_ATTR_RULE,
+	/* __u32, enum simplepf_engine_id */
+	SIMPLEPF_ATTR_ENGINE,
+	__SIMPLEPF_ATTR_LAST
 };
+#define SIMPLEPF_ATTR_MAX (__SIMPLEPF_ATTR_LAST - 1)
 
 #endif	/* _SIMPLEPF_SIMPLEPF_H */
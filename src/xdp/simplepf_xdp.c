@@ -0,0 +1,276 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * XDP program that drops the packets the input chain would drop, at the
+ * driver. See simplepf_xdp.h for its maps and how they are kept in sync
+ * with the chain.
+ *
+ * Packets are parsed like the chain code does and matched against the rules
+ * in order with the reference matcher of the module, so the verdicts are
+ * the same. Fragments are left to the stack: the input hook only sees
+ * reassembled datagrams, and only the first fragment has the ports.
+ * XDP sees every packet received on the interface, but the input chain only
+ * applies to the ones for this host; a packet the chain drops is only
+ * dropped here if the routing table does not forward it.
+ *
+ * Self-contained, so it builds with nothing but clang and the kernel
+ * headers; the maps use the iproute2 ELF layout.
+ */
+
+#include <stdbool.h>
+#include <linux/types.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/icmp.h>
+#include <asm/byteorder.h>
+
+#define ntohs(x) __be16_to_cpu(x)
+#define ntohl(x) __be32_to_cpu(x)
+#define htons(x) __cpu_to_be16(x)
+#define htonl(x) __cpu_to_be32(x)
+
+#include "../match.h"
+#include "simplepf_xdp.h"
+
+#define SEC(name) __attribute__((section(name), used))
+
+static void *(*bpf_map_lookup_elem)(void *map, const void *key) =
+	(void *)BPF_FUNC_map_lookup_elem;
+static int (*bpf_fib_lookup)(void *ctx, struct bpf_fib_lookup *params,
+		int plen, __u32 flags) = (void *)BPF_FUNC_fib_lookup;
+
+/* Map definition as iproute2 expects it. */
+struct bpf_elf_map {
+	__u32 type;
+	__u32 size_key;
+	__u32 size_value;
+	__u32 max_elem;
+	__u32 flags;
+	__u32 id;
+	__u32 pinning;
+	__u32 inner_id;
+	__u32 inner_idx;
+};
+
+#define PIN_GLOBAL_NS 2
+
+/* Not in the uapi headers. */
+#define IP_MF 0x2000
+#define IP_OFFSET 0x1fff
+#ifndef AF_INET
+#define AF_INET 2
+#endif
+
+struct bpf_elf_map SEC("maps") simplepf_rules = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.size_key = sizeof(__u32),
+	.size_value = sizeof(struct simplepf_rule),
+	.max_elem = 2 * SIMPLEPF_XDP_MAX_RULES,
+	.pinning = PIN_GLOBAL_NS,
+};
+
+struct bpf_elf_map SEC("maps") simplepf_meta = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.size_key = sizeof(__u32),
+	.size_value = sizeof(__u32),
+	.max_elem = 1,
+	.pinning = PIN_GLOBAL_NS,
+};
+
+struct bpf_elf_map SEC("maps") simplepf_stats = {
+	.type = BPF_MAP_TYPE_PERCPU_ARRAY,
+	.size_key = sizeof(__u32),
+	.size_value = sizeof(struct simplepf_xdp_counter),
+	.max_elem = __SIMPLEPF_XDP_STAT_LAST,
+	.pinning = PIN_GLOBAL_NS,
+};
+
+static __always_inline int xdp_verdict(struct xdp_md *ctx,
+		enum simplepf_xdp_stat stat, int verdict)
+{
+	__u32 key = stat;
+	struct simplepf_xdp_counter *counter;
+
+	counter = bpf_map_lookup_elem(&simplepf_stats, &key);
+	if (counter) {
+		counter->packets++;
+		counter->bytes += ctx->data_end - ctx->data;
+	}
+
+	return verdict;
+}
+
+/*
+ * Extract the fields rules match on, as parse_packet() in the chain code,
+ * and the TOS for the route lookup.
+ * Returns false if the packet is to be left to the stack.
+ */
+static __always_inline bool xdp_parse_packet(void *data, void *data_end,
+		struct simplepf_packet *pkt, __u8 *tos)
+{
+	struct ethhdr *eth = data;
+	struct iphdr *ip;
+	void *l4;
+
+	if ((void *)(eth + 1) > data_end || eth->h_proto != htons(ETH_P_IP)) {
+		return false;
+	}
+
+	ip = (void *)(eth + 1);
+	if ((void *)(ip + 1) > data_end || ip->ihl < 5) {
+		return false;
+	}
+	if (ip->frag_off & htons(IP_MF | IP_OFFSET)) {
+		return false;
+	}
+
+	*tos = ip->tos;
+	pkt->saddr = ip->saddr;
+	pkt->daddr = ip->daddr;
+	pkt->protocol = ip->protocol;
+	pkt->sport = 0;
+	pkt->dport = 0;
+	pkt->icmp_type = 0;
+	pkt->class = simplepf_proto_class(ip->protocol);
+
+	l4 = (void *)ip + ip->ihl * 4;
+	switch (pkt->class) {
+	case SIMPLEPF_CLASS_ICMP:
+	{
+		struct icmphdr *icmp = l4;
+
+		if ((void *)(icmp + 1) > data_end) {
+			pkt->class = __SIMPLEPF_CLASS_LAST;
+			break;
+		}
+		pkt->icmp_type = icmp->type;
+	}
+	break;
+
+	case SIMPLEPF_CLASS_L4:
+	{
+		/* The ports are the first two fields of TCP and UDP. */
+		__be16 *ports = l4;
+
+		if ((void *)(ports + 2) > data_end) {
+			pkt->class = __SIMPLEPF_CLASS_LAST;
+			break;
+		}
+		pkt->sport = ports[0];
+		pkt->dport = ports[1];
+	}
+	break;
+
+	default:
+	break;
+	}
+
+	return true;
+}
+
+/*
+ * Whether the packet goes to the input hook rather than the forward hook,
+ * as far as the routing table tells. Packets are only forwarded on an
+ * interface with forwarding enabled, and then only if they have a unicast
+ * route that isn't local; broadcast and multicast are delivered locally.
+ * Packets without a route never reach the input hook either, but the stack
+ * answers some of them with an ICMP error, so they are left to it.
+ */
+static __always_inline bool xdp_for_host(struct xdp_md *ctx,
+		const struct simplepf_packet *pkt, __u8 tos)
+{
+	struct bpf_fib_lookup fib = {};
+	int ret;
+
+	fib.family = AF_INET;
+	fib.tos = tos;
+	fib.l4_protocol = pkt->protocol;
+	fib.sport = pkt->sport;
+	fib.dport = pkt->dport;
+	fib.ipv4_src = pkt->saddr;
+	fib.ipv4_dst = pkt->daddr;
+	fib.ifindex = ctx->ingress_ifindex;
+
+	ret = bpf_fib_lookup(ctx, &fib, sizeof fib, 0);
+	return ret == BPF_FIB_LKUP_RET_NOT_FWDED ||
+		ret == BPF_FIB_LKUP_RET_FWD_DISABLED;
+}
+
+SEC("xdp")
+int simplepf_xdp(struct xdp_md *ctx)
+{
+	void *data = (void *)(long)ctx->data;
+	void *data_end = (void *)(long)ctx->data_end;
+	struct simplepf_packet pkt;
+	__u8 tos;
+	__u32 key = 0;
+	__u32 *meta;
+	__u32 count;
+	__u32 base;
+	__u32 i;
+
+	if (!xdp_parse_packet(data, data_end, &pkt, &tos)) {
+		return xdp_verdict(ctx, SIMPLEPF_XDP_STAT_SKIP, XDP_PASS);
+	}
+	if (pkt.class >= __SIMPLEPF_CLASS_LAST) {
+		return xdp_verdict(ctx, SIMPLEPF_XDP_STAT_PASS, XDP_PASS);
+	}
+
+	meta = bpf_map_lookup_elem(&simplepf_meta, &key);
+	if (!meta) {
+		return xdp_verdict(ctx, SIMPLEPF_XDP_STAT_PASS, XDP_PASS);
+	}
+	count = SIMPLEPF_XDP_META_COUNT(*meta);
+	base = SIMPLEPF_XDP_META_HALF(*meta) * SIMPLEPF_XDP_MAX_RULES;
+
+#pragma clang loop unroll(disable)
+	for (i = 0; i < SIMPLEPF_XDP_MAX_RULES && i < count; i++) {
+		const struct simplepf_rule *rule;
+		enum simplepf_action action;
+
+		key = base + i;
+		rule = bpf_map_lookup_elem(&simplepf_rules, &key);
+		if (!rule) {
+			break;
+		}
+		if (rule->filter_ifindex &&
+				rule->ifindex != ctx->ingress_ifindex) {
+			continue;
+		}
+
+		action = simplepf_match_rule(rule, &pkt);
+		/*
+		 * Only drops need the route lookup; most packets are
+		 * accepted without one.
+		 */
+		if (action == SIMPLEPF_ACTION_DROP &&
+				xdp_for_host(ctx, &pkt, tos)) {
+			return xdp_verdict(ctx, SIMPLEPF_XDP_STAT_DROP,
+					XDP_DROP);
+		}
+		if (action != __SIMPLEPF_ACTION_LAST) {
+			break;
+		}
+	}
+
+	return xdp_verdict(ctx, SIMPLEPF_XDP_STAT_PASS, XDP_PASS);
+}
+
+char __license[] SEC("license") = "GPL";
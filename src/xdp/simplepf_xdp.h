@@ -0,0 +1,82 @@
+/*
+ * simplepf, a simple packet filtering firewall
+ * Copyright (C) 2019 Yağmur Oymak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMPLEPF_XDP_H
+#define _SIMPLEPF_XDP_H
+
+#include <linux/types.h>
+
+/*
+ * Maps of the XDP program (simplepf_xdp.c), shared with the tools that
+ * fill them.
+ *
+ * The program applies the input chain at the driver: a packet for this host
+ * whose first matching rule drops it is dropped there, before the kernel
+ * builds an skb for it; any other packet goes on to the stack and the
+ * netfilter hooks as usual. Whether a packet is for this host is looked up
+ * in the routing table (bpf_fib_lookup()): packets that would be forwarded
+ * are left to the forward chain, even if the input chain drops them. On an
+ * interface without forwarding, no packet is forwarded, so all of them are
+ * checked. The maps hold a copy of the chain, made by userspace
+ * (simplepf --xdp-sync), of at most its first SIMPLEPF_XDP_MAX_RULES rules.
+ * That is enough to be right: if a rule of a prefix of the chain matches,
+ * the first one that does is the first match of the whole chain, and if
+ * none does, the packet is left for the hooks to decide.
+ *
+ * When loaded with iproute2 (ip link set dev DEV xdp obj simplepf_xdp.o
+ * sec xdp), the maps are pinned as SIMPLEPF_XDP_PIN_DIR/<name>:
+ *
+ * SIMPLEPF_XDP_RULES_MAP: array of 2 * SIMPLEPF_XDP_MAX_RULES
+ *  struct simplepf_rule in canonical form (see simplepf_match_rule()),
+ *  in two halves.
+ * SIMPLEPF_XDP_META_MAP: array of a single __u32, SIMPLEPF_XDP_META() of
+ *  the number of rules and the half they are in. An update writes the
+ *  rules to the other half and then switches to it with a single store,
+ *  so the program sees either the old rules or the new ones.
+ * SIMPLEPF_XDP_STATS_MAP: per-CPU array of struct simplepf_xdp_counter,
+ *  indexed by enum simplepf_xdp_stat.
+ */
+#define SIMPLEPF_XDP_MAX_RULES 1024
+
+#define SIMPLEPF_XDP_PIN_DIR "/sys/fs/bpf/tc/globals"
+#define SIMPLEPF_XDP_RULES_MAP "simplepf_rules"
+#define SIMPLEPF_XDP_META_MAP "simplepf_meta"
+#define SIMPLEPF_XDP_STATS_MAP "simplepf_stats"
+
+#define SIMPLEPF_XDP_META(count, half) (((count) << 1) | (half))
+#define SIMPLEPF_XDP_META_COUNT(meta) ((meta) >> 1)
+#define SIMPLEPF_XDP_META_HALF(meta) ((meta) & 1)
+
+enum simplepf_xdp_stat {
+	/*
+	 * No rule matched, the first match accepts, or it drops but the
+	 * packet is to be forwarded.
+	 */
+	SIMPLEPF_XDP_STAT_PASS,
+	SIMPLEPF_XDP_STAT_DROP,
+	/* Not IPv4, or a fragment: left to the stack unclassified. */
+	SIMPLEPF_XDP_STAT_SKIP,
+	__SIMPLEPF_XDP_STAT_LAST
+};
+
+struct simplepf_xdp_counter {
+	__u64 packets;
+	__u64 bytes;
+};
+
+#endif	/* _SIMPLEPF_XDP_H */
@@ -0,0 +1,108 @@
+#!/bin/sh
+#
+# simplepf, a simple packet filtering firewall
+# Copyright (C) 2019 Yağmur Oymak
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#
+# Compare the drop rate of the netfilter hook with the one of the XDP
+# program on a veth pair. pktgen floods UDP packets from a namespace over
+# the pair, and a drop rule of the input chain drops them; first at the
+# input hook, then with the XDP program attached to the receiving end.
+#
+# Needs root, the module loaded, pktgen, iproute2 with BPF support,
+# and simplepf_xdp.o and ../tools/simplepf.out built.
+# Usage: veth-bench.sh [seconds]
+#
+# On veth the skb is already built when the packet is received, so the
+# gain is smaller than on a physical NIC, where XDP runs before that.
+#
+
+set -e
+
+SECONDS_PER_RUN=${1:-10}
+DIR=$(dirname "$0")
+TOOL="$DIR/../tools/simplepf.out"
+OBJ="$DIR/simplepf_xdp.o"
+NS=simplepf-bench
+GEN_IP=10.199.0.1
+DUT_IP=10.199.0.2
+PORT=9
+
+cleanup() {
+	ip link set dev spf-dut xdp off 2>/dev/null || true
+	rm -f /sys/fs/bpf/tc/globals/simplepf_rules \
+		/sys/fs/bpf/tc/globals/simplepf_meta \
+		/sys/fs/bpf/tc/globals/simplepf_stats
+	ip netns del $NS 2>/dev/null || true
+	ip link del spf-dut 2>/dev/null || true
+	"$TOOL" --flush input >/dev/null 2>&1 || true
+}
+trap cleanup EXIT
+
+pg() {
+	ip netns exec $NS sh -c "echo '$2' > /proc/net/pktgen/$1"
+}
+
+# Packets dropped so far by the rule, at the hook or in XDP.
+nf_drops() {
+	awk '$1 == "input" && $2 == "rule" && $3 == 0 { print $5 }' \
+		/proc/simplepf/stats
+}
+
+xdp_drops() {
+	"$TOOL" --xdp-stats | awk '$2 == "drop" { print $4 }'
+}
+
+# Run pktgen for SECONDS_PER_RUN seconds and print the drop rate
+# measured with the given counter.
+run() {
+	before=$($1)
+	pg pgctrl start &
+	sleep "$SECONDS_PER_RUN"
+	pg pgctrl stop
+	wait
+	after=$($1)
+	echo $(( (after - before) / SECONDS_PER_RUN ))
+}
+
+modprobe pktgen
+ip netns add $NS
+ip link add spf-dut type veth peer name spf-gen
+ip link set dev spf-gen netns $NS
+ip addr add $DUT_IP/24 dev spf-dut
+ip link set dev spf-dut up
+ip netns exec $NS ip addr add $GEN_IP/24 dev spf-gen
+ip netns exec $NS ip link set dev spf-gen up
+
+pg kpktgend_0 rem_device_all
+pg kpktgend_0 "add_device spf-gen"
+pg spf-gen "count 0"
+pg spf-gen "pkt_size 64"
+pg spf-gen "clone_skb 0"
+pg spf-gen "dst $DUT_IP"
+pg spf-gen "dst_mac $(cat /sys/class/net/spf-dut/address)"
+pg spf-gen "udp_dst_min $PORT"
+pg spf-gen "udp_dst_max $PORT"
+
+"$TOOL" --flush input
+"$TOOL" --add input --src $GEN_IP --proto udp --dport $PORT
+
+echo "netfilter: $(run nf_drops) pps dropped"
+
+ip link set dev spf-dut xdp obj "$OBJ" sec xdp
+"$TOOL" --xdp-sync
+
+echo "xdp: $(run xdp_drops) pps dropped"